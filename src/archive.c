@@ -0,0 +1,452 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#define MODULE_NAME "archive"
+
+/// Archive layout, one partition per device and UTC day:
+///   <root>/<device>/<YYYY>/<MM>/<DD>.gts   -- points of the day, track store format
+///   <root>/<device>/<YYYY>/<MM>/<DD>.meta  -- sidecar with point count, time range and bounding box in micro-degrees
+///   <root>/index                           -- spatial index over all partitions, see spatial.c
+/// Partitions are rewritten whole when more points of the same day arrive. The sidecar is removed before the points
+/// are replaced and written again after them, so a sidecar always describes its partition; a partition left without
+/// one by a crash is read whole and gets it back on its next write.
+
+#define ARCHIVE_DAY 86400
+
+typedef struct
+{
+   unsigned int npoints;
+   int64_t from, to;
+   int32_t lat0, lon0, lat1, lon1;  // micro-degrees
+} Archive_meta;
+
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+static void archive_partition_path( char* path, size_t len, const char* root, const char* device, int64_t day, const char* ext )
+{
+   GPS_point point;
+   GPS_point_set_epoch( &point, day * ARCHIVE_DAY );
+   snprintf( path, len, "%s/%s/%04d/%02d/%02d.%s", root, device, point.time[5], point.time[4], point.time[3], ext );
+}
+
+/// Create all directories of the path, the last component is a file
+static bool archive_mkdirs( const char* filename )
+{
+   char path[ BUFFER_SIZE ];
+   char* pos;
+
+   snprintf( path, sizeof(path), "%s", filename );
+   for ( pos = strchr( path + 1, '/' ); pos != NULL; pos = strchr( pos + 1, '/' ) )
+   {
+      *pos = 0x00;
+      if ( mkdir( path, 0755 ) != 0 && errno != EEXIST )
+      {
+         ERROR("Cannot create directory '%s': %s", path, strerror(errno) );
+         return false;
+      }
+      *pos = '/';
+   }
+   return true;
+}
+
+static int64_t archive_floor_day( int64_t epoch )
+{
+   return ( epoch >= 0 ) ? epoch / ARCHIVE_DAY : ( epoch - ARCHIVE_DAY + 1 ) / ARCHIVE_DAY;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Sidecar
+///--------------------------------------------------------------------------------------------------------------------
+static bool archive_meta_read( const char* filename, Archive_meta* meta )
+{
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot read partition sidecar '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+
+   long long from, to;
+   int fields = fscanf( fid, "points %u\nfrom %lld\nto %lld\nbox %d %d %d %d\n", &meta->npoints, &from, &to,
+                        &meta->lat0, &meta->lon0, &meta->lat1, &meta->lon1 );
+   fclose( fid );
+
+   meta->from = from;
+   meta->to   = to;
+   if ( fields != 7 )
+   {
+      ERROR("Partition sidecar '%s' is corrupted", filename );
+      return false;
+   }
+   return true;
+}
+
+static bool archive_meta_write( const char* filename, const GPS_points* data )
+{
+   char text[ BUFFER_SIZE ];
+   Archive_meta meta;
+   unsigned int loop;
+
+   meta.npoints = data->npoints;
+   meta.from    = GPS_point_epoch( &data->points[0] );
+   meta.to      = GPS_point_epoch( &data->points[ data->npoints - 1 ] );
+   meta.lat0    = meta.lat1 = data->points[0].latitude;
+   meta.lon0    = meta.lon1 = data->points[0].longitude;
+   for ( loop = 1; loop < data->npoints; loop ++ )
+   {
+      const GPS_point* point = &data->points[loop];
+      meta.lat0 = ( point->latitude  < meta.lat0 ) ? point->latitude  : meta.lat0;
+      meta.lat1 = ( point->latitude  > meta.lat1 ) ? point->latitude  : meta.lat1;
+      meta.lon0 = ( point->longitude < meta.lon0 ) ? point->longitude : meta.lon0;
+      meta.lon1 = ( point->longitude > meta.lon1 ) ? point->longitude : meta.lon1;
+   }
+
+   Output* output = output_open( filename );
+   if ( output == NULL )
+      return false;
+   int len = snprintf( text, sizeof(text), "points %u\nfrom %lld\nto %lld\nbox %d %d %d %d\n", meta.npoints,
+                       (long long)meta.from, (long long)meta.to, meta.lat0, meta.lon0, meta.lat1, meta.lon1 );
+   output_write( output, text, len );
+   return output_close( output, NULL, NULL );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Sort points by time, removing points that are already there with same time and position
+///--------------------------------------------------------------------------------------------------------------------
+static int archive_point_compare( const void* a, const void* b )
+{
+   const GPS_point* pa = (const GPS_point*)a;
+   const GPS_point* pb = (const GPS_point*)b;
+   int64_t ta = GPS_point_epoch( pa );
+   int64_t tb = GPS_point_epoch( pb );
+
+   if ( ta != tb )
+      return ta < tb ? -1 : 1;
+   if ( pa->latitude != pb->latitude )
+      return pa->latitude < pb->latitude ? -1 : 1;
+   if ( pa->longitude != pb->longitude )
+      return pa->longitude < pb->longitude ? -1 : 1;
+   return 0;
+}
+
+static void archive_sort_unique( GPS_points* data )
+{
+   unsigned int loop, count = 0;
+
+   qsort( data->points, data->npoints, sizeof(GPS_point), archive_point_compare );
+   for ( loop = 0; loop < data->npoints; loop ++ )
+   {
+      if ( count > 0 && archive_point_compare( &data->points[count - 1], &data->points[loop] ) == 0 )
+         continue;
+      data->points[ count ++ ] = data->points[loop];
+   }
+   data->npoints = count;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Merge points of single day with existing partition. The points that were not yet in the partition are left in 'fresh'
+///--------------------------------------------------------------------------------------------------------------------
+static bool archive_write_day( const char* root, const char* device, int64_t day, const GPS_point* points,
+                               unsigned int npoints, GPS_points* fresh )
+{
+   char track_file[ BUFFER_SIZE ];
+   char meta_file[ BUFFER_SIZE ];
+   GPS_points existing;
+   GPS_points merged;
+   unsigned int loop, eloop;
+
+   archive_partition_path( track_file, sizeof(track_file), root, device, day, "gts" );
+   archive_partition_path( meta_file, sizeof(meta_file), root, device, day, "meta" );
+   if ( !archive_mkdirs( track_file ) )
+      return false;
+
+   // the points already there are kept whatever the state of the sidecar
+   GPS_points_init( &existing );
+   if ( access( track_file, F_OK ) == 0 && !GPS_points_read( &existing, track_file ) )
+      return false;
+
+   GPS_points_init( &merged );
+   merged.points = (GPS_point*)malloc( ( existing.npoints + npoints ) * sizeof(GPS_point) + 1 );
+   fresh->points = (GPS_point*)malloc( npoints * sizeof(GPS_point) + 1 );
+   fresh->npoints = 0;
+   if ( merged.points == NULL || fresh->points == NULL )
+   {
+      ERROR("Out of memory!");
+      GPS_points_free( &existing );
+      GPS_points_free( &merged );
+      return false;
+   }
+
+   // both are sorted, merge and pick what was new
+   loop = 0;
+   eloop = 0;
+   while ( loop < npoints || eloop < existing.npoints )
+   {
+      int order = ( loop == npoints ) ? 1 : ( eloop == existing.npoints ) ? -1 :
+                  archive_point_compare( &points[loop], &existing.points[eloop] );
+      if ( order < 0 )
+      {
+         fresh->points[ fresh->npoints ++ ] = points[loop];
+         merged.points[ merged.npoints ++ ]  = points[ loop ++ ];
+      }
+      else
+      {
+         if ( order == 0 )
+            loop ++;
+         merged.points[ merged.npoints ++ ] = existing.points[ eloop ++ ];
+      }
+   }
+   GPS_points_free( &existing );
+
+   bool ok = true;
+   if ( fresh->npoints > 0 )
+   {
+      // replaced only once the new partition is on disk, without a sidecar in the meantime
+      ok = output_remove( meta_file );
+      ok = ok && GPS_points_write( &merged, track_file );
+      ok = ok && archive_meta_write( meta_file, &merged );
+   }
+   GPS_points_free( &merged );
+   return ok;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Shard points to day partitions of the device and add the new ones to archive spatial index
+///--------------------------------------------------------------------------------------------------------------------
+bool archive_write( const char* root, const char* device, GPS_points* data )
+{
+   char index_file[ BUFFER_SIZE ];
+   char track_file[ BUFFER_SIZE ];
+   unsigned int first, last;
+
+   if ( strchr( device, '/' ) != NULL || device[0] == '.' || device[0] == 0x00 )
+   {
+      ERROR("Invalid device name '%s'", device );
+      return false;
+   }
+
+   archive_sort_unique( data );
+   snprintf( index_file, sizeof(index_file), "%s/index", root );
+
+   for ( first = 0; first < data->npoints; first = last )
+   {
+      int64_t day = archive_floor_day( GPS_point_epoch( &data->points[first] ) );
+      GPS_points fresh;
+
+      for ( last = first + 1; last < data->npoints; last ++ )
+      {
+         if ( archive_floor_day( GPS_point_epoch( &data->points[last] ) ) != day )
+            break;
+      }
+
+      GPS_points_init( &fresh );
+      bool ok = archive_write_day( root, device, day, &data->points[first], last - first, &fresh );
+      if ( ok && fresh.npoints > 0 )
+      {
+         const char* name = track_file;
+         archive_partition_path( track_file, sizeof(track_file), root, device, day, "gts" );
+         ok = spatial_index_add( index_file, &name, &fresh, 1 );
+      }
+      DEBUG(3, "partition of day %lld: %u points, %u new", (long long)day, last - first, fresh.npoints );
+      GPS_points_free( &fresh );
+      if ( !ok )
+         return false;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Read points of the device between given times. Only partitions of those days are looked at, and only
+/// blocks overlapping the time window are decoded.
+/// \returns number of points or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long archive_extract( const char* root, const char* device, int64_t from, int64_t to, GPS_writer* writer )
+{
+   char track_file[ BUFFER_SIZE ];
+   char meta_file[ BUFFER_SIZE ];
+   GPS_point* points;
+   int64_t day;
+   long found = 0;
+   unsigned int block;
+   int loop;
+
+   points = (GPS_point*)malloc( TRACK_BLOCK_POINTS * sizeof(GPS_point) );
+   if ( points == NULL )
+   {
+      ERROR("Out of memory!");
+      return -1;
+   }
+
+   for ( day = archive_floor_day( from ); day <= archive_floor_day( to ); day ++ )
+   {
+      Archive_meta meta;
+
+      archive_partition_path( meta_file, sizeof(meta_file), root, device, day, "meta" );
+      archive_partition_path( track_file, sizeof(track_file), root, device, day, "gts" );
+      // a partition left without its sidecar is read whole, blocks outside the window are still skipped
+      if ( access( meta_file, F_OK ) == 0 )
+      {
+         if ( !archive_meta_read( meta_file, &meta ) )
+         {
+            free( points );
+            return -1;
+         }
+         if ( meta.to < from || meta.from > to )
+            continue;
+      }
+      else if ( access( track_file, F_OK ) != 0 )
+         continue;
+
+      Track_reader* reader = track_reader_open( track_file );
+      if ( reader == NULL )
+      {
+         free( points );
+         return -1;
+      }
+      DEBUG(3, "reading partition '%s'", track_file );
+
+      for ( block = 0; block < track_reader_nblocks( reader ); block ++ )
+      {
+         int64_t first, last;
+         track_reader_block_time( reader, block, &first, &last );
+         if ( last < from || first > to )
+            continue;
+
+         int count = track_reader_block( reader, block, points );
+         for ( loop = 0; loop < count; loop ++ )
+         {
+            int64_t time = GPS_point_epoch( &points[loop] );
+            if ( time < from || time > to )
+               continue;
+            if ( !GPS_writer_append( writer, &points[loop] ) )
+            {
+               count = -1;
+               break;
+            }
+            found ++;
+         }
+         if ( count < 0 )
+         {
+            track_reader_close( reader );
+            free( points );
+            return -1;
+         }
+      }
+      track_reader_close( reader );
+   }
+   free( points );
+   return found;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Inputs of the batch modes by device
+///--------------------------------------------------------------------------------------------------------------------
+static bool archive_device_add( Archive_inputs* inputs, const char* device )
+{
+   if ( !GPS_array_grow( (void**)&inputs->devices, inputs->ndevices, sizeof(Archive_device) ) )
+      return false;
+
+   Archive_device* entry = &inputs->devices[ inputs->ndevices ];
+   memset( entry, 0, sizeof(Archive_device) );
+   entry->device = strdup( device );
+   if ( entry->device == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   inputs->ndevices ++;
+   return true;
+}
+
+/// File to the last device
+static bool archive_file_add( Archive_inputs* inputs, const char* filename )
+{
+   Archive_device* entry = &inputs->devices[ inputs->ndevices - 1 ];
+
+   if ( !GPS_array_grow( (void**)&entry->files, entry->nfiles, sizeof(char*) ) )
+      return false;
+   entry->files[ entry->nfiles ] = strdup( filename );
+   if ( entry->files[ entry->nfiles ] == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   entry->nfiles ++;
+   inputs->nfiles ++;
+   return true;
+}
+
+static int archive_entry_filter( const struct dirent* entry )
+{
+   return entry->d_name[0] != '.' && strstr( entry->d_name, ".tmp" ) == NULL;
+}
+
+/// Track store files under the directory to the last device, sorted by name so that dates are in order. Under
+/// an archive root ('devices') each subdirectory is a new device.
+static bool archive_collect( Archive_inputs* inputs, const char* dirname, bool devices )
+{
+   struct dirent** list;
+   struct stat info;
+   int count, loop;
+   bool ok = true;
+
+   count = scandir( dirname, &list, archive_entry_filter, alphasort );
+   if ( count < 0 )
+   {
+      ERROR("Cannot open directory '%s': %s", dirname, strerror(errno) );
+      return false;
+   }
+   for ( loop = 0; loop < count; loop ++ )
+   {
+      char path[ BUFFER_SIZE ];
+      snprintf( path, sizeof(path), "%s/%s", dirname, list[loop]->d_name );
+      if ( ok && stat( path, &info ) == 0 )
+      {
+         if ( S_ISDIR( info.st_mode ) )
+            ok = ( !devices || archive_device_add( inputs, list[loop]->d_name ) ) &&
+                 archive_collect( inputs, path, false );
+         else if ( !devices && GPS_format_of( path ) == GPS_FORMAT_TRACK )
+            ok = archive_file_add( inputs, path );
+      }
+      free( list[loop] );
+   }
+   free( list );
+   return ok;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Add a saved track or an archive root to the inputs. A track file is its own device named by the file, each
+/// subdirectory of an archive root is a device with its partitions in order of date.
+///--------------------------------------------------------------------------------------------------------------------
+bool archive_inputs_add( Archive_inputs* inputs, const char* filename )
+{
+   struct stat info;
+
+   if ( stat( filename, &info ) != 0 || !S_ISDIR( info.st_mode ) )
+      return archive_device_add( inputs, filename ) && archive_file_add( inputs, filename );
+   return archive_collect( inputs, filename, true );
+}
+
+void archive_inputs_free( Archive_inputs* inputs )
+{
+   unsigned int loop, floop;
+
+   for ( loop = 0; loop < inputs->ndevices; loop ++ )
+   {
+      for ( floop = 0; floop < inputs->devices[loop].nfiles; floop ++ )
+         free( inputs->devices[loop].files[floop] );
+      free( inputs->devices[loop].files );
+      free( inputs->devices[loop].device );
+   }
+   free( inputs->devices );
+   memset( inputs, 0, sizeof(Archive_inputs) );
+}
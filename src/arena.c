@@ -0,0 +1,246 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#define MODULE_NAME "arena"
+
+/// Points are appended to fixed size chunks that are linked in order, so growing never moves the points already
+/// stored and memory follows what was actually appended. Chunks are 2 MB, the size of a huge page, and can be
+/// taken from the heap, from anonymous mappings, or from huge page mappings. Explicit huge pages are tried
+/// first and transparent huge pages are asked for when they are not configured.
+
+#define ARENA_CHUNK_BYTES ((size_t)2*1024*1024)
+
+struct GPS_arena_chunk
+{
+   GPS_arena_chunk* next;
+   unsigned int     count;
+   unsigned int     capacity;
+   bool             mapped;
+   GPS_point        points[];
+};
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+void GPS_arena_init( GPS_arena* arena, int backing )
+{
+   memset( arena, 0, sizeof(GPS_arena) );
+   arena->backing = backing;
+}
+
+static GPS_arena_chunk* arena_chunk_map( int backing )
+{
+   void* memory = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+   if ( backing == GPS_ARENA_HUGEPAGE )
+      memory = mmap( NULL, ARENA_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+#endif
+   if ( memory == MAP_FAILED )
+   {
+      memory = mmap( NULL, ARENA_CHUNK_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+#ifdef MADV_HUGEPAGE
+      if ( memory != MAP_FAILED && backing == GPS_ARENA_HUGEPAGE )
+         madvise( memory, ARENA_CHUNK_BYTES, MADV_HUGEPAGE );
+#endif
+   }
+   return ( memory != MAP_FAILED ) ? (GPS_arena_chunk*)memory : NULL;
+}
+
+static GPS_arena_chunk* arena_chunk_new( GPS_arena* arena )
+{
+   GPS_arena_chunk* chunk;
+   bool mapped = ( arena->backing != GPS_ARENA_HEAP );
+
+   chunk = mapped ? arena_chunk_map( arena->backing ) : (GPS_arena_chunk*)malloc( ARENA_CHUNK_BYTES );
+   if ( chunk == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+   chunk->next     = NULL;
+   chunk->count    = 0;
+   chunk->capacity = ( ARENA_CHUNK_BYTES - sizeof(GPS_arena_chunk) ) / sizeof(GPS_point);
+   chunk->mapped   = mapped;
+
+   if ( arena->last != NULL )
+      arena->last->next = chunk;
+   else
+      arena->first = chunk;
+   arena->last = chunk;
+   arena->nchunks ++;
+   return chunk;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Slot for the next point, NULL if out of memory
+///--------------------------------------------------------------------------------------------------------------------
+GPS_point* GPS_arena_append( GPS_arena* arena )
+{
+   GPS_arena_chunk* chunk = arena->last;
+
+   if ( chunk == NULL || chunk->count == chunk->capacity )
+   {
+      chunk = arena_chunk_new( arena );
+      if ( chunk == NULL )
+         return NULL;
+   }
+   arena->npoints ++;
+   return &chunk->points[ chunk->count ++ ];
+}
+
+bool GPS_arena_append_points( GPS_arena* arena, const GPS_point* points, size_t npoints )
+{
+   while ( npoints > 0 )
+   {
+      GPS_arena_chunk* chunk = arena->last;
+      if ( chunk == NULL || chunk->count == chunk->capacity )
+      {
+         chunk = arena_chunk_new( arena );
+         if ( chunk == NULL )
+            return false;
+      }
+      size_t copy = chunk->capacity - chunk->count;
+      copy = ( copy < npoints ) ? copy : npoints;
+      memcpy( chunk->points + chunk->count, points, copy * sizeof(GPS_point) );
+      chunk->count   += copy;
+      arena->npoints += copy;
+      points  += copy;
+      npoints -= copy;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Iterate over the points a chunk at a time: returns the next run of consecutive points and their count,
+/// NULL after the last one. The iterator is started with GPS_arena_iter_init.
+///--------------------------------------------------------------------------------------------------------------------
+void GPS_arena_iter_init( const GPS_arena* arena, GPS_arena_iter* iter )
+{
+   iter->chunk = arena->first;
+}
+
+const GPS_point* GPS_arena_next( GPS_arena_iter* iter, unsigned int* count )
+{
+   const GPS_arena_chunk* chunk = iter->chunk;
+
+   while ( chunk != NULL && chunk->count == 0 )
+      chunk = chunk->next;
+   if ( chunk == NULL )
+   {
+      iter->chunk = NULL;
+      return NULL;
+   }
+   iter->chunk = chunk->next;
+   *count = chunk->count;
+   return chunk->points;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Move the points to single array of exactly their size, the arena is left empty. Each chunk is released as soon as
+/// it has been copied and the array grows a chunk at a time, so memory stays at about the size of the points: large
+/// arrays are mapped by malloc and grown by remapping their pages, not by copying.
+///--------------------------------------------------------------------------------------------------------------------
+bool GPS_arena_to_points( GPS_arena* arena, GPS_points* points )
+{
+   GPS_arena_chunk* chunk = arena->first;
+   GPS_point* array = NULL;
+   size_t npoints = 0;
+
+   if ( arena->npoints > UINT32_MAX )
+   {
+      ERROR("Too many points: %zu", arena->npoints );
+      return false;
+   }
+
+   while ( chunk != NULL )
+   {
+      GPS_arena_chunk* next = chunk->next;
+      GPS_point* more = (GPS_point*)realloc( array, ( npoints + chunk->count ) * sizeof(GPS_point) + 1 );
+      if ( more == NULL )
+      {
+         ERROR("Out of memory!");
+         arena->first = chunk;
+         GPS_arena_free( arena );
+         free( array );
+         return false;
+      }
+      array = more;
+      memcpy( array + npoints, chunk->points, chunk->count * sizeof(GPS_point) );
+      npoints += chunk->count;
+
+      if ( chunk->mapped )
+         munmap( chunk, ARENA_CHUNK_BYTES );
+      else
+         free( chunk );
+      chunk = next;
+   }
+   arena->first = NULL;
+   GPS_arena_free( arena );
+
+   points->points  = ( array != NULL ) ? array : (GPS_point*)malloc( 1 );
+   points->npoints = npoints;
+   if ( points->points == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Release all chunks at once, the arena can be used again
+///--------------------------------------------------------------------------------------------------------------------
+void GPS_arena_free( GPS_arena* arena )
+{
+   GPS_arena_chunk* chunk = arena->first;
+
+   while ( chunk != NULL )
+   {
+      GPS_arena_chunk* next = chunk->next;
+      if ( chunk->mapped )
+         munmap( chunk, ARENA_CHUNK_BYTES );
+      else
+         free( chunk );
+      chunk = next;
+   }
+   GPS_arena_init( arena, arena->backing );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Backing of arenas selected with GEOTECH_ARENA environment variable: heap (default), mmap or hugepage
+///--------------------------------------------------------------------------------------------------------------------
+int GPS_arena_backing( void )
+{
+   const char* env = getenv( "GEOTECH_ARENA" );
+
+   if ( env != NULL && strcmp( env, "mmap" ) == 0 )
+      return GPS_ARENA_MMAP;
+   if ( env != NULL && strcmp( env, "hugepage" ) == 0 )
+      return GPS_ARENA_HUGEPAGE;
+   return GPS_ARENA_HEAP;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Grow array of 'count' elements before appending one. Arrays grow by doubling, the capacity is implied by the
+/// count: 16, 32, 64 ..
+///--------------------------------------------------------------------------------------------------------------------
+bool GPS_array_grow( void** array, unsigned int count, size_t size )
+{
+   if ( count != 0 && ( count < 16 || (count & (count - 1)) != 0 ) )
+      return true;
+
+   size_t capacity = ( count == 0 ) ? 16 : (size_t)count * 2;
+   void* more = realloc( *array, capacity * size );
+   if ( more == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   *array = more;
+   return true;
+}
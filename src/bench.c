@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#define MODULE_NAME "bench"
+
+///-------------------------------------------------------------------------------------
+int GLOBAL_debug_level = 0;
+
+#define BENCH_WARMUP       5
+#define BENCH_REPS         51
+#define BENCH_BATCH        4096
+#define BENCH_MAX_RESULTS  32
+#define BENCH_THRESHOLD    10.0
+
+/// Recorded entry responce from device, see messages.h
+static const unsigned char bench_recorded_entry[20] = { 0x23, 0x23, 0xa7, 0x10, 0x02, 0x7e, 0x01, 0x7c, 0xaa, 0x96,
+                                                        0x03, 0x27, 0x00, 0x20, 0x4e, 0xaf, 0xb9, 0x02, 0x31, 0x27 };
+
+typedef struct
+{
+   char   name[64];
+   double median_ns;   // per operation
+   double p99_ns;      // per operation
+   double mb_per_s;    // at median
+   unsigned int reps;
+} Bench_result;
+
+typedef struct
+{
+   const char* name;
+   /// runs one batch of operations, returns number of operations done
+   unsigned int (*run)( void* context );
+   void*  context;
+   double bytes_per_op;
+} Bench_case;
+
+static volatile unsigned int bench_sink = 0;
+
+///-------------------------------------------------------------------------------------
+///-------------------------------------------------------------------------------------
+static double bench_now( void )
+{
+   struct timespec now;
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static int bench_compare_double( const void* a, const void* b )
+{
+   double da = *(const double*)a;
+   double db = *(const double*)b;
+   return (da > db) - (da < db);
+}
+
+///-------------------------------------------------------------------------------------
+/// Run the case with warmup and repetitions, each repetition is one batch
+///-------------------------------------------------------------------------------------
+static void bench_run( const Bench_case* bench, Bench_result* result )
+{
+   double samples[ BENCH_REPS ];
+   int loop;
+
+   for ( loop = 0; loop < BENCH_WARMUP; loop ++ )
+      bench->run( bench->context );
+
+   for ( loop = 0; loop < BENCH_REPS; loop ++ )
+   {
+      double start = bench_now();
+      unsigned int ops = bench->run( bench->context );
+      samples[loop] = ( bench_now() - start ) / ops;
+   }
+   qsort( samples, BENCH_REPS, sizeof(double), bench_compare_double );
+
+   strncpy( result->name, bench->name, sizeof(result->name) - 1 );
+   result->name[ sizeof(result->name) - 1 ] = 0x00;
+   result->median_ns = samples[ BENCH_REPS / 2 ];
+   result->p99_ns    = samples[ (BENCH_REPS * 99) / 100 ];
+   result->mb_per_s  = bench->bytes_per_op * 1000.0 / result->median_ns;
+   result->reps      = BENCH_REPS;
+
+   printf("  %-24s %12.02f ns/op %12.02f p99 %10.02f MB/s\n", result->name, result->median_ns, result->p99_ns, result->mb_per_s );
+}
+
+
+///-------------------------------------------------------------------------------------
+/// SYNTHETIC INPUTS
+///-------------------------------------------------------------------------------------
+typedef struct
+{
+   unsigned char* entries; // BENCH_BATCH entries of 20 bytes
+} Bench_entries;
+
+static void bench_entries_init( Bench_entries* input, bool recorded )
+{
+   int loop, bloop;
+
+   input->entries = (unsigned char*)malloc( BENCH_BATCH * 20 );
+   srand( 1234 );
+   for ( loop = 0; loop < BENCH_BATCH; loop ++ )
+   {
+      unsigned char* entry = input->entries + loop*20;
+      memcpy( entry, bench_recorded_entry, 20 );
+      if ( recorded )
+         continue;
+
+      for ( bloop = 3; bloop < 19; bloop ++ )
+         entry[bloop] = rand() & 0xff;
+      entry[19] = calculate_entry_checksum( entry );
+   }
+}
+
+static unsigned int bench_checksum( void* context )
+{
+   Bench_entries* input = (Bench_entries*)context;
+   unsigned int loop, sum = 0;
+
+   for ( loop = 0; loop < BENCH_BATCH; loop ++ )
+      sum += calculate_entry_checksum( input->entries + loop*20 );
+   bench_sink += sum;
+   return BENCH_BATCH;
+}
+
+static unsigned int bench_coordinate( void* context )
+{
+   Bench_entries* input = (Bench_entries*)context;
+   unsigned int loop;
+   unsigned int sum = 0;
+
+   for ( loop = 0; loop < BENCH_BATCH; loop ++ )
+      sum += convert_coordinate( input->entries + loop*20 + 3 ) + convert_coordinate( input->entries + loop*20 + 7 );
+   bench_sink += sum;
+   return 2*BENCH_BATCH;
+}
+
+static unsigned int bench_time( void* context )
+{
+   Bench_entries* input = (Bench_entries*)context;
+   unsigned int loop;
+   int32_t date[6];
+
+   for ( loop = 0; loop < BENCH_BATCH; loop ++ )
+   {
+      convert_time( date, input->entries + loop*20 + 15 );
+      bench_sink += date[0];
+   }
+   return BENCH_BATCH;
+}
+
+static unsigned int bench_compare( void* context )
+{
+   Bench_entries* input = (Bench_entries*)context;
+   unsigned int loop;
+
+   for ( loop = 0; loop < BENCH_BATCH; loop ++ )
+      bench_sink += compare_responce( input->entries + loop*20, bench_recorded_entry, 3, 20 );
+   return BENCH_BATCH;
+}
+
+///-------------------------------------------------------------------------------------
+/// Point formatting, written to /dev/null
+///-------------------------------------------------------------------------------------
+typedef struct
+{
+   GPS_points points;
+} Bench_format;
+
+static unsigned int bench_format( void* context )
+{
+   Bench_format* input = (Bench_format*)context;
+
+   if ( !GPS_points_write( &input->points, "/dev/null" ) )
+      exit(1);
+   return input->points.npoints;
+}
+
+static double bench_format_bytes_per_op( Bench_format* input )
+{
+   char filename[] = "/tmp/geotech_bench_XXXXXX";
+   struct stat info;
+   int fd = mkstemp( filename );
+
+   if ( fd < 0 )
+      return 0.0;
+   close( fd );
+
+   GPS_points_write( &input->points, filename );
+   stat( filename, &info );
+   unlink( filename );
+   return (double)info.st_size / input->points.npoints;
+}
+
+static void bench_format_init( Bench_format* input, Bench_entries* entries )
+{
+   unsigned int loop;
+
+   GPS_points_init( &input->points );
+   input->points.npoints = BENCH_BATCH;
+   input->points.points  = (GPS_point*)malloc( BENCH_BATCH * sizeof(GPS_point) );
+   for ( loop = 0; loop < BENCH_BATCH; loop ++ )
+   {
+      const unsigned char* entry = entries->entries + loop*20;
+      GPS_point* point = &input->points.points[loop];
+      point->longitude = convert_coordinate( entry + 3 );
+      point->latitude  = convert_coordinate( entry + 7 );
+      point->height    = entry[11] + (entry[12]<<8);
+      convert_time( point->time, entry + 15 );
+   }
+}
+
+
+///-------------------------------------------------------------------------------------
+/// JSON in and out
+///-------------------------------------------------------------------------------------
+static bool bench_write_json( const char* filename, const Bench_result* results, int nresults )
+{
+   int loop;
+   FILE* fid = fopen( filename, "wb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s' for writing: %s", filename, strerror(errno) );
+      return false;
+   }
+
+   fprintf( fid, "{\n  \"results\": [\n" );
+   for ( loop = 0; loop < nresults; loop ++ )
+   {
+      fprintf( fid, "    { \"name\": \"%s\", \"median_ns\": %.03f, \"p99_ns\": %.03f, \"mb_per_s\": %.03f, \"reps\": %u }%s\n",
+               results[loop].name, results[loop].median_ns, results[loop].p99_ns, results[loop].mb_per_s, results[loop].reps,
+               loop + 1 < nresults ? "," : "" );
+   }
+   fprintf( fid, "  ]\n}\n" );
+
+   if ( fclose( fid ) != 0 )
+   {
+      ERROR("Cannot write file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   return true;
+}
+
+/// Reads the files written by bench_write_json, one result per line
+static int bench_read_json( const char* filename, Bench_result* results )
+{
+   char line[ BUFFER_SIZE ];
+   int nresults = 0;
+
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      return -1;
+   }
+
+   while ( nresults < BENCH_MAX_RESULTS && fgets( line, sizeof(line), fid ) != NULL )
+   {
+      Bench_result* result = &results[nresults];
+      if ( sscanf( line, " { \"name\": \"%63[^\"]\", \"median_ns\": %lf, \"p99_ns\": %lf, \"mb_per_s\": %lf, \"reps\": %u",
+                   result->name, &result->median_ns, &result->p99_ns, &result->mb_per_s, &result->reps ) == 5 )
+         nresults ++;
+   }
+   fclose( fid );
+   return nresults;
+}
+
+///-------------------------------------------------------------------------------------
+/// Compare two result files, returns number of cases slower than threshold percent
+///-------------------------------------------------------------------------------------
+static int bench_compare_files( const char* base_file, const char* current_file, double threshold )
+{
+   Bench_result base[ BENCH_MAX_RESULTS ];
+   Bench_result current[ BENCH_MAX_RESULTS ];
+   int nbase, ncurrent, loop, bloop;
+   int regressions = 0;
+
+   nbase    = bench_read_json( base_file, base );
+   ncurrent = bench_read_json( current_file, current );
+   if ( nbase < 0 || ncurrent < 0 )
+      return -1;
+
+   printf("  %-24s %12s %12s %9s\n", "CASE", "BASE ns/op", "NOW ns/op", "CHANGE" );
+   for ( loop = 0; loop < ncurrent; loop ++ )
+   {
+      for ( bloop = 0; bloop < nbase; bloop ++ )
+      {
+         if ( strcmp( base[bloop].name, current[loop].name ) == 0 )
+            break;
+      }
+      if ( bloop == nbase )
+      {
+         printf("  %-24s %12s %12.02f %9s\n", current[loop].name, "-", current[loop].median_ns, "new" );
+         continue;
+      }
+
+      double change = 100.0 * ( current[loop].median_ns - base[bloop].median_ns ) / base[bloop].median_ns;
+      bool   slower = change > threshold;
+      printf("  %-24s %12.02f %12.02f %+8.01f%%%s\n", current[loop].name, base[bloop].median_ns, current[loop].median_ns,
+             change, slower ? "  REGRESSION" : "" );
+      if ( slower )
+         regressions ++;
+   }
+   return regressions;
+}
+
+
+///-------------------------------------------------------------------------------------
+///-------------------------------------------------------------------------------------
+void usage()
+{
+   printf("usage: ./geotech_bench [<results.json>]\n");
+   printf("       ./geotech_bench compare <base.json> <current.json> [<threshold percent>]\n");
+   exit(1);
+}
+
+int main( int argc, char** argv )
+{
+   Bench_result  results[ BENCH_MAX_RESULTS ];
+   int           nresults = 0;
+   Bench_entries synthetic, recorded;
+   Bench_format  format;
+
+   if ( argc >= 2 && strcmp( argv[1], "compare" ) == 0 )
+   {
+      if ( argc != 4 && argc != 5 )
+         usage();
+
+      double threshold = ( argc == 5 ) ? atof( argv[4] ) : BENCH_THRESHOLD;
+      int regressions = bench_compare_files( argv[2], argv[3], threshold );
+      if ( regressions != 0 )
+      {
+         printf("%d case(s) regressed more than %.01f%%\n", regressions, threshold );
+         return 1;
+      }
+      return 0;
+   }
+   if ( argc > 2 )
+      usage();
+
+   bench_entries_init( &synthetic, false );
+   bench_entries_init( &recorded, true );
+   bench_format_init( &format, &synthetic );
+
+   Bench_case cases[] =
+   {
+      { "checksum/synthetic",  bench_checksum, &synthetic, 20 },
+      { "checksum/recorded",   bench_checksum, &recorded,  20 },
+      { "convert_coordinate",  bench_coordinate, &synthetic, 4 },
+      { "convert_time",        bench_time,     &synthetic, 4 },
+      { "compare_responce",    bench_compare,  &recorded,  3 },
+      { "GPS_points_write",    bench_format,   &format,    bench_format_bytes_per_op( &format ) },
+   };
+   unsigned int loop;
+
+   printf("---------------------------------------------------------------------------------------\n");
+   for ( loop = 0; loop < sizeof(cases)/sizeof(cases[0]); loop ++ )
+      bench_run( &cases[loop], &results[ nresults ++ ] );
+   printf("---------------------------------------------------------------------------------------\n");
+
+   free( synthetic.entries );
+   free( recorded.entries );
+   GPS_points_free( &format.points );
+
+   if ( argc == 2 && !bench_write_json( argv[1], results, nresults ) )
+      return 1;
+
+   return 0;
+}
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 extern int GLOBAL_debug_level;
 
@@ -13,14 +14,56 @@ void print_error ( const char* module, const char* format, ... );
 #define DEBUG(lvl,  ... ) print_debug(lvl, MODULE_NAME, __FILE__, __LINE__, ## __VA_ARGS__ )
 
 #define BUFFER_SIZE 1024
-/// How many seconds to wait
+/// How many seconds to wait before the first round trip has been measured
 #define SERIAL_WAIT_FOR_COMM 0.1 
+/// Bounds for the adaptive read timeout, seconds
+#define SERIAL_WAIT_MIN 0.01
+#define SERIAL_WAIT_MAX 2.0
+/// Longest pause inside a message once it has started, seconds
+#define SERIAL_WAIT_BYTES 0.5
+
+/// Request types that have their own round trip estimate
+#define SERIAL_CMD_HANDSHAKE 0
+#define SERIAL_CMD_RESET     1
+#define SERIAL_CMD_SAMPLING  2
+#define SERIAL_CMD_DOWNLOAD  3
+#define SERIAL_CMD_ENTRY     4
+#define SERIAL_CMD_COUNT     5
+
+/// Round trip estimate of single request type, like TCP RTO (RFC 6298)
+typedef struct
+{
+   double srtt;    // smoothed round trip time, seconds
+   double rttvar;  // round trip variance, seconds
+   double rto;     // current read timeout, seconds
+   unsigned int samples;
+   unsigned int timeouts;
+} Serial_timing;
+
+/// Link counters of the session
+typedef struct
+{
+   uint64_t bytes_read;
+   uint64_t bytes_written;
+   uint64_t points;            // entries decoded
+   uint32_t retries;           // entry reads and handshakes tried again
+   uint32_t checksum_errors;
+   double   handshake;         // seconds to open and set up the link
+} Serial_counters;
+
+/// Coordinates are kept as the device sends them, fixed point micro-degrees
+#define MICRODEG_TO_DEG 0.000001
+#define MICRODEG_TO_RAD ( MICRODEG_TO_DEG * M_PI / 180.0 )   // M_PI of math.h where used
+/// Mean radius of the earth, meters, the one radius of all distances
+#define EARTH_RADIUS    6371008.8
+/// Meters per micro-degree of latitude on that radius
+#define MICRODEG_METERS ( EARTH_RADIUS * MICRODEG_TO_RAD )
 
 typedef struct
 {
-   float longitude;
-   float latitude;
-   float height;
+   int32_t longitude; // micro-degrees
+   int32_t latitude;  // micro-degrees
+   int32_t height;    // meters
    
    int32_t time[6]; // 0 = seconds, 1=minutes,2=hours,3=days,4=months,5=years
 } GPS_point;
@@ -31,18 +74,389 @@ typedef struct
    GPS_point* points;
 } GPS_points;
 
+/// ---------- IMPLEMENTED IN arena.c ---------------
+/// Chunk memory of point arenas
+#define GPS_ARENA_HEAP     0
+#define GPS_ARENA_MMAP     1
+#define GPS_ARENA_HUGEPAGE 2
+
+typedef struct GPS_arena_chunk GPS_arena_chunk;
+
+/// Points in chunks that never move, for inputs of unknown size
+typedef struct
+{
+   GPS_arena_chunk* first;
+   GPS_arena_chunk* last;
+   size_t           npoints;
+   unsigned int     nchunks;
+   int              backing;
+} GPS_arena;
+
+typedef struct
+{
+   const GPS_arena_chunk* chunk;
+} GPS_arena_iter;
+
+void GPS_arena_init( GPS_arena* arena, int backing );
+int GPS_arena_backing( void );
+GPS_point* GPS_arena_append( GPS_arena* arena );
+bool GPS_arena_append_points( GPS_arena* arena, const GPS_point* points, size_t npoints );
+void GPS_arena_iter_init( const GPS_arena* arena, GPS_arena_iter* iter );
+const GPS_point* GPS_arena_next( GPS_arena_iter* iter, unsigned int* count );
+bool GPS_arena_to_points( GPS_arena* arena, GPS_points* points );
+void GPS_arena_free( GPS_arena* arena );
+bool GPS_array_grow( void** array, unsigned int count, size_t size );
+
+/// Receives points one at a time as they are decoded, false stops the producer
+typedef bool (*GPS_point_sink)( const GPS_point* point, void* context );
+
 /// ---------- IMPLEMENTED IN serial.cc ---------------
 int serial_reset( int serial_fd , unsigned char* buffer  );
 bool serial_init_highspeed( const char* device, unsigned char* buffer, int* serial_fd_p );
 
 int serial_query_sampling( int serial_fd, unsigned char* buffer, unsigned int* sample_rate );
 int serial_set_sampling ( int serial_fd, unsigned char* buffer, int sampling );
-int serial_download ( int serial_fd, unsigned char* buffer, GPS_points* points );
+int serial_download ( int serial_fd, unsigned char* buffer, GPS_arena* points, GPS_point_sink sink, void* context );
 int serial_clear_datapoints( int serial_fd, unsigned char* buffer );
+int serial_download_count( int serial_fd, unsigned char* buffer, int* count );
+int serial_fetch_entry( int serial_fd, unsigned char* buffer, int index, GPS_point* point );
+const Serial_timing* serial_timing_get( int cmd );
+const char* serial_timing_name( int cmd );
+void serial_timing_print( void );
+void serial_counters_get( Serial_counters* counters );
+
+/// decoding helpers, exposed for geotech_bench
+int32_t convert_coordinate( const unsigned char* buffer );
+void convert_time( int32_t* date, const unsigned char* buffer );
+unsigned char calculate_entry_checksum( const unsigned char* buffer );
+bool compare_responce( const unsigned char* input, const unsigned char* orig, unsigned int orig_len, unsigned int msg_len );
+
+/// ---------- IMPLEMENTED IN output.c ---------------
+/// Compression selected by the file name extension
+#define OUTPUT_PLAIN 0
+#define OUTPUT_GZIP  1   // .gz
+#define OUTPUT_ZSTD  2   // .zst
+
+typedef struct Output Output;
+
+/// Called once the written file is durable, or with ok false when it failed
+typedef void (*Output_done)( const char* filename, bool ok, void* context );
+
+int output_codec_of( const char* filename );
+Output* output_open( const char* filename );
+Output* output_open_at( const char* filename, int64_t offset );
+bool output_write( Output* output, const void* data, size_t len );
+bool output_close( Output* output, Output_done done, void* context );
+void output_abort( Output* output );
+bool output_remove( const char* filename );
 
 /// ---------- IMPLEMENTED IN datafile.cc ---------------
+/// Output format is selected by the file name extension
+#define GPS_FORMAT_GPX   1
+#define GPS_FORMAT_TRACK 2   // .gts, compressed track store
+#define GPS_FORMAT_CSV   3   // written only
+#define GPS_FORMAT_DATABASE 4   // .db, SQLite database, written only
+
+/// GPX and CSV output is compressed when the name ends with .gz or .zst, see output.c
+
+typedef struct GPS_writer GPS_writer;
+typedef struct GPS_reader GPS_reader;
+
 bool GPS_points_init( GPS_points* points );
 bool GPS_points_write( GPS_points* points, const char* filename );
+bool GPS_points_read( GPS_points* points, const char* filename );
 bool GPS_points_free( GPS_points* points );
 
+int GPS_format_of( const char* filename );
+GPS_writer* GPS_writer_open( const char* filename );
+bool GPS_writer_append( GPS_writer* writer, const GPS_point* point );
+bool GPS_writer_append_named( GPS_writer* writer, const GPS_point* point, const char* name, const char* desc );
+bool GPS_writer_append_points( GPS_writer* writer, const GPS_point* points, unsigned int npoints );
+void GPS_writer_notify( GPS_writer* writer, Output_done done, void* context );
+void GPS_writer_session( GPS_writer* writer, const char* device, bool rtree );
+bool GPS_writer_close( GPS_writer* writer );
+void GPS_writer_abort( GPS_writer* writer );
+GPS_reader* GPS_reader_open( const char* filename );
+int GPS_reader_read( GPS_reader* reader, GPS_point* points, unsigned int max_points );
+void GPS_reader_close( GPS_reader* reader );
+
+int64_t GPS_point_epoch( const GPS_point* point );
+void GPS_point_set_epoch( GPS_point* point, int64_t epoch );
+bool GPS_parse_time( const char* text, int64_t* epoch );
+int GPS_format_microdeg( char* out, int32_t value );
+/// Largest magnitudes of coordinates, micro-degrees
+#define GPS_LATITUDE_MAX   90000000
+#define GPS_LONGITUDE_MAX 180000000
+bool GPS_parse_microdeg( const char* text, int32_t limit, int32_t* value );
+
+/// ---------- IMPLEMENTED IN trackstore.c ---------------
+/// Points per independently decodable block
+#define TRACK_BLOCK_POINTS 4096
+
+typedef struct Track_writer Track_writer;
+typedef struct Track_reader Track_reader;
+
+Track_writer* track_writer_open( const char* filename );
+Track_writer* track_writer_open_at( const char* filename, int64_t offset );
+bool track_writer_append( Track_writer* writer, const GPS_point* point );
+bool track_writer_close( Track_writer* writer );
+void track_writer_abort( Track_writer* writer );
+
+Track_reader* track_reader_open( const char* filename );
+Track_reader* track_reader_open_at( const char* filename, uint64_t offset, uint64_t size );
+unsigned int track_reader_nblocks( const Track_reader* reader );
+unsigned int track_reader_npoints( const Track_reader* reader );
+void track_reader_block_time( const Track_reader* reader, unsigned int block, int64_t* first_time, int64_t* last_time );
+int track_reader_block( const Track_reader* reader, unsigned int block, GPS_point* points );
+void track_reader_close( Track_reader* reader );
+
+/// ---------- IMPLEMENTED IN spatial.c ---------------
+typedef struct
+{
+   int32_t lat0, lon0;   // micro-degrees, bounding box corners or center of radius query
+   int32_t lat1, lon1;
+   double  radius;       // meters, 0 for bounding box query
+   int64_t from, to;     // time window
+} Spatial_query;
+
+typedef void (*Spatial_hit)( const char* track, uint32_t track_id, int64_t time, int32_t latitude, int32_t longitude, void* context );
+
+bool spatial_index_add( const char* index_file, const char* const* names, const GPS_points* tracks, int ntracks );
+long spatial_index_query( const char* index_file, const Spatial_query* query, Spatial_hit hit, void* context );
+
+/// ---------- IMPLEMENTED IN workers.c ---------------
+typedef void (*Worker_job)( unsigned int index, void* context );
+typedef void (*Worker_main)( void* context );
+
+unsigned int workers_count( void );
+void workers_run( unsigned int njobs, Worker_job job, void* context );
+bool workers_serve( unsigned int njobs, Worker_job job, Worker_main main, void* context );
+
+/// ---------- IMPLEMENTED IN trackstats.c ---------------
+#define STATS_KERNEL_HAVERSINE       1
+#define STATS_KERNEL_EQUIRECTANGULAR 2
+
+typedef struct
+{
+   unsigned int npoints;
+   int64_t start, end;
+   double distance;      // meters
+   double total_time;    // seconds
+   double moving_time;   // seconds
+   double moving_distance;
+   double avg_speed;     // m/s, over moving time
+   double max_speed;     // m/s
+   double ascent, descent;
+   int32_t lat0, lon0, lat1, lon1;  // micro-degrees
+} Track_stats;
+
+bool track_stats( const GPS_points* points, int kernel, Track_stats* stats );
+void track_stats_print( const Track_stats* stats );
+
+/// ---------- IMPLEMENTED IN archive.c ---------------
+bool archive_write( const char* root, const char* device, GPS_points* points );
+long archive_extract( const char* root, const char* device, int64_t from, int64_t to, GPS_writer* writer );
+
+/// Saved tracks and archive roots by device, start from all zero
+typedef struct
+{
+   char*        device;
+   char**       files;       // track store files in order of date
+   unsigned int nfiles;
+} Archive_device;
+
+typedef struct
+{
+   Archive_device* devices;
+   unsigned int    ndevices;
+   unsigned int    nfiles;   // of all devices
+} Archive_inputs;
+
+bool archive_inputs_add( Archive_inputs* inputs, const char* filename );
+void archive_inputs_free( Archive_inputs* inputs );
+
+/// ---------- IMPLEMENTED IN merge.c ---------------
+typedef struct
+{
+   size_t memory;      // bytes for sorting, 0 for default
+   double tolerance;   // meters, points of same second closer than this are duplicates
+} Merge_options;
+
+typedef struct
+{
+   long read;
+   long written;
+   long dropped;
+   unsigned int runs;  // sorted runs spilled to disk
+} Merge_result;
+
+long merge_tracks( const char* output, const char* const* inputs, int ninputs, const Merge_options* options,
+                   Merge_result* result );
+
+/// ---------- IMPLEMENTED IN heatmap.c ---------------
+typedef struct
+{
+   int     zoom;                    // web mercator zoom level, -1 to fit the bounding box to about 2048 pixels
+   int32_t lat0, lon0, lat1, lon1;  // micro-degrees, all zero for bounding box of the points
+} Heatmap_options;
+
+long heatmap_render( const char* output, const char* const* inputs, int ninputs, const Heatmap_options* options );
+
+/// ---------- IMPLEMENTED IN pyramid.c ---------------
+typedef struct
+{
+   int          zoom;                    // web mercator zoom level of the display
+   int32_t      lat0, lon0, lat1, lon1;  // micro-degrees, viewport
+   unsigned int max_points;              // coarser level is used if the view would have more, 0 for no limit
+} Pyramid_view;
+
+bool pyramid_build( const char* filename, const GPS_points* points );
+long pyramid_extract( const char* filename, const Pyramid_view* view, GPS_writer* writer );
+
+/// ---------- IMPLEMENTED IN wkt.c ---------------
+/// Receives a WKT geometry: its name, then 'list' at the opening and at the closing of each list of the geometry,
+/// level 1 being a list of coordinates, and 'vertex' for each coordinate. False stops the reading.
+typedef struct
+{
+   bool (*name)( void* context, const char* name, size_t len, unsigned int linenum );
+   bool (*list)( void* context, unsigned int level, bool open );
+   bool (*vertex)( void* context, double lon, double lat );
+} Wkt_handler;
+
+bool wkt_read( char* text, const char* keyword, unsigned int levels, const Wkt_handler* handler, void* context );
+
+/// ---------- IMPLEMENTED IN geofence.c ---------------
+#define GEOFENCE_ENTER 1
+#define GEOFENCE_EXIT  2
+#define GEOFENCE_DWELL 3
+
+#define GEOFENCE_CSV_HEADER "device,fence,event,time,latitude,longitude,duration\n"
+
+typedef struct Geofence Geofence;
+typedef struct Geofence_tracker Geofence_tracker;
+
+typedef struct
+{
+   int         type;                 // GEOFENCE_ENTER, GEOFENCE_EXIT or GEOFENCE_DWELL
+   const char* fence;
+   const char* device;
+   int64_t     time;
+   int32_t     latitude, longitude;  // micro-degrees
+   int64_t     duration;             // seconds since enter, for exit and dwell
+} Geofence_event;
+
+typedef void (*Geofence_handler)( const Geofence_event* event, void* context );
+
+Geofence* geofence_load( const char* filename );
+unsigned int geofence_count( const Geofence* fences );
+void geofence_free( Geofence* fences );
+
+Geofence_tracker* geofence_tracker_open( const Geofence* fences, const char* device, int64_t dwell,
+                                         Geofence_handler handler, void* context );
+bool geofence_tracker_feed( const GPS_point* point, void* tracker );
+long geofence_tracker_close( Geofence_tracker* tracker );
+void geofence_event_print( const Geofence_event* event, void* fid );
+
+long geofence_scan( const Geofence* fences, const char* output, const char* const* inputs, int ninputs, int64_t dwell );
+
+/// ---------- IMPLEMENTED IN gazetteer.c ---------------
+typedef struct Gazetteer Gazetteer;
+
+Gazetteer* gazetteer_open( const char* filename );
+unsigned int gazetteer_count( const Gazetteer* gazetteer );
+void gazetteer_close( Gazetteer* gazetteer );
+const char* gazetteer_nearest( const Gazetteer* gazetteer, int32_t latitude, int32_t longitude, double radius,
+                               double* distance );
+long gazetteer_tag( const Gazetteer* gazetteer, const GPS_points* points, double radius, bool ends_only,
+                    GPS_writer* writer );
+
+/// ---------- IMPLEMENTED IN dem.c ---------------
+typedef struct Dem Dem;
+
+Dem* dem_open( const char* directory );
+void dem_close( Dem* dem );
+bool dem_height( Dem* dem, int32_t latitude, int32_t longitude, double* height );
+long dem_elevate( Dem* dem, GPS_point* points, unsigned int npoints );
+long dem_elevate_tree( Dem* dem, const char* dirname );
+
+/// ---------- IMPLEMENTED IN feed.c ---------------
+typedef struct Feed Feed;
+typedef struct Feed_reader Feed_reader;
+
+Feed* feed_create( const char* name, const char* device, unsigned int capacity );
+bool feed_publish( const GPS_point* point, void* feed );
+void feed_close( Feed* feed );
+
+Feed_reader* feed_reader_open( const char* name );
+const char* feed_reader_device( const Feed_reader* reader );
+int feed_reader_read( Feed_reader* reader, GPS_point* points, unsigned int max_points, int timeout_ms, uint64_t* lost );
+void feed_reader_close( Feed_reader* reader );
+
+/// ---------- IMPLEMENTED IN database.c ---------------
+typedef struct Database Database;
+
+Database* database_open( const char* filename );
+bool database_session( Database* database, const char* device, bool rtree );
+bool database_append( Database* database, const GPS_point* point );
+bool database_close( Database* database );
+void database_abort( Database* database );
+long database_export( const char* filename, const char* const* inputs, int ninputs, bool rtree );
+
+/// ---------- IMPLEMENTED IN roads.c ---------------
+typedef struct Roads Roads;
+
+Roads* roads_open( const char* filename );
+unsigned int roads_count( const Roads* roads );
+void roads_close( Roads* roads );
+long roads_match( const Roads* roads, const GPS_points* points, double radius, GPS_writer* writer,
+                  const char* edges_file );
+
+/// ---------- IMPLEMENTED IN resample.c ---------------
+typedef struct
+{
+   int64_t step;      // seconds between points
+   int64_t max_gap;   // seconds, no positions are interpolated over longer gaps
+} Resample_options;
+
+typedef struct Resampler Resampler;
+
+Resampler* resample_open( const char* filename, int64_t step, int64_t max_gap, double offset );
+int resample_next( Resampler* resampler, GPS_point* point );
+void resample_close( Resampler* resampler );
+void resample_input( const char* input, char* filename, size_t len, double* offset );
+long resample_track( const char* filename, const Resample_options* options, GPS_writer* writer );
+long resample_join( const char* output, const char* const* inputs, int ninputs, const Resample_options* options );
+
+/// ---------- IMPLEMENTED IN stays.c ---------------
+#define STAYS_PLACES_CSV_HEADER "name,latitude,longitude,visits,sessions,seconds,first,last\n"
+#define STAYS_VISITS_CSV_HEADER "device,session,place,arrived,left,seconds,latitude,longitude,points\n"
+
+typedef struct
+{
+   double       distance;     // meters, points of a stay are within this of its first point
+   int64_t      duration;     // seconds, shortest stay
+   double       eps;          // meters, stays within this are neighbours
+   unsigned int min_visits;   // stays around a place, itself included
+} Stays_options;
+
+long stays_scan( const char* places_file, const char* visits_file, const char* const* inputs, int ninputs,
+                 const Stays_options* options, long* nstays );
+
+/// ---------- IMPLEMENTED IN telemetry.c ---------------
+typedef struct Telemetry Telemetry;
+
+Telemetry* telemetry_start( const char* history, const char* port, const char* device, const char* mode,
+                            const char* metrics );
+bool telemetry_end( Telemetry* telemetry, bool ok );
+long telemetry_health( const char* history );
+
+/// ---------- IMPLEMENTED IN verify.c ---------------
+typedef struct Verify_manifest Verify_manifest;
+
+Verify_manifest* verify_manifest_open( const char* filename );
+bool verify_manifest_add( Verify_manifest* manifest, const GPS_point* point );
+bool verify_manifest_close( Verify_manifest* manifest, bool ok );
+bool verify_device( int serial_fd, unsigned char* buffer, const char* manifest_file, const char* saved,
+                    const char* device, double confidence, double fraction );
+
 #endif
\ No newline at end of file
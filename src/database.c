@@ -0,0 +1,475 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+#define MODULE_NAME "database"
+
+/// Points are loaded to a SQLite database of fixed schema, each load or device of an export is a session:
+///
+///   sessions( id, device, loaded, points, first_time, last_time )
+///   points( id, session, time, latitude, longitude, height )   -- epoch seconds, micro-degrees, meters
+///   track_points                                                -- view of the points with their device
+///   points_rtree( id, min_lat, max_lat, min_lon, max_lon )      -- optional R*Tree over the points, degrees
+///
+/// Rows are inserted with prepared statements of many rows each, inside a transaction that is committed every
+/// DATABASE_COMMIT_POINTS points and at the end. The database is in WAL mode and a commit is on disk when it
+/// returns. Indexes are created after the points are loaded to a new database, later loads update them.
+/// Once a database has the R*Tree every load fills it.
+
+#define DATABASE_BATCH         128          // rows per insert statement
+#define DATABASE_COMMIT_POINTS (1 << 20)
+#define DATABASE_CHUNK         65536        // points read at a time by export
+
+#ifdef HAVE_SQLITE3
+
+static const char* database_schema =
+   "PRAGMA synchronous=FULL;"
+   "PRAGMA cache_size=-65536;"
+   "PRAGMA temp_store=MEMORY;"
+   "CREATE TABLE IF NOT EXISTS sessions( id INTEGER PRIMARY KEY, device TEXT, loaded INTEGER,"
+   " points INTEGER DEFAULT 0, first_time INTEGER, last_time INTEGER );"
+   "CREATE TABLE IF NOT EXISTS points( id INTEGER PRIMARY KEY, session INTEGER NOT NULL, time INTEGER NOT NULL,"
+   " latitude INTEGER NOT NULL, longitude INTEGER NOT NULL, height INTEGER );"
+   "CREATE VIEW IF NOT EXISTS track_points AS SELECT s.device, p.session, p.time, p.latitude, p.longitude, p.height"
+   " FROM points p JOIN sessions s ON s.id = p.session;";
+
+static const char* database_indexes =
+   "CREATE INDEX IF NOT EXISTS points_session_time ON points( session, time );"
+   "CREATE INDEX IF NOT EXISTS points_time ON points( time );"
+   "PRAGMA optimize;";
+
+struct Database
+{
+   sqlite3*      db;
+   char*         filename;
+   sqlite3_stmt* insert;        // DATABASE_BATCH points
+   sqlite3_stmt* insert_one;
+   sqlite3_stmt* rtree;         // DATABASE_BATCH points, NULL without R*Tree
+   sqlite3_stmt* rtree_one;
+   bool          has_rtree;
+
+   // current session, 0 if none
+   sqlite3_int64 session;
+   sqlite3_int64 next_id;
+   long          npoints;
+   int64_t       first_time, last_time;
+   long          uncommitted;
+
+   GPS_point     batch[ DATABASE_BATCH ];
+   unsigned int  nbatch;
+};
+
+static bool database_exec( Database* database, const char* sql )
+{
+   char* message = NULL;
+
+   if ( sqlite3_exec( database->db, sql, NULL, NULL, &message ) != SQLITE_OK )
+   {
+      ERROR("Database '%s': %s", database->filename, message != NULL ? message : "failed" );
+      sqlite3_free( message );
+      return false;
+   }
+   return true;
+}
+
+static bool database_failed( Database* database, const char* what )
+{
+   ERROR("Database '%s': %s: %s", database->filename, what, sqlite3_errmsg( database->db ) );
+   return false;
+}
+
+/// Insert statement of 'rows' rows of 'columns' values each
+static sqlite3_stmt* database_prepare_insert( Database* database, const char* table, int columns, int rows )
+{
+   char sql[ 64 + DATABASE_BATCH * 32 ];   // rows of up to 15 values
+   sqlite3_stmt* statement = NULL;
+   int len, row, column;
+
+   len = snprintf( sql, sizeof(sql), "INSERT INTO %s VALUES ", table );
+   for ( row = 0; row < rows; row ++ )
+   {
+      sql[ len ++ ] = ( row > 0 ) ? ',' : ' ';
+      sql[ len ++ ] = '(';
+      for ( column = 0; column < columns; column ++ )
+      {
+         sql[ len ++ ] = '?';
+         sql[ len ++ ] = ( column + 1 < columns ) ? ',' : ')';
+      }
+   }
+   sql[ len ] = 0;
+
+   if ( sqlite3_prepare_v2( database->db, sql, len + 1, &statement, NULL ) != SQLITE_OK )
+   {
+      database_failed( database, "prepare" );
+      return NULL;
+   }
+   return statement;
+}
+
+static void database_finalize( Database* database )
+{
+   sqlite3_finalize( database->insert );
+   sqlite3_finalize( database->insert_one );
+   sqlite3_finalize( database->rtree );
+   sqlite3_finalize( database->rtree_one );
+   database->insert = database->insert_one = database->rtree = database->rtree_one = NULL;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Open or create database file, points are added to sessions started with database_session
+///--------------------------------------------------------------------------------------------------------------------
+Database* database_open( const char* filename )
+{
+   Database* database = (Database*)calloc( 1, sizeof(Database) );
+   if ( database == NULL || ( database->filename = strdup( filename ) ) == NULL )
+   {
+      ERROR("Out of memory!");
+      free( database );
+      return NULL;
+   }
+   if ( sqlite3_open( filename, &database->db ) != SQLITE_OK )
+   {
+      ERROR("Cannot open database '%s': %s", filename, sqlite3_errmsg( database->db ) );
+      sqlite3_close( database->db );
+      free( database->filename );
+      free( database );
+      return NULL;
+   }
+   sqlite3_busy_timeout( database->db, 5000 );
+
+   // journal mode is kept in the file, the rest is for this connection
+   bool ok = database_exec( database, "PRAGMA journal_mode=WAL;" ) && database_exec( database, database_schema );
+   if ( ok )
+   {
+      sqlite3_stmt* statement;
+      ok = sqlite3_prepare_v2( database->db, "SELECT 1 FROM sqlite_master WHERE name = 'points_rtree'", -1,
+                               &statement, NULL ) == SQLITE_OK;
+      database->has_rtree = ok && sqlite3_step( statement ) == SQLITE_ROW;
+      sqlite3_finalize( statement );
+   }
+   database->insert     = ok ? database_prepare_insert( database, "points", 6, DATABASE_BATCH ) : NULL;
+   database->insert_one = ok ? database_prepare_insert( database, "points", 6, 1 ) : NULL;
+   if ( database->insert == NULL || database->insert_one == NULL )
+   {
+      database_finalize( database );
+      sqlite3_close( database->db );
+      free( database->filename );
+      free( database );
+      return NULL;
+   }
+   return database;
+}
+
+static bool database_rtree_prepare( Database* database )
+{
+   database->rtree     = database_prepare_insert( database, "points_rtree", 5, DATABASE_BATCH );
+   database->rtree_one = database_prepare_insert( database, "points_rtree", 5, 1 );
+   return database->rtree != NULL && database->rtree_one != NULL;
+}
+
+/// Insert points with the statement of as many rows
+static bool database_insert( Database* database, const GPS_point* points, unsigned int count )
+{
+   sqlite3_stmt* insert = ( count == DATABASE_BATCH ) ? database->insert : database->insert_one;
+   sqlite3_stmt* rtree  = ( count == DATABASE_BATCH ) ? database->rtree : database->rtree_one;
+   unsigned int loop;
+   int param = 1;
+
+   for ( loop = 0; loop < count; loop ++ )
+   {
+      int64_t epoch = GPS_point_epoch( &points[loop] );
+      sqlite3_bind_int64( insert, param ++, database->next_id + loop );
+      sqlite3_bind_int64( insert, param ++, database->session );
+      sqlite3_bind_int64( insert, param ++, epoch );
+      sqlite3_bind_int( insert, param ++, points[loop].latitude );
+      sqlite3_bind_int( insert, param ++, points[loop].longitude );
+      sqlite3_bind_int( insert, param ++, points[loop].height );
+
+      if ( database->npoints == 0 && loop == 0 )
+         database->first_time = epoch;
+      database->last_time = epoch;
+   }
+   bool ok = ( sqlite3_step( insert ) == SQLITE_DONE );
+   sqlite3_reset( insert );
+   if ( !ok )
+      return database_failed( database, "insert" );
+
+   if ( rtree != NULL )
+   {
+      for ( param = 1, loop = 0; loop < count; loop ++ )
+      {
+         double lat = points[loop].latitude * MICRODEG_TO_DEG;
+         double lon = points[loop].longitude * MICRODEG_TO_DEG;
+         sqlite3_bind_int64( rtree, param ++, database->next_id + loop );
+         sqlite3_bind_double( rtree, param ++, lat );
+         sqlite3_bind_double( rtree, param ++, lat );
+         sqlite3_bind_double( rtree, param ++, lon );
+         sqlite3_bind_double( rtree, param ++, lon );
+      }
+      ok = ( sqlite3_step( rtree ) == SQLITE_DONE );
+      sqlite3_reset( rtree );
+      if ( !ok )
+         return database_failed( database, "insert to R*Tree" );
+   }
+
+   database->next_id     += count;
+   database->npoints     += count;
+   database->uncommitted += count;
+   return true;
+}
+
+static bool database_flush( Database* database )
+{
+   unsigned int loop;
+   bool ok = true;
+
+   if ( database->nbatch == DATABASE_BATCH )
+      ok = database_insert( database, database->batch, DATABASE_BATCH );
+   else
+      for ( loop = 0; ok && loop < database->nbatch; loop ++ )
+         ok = database_insert( database, &database->batch[loop], 1 );
+   database->nbatch = 0;
+   return ok;
+}
+
+/// Flush the points of the session and record its summary, the transaction is left open
+static bool database_session_end( Database* database )
+{
+   sqlite3_stmt* statement;
+
+   if ( database->session == 0 )
+      return true;
+   if ( !database_flush( database ) )
+      return false;
+
+   if ( sqlite3_prepare_v2( database->db, "UPDATE sessions SET points = ?, first_time = ?, last_time = ? WHERE id = ?",
+                            -1, &statement, NULL ) != SQLITE_OK )
+      return database_failed( database, "prepare" );
+   sqlite3_bind_int64( statement, 1, database->npoints );
+   if ( database->npoints > 0 )
+   {
+      sqlite3_bind_int64( statement, 2, database->first_time );
+      sqlite3_bind_int64( statement, 3, database->last_time );
+   }
+   sqlite3_bind_int64( statement, 4, database->session );
+   bool ok = ( sqlite3_step( statement ) == SQLITE_DONE );
+   sqlite3_finalize( statement );
+   database->session = 0;
+   return ok || database_failed( database, "update session" );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Start new session of a device, device may be NULL. With 'rtree' the R*Tree is created if the database does not
+/// have it yet. The previous session is ended.
+///--------------------------------------------------------------------------------------------------------------------
+bool database_session( Database* database, const char* device, bool rtree )
+{
+   sqlite3_stmt* statement;
+
+   if ( !database_session_end( database ) )
+      return false;
+   if ( sqlite3_get_autocommit( database->db ) && !database_exec( database, "BEGIN IMMEDIATE;" ) )
+      return false;
+
+   if ( rtree && !database->has_rtree )
+   {
+      if ( !database_exec( database, "CREATE VIRTUAL TABLE points_rtree USING rtree( id, min_lat, max_lat,"
+                                     " min_lon, max_lon );" ) )
+         return false;
+      database->has_rtree = true;
+   }
+   if ( database->has_rtree && database->rtree == NULL && !database_rtree_prepare( database ) )
+      return false;
+
+   if ( sqlite3_prepare_v2( database->db, "INSERT INTO sessions( device, loaded ) VALUES ( ?, ? )", -1,
+                            &statement, NULL ) != SQLITE_OK )
+      return database_failed( database, "prepare" );
+   if ( device != NULL )
+      sqlite3_bind_text( statement, 1, device, -1, SQLITE_TRANSIENT );
+   sqlite3_bind_int64( statement, 2, (sqlite3_int64)time( NULL ) );
+   bool ok = ( sqlite3_step( statement ) == SQLITE_DONE );
+   sqlite3_finalize( statement );
+   if ( !ok )
+      return database_failed( database, "insert session" );
+   database->session = sqlite3_last_insert_rowid( database->db );
+   database->npoints = 0;
+
+   ok = sqlite3_prepare_v2( database->db, "SELECT IFNULL( MAX( id ), 0 ) + 1 FROM points", -1, &statement,
+                            NULL ) == SQLITE_OK && sqlite3_step( statement ) == SQLITE_ROW;
+   database->next_id = ok ? sqlite3_column_int64( statement, 0 ) : 0;
+   sqlite3_finalize( statement );
+   return ok || database_failed( database, "select" );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Add point to the session, a session without device is started if there is none
+///--------------------------------------------------------------------------------------------------------------------
+bool database_append( Database* database, const GPS_point* point )
+{
+   if ( database->session == 0 && !database_session( database, NULL, false ) )
+      return false;
+
+   database->batch[ database->nbatch ++ ] = *point;
+   if ( database->nbatch < DATABASE_BATCH )
+      return true;
+   if ( !database_flush( database ) )
+      return false;
+
+   // bounded transactions keep the write ahead log small
+   if ( database->uncommitted >= DATABASE_COMMIT_POINTS )
+   {
+      if ( !database_exec( database, "COMMIT; BEGIN IMMEDIATE;" ) )
+         return false;
+      database->uncommitted = 0;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// End the session, commit and create the indexes. True when the points are on disk.
+///--------------------------------------------------------------------------------------------------------------------
+bool database_close( Database* database )
+{
+   bool ok = database_session_end( database );
+
+   if ( !sqlite3_get_autocommit( database->db ) )
+      ok = database_exec( database, ok ? "COMMIT;" : "ROLLBACK;" ) && ok;
+   ok = ok && database_exec( database, database_indexes );
+
+   database_finalize( database );
+   if ( sqlite3_close( database->db ) != SQLITE_OK )
+      ok = database_failed( database, "close" );
+   free( database->filename );
+   free( database );
+   return ok;
+}
+
+/// Roll back the points not committed yet and close, bounded commits of a long session stay. Frees the database.
+void database_abort( Database* database )
+{
+   if ( !sqlite3_get_autocommit( database->db ) )
+      database_exec( database, "ROLLBACK;" );
+   database_finalize( database );
+   sqlite3_close( database->db );
+   free( database->filename );
+   free( database );
+}
+
+#else
+
+Database* database_open( const char* filename )
+{
+   ERROR("Cannot write '%s': built without SQLite", filename );
+   return NULL;
+}
+
+bool database_session( Database* database, const char* device, bool rtree )
+{
+   return false;
+}
+
+bool database_append( Database* database, const GPS_point* point )
+{
+   return false;
+}
+
+bool database_close( Database* database )
+{
+   return false;
+}
+
+void database_abort( Database* database )
+{
+}
+
+#endif
+
+///--------------------------------------------------------------------------------------------------------------------
+/// EXPORT
+///--------------------------------------------------------------------------------------------------------------------
+
+/// Points of a track file to the current session
+static long database_load_file( Database* database, const char* filename, GPS_point* points )
+{
+   long count = 0;
+   int ret, loop;
+
+   GPS_reader* reader = GPS_reader_open( filename );
+   if ( reader == NULL )
+      return -1;
+   while ( (ret = GPS_reader_read( reader, points, DATABASE_CHUNK )) > 0 )
+   {
+      for ( loop = 0; loop < ret; loop ++ )
+         if ( !database_append( database, &points[loop] ) )
+            ret = -1;
+      if ( ret < 0 )
+         break;
+      count += ret;
+   }
+   GPS_reader_close( reader );
+   return ( ret < 0 ) ? -1 : count;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Load saved tracks and archive roots to database. A track file is a session of the device named by the file, in
+/// an archive each device is a session. \returns number of points or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long database_export( const char* filename, const char* const* inputs, int ninputs, bool rtree )
+{
+   Archive_inputs devices;
+   long total = 0;
+   unsigned int loop, floop;
+   int iloop;
+
+   memset( &devices, 0, sizeof(devices) );
+   for ( iloop = 0; iloop < ninputs; iloop ++ )
+      if ( !archive_inputs_add( &devices, inputs[iloop] ) )
+      {
+         archive_inputs_free( &devices );
+         return -1;
+      }
+
+   GPS_point* points = (GPS_point*)malloc( DATABASE_CHUNK * sizeof(GPS_point) );
+   if ( points == NULL )
+   {
+      ERROR("Out of memory!");
+      archive_inputs_free( &devices );
+      return -1;
+   }
+   Database* database = database_open( filename );
+   if ( database == NULL )
+   {
+      free( points );
+      archive_inputs_free( &devices );
+      return -1;
+   }
+
+   for ( loop = 0; total >= 0 && loop < devices.ndevices; loop ++ )
+   {
+      const Archive_device* device = &devices.devices[loop];
+      long loaded = database_session( database, device->device, rtree ) ? 0 : -1;
+      for ( floop = 0; loaded >= 0 && floop < device->nfiles; floop ++ )
+      {
+         long count = database_load_file( database, device->files[floop], points );
+         loaded = ( count < 0 ) ? -1 : loaded + count;
+      }
+      total = ( loaded < 0 ) ? -1 : total + loaded;
+      DEBUG(2, "device '%s': %ld points", device->device, loaded );
+   }
+
+   // a failed export is rolled back, not committed
+   if ( total < 0 )
+      database_abort( database );
+   else if ( !database_close( database ) )
+      total = -1;
+   free( points );
+   archive_inputs_free( &devices );
+   return total;
+}
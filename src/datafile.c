@@ -1,13 +1,61 @@
-
-
 #include "common.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include <pthread.h>
 
 #define MODULE_NAME "datafile"
 
+/// Longest formatted GPX track point
+#define GPX_POINT_MAX 256
+
+#define CSV_HEADER "time,latitude,longitude,elevation\n"
+
+/// Text output of many points is formatted in parallel, chunks of this many points per job
+#define FORMAT_CHUNK    4096
+/// Fewer points are formatted by the calling thread
+#define FORMAT_PARALLEL 32768
+
+/// GPX text is read in chunks of this size
+#define GPX_CHUNK (1024*1024)
+
+struct GPS_writer
+{
+   int     format;
+   Output* output;
+   Track_writer* track;
+   Database* database;
+
+   // durable completion handler
+   char*       filename;
+   Output_done done;
+   void*       context;
+};
+
+struct GPS_reader
+{
+   int   format;
+   char* filename;
+
+   // GPX text, pos is the first unparsed character
+   FILE*  fid;
+   char*  text;
+   size_t capacity;
+   bool   eof;
+
+   // decoded block of track store
+   Track_reader* track;
+   unsigned int  block;
+   GPS_point*    points;
+
+   size_t pos;
+   size_t length;
+};
+
 ///--------------------------------------------------------------------------------------------------------------------
 ///--------------------------------------------------------------------------------------------------------------------
 bool GPS_points_init( GPS_points* points )
@@ -22,49 +70,893 @@ bool GPS_points_init( GPS_points* points )
 bool GPS_points_free( GPS_points* points )
 {
    free( points->points  );
+   points->points  = NULL;
    points->npoints = 0;
    return true;
 }
 
+///--------------------------------------------------------------------------------------------------------------------
+/// Seconds since 1970 of the point time, device times are UTC
+///--------------------------------------------------------------------------------------------------------------------
+int64_t GPS_point_epoch( const GPS_point* point )
+{
+   // days from civil, proleptic gregorian calendar
+   int64_t year  = point->time[5] - ( point->time[4] <= 2 );
+   int64_t era   = ( year >= 0 ? year : year - 399 ) / 400;
+   int64_t yoe   = year - era * 400;
+   int64_t month = point->time[4];
+   int64_t doy   = ( 153 * ( month + ( month > 2 ? -3 : 9 ) ) + 2 ) / 5 + point->time[3] - 1;
+   int64_t doe   = yoe * 365 + yoe/4 - yoe/100 + doy;
+   int64_t days  = era * 146097 + doe - 719468;
+
+   return days * 86400 + point->time[2] * 3600 + point->time[1] * 60 + point->time[0];
+}
+
+void GPS_point_set_epoch( GPS_point* point, int64_t epoch )
+{
+   int64_t days = epoch / 86400;
+   int64_t secs = epoch % 86400;
+   if ( secs < 0 )
+   {
+      secs += 86400;
+      days -= 1;
+   }
+
+   // civil from days
+   days += 719468;
+   int64_t era   = ( days >= 0 ? days : days - 146096 ) / 146097;
+   int64_t doe   = days - era * 146097;
+   int64_t yoe   = ( doe - doe/1460 + doe/36524 - doe/146096 ) / 365;
+   int64_t doy   = doe - ( 365*yoe + yoe/4 - yoe/100 );
+   int64_t mp    = ( 5*doy + 2 ) / 153;
+   int64_t month = mp + ( mp < 10 ? 3 : -9 );
+
+   point->time[5] = yoe + era * 400 + ( month <= 2 );
+   point->time[4] = month;
+   point->time[3] = doy - ( 153*mp + 2 )/5 + 1;
+   point->time[2] = secs / 3600;
+   point->time[1] = ( secs / 60 ) % 60;
+   point->time[0] = secs % 60;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+int GPS_format_of( const char* filename )
+{
+   const char* end = filename + strlen( filename );
+   const char* ext;
+
+   // format of compressed output is the extension before .gz or .zst
+   if ( output_codec_of( filename ) != OUTPUT_PLAIN )
+      end = strrchr( filename, '.' );
+   for ( ext = end; ext > filename && *( ext - 1 ) != '/'; )
+      if ( *( -- ext ) == '.' )
+         break;
+
+   if ( end - ext == 4 && strncasecmp( ext, ".gts", 4 ) == 0 )
+      return GPS_FORMAT_TRACK;
+   if ( end - ext == 4 && strncasecmp( ext, ".csv", 4 ) == 0 )
+      return GPS_FORMAT_CSV;
+   if ( end - ext == 3 && strncasecmp( ext, ".db", 3 ) == 0 )
+      return GPS_FORMAT_DATABASE;
+
+   return GPS_FORMAT_GPX;
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+static bool GPX_write_header( Output* output )
+{
+   static const char header[] =
+      "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\" ?>\n"
+      "<gpx xmlns=\"http://www.topografix.com/GPX/1/1\" creator=\"MapSource 6.15.7\" version=\"1.1\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"http://www.topografix.com/GPX/1/1 http://www.topografix.com/GPX/1/1/gpx.xsd\">\n"
+      "<metadata>\n"
+      "<text>Geotech GPS receiver, data downloaded with geotech_tool </text> \n"
+      "</metadata>\n"
+
+      " <trk>\n"
+      "  <name>Route1</name>\n"
+      "  <trkseg>\n";
+   return output_write( output, header, sizeof(header) - 1 );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Integer only text formatting, coordinates are printed exactly from the micro-degrees
+///--------------------------------------------------------------------------------------------------------------------
+static inline char* format_append( char* out, const char* text, int len )
+{
+   memcpy( out, text, len );
+   return out + len;
+}
+
+#define FORMAT_LITERAL( out, text ) format_append( out, text, sizeof(text) - 1 )
+
+/// Unsigned value with at least 'width' digits, zero padded
+static inline char* format_uint( char* out, uint32_t value, int width )
+{
+   char digits[16];
+   int len = 0;
+
+   do
+   {
+      digits[ len ++ ] = '0' + value % 10;
+      value = value / 10;
+   } while ( value > 0 || len < width );
+
+   while ( len > 0 )
+      *out++ = digits[ -- len ];
+   return out;
+}
+
+static inline char* format_int( char* out, int32_t value )
+{
+   if ( value < 0 )
+   {
+      *out++ = '-';
+      return format_uint( out, -(int64_t)value, 1 );
+   }
+   return format_uint( out, value, 1 );
+}
+
+/// \returns number of characters written, not zero terminated
+int GPS_format_microdeg( char* out, int32_t value )
+{
+   char* pos = out;
+   uint32_t magnitude = ( value < 0 ) ? -(int64_t)value : value;
+
+   if ( value < 0 )
+      *pos++ = '-';
+   pos = format_uint( pos, magnitude / 1000000, 1 );
+   *pos++ = '.';
+   pos = format_uint( pos, magnitude % 1000000, 6 );
+   return pos - out;
+}
+
+/// Parse decimal degrees to micro-degrees without floating point, rounding at the seventh decimal. The whole text
+/// must be the number, spaces around it aside, and its magnitude at most 'limit' micro-degrees.
+bool GPS_parse_microdeg( const char* text, int32_t limit, int32_t* value )
+{
+   int64_t whole = 0, fraction = 0;
+   int digits = 0;
+   bool negative = false;
+
+   while ( *text == ' ' )
+      text ++;
+   if ( *text == '-' || *text == '+' )
+      negative = ( *text++ == '-' );
+   // a digit before or after the point, "." alone is not zero
+   if ( ( text[0] < '0' || text[0] > '9' ) && ( text[0] != '.' || text[1] < '0' || text[1] > '9' ) )
+      return false;
+
+   // checked digit by digit, before the degrees could overflow
+   for ( ; *text >= '0' && *text <= '9'; text ++ )
+   {
+      whole = whole * 10 + ( *text - '0' );
+      if ( whole > limit / 1000000 )
+         return false;
+   }
+   if ( *text == '.' )
+   {
+      text ++;
+      for ( ; *text >= '0' && *text <= '9'; text ++, digits ++ )
+      {
+         if ( digits < 7 )
+            fraction = fraction * 10 + ( *text - '0' );
+      }
+   }
+   for ( ; digits < 7; digits ++ )
+      fraction = fraction * 10;
+   while ( *text == ' ' )
+      text ++;
+   if ( *text != 0x00 )
+      return false;
+
+   int64_t result = whole * 1000000 + ( fraction + 5 ) / 10;
+   if ( result > limit )
+      return false;
+   *value = negative ? -result : result;
+   return true;
+}
+
+/// YYYY-MM-DDTHH:MM:SS
+static inline char* format_time( char* out, const GPS_point* point )
+{
+   char* pos = out;
+
+   pos = format_uint( pos, point->time[5], 4 );
+   *pos++ = '-';
+   pos = format_uint( pos, point->time[4], 2 );
+   *pos++ = '-';
+   pos = format_uint( pos, point->time[3], 2 );
+   *pos++ = 'T';
+   pos = format_uint( pos, point->time[2], 2 );
+   *pos++ = ':';
+   pos = format_uint( pos, point->time[1], 2 );
+   *pos++ = ':';
+   pos = format_uint( pos, point->time[0], 2 );
+   return pos;
+}
+
+/// Track point up to its time, the caller closes the element
+static char* GPX_format_point_body( char* out, const GPS_point* point )
+{
+   char* pos = out;
+
+   pos = FORMAT_LITERAL( pos, "  <trkpt lat=\"" );
+   pos += GPS_format_microdeg( pos, point->latitude );
+   pos = FORMAT_LITERAL( pos, "\" lon=\"" );
+   pos += GPS_format_microdeg( pos, point->longitude );
+   pos = FORMAT_LITERAL( pos, "\"> \n     <ele> " );
+   pos = format_int( pos, point->height );
+   pos = FORMAT_LITERAL( pos, ".000000</ele> \n     <time>" );
+   pos = format_time( pos, point );
+   pos = FORMAT_LITERAL( pos, "Z</time> \n" );
+   //    <ele>39.000000</ele>
+   //    <time>2012-04-01T13:38:47Z</time>
+   return pos;
+}
+
+static int GPX_format_point( char* out, const GPS_point* point )
+{
+   char* pos = GPX_format_point_body( out, point );
+   pos = FORMAT_LITERAL( pos, "  </trkpt>\n" );
+   return pos - out;
+}
+
+/// time,latitude,longitude,elevation
+static int CSV_format_point( char* out, const GPS_point* point )
+{
+   char* pos = format_time( out, point );
+
+   pos = FORMAT_LITERAL( pos, "Z," );
+   pos += GPS_format_microdeg( pos, point->latitude );
+   *pos++ = ',';
+   pos += GPS_format_microdeg( pos, point->longitude );
+   *pos++ = ',';
+   pos = format_int( pos, point->height );
+   *pos++ = '\n';
+   return pos - out;
+}
+
+/// Text content of an element, with XML special characters escaped
+static bool GPX_write_text( Output* output, const char* element, const char* text )
+{
+   char tag[ 64 ];
+   const char* run = text;
+
+   bool ok = output_write( output, tag, snprintf( tag, sizeof(tag), "     <%s>", element ) );
+   for ( ; ok && *text != 0x00; text ++ )
+   {
+      const char* entity = ( *text == '<' ) ? "&lt;" : ( *text == '>' ) ? "&gt;" : ( *text == '&' ) ? "&amp;" : NULL;
+      if ( entity == NULL )
+         continue;
+      ok = output_write( output, run, text - run ) && output_write( output, entity, strlen( entity ) );
+      run = text + 1;
+   }
+   ok = ok && output_write( output, run, text - run );
+   return ok && output_write( output, tag, snprintf( tag, sizeof(tag), "</%s>\n", element ) );
+}
+
+static bool GPX_write_point( Output* output, const GPS_point* point )
+{
+   char text[ GPX_POINT_MAX ];
+   return output_write( output, text, GPX_format_point( text, point ) );
+}
+
+static bool GPX_write_footer( Output* output )
+{
+   static const char footer[] =
+      "  </trkseg>\n"
+      " </trk>\n"
+      "</gpx>\n";
+   return output_write( output, footer, sizeof(footer) - 1 );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Streaming output, format is selected by the file name. The file is written asynchronously and replaces an
+/// existing one only when closed successfully, see output.c
+///--------------------------------------------------------------------------------------------------------------------
+GPS_writer* GPS_writer_open( const char* filename )
+{
+   GPS_writer* writer = (GPS_writer*)calloc( 1, sizeof(GPS_writer) );
+   if ( writer == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+   writer->format   = GPS_format_of( filename );
+   writer->filename = strdup( filename );
+   if ( writer->filename == NULL )
+   {
+      ERROR("Out of memory!");
+      free( writer );
+      return NULL;
+   }
+
+   // track store is read by blocks from the mapped file, it is not compressed further
+   if ( writer->format == GPS_FORMAT_TRACK && output_codec_of( filename ) != OUTPUT_PLAIN )
+      ERROR("Cannot write '%s': track store is already compressed", filename );
+   else if ( writer->format == GPS_FORMAT_DATABASE && output_codec_of( filename ) != OUTPUT_PLAIN )
+      ERROR("Cannot write '%s': database is not compressed", filename );
+   else if ( writer->format == GPS_FORMAT_TRACK )
+      writer->track = track_writer_open( filename );
+   else if ( writer->format == GPS_FORMAT_DATABASE )
+      writer->database = database_open( filename );
+   else
+      writer->output = output_open( filename );
+   if ( writer->track == NULL && writer->output == NULL && writer->database == NULL )
+   {
+      free( writer->filename );
+      free( writer );
+      return NULL;
+   }
+   if ( writer->format == GPS_FORMAT_GPX )
+      GPX_write_header( writer->output );
+   if ( writer->format == GPS_FORMAT_CSV )
+      output_write( writer->output, CSV_HEADER, sizeof(CSV_HEADER) - 1 );
+   return writer;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Handler called when the writer is closed, after the file is on disk or has failed
+///--------------------------------------------------------------------------------------------------------------------
+void GPS_writer_notify( GPS_writer* writer, Output_done done, void* context )
+{
+   writer->done    = done;
+   writer->context = context;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Device of the points and whether to fill the R*Tree, for database output. Call before the first point,
+/// other formats ignore it.
+///--------------------------------------------------------------------------------------------------------------------
+void GPS_writer_session( GPS_writer* writer, const char* device, bool rtree )
+{
+   if ( writer->format == GPS_FORMAT_DATABASE )
+      database_session( writer->database, device, rtree );
+}
+
+bool GPS_writer_append( GPS_writer* writer, const GPS_point* point )
+{
+   char text[ GPX_POINT_MAX ];
+
+   if ( writer->format == GPS_FORMAT_TRACK )
+      return track_writer_append( writer->track, point );
+   if ( writer->format == GPS_FORMAT_DATABASE )
+      return database_append( writer->database, point );
+   if ( writer->format == GPS_FORMAT_CSV )
+      return output_write( writer->output, text, CSV_format_point( text, point ) );
+
+   return GPX_write_point( writer->output, point );
+}
+
+/// Point with GPX <name> and <desc>, either may be NULL. Other formats keep only the point.
+bool GPS_writer_append_named( GPS_writer* writer, const GPS_point* point, const char* name, const char* desc )
+{
+   char text[ GPX_POINT_MAX ];
+
+   if ( writer->format != GPS_FORMAT_GPX || ( name == NULL && desc == NULL ) )
+      return GPS_writer_append( writer, point );
+
+   bool ok = output_write( writer->output, text, GPX_format_point_body( text, point ) - text );
+   if ( ok && name != NULL )
+      ok = GPX_write_text( writer->output, "name", name );
+   if ( ok && desc != NULL )
+      ok = GPX_write_text( writer->output, "desc", desc );
+   return ok && output_write( writer->output, "  </trkpt>\n", 11 );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// PARALLEL TEXT FORMATTING
+///--------------------------------------------------------------------------------------------------------------------
+typedef struct
+{
+   const GPS_point* points;
+   unsigned int     npoints;
+   unsigned int     nchunks;
+   int              format;
+   Output*          output;
+   pthread_mutex_t  lock;
+   pthread_cond_t   cond;
+   unsigned int     nslots;     // chunk i is formatted to slot i % nslots once chunk i - nslots is written
+   char**           texts;
+   size_t*          lens;
+   bool*            ready;      // slot is formatted and waits to be written
+   unsigned int     written;    // chunks written so far, in order
+   bool             failed;
+} Format_job;
+
+static void format_chunk( unsigned int index, void* context )
+{
+   Format_job* job = (Format_job*)context;
+   unsigned int first = index * FORMAT_CHUNK;
+   unsigned int last  = ( first + FORMAT_CHUNK < job->npoints ) ? first + FORMAT_CHUNK : job->npoints;
+   unsigned int slot  = index % job->nslots;
+   unsigned int loop;
+
+   pthread_mutex_lock( &job->lock );
+   while ( index >= job->written + job->nslots && !job->failed )
+      pthread_cond_wait( &job->cond, &job->lock );
+   bool failed = job->failed;
+   pthread_mutex_unlock( &job->lock );
+   if ( failed )
+      return;
+
+   char* pos = job->texts[slot];
+   for ( loop = first; loop < last; loop ++ )
+      pos += ( job->format == GPS_FORMAT_CSV ) ? CSV_format_point( pos, &job->points[loop] )
+                                              : GPX_format_point( pos, &job->points[loop] );
+   job->lens[slot] = pos - job->texts[slot];
+
+   pthread_mutex_lock( &job->lock );
+   job->ready[slot] = true;
+   pthread_cond_broadcast( &job->cond );
+   pthread_mutex_unlock( &job->lock );
+}
+
+/// Write the chunks in order as they are formatted, on the calling thread
+static void format_write( void* context )
+{
+   Format_job* job = (Format_job*)context;
+
+   pthread_mutex_lock( &job->lock );
+   while ( job->written < job->nchunks && !job->failed )
+   {
+      unsigned int slot = job->written % job->nslots;
+      if ( !job->ready[slot] )
+      {
+         pthread_cond_wait( &job->cond, &job->lock );
+         continue;
+      }
+      pthread_mutex_unlock( &job->lock );
+      bool ok = output_write( job->output, job->texts[slot], job->lens[slot] );
+      pthread_mutex_lock( &job->lock );
+      job->ready[slot] = false;
+      job->failed      = !ok;
+      job->written ++;
+      pthread_cond_broadcast( &job->cond );
+   }
+   pthread_mutex_unlock( &job->lock );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Append array of points. GPX and CSV text of long arrays is formatted in chunks on the thread pool, started once
+/// for the array, while the calling thread writes the chunks in order through a window of two buffers per thread.
+/// The output is the same as appending the points one by one.
+///--------------------------------------------------------------------------------------------------------------------
+bool GPS_writer_append_points( GPS_writer* writer, const GPS_point* points, unsigned int npoints )
+{
+   Format_job job;
+   unsigned int loop;
+   bool ok = true;
+
+   memset( &job, 0, sizeof(job) );
+   if ( ( writer->format == GPS_FORMAT_GPX || writer->format == GPS_FORMAT_CSV ) && npoints >= FORMAT_PARALLEL &&
+        workers_count() > 1 )
+   {
+      job.points  = points;
+      job.npoints = npoints;
+      job.nchunks = ( npoints + FORMAT_CHUNK - 1 ) / FORMAT_CHUNK;
+      job.format  = writer->format;
+      job.output  = writer->output;
+      job.nslots  = workers_count() * 2;
+      job.texts   = (char**)calloc( job.nslots, sizeof(char*) );
+      job.lens    = (size_t*)malloc( job.nslots * sizeof(size_t) );
+      job.ready   = (bool*)calloc( job.nslots, sizeof(bool) );
+      ok = ( job.texts != NULL && job.lens != NULL && job.ready != NULL );
+      for ( loop = 0; ok && loop < job.nslots; loop ++ )
+         ok = ( job.texts[loop] = (char*)malloc( FORMAT_CHUNK * GPX_POINT_MAX ) ) != NULL;
+      if ( !ok )
+         ERROR("Out of memory!");
+   }
+
+   bool served = false;
+   if ( ok && job.nchunks > 0 )
+   {
+      pthread_mutex_init( &job.lock, NULL );
+      pthread_cond_init( &job.cond, NULL );
+      served = workers_serve( job.nchunks, format_chunk, format_write, &job );
+      pthread_cond_destroy( &job.cond );
+      pthread_mutex_destroy( &job.lock );
+      ok = !job.failed;
+   }
+
+   // short arrays, other formats or no threads
+   for ( loop = 0; ok && !served && loop < npoints; loop ++ )
+      ok = GPS_writer_append( writer, &points[loop] );
+
+   for ( loop = 0; job.texts != NULL && loop < job.nslots; loop ++ )
+      free( job.texts[loop] );
+   free( job.texts );
+   free( job.lens );
+   free( job.ready );
+   return ok;
+}
+
+bool GPS_writer_close( GPS_writer* writer )
+{
+   bool ok;
+
+   if ( writer->format == GPS_FORMAT_TRACK || writer->format == GPS_FORMAT_DATABASE )
+   {
+      ok = ( writer->track != NULL ) ? track_writer_close( writer->track ) : database_close( writer->database );
+      if ( writer->done != NULL )
+         writer->done( writer->filename, ok, writer->context );
+   }
+   else
+   {
+      if ( writer->format == GPS_FORMAT_GPX )
+         GPX_write_footer( writer->output );
+      ok = output_close( writer->output, writer->done, writer->context );
+   }
+   free( writer->filename );
+   free( writer );
+   return ok;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Drop a writer that has failed or whose points are incomplete: an existing file is kept as it was and the handler
+/// is told the file was not saved. Frees the writer.
+///--------------------------------------------------------------------------------------------------------------------
+void GPS_writer_abort( GPS_writer* writer )
+{
+   if ( writer->track != NULL )
+      track_writer_abort( writer->track );
+   else if ( writer->database != NULL )
+      database_abort( writer->database );
+   else
+      output_abort( writer->output );
+   if ( writer->done != NULL )
+      writer->done( writer->filename, false, writer->context );
+   free( writer->filename );
+   free( writer );
+}
+
 ///--------------------------------------------------------------------------------------------------------------------
 ///--------------------------------------------------------------------------------------------------------------------
 bool GPS_points_write( GPS_points* data, const char* filename )
 {
-   GPS_point* points = data->points;
-   
-   FILE* fid = fopen( filename, "wb" );
-   if (fid == NULL )
+   GPS_writer* writer = GPS_writer_open( filename );
+   if ( writer == NULL )
+      return false;
+
+   if ( !GPS_writer_append_points( writer, data->points, data->npoints ) )
+   {
+      GPS_writer_abort( writer );
+      return false;
+   }
+   return GPS_writer_close( writer );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Parse time given as 'YYYY-MM-DD' or 'YYYY-MM-DDTHH:MM:SS', UTC
+///--------------------------------------------------------------------------------------------------------------------
+bool GPS_parse_time( const char* text, int64_t* epoch )
+{
+   GPS_point point;
+   int fields;
+
+   memset( &point, 0, sizeof(point) );
+   fields = sscanf( text, "%d-%d-%dT%d:%d:%d", &point.time[5], &point.time[4], &point.time[3],
+                    &point.time[2], &point.time[1], &point.time[0] );
+   if ( fields != 3 && fields != 6 )
+   {
+      ERROR("Cannot parse time '%s', expected YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS", text );
+      return false;
+   }
+   *epoch = GPS_point_epoch( &point );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Value of tag attribute 'name="value"' before end of tag
+///--------------------------------------------------------------------------------------------------------------------
+static bool GPX_attribute( const char* tag, const char* tag_end, const char* name, int32_t limit, int32_t* value )
+{
+   const char* attr = tag;
+   size_t len = strlen( name );
+
+   while ( (attr = strstr( attr, name )) != NULL && attr < tag_end )
+   {
+      if ( attr[-1] == ' ' && attr[len] == '=' && ( attr[len+1] == '"' || attr[len+1] == '\'' ) )
+      {
+         // the value up to its closing quote
+         char number[ 32 ];
+         const char* start = attr + len + 2;
+         const char* end = strchr( start, attr[len+1] );
+         if ( end == NULL || end > tag_end || end - start >= (long)sizeof(number) )
+            return false;
+         memcpy( number, start, end - start );
+         number[ end - start ] = 0x00;
+         return GPS_parse_microdeg( number, limit, value );
+      }
+      attr += len;
+   }
+   return false;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Parse next track point of zero terminated GPX text. Without 'last' the point must be complete in the text.
+/// \returns position after the point, or NULL if there is no complete point. 'valid' is false if the point
+///          has no coordinates.
+///--------------------------------------------------------------------------------------------------------------------
+static const char* GPX_parse_point( const char* pos, bool last, GPS_point* point, bool* valid )
+{
+   int32_t lat, lon;
+
+   if ( (pos = strstr( pos, "<trkpt" )) == NULL )
+      return NULL;
+
+   const char* tag_end = strchr( pos, '>' );
+   if ( tag_end == NULL )
+      return NULL;
+
+   const char* end = ( tag_end[-1] == '/' ) ? tag_end : strstr( tag_end, "</trkpt>" );
+   if ( end == NULL )
+   {
+      if ( !last )
+         return NULL;
+      end = tag_end;
+   }
+
+   memset( point, 0, sizeof(GPS_point) );
+   *valid = GPX_attribute( pos, tag_end, "lat", GPS_LATITUDE_MAX, &lat ) &&
+            GPX_attribute( pos, tag_end, "lon", GPS_LONGITUDE_MAX, &lon );
+   if ( !*valid )
+      return tag_end;
+
+   point->latitude  = lat;
+   point->longitude = lon;
+
+   const char* ele  = strstr( tag_end, "<ele>" );
+   const char* time = strstr( tag_end, "<time>" );
+   if ( ele != NULL && ele < end )
+      point->height = lrint( strtod( ele + 5, NULL ) );
+   if ( time != NULL && time < end )
+   {
+      // sscanf takes the length of its input, give it only the time and not the rest of the chunk
+      char text[32];
+      size_t len = end - ( time + 6 );
+      len = ( len < sizeof(text) - 1 ) ? len : sizeof(text) - 1;
+      memcpy( text, time + 6, len );
+      text[len] = 0x00;
+      sscanf( text, "%d-%d-%dT%d:%d:%d", &point->time[5], &point->time[4], &point->time[3],
+              &point->time[2], &point->time[1], &point->time[0] );
+   }
+   return end;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Streaming input, points are read in chunks so that files of any size can be processed in bounded memory
+///--------------------------------------------------------------------------------------------------------------------
+GPS_reader* GPS_reader_open( const char* filename )
+{
+   GPS_reader* reader = (GPS_reader*)calloc( 1, sizeof(GPS_reader) );
+   if ( reader == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+   reader->format   = GPS_format_of( filename );
+   reader->filename = strdup( filename );
+   if ( reader->format == GPS_FORMAT_CSV || reader->format == GPS_FORMAT_DATABASE ||
+        output_codec_of( filename ) != OUTPUT_PLAIN )
+   {
+      ERROR("Cannot read '%s': only GPX and track store files are read", filename );
+      GPS_reader_close( reader );
+      return NULL;
+   }
+
+   if ( reader->format == GPS_FORMAT_TRACK )
+   {
+      reader->track  = track_reader_open( filename );
+      reader->points = (GPS_point*)malloc( TRACK_BLOCK_POINTS * sizeof(GPS_point) );
+      if ( reader->track == NULL || reader->points == NULL || reader->filename == NULL )
+      {
+         GPS_reader_close( reader );
+         return NULL;
+      }
+      return reader;
+   }
+
+   reader->fid      = fopen( filename, "rb" );
+   reader->capacity = GPX_CHUNK;
+   reader->text     = (char*)malloc( reader->capacity + 1 );
+   if ( reader->fid == NULL )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      GPS_reader_close( reader );
+      return NULL;
+   }
+   if ( reader->text == NULL || reader->filename == NULL )
+   {
+      ERROR("Out of memory!");
+      GPS_reader_close( reader );
+      return NULL;
+   }
+   reader->text[0] = 0x00;
+   return reader;
+}
+
+/// Move unparsed text to start of the buffer and fill the rest from file, \returns false on failure
+static bool GPX_fill( GPS_reader* reader )
+{
+   size_t left = reader->length - reader->pos;
+
+   memmove( reader->text, reader->text + reader->pos, left );
+   reader->pos    = 0;
+   reader->length = left;
+
+   // single point does not fit, grow the buffer
+   if ( left == reader->capacity )
+   {
+      char* text = (char*)realloc( reader->text, reader->capacity * 2 + 1 );
+      if ( text == NULL )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      reader->text      = text;
+      reader->capacity *= 2;
+   }
+
+   size_t red = fread( reader->text + left, 1, reader->capacity - left, reader->fid );
+   if ( ferror( reader->fid ) )
+   {
+      ERROR("Cannot read file '%s': %s", reader->filename, strerror(errno) );
+      return false;
+   }
+   reader->eof    = ( red < reader->capacity - left );
+   reader->length = left + red;
+   reader->text[ reader->length ] = 0x00;
+   return true;
+}
+
+/// \returns number of points read, 0 at end of file and -1 on failure
+static int GPX_read_points( GPS_reader* reader, GPS_point* points, unsigned int max_points )
+{
+   unsigned int count = 0;
+
+   while ( count < max_points )
+   {
+      const char* pos = reader->text + reader->pos;
+      bool valid;
+      const char* end = GPX_parse_point( pos, reader->eof, &points[count], &valid );
+      if ( end == NULL )
+      {
+         if ( reader->eof )
+            break;
+         // keep partial point, or the last bytes in case a tag name is split
+         const char* start = strstr( pos, "<trkpt" );
+         if ( start == NULL )
+            start = reader->text + ( reader->length > 8 ? reader->length - 8 : 0 );
+         reader->pos = ( start > pos ) ? start - reader->text : reader->pos;
+         if ( !GPX_fill( reader ) )
+            return -1;
+         continue;
+      }
+
+      reader->pos = end - reader->text;
+      if ( !valid )
+      {
+         ERROR("Track point without coordinates in '%s'", reader->filename );
+         continue;
+      }
+      count ++;
+   }
+   return count;
+}
+
+int GPS_reader_read( GPS_reader* reader, GPS_point* points, unsigned int max_points )
+{
+   if ( reader->format != GPS_FORMAT_TRACK )
+      return GPX_read_points( reader, points, max_points );
+
+   unsigned int count = 0;
+   while ( count < max_points )
+   {
+      if ( reader->pos == reader->length )
+      {
+         if ( reader->block == track_reader_nblocks( reader->track ) )
+            break;
+         int red = track_reader_block( reader->track, reader->block ++, reader->points );
+         if ( red < 0 )
+            return -1;
+         reader->pos    = 0;
+         reader->length = red;
+         continue;
+      }
+
+      unsigned int copy = reader->length - reader->pos;
+      if ( copy > max_points - count )
+         copy = max_points - count;
+      memcpy( points + count, reader->points + reader->pos, copy * sizeof(GPS_point) );
+      reader->pos += copy;
+      count       += copy;
+   }
+   return count;
+}
+
+void GPS_reader_close( GPS_reader* reader )
+{
+   if ( reader->track != NULL )
+      track_reader_close( reader->track );
+   if ( reader->fid != NULL )
+      fclose( reader->fid );
+   free( reader->points );
+   free( reader->text );
+   free( reader->filename );
+   free( reader );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Read track points of GPX file, as written by GPS_points_write or other tools
+///--------------------------------------------------------------------------------------------------------------------
+static bool GPX_read( GPS_points* data, const char* filename )
+{
+   GPS_point points[ 1024 ];
+   GPS_arena arena;
+   int count = 0;
+   bool ok = true;
+
+   GPS_reader* reader = GPS_reader_open( filename );
+   if ( reader == NULL )
+      return false;
+
+   // the number of points is not known before the end, collect to arena and copy once
+   GPS_arena_init( &arena, GPS_arena_backing() );
+   while ( ok && (count = GPS_reader_read( reader, points, 1024 )) > 0 )
+      ok = GPS_arena_append_points( &arena, points, count );
+   GPS_reader_close( reader );
+
+   ok = ok && count >= 0 && GPS_arena_to_points( &arena, data );
+   GPS_arena_free( &arena );
+   return ok;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Read all points of track store file
+///--------------------------------------------------------------------------------------------------------------------
+static bool track_read( GPS_points* data, const char* filename )
+{
+   unsigned int loop;
+
+   Track_reader* reader = track_reader_open( filename );
+   if ( reader == NULL )
+      return false;
+
+   data->points = (GPS_point*)malloc( track_reader_npoints( reader ) * sizeof(GPS_point) + 1 );
+   if ( data->points == NULL )
    {
-      printf("Error! Cannot open file '%s' for writing: %s \n", filename, strerror(errno ));
+      ERROR("Out of memory!");
+      track_reader_close( reader );
       return false;
    }
-   int ploop=0;
-   
-   fprintf(fid, "<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\" ?>\n" );
-   fprintf(fid, "<gpx xmlns=\"http://www.topografix.com/GPX/1/1\" creator=\"MapSource 6.15.7\" version=\"1.1\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"http://www.topografix.com/GPX/1/1 http://www.topografix.com/GPX/1/1/gpx.xsd\">\n");
-   fprintf(fid, "<metadata>\n");
-   fprintf(fid, "<text>Geotech GPS receiver, data downloaded with geotech_tool </text> \n");
-   fprintf(fid, "</metadata>\n");
-
-   fprintf(fid, " <trk>\n");
-   fprintf(fid, "  <name>Route1</name>\n");
-   fprintf(fid, "  <trkseg>\n");
-   for ( ploop = 0; ploop < data->npoints; ploop ++ )
-   {
-      fprintf(fid, "  <trkpt lat=\"%.06f\" lon=\"%.06f\"> \n", points[ploop].latitude, points[ploop].longitude );
-      fprintf(fid, "     <ele> %.06f</ele> \n",  points[ploop].height );
-      fprintf(fid, "     <time>%04d-%02d-%02dT%02d:%02d:%02dZ</time> \n",  points[ploop].time[5], points[ploop].time[4], points[ploop].time[3], 
-                                                                      points[ploop].time[2], points[ploop].time[1], points[ploop].time[0] );
-     //    <ele>39.000000</ele>
-     //    <time>2012-04-01T13:38:47Z</time>
-      fprintf(fid, "  </trkpt>\n");
-      /// fprintf(fid, "p%04d, %.03f, %0.6f, %0.6f \n", ploop, points->height[ploop], points->latitude[ploop], points->longitude[ploop] );
-   }
-   fprintf(fid, "  </trkseg>\n");
-   fprintf(fid, " </trk>\n");
-   fprintf(fid, "</gpx>\n");
-   
-   fclose( fid );
+
+   data->npoints = 0;
+   for ( loop = 0; loop < track_reader_nblocks( reader ); loop ++ )
+   {
+      int count = track_reader_block( reader, loop, data->points + data->npoints );
+      if ( count < 0 )
+      {
+         track_reader_close( reader );
+         GPS_points_free( data );
+         return false;
+      }
+      data->npoints += count;
+   }
+   track_reader_close( reader );
    return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Read all points of saved file, format is selected by the file name
+///--------------------------------------------------------------------------------------------------------------------
+bool GPS_points_read( GPS_points* data, const char* filename )
+{
+   if ( GPS_format_of( filename ) == GPS_FORMAT_TRACK && output_codec_of( filename ) == OUTPUT_PLAIN )
+      return track_read( data, filename );
 
+   return GPX_read( data, filename );
 }
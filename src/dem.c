@@ -0,0 +1,362 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MODULE_NAME "dem"
+
+/// Terrain heights from SRTM tiles in a directory. Tile 'N60E024.hgt' covers latitudes 60..61 and longitudes
+/// 24..25 as rows of big endian 16 bit heights in meters from north to south, 3601 x 3601 samples for one arc
+/// second or 1201 x 1201 for three. Tiles are mapped when first needed and unmapped in least recently used order,
+/// so only the pages that are looked up are read. Missing tiles are remembered and not looked for again.
+
+/// Mapped tiles at the same time
+#define DEM_CACHE_TILES 16
+
+/// One key per one degree tile of the world
+#define DEM_KEYS        ( 180 * 360 )
+
+/// Points are ordered by tile in batches of this size
+#define DEM_BATCH       65536
+
+#define DEM_VOID        -32768
+
+#define DEM_UNKNOWN     0
+#define DEM_MISSING     1
+
+typedef struct
+{
+   int            key;       // -1 for free slot
+   const uint8_t* samples;
+   size_t         size;
+   int            width;     // samples per row and column
+   int            lat0;      // south west corner in degrees
+   int            lon0;
+   unsigned long  used;      // last use, for eviction
+} Dem_tile;
+
+struct Dem
+{
+   char*         directory;
+   Dem_tile      tiles[ DEM_CACHE_TILES ];
+   Dem_tile*     last;
+   unsigned long clock;
+   unsigned char state[ DEM_KEYS ];
+   unsigned int  nloaded;
+};
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Tiles of the directory are opened when they are needed
+///--------------------------------------------------------------------------------------------------------------------
+Dem* dem_open( const char* directory )
+{
+   struct stat info;
+   unsigned int loop;
+
+   if ( stat( directory, &info ) != 0 || !S_ISDIR( info.st_mode ) )
+   {
+      ERROR("Cannot open elevation directory '%s'", directory );
+      return NULL;
+   }
+   Dem* dem = (Dem*)calloc( 1, sizeof(Dem) );
+   if ( dem == NULL || ( dem->directory = strdup( directory ) ) == NULL )
+   {
+      ERROR("Out of memory!");
+      free( dem );
+      return NULL;
+   }
+   for ( loop = 0; loop < DEM_CACHE_TILES; loop ++ )
+      dem->tiles[loop].key = -1;
+   return dem;
+}
+
+void dem_close( Dem* dem )
+{
+   unsigned int loop;
+
+   if ( dem == NULL )
+      return;
+   for ( loop = 0; loop < DEM_CACHE_TILES; loop ++ )
+      if ( dem->tiles[loop].key >= 0 )
+         munmap( (void*)dem->tiles[loop].samples, dem->tiles[loop].size );
+   DEBUG(3, "%u tiles mapped", dem->nloaded );
+   free( dem->directory );
+   free( dem );
+}
+
+/// Degrees rounded down, from micro-degrees
+static inline int dem_floor_degree( int32_t value )
+{
+   return ( value >= 0 ) ? value / 1000000 : -( ( -(int64_t)value + 999999 ) / 1000000 );
+}
+
+static inline int dem_key( int32_t latitude, int32_t longitude )
+{
+   int lat = dem_floor_degree( latitude );
+   int lon = dem_floor_degree( longitude );
+
+   if ( lat < -90 || lat >= 90 || lon < -180 || lon >= 180 )
+      return -1;
+   return ( lat + 90 ) * 360 + ( lon + 180 );
+}
+
+static bool dem_tile_map( Dem* dem, Dem_tile* tile, int key )
+{
+   char filename[ BUFFER_SIZE ];
+   struct stat info;
+   int lat = key / 360 - 90;
+   int lon = key % 360 - 180;
+
+   snprintf( filename, sizeof(filename), "%s/%c%02d%c%03d.hgt", dem->directory, lat < 0 ? 'S' : 'N', abs( lat ),
+             lon < 0 ? 'W' : 'E', abs( lon ) );
+   int fd = open( filename, O_RDONLY );
+   if ( fd < 0 )
+   {
+      DEBUG(3, "No elevation tile '%s'", filename );
+      return false;
+   }
+   if ( fstat( fd, &info ) != 0 || ( info.st_size != 3601 * 3601 * 2 && info.st_size != 1201 * 1201 * 2 ) )
+   {
+      ERROR("Elevation tile '%s' is not SRTM 1 or 3 arc second tile", filename );
+      close( fd );
+      return false;
+   }
+
+   void* samples = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+   close( fd );
+   if ( samples == MAP_FAILED )
+   {
+      ERROR("Cannot map file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   // lookups are scattered along a track
+   madvise( samples, info.st_size, MADV_RANDOM );
+
+   tile->key     = key;
+   tile->samples = (const uint8_t*)samples;
+   tile->size    = info.st_size;
+   tile->width   = ( info.st_size == 3601 * 3601 * 2 ) ? 3601 : 1201;
+   tile->lat0    = lat;
+   tile->lon0    = lon;
+   dem->nloaded ++;
+   return true;
+}
+
+/// Mapped tile of the key, NULL if there is no such tile
+static Dem_tile* dem_tile( Dem* dem, int key )
+{
+   Dem_tile* tile;
+   Dem_tile* oldest = &dem->tiles[0];
+   unsigned int loop;
+
+   if ( key < 0 )
+      return NULL;
+   if ( dem->last != NULL && dem->last->key == key )
+      return dem->last;
+   if ( dem->state[key] == DEM_MISSING )
+      return NULL;
+
+   for ( loop = 0; loop < DEM_CACHE_TILES; loop ++ )
+   {
+      tile = &dem->tiles[loop];
+      if ( tile->key == key )
+      {
+         tile->used = ++ dem->clock;
+         dem->last  = tile;
+         return tile;
+      }
+      if ( tile->key < 0 || ( oldest->key >= 0 && tile->used < oldest->used ) )
+         oldest = tile;
+   }
+
+   if ( oldest->key >= 0 )
+   {
+      munmap( (void*)oldest->samples, oldest->size );
+      oldest->key = -1;
+   }
+   if ( !dem_tile_map( dem, oldest, key ) )
+   {
+      dem->state[key] = DEM_MISSING;
+      return NULL;
+   }
+   oldest->used = ++ dem->clock;
+   dem->last    = oldest;
+   return oldest;
+}
+
+static inline int dem_sample( const Dem_tile* tile, int row, int col )
+{
+   const uint8_t* sample = tile->samples + 2 * ( (size_t)row * tile->width + col );
+   return (int16_t)( ( sample[0] << 8 ) | sample[1] );
+}
+
+/// Bilinear interpolation of the four samples around the point, voids are left out
+static bool dem_tile_height( const Dem_tile* tile, int32_t latitude, int32_t longitude, double* height )
+{
+   int cells = tile->width - 1;
+   double y = ( (int64_t)( tile->lat0 + 1 ) * 1000000 - latitude ) * cells / 1e6;
+   double x = ( longitude - (int64_t)tile->lon0 * 1000000 ) * cells / 1e6;
+   int row = (int)y;
+   int col = (int)x;
+
+   row = ( row < 0 ) ? 0 : ( row >= cells ) ? cells - 1 : row;
+   col = ( col < 0 ) ? 0 : ( col >= cells ) ? cells - 1 : col;
+   double dy = y - row;
+   double dx = x - col;
+
+   int nw = dem_sample( tile, row, col );
+   int ne = dem_sample( tile, row, col + 1 );
+   int sw = dem_sample( tile, row + 1, col );
+   int se = dem_sample( tile, row + 1, col + 1 );
+   if ( nw != DEM_VOID && ne != DEM_VOID && sw != DEM_VOID && se != DEM_VOID )
+   {
+      *height = ( nw * ( 1 - dx ) + ne * dx ) * ( 1 - dy ) + ( sw * ( 1 - dx ) + se * dx ) * dy;
+      return true;
+   }
+
+   double weights[4] = { ( 1 - dx ) * ( 1 - dy ), dx * ( 1 - dy ), ( 1 - dx ) * dy, dx * dy };
+   int samples[4] = { nw, ne, sw, se };
+   double sum = 0.0, weight = 0.0;
+   int loop;
+   for ( loop = 0; loop < 4; loop ++ )
+   {
+      if ( samples[loop] == DEM_VOID )
+         continue;
+      sum    += samples[loop] * weights[loop];
+      weight += weights[loop];
+   }
+   if ( weight <= 0.0 )
+      return false;
+   *height = sum / weight;
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Terrain height in meters at the point, false where there is no tile or only voids
+///--------------------------------------------------------------------------------------------------------------------
+bool dem_height( Dem* dem, int32_t latitude, int32_t longitude, double* height )
+{
+   Dem_tile* tile = dem_tile( dem, dem_key( latitude, longitude ) );
+
+   return tile != NULL && dem_tile_height( tile, latitude, longitude, height );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Replace heights of the points by terrain heights, points without terrain height keep theirs. The points are
+/// visited by tile in batches, so each tile is found once per batch and its pages are read together.
+/// \returns number of points given terrain height, -1 on error
+///--------------------------------------------------------------------------------------------------------------------
+long dem_elevate( Dem* dem, GPS_point* points, unsigned int npoints )
+{
+   unsigned int* counts = (unsigned int*)malloc( ( DEM_KEYS + 1 ) * sizeof(unsigned int) );
+   unsigned int* order  = (unsigned int*)malloc( DEM_BATCH * sizeof(unsigned int) );
+   int* keys            = (int*)malloc( DEM_BATCH * sizeof(int) );
+   unsigned int first, loop;
+   long count = 0;
+
+   if ( counts == NULL || order == NULL || keys == NULL )
+   {
+      ERROR("Out of memory!");
+      free( counts );
+      free( order );
+      free( keys );
+      return -1;
+   }
+
+   for ( first = 0; first < npoints; first += DEM_BATCH )
+   {
+      unsigned int nbatch = ( npoints - first < DEM_BATCH ) ? npoints - first : DEM_BATCH;
+      GPS_point* batch = points + first;
+
+      // counting sort of the batch by tile, points outside the world are left out
+      memset( counts, 0, ( DEM_KEYS + 1 ) * sizeof(unsigned int) );
+      for ( loop = 0; loop < nbatch; loop ++ )
+      {
+         keys[loop] = dem_key( batch[loop].latitude, batch[loop].longitude );
+         if ( keys[loop] >= 0 )
+            counts[ keys[loop] + 1 ] ++;
+      }
+      for ( loop = 0; loop < DEM_KEYS; loop ++ )
+         counts[ loop + 1 ] += counts[loop];
+      unsigned int nvalid = counts[ DEM_KEYS ];
+      for ( loop = 0; loop < nbatch; loop ++ )
+         if ( keys[loop] >= 0 )
+            order[ counts[ keys[loop] ] ++ ] = loop;
+
+      for ( loop = 0; loop < nvalid; )
+      {
+         int key = keys[ order[loop] ];
+         Dem_tile* tile = dem_tile( dem, key );
+         for ( ; loop < nvalid && keys[ order[loop] ] == key; loop ++ )
+         {
+            GPS_point* point = &batch[ order[loop] ];
+            double height;
+            if ( tile != NULL && dem_tile_height( tile, point->latitude, point->longitude, &height ) )
+            {
+               point->height = (int32_t)lround( height );
+               count ++;
+            }
+         }
+      }
+   }
+
+   free( counts );
+   free( order );
+   free( keys );
+   return count;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Replace heights in all track store files under the directory, each file is replaced when it is on disk
+/// \returns number of points given terrain height, -1 on error
+///--------------------------------------------------------------------------------------------------------------------
+long dem_elevate_tree( Dem* dem, const char* dirname )
+{
+   DIR* dir = opendir( dirname );
+   struct dirent* entry;
+   struct stat info;
+   long count = 0;
+
+   if ( dir == NULL )
+   {
+      ERROR("Cannot open directory '%s': %s", dirname, strerror(errno) );
+      return -1;
+   }
+   while ( count >= 0 && (entry = readdir( dir )) != NULL )
+   {
+      char path[ BUFFER_SIZE ];
+      if ( entry->d_name[0] == '.' || strstr( entry->d_name, ".tmp" ) != NULL )
+         continue;
+
+      snprintf( path, sizeof(path), "%s/%s", dirname, entry->d_name );
+      if ( stat( path, &info ) != 0 )
+         continue;
+      if ( S_ISDIR( info.st_mode ) )
+      {
+         long more = dem_elevate_tree( dem, path );
+         count = ( more < 0 ) ? -1 : count + more;
+      }
+      else if ( GPS_format_of( path ) == GPS_FORMAT_TRACK && output_codec_of( path ) == OUTPUT_PLAIN )
+      {
+         GPS_points data;
+         GPS_points_init( &data );
+         long more = GPS_points_read( &data, path ) ? dem_elevate( dem, data.points, data.npoints ) : -1;
+         if ( more < 0 || ( more > 0 && !GPS_points_write( &data, path ) ) )
+            count = -1;
+         else
+            count += more;
+         GPS_points_free( &data );
+      }
+   }
+   closedir( dir );
+   return count;
+}
@@ -0,0 +1,321 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MODULE_NAME "feed"
+
+/// Points are published to a ring in POSIX shared memory '/geotech.<name>' as they are decoded. There is one
+/// writer and any number of readers, each reader keeps its own position. The writer never waits for readers:
+/// a reader that falls more than the ring behind loses the oldest points and is told how many.
+///
+/// Every slot has a sequence number, odd while the slot is being written and 2 * (n + 1) once it holds point n,
+/// so a reader can tell a point that was overwritten while it was copied. The head is the number of points
+/// published. Waiting readers sleep on a futex in the header that the writer wakes only when someone waits.
+
+#define FEED_MAGIC    "GTF1"
+#define FEED_NAME_MAX 64
+
+typedef struct
+{
+   uint64_t  sequence;
+   GPS_point point;
+} Feed_slot;
+
+typedef struct
+{
+   char     magic[4];
+   uint32_t point_size;   // sizeof(GPS_point) of the writer
+   uint32_t capacity;     // slots, a power of two
+   uint32_t closed;       // no more points will come
+   int32_t  writer;       // process id, a writer that died does not close the feed
+   char     device[ FEED_NAME_MAX ];
+
+   uint64_t head;         // points published
+   uint32_t signal;       // futex, changes when points are published
+   uint32_t waiters;      // readers sleeping on the futex
+
+   Feed_slot slots[];
+} Feed_header;
+
+struct Feed
+{
+   Feed_header* header;
+   size_t       size;
+   char*        name;     // of the shared memory object
+};
+
+struct Feed_reader
+{
+   Feed_header* header;
+   size_t       size;
+   uint64_t     position;  // next point to read
+};
+
+static size_t feed_size( uint32_t capacity )
+{
+   return sizeof(Feed_header) + (size_t)capacity * sizeof(Feed_slot);
+}
+
+static void feed_object_name( char* object, size_t len, const char* name )
+{
+   snprintf( object, len, "/geotech.%s", name );
+}
+
+static void feed_wake( Feed_header* header )
+{
+   __atomic_add_fetch( &header->signal, 1, __ATOMIC_SEQ_CST );
+   if ( __atomic_load_n( &header->waiters, __ATOMIC_SEQ_CST ) > 0 )
+      syscall( SYS_futex, &header->signal, FUTEX_WAKE, INT_MAX, NULL, NULL, 0 );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// WRITER
+///--------------------------------------------------------------------------------------------------------------------
+
+///--------------------------------------------------------------------------------------------------------------------
+/// New feed of given number of points, rounded up to power of two. An older feed of the same name is replaced,
+/// its readers keep what they have mapped.
+///--------------------------------------------------------------------------------------------------------------------
+Feed* feed_create( const char* name, const char* device, unsigned int capacity )
+{
+   char object[ BUFFER_SIZE ];
+   uint32_t slots = 1;
+
+   while ( slots < capacity && slots < ( 1u << 30 ) )
+      slots = slots * 2;
+
+   Feed* feed = (Feed*)calloc( 1, sizeof(Feed) );
+   if ( feed == NULL || ( feed->name = strdup( name ) ) == NULL )
+   {
+      ERROR("Out of memory!");
+      free( feed );
+      return NULL;
+   }
+   feed->size = feed_size( slots );
+
+   feed_object_name( object, sizeof(object), name );
+   shm_unlink( object );
+   // readers map the feed writable to count themselves in 'waiters', so any reader could also corrupt the ring:
+   // only programs of the same user are let in
+   int fd = shm_open( object, O_RDWR | O_CREAT | O_EXCL, 0600 );
+   if ( fd < 0 || ftruncate( fd, feed->size ) != 0 )
+   {
+      ERROR("Cannot create shared memory '%s': %s", object, strerror(errno) );
+      if ( fd >= 0 )
+      {
+         close( fd );
+         shm_unlink( object );
+      }
+      free( feed->name );
+      free( feed );
+      return NULL;
+   }
+   void* memory = mmap( NULL, feed->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+   close( fd );
+   if ( memory == MAP_FAILED )
+   {
+      ERROR("Cannot map shared memory '%s': %s", object, strerror(errno) );
+      shm_unlink( object );
+      free( feed->name );
+      free( feed );
+      return NULL;
+   }
+
+   // new object is zero filled, the magic is written last so readers see a complete header
+   feed->header = (Feed_header*)memory;
+   feed->header->point_size = sizeof(GPS_point);
+   feed->header->capacity   = slots;
+   feed->header->writer     = getpid();
+   snprintf( feed->header->device, FEED_NAME_MAX, "%s", device != NULL ? device : "" );
+   __atomic_thread_fence( __ATOMIC_RELEASE );
+   memcpy( feed->header->magic, FEED_MAGIC, 4 );
+   return feed;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Publish point, never blocks. GPS_point_sink, always true.
+///--------------------------------------------------------------------------------------------------------------------
+bool feed_publish( const GPS_point* point, void* context )
+{
+   Feed_header* header = ((Feed*)context)->header;
+   uint64_t head = header->head;
+   Feed_slot* slot = &header->slots[ head & ( header->capacity - 1 ) ];
+
+   __atomic_store_n( &slot->sequence, 2 * head + 1, __ATOMIC_RELAXED );
+   __atomic_thread_fence( __ATOMIC_RELEASE );
+   slot->point = *point;
+   __atomic_store_n( &slot->sequence, 2 * head + 2, __ATOMIC_RELEASE );
+   __atomic_store_n( &header->head, head + 1, __ATOMIC_RELEASE );
+
+   feed_wake( header );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Tell readers that no more points come and remove the name, readers that have it open read to the end
+///--------------------------------------------------------------------------------------------------------------------
+void feed_close( Feed* feed )
+{
+   char object[ BUFFER_SIZE ];
+
+   if ( feed == NULL )
+      return;
+   __atomic_store_n( &feed->header->closed, 1, __ATOMIC_RELEASE );
+   feed_wake( feed->header );
+
+   feed_object_name( object, sizeof(object), feed->name );
+   shm_unlink( object );
+   munmap( feed->header, feed->size );
+   free( feed->name );
+   free( feed );
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// READER
+///--------------------------------------------------------------------------------------------------------------------
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Attach to a feed, reading starts from the oldest point still in the ring. NULL if there is no such feed.
+///--------------------------------------------------------------------------------------------------------------------
+Feed_reader* feed_reader_open( const char* name )
+{
+   char object[ BUFFER_SIZE ];
+   struct stat info;
+
+   feed_object_name( object, sizeof(object), name );
+   // readers write the count of waiters
+   int fd = shm_open( object, O_RDWR, 0 );
+   if ( fd < 0 )
+   {
+      DEBUG(3, "No feed '%s': %s", object, strerror(errno) );
+      return NULL;
+   }
+   void* memory = MAP_FAILED;
+   if ( fstat( fd, &info ) == 0 && (size_t)info.st_size >= sizeof(Feed_header) )
+      memory = mmap( NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+   close( fd );
+   if ( memory == MAP_FAILED )
+   {
+      DEBUG(3, "Cannot map feed '%s'", object );
+      return NULL;
+   }
+
+   Feed_header* header = (Feed_header*)memory;
+   if ( memcmp( header->magic, FEED_MAGIC, 4 ) != 0 || header->point_size != sizeof(GPS_point) ||
+        (size_t)info.st_size < feed_size( header->capacity ) )
+   {
+      // also a feed still being created
+      DEBUG(3, "Feed '%s' is not ready or of other version", object );
+      munmap( memory, info.st_size );
+      return NULL;
+   }
+   __atomic_thread_fence( __ATOMIC_ACQUIRE );
+
+   Feed_reader* reader = (Feed_reader*)calloc( 1, sizeof(Feed_reader) );
+   if ( reader == NULL )
+   {
+      ERROR("Out of memory!");
+      munmap( memory, info.st_size );
+      return NULL;
+   }
+   uint64_t head = __atomic_load_n( &header->head, __ATOMIC_ACQUIRE );
+   reader->header   = header;
+   reader->size     = info.st_size;
+   reader->position = ( head > header->capacity ) ? head - header->capacity : 0;
+   return reader;
+}
+
+const char* feed_reader_device( const Feed_reader* reader )
+{
+   return reader->header->device;
+}
+
+/// Copy available points, skipping over the ones the writer has already overwritten
+static int feed_reader_copy( Feed_reader* reader, GPS_point* points, unsigned int max_points, uint64_t* lost )
+{
+   Feed_header* header = reader->header;
+   uint64_t head = __atomic_load_n( &header->head, __ATOMIC_ACQUIRE );
+   unsigned int count = 0;
+
+   while ( count < max_points && reader->position < head )
+   {
+      if ( head - reader->position > header->capacity )
+      {
+         *lost += head - header->capacity - reader->position;
+         reader->position = head - header->capacity;
+      }
+      const Feed_slot* slot = &header->slots[ reader->position & ( header->capacity - 1 ) ];
+      uint64_t expected = 2 * reader->position + 2;
+
+      uint64_t before = __atomic_load_n( &slot->sequence, __ATOMIC_ACQUIRE );
+      points[count] = slot->point;
+      __atomic_thread_fence( __ATOMIC_ACQUIRE );
+      uint64_t after = __atomic_load_n( &slot->sequence, __ATOMIC_RELAXED );
+      if ( before != expected || after != expected )
+      {
+         // being overwritten, the writer is a whole ring ahead and the point is gone
+         head = __atomic_load_n( &header->head, __ATOMIC_ACQUIRE );
+         if ( head - reader->position <= header->capacity )
+         {
+            ( *lost ) ++;
+            reader->position ++;
+         }
+         continue;
+      }
+      count ++;
+      reader->position ++;
+   }
+   return count;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Read up to max_points, waiting at most timeout_ms for the first one. Points lost because the reader fell behind
+/// are added to 'lost'. \returns number of points read, 0 on timeout, -1 when the feed is closed (or its writer
+/// has died) and all are read.
+///--------------------------------------------------------------------------------------------------------------------
+int feed_reader_read( Feed_reader* reader, GPS_point* points, unsigned int max_points, int timeout_ms, uint64_t* lost )
+{
+   Feed_header* header = reader->header;
+   struct timespec timeout = { timeout_ms / 1000, ( timeout_ms % 1000 ) * 1000000L };
+
+   while ( true )
+   {
+      uint32_t signal = __atomic_load_n( &header->signal, __ATOMIC_SEQ_CST );
+      int count = feed_reader_copy( reader, points, max_points, lost );
+      if ( count > 0 )
+         return count;
+      if ( __atomic_load_n( &header->closed, __ATOMIC_ACQUIRE ) ||
+           ( kill( header->writer, 0 ) != 0 && errno == ESRCH ) )
+         return ( reader->position < __atomic_load_n( &header->head, __ATOMIC_ACQUIRE ) ) ? 0 : -1;
+      if ( timeout_ms <= 0 )
+         return 0;
+
+      __atomic_add_fetch( &header->waiters, 1, __ATOMIC_SEQ_CST );
+      long ret = syscall( SYS_futex, &header->signal, FUTEX_WAIT, signal, &timeout, NULL, 0 );
+      __atomic_sub_fetch( &header->waiters, 1, __ATOMIC_SEQ_CST );
+      if ( ret != 0 && errno == ETIMEDOUT )
+         return 0;
+   }
+}
+
+void feed_reader_close( Feed_reader* reader )
+{
+   if ( reader == NULL )
+      return;
+   munmap( reader->header, reader->size );
+   free( reader );
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "common.h"
+#define MODULE_NAME "feedreader"
+
+///-------------------------------------------------------------------------------------
+int GLOBAL_debug_level = 0;
+
+#define FEEDREADER_BATCH    1024
+#define FEEDREADER_WAIT_MS  200
+
+/// Example consumer of the shared memory feed of a download (./geotech <device> download <file> --shm <name>).
+/// Points are printed as CSV as they arrive. The feed may be started before or after the reader.
+
+void usage()
+{
+   printf("usage: ./geotech_feedreader <name> [<delay ms per batch>]\n");
+   printf("       prints points of shared memory feed <name> until the download ends, the delay\n");
+   printf("       makes a slow reader that loses the points the download has overwritten\n");
+   exit(1);
+}
+
+static void feedreader_print( const GPS_point* point )
+{
+   char latitude[16], longitude[16];
+
+   latitude[ GPS_format_microdeg( latitude, point->latitude ) ] = 0;
+   longitude[ GPS_format_microdeg( longitude, point->longitude ) ] = 0;
+   printf("%04d-%02d-%02dT%02d:%02d:%02dZ,%s,%s,%d\n", point->time[5], point->time[4], point->time[3],
+          point->time[2], point->time[1], point->time[0], latitude, longitude, point->height );
+}
+
+int main( int argc, char** argv )
+{
+   static GPS_point points[ FEEDREADER_BATCH ];
+   Feed_reader* reader;
+   uint64_t lost = 0;
+   uint64_t total = 0;
+   int count;
+
+   if ( argc != 2 && argc != 3 )
+      usage();
+   int delay_ms = ( argc == 3 ) ? atoi( argv[2] ) : 0;
+
+   while ( (reader = feed_reader_open( argv[1] )) == NULL )
+      usleep( FEEDREADER_WAIT_MS * 1000 );
+   fprintf( stderr, "Reading feed '%s' of device '%s'\n", argv[1], feed_reader_device( reader ) );
+
+   while ( (count = feed_reader_read( reader, points, FEEDREADER_BATCH, FEEDREADER_WAIT_MS, &lost )) >= 0 )
+   {
+      int loop;
+      for ( loop = 0; loop < count; loop ++ )
+         feedreader_print( &points[loop] );
+      total += count;
+      if ( count > 0 && delay_ms > 0 )
+         usleep( delay_ms * 1000 );
+   }
+   feed_reader_close( reader );
+
+   fprintf( stderr, "Feed ended: %llu points read, %llu lost\n", (unsigned long long)total,
+            (unsigned long long)lost );
+   return 0;
+}
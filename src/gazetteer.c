@@ -0,0 +1,517 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MODULE_NAME "gazetteer"
+
+/// Places are read from CSV 'name,latitude,longitude' (columns are found by header names if there is a header),
+/// or from GeoNames tab separated dump. They are indexed once to '<gazetteer>.idx' and the index is used as long
+/// as the gazetteer is unchanged. The index is an implicit k-d tree: nodes are stored so that the node of range
+/// [lo, hi) is at (lo + hi) / 2, splitting by latitude on even and longitude on odd depths, so it needs no
+/// pointers and is searched straight from the mapped file.
+///
+/// Index file: header, nodes, zero terminated names.
+
+#define GAZETTEER_MAGIC   "GTG1"
+/// Trips of tagged tracks are split at gaps longer than this, seconds
+#define GAZETTEER_TRIP_GAP 1800
+
+typedef struct
+{
+   char     magic[4];
+   uint32_t count;
+   uint64_t source_size;
+   int64_t  source_mtime;
+   uint64_t names_size;
+} Gazetteer_header;
+
+typedef struct
+{
+   int32_t  lat, lon;  // micro-degrees
+   uint32_t name;      // offset in names
+} Gazetteer_node;
+
+struct Gazetteer
+{
+   void*                 map;
+   size_t                map_size;
+   const Gazetteer_node* nodes;
+   unsigned int          count;
+   const char*           names;
+};
+
+typedef struct
+{
+   Gazetteer_node* nodes;
+   unsigned int    count;
+   char*           names;
+   size_t          names_size;
+   size_t          names_capacity;
+} Gazetteer_build;
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Reading places
+///--------------------------------------------------------------------------------------------------------------------
+static bool gazetteer_add( Gazetteer_build* build, const char* name, size_t len, int32_t lat, int32_t lon )
+{
+   if ( (build->count & 0xFFFF) == 0 )
+   {
+      Gazetteer_node* more = (Gazetteer_node*)realloc( build->nodes, ( build->count + 0x10000 ) * sizeof(Gazetteer_node) );
+      if ( more == NULL )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      build->nodes = more;
+   }
+   if ( build->names_size + len + 1 > build->names_capacity )
+   {
+      size_t capacity = ( build->names_capacity + len + 1 ) * 2;
+      char* more = (char*)realloc( build->names, capacity );
+      if ( more == NULL || build->names_size + len + 1 > UINT32_MAX )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      build->names = more;
+      build->names_capacity = capacity;
+   }
+
+   Gazetteer_node* node = &build->nodes[ build->count ++ ];
+   node->lat  = lat;
+   node->lon  = lon;
+   node->name = build->names_size;
+   memcpy( build->names + build->names_size, name, len );
+   build->names[ build->names_size + len ] = 0x00;
+   build->names_size += len + 1;
+   return true;
+}
+
+/// Split line to fields at the delimiter, CSV quotes are removed. Fields are zero terminated in place.
+static unsigned int gazetteer_fields( char* line, char delimiter, char** fields, unsigned int max )
+{
+   unsigned int count = 0;
+   char* pos = line;
+
+   while ( count < max )
+   {
+      char* out = pos;
+      fields[ count ++ ] = pos;
+      if ( *pos == '"' && delimiter == ',' )
+      {
+         // quoted, doubled quote is a quote
+         for ( pos ++; *pos != 0x00; pos ++ )
+         {
+            if ( *pos == '"' && *(++ pos) != '"' )
+               break;
+            *out ++ = *pos;
+         }
+      }
+      for ( ; *pos != 0x00 && *pos != delimiter; pos ++ )
+         *out ++ = *pos;
+
+      bool more = ( *pos == delimiter );
+      *out = 0x00;
+      if ( !more )
+         break;
+      pos ++;
+   }
+   return count;
+}
+
+static bool gazetteer_column( const char* field, const char* const* names )
+{
+   for ( ; *names != NULL; names ++ )
+   {
+      if ( strcasecmp( field, *names ) == 0 )
+         return true;
+   }
+   return false;
+}
+
+static bool gazetteer_parse( Gazetteer_build* build, char* text )
+{
+   static const char* name_columns[] = { "name", "place", "title", NULL };
+   static const char* lat_columns[]  = { "lat", "latitude", "y", NULL };
+   static const char* lon_columns[]  = { "lon", "lng", "long", "longitude", "x", NULL };
+   char* fields[32];
+   unsigned int col_name = 0, col_lat = 1, col_lon = 2;
+   unsigned int linenum = 0, skipped = 0, loop;
+   char* line = text;
+
+   // GeoNames dump: id, name, asciiname, alternatenames, latitude, longitude, ..
+   char* first_end = strchr( text, '\n' );
+   char delimiter = ( memchr( text, '\t', first_end ? (size_t)( first_end - text ) : strlen( text ) ) != NULL ) ? '\t' : ',';
+   if ( delimiter == '\t' )
+   {
+      col_name = 1;
+      col_lat  = 4;
+      col_lon  = 5;
+   }
+
+   while ( line != NULL && *line != 0x00 )
+   {
+      char* next = strchr( line, '\n' );
+      if ( next != NULL )
+         *(next ++) = 0x00;
+      size_t len = strlen( line );
+      if ( len > 0 && line[ len - 1 ] == '\r' )
+         line[ len - 1 ] = 0x00;
+
+      unsigned int count = gazetteer_fields( line, delimiter, fields, 32 );
+      int32_t lat, lon;
+      linenum ++;
+      if ( linenum == 1 && delimiter == ',' && count >= 3 && !GPS_parse_microdeg( fields[1], GPS_LATITUDE_MAX, &lat ) )
+      {
+         // header line
+         for ( loop = 0; loop < count; loop ++ )
+         {
+            if ( gazetteer_column( fields[loop], name_columns ) )
+               col_name = loop;
+            else if ( gazetteer_column( fields[loop], lat_columns ) )
+               col_lat = loop;
+            else if ( gazetteer_column( fields[loop], lon_columns ) )
+               col_lon = loop;
+         }
+      }
+      else if ( count > col_name && count > col_lat && count > col_lon && fields[ col_name ][0] != 0x00 &&
+                GPS_parse_microdeg( fields[ col_lat ], GPS_LATITUDE_MAX, &lat ) &&
+                GPS_parse_microdeg( fields[ col_lon ], GPS_LONGITUDE_MAX, &lon ) )
+      {
+         if ( !gazetteer_add( build, fields[ col_name ], strlen( fields[ col_name ] ), lat, lon ) )
+            return false;
+      }
+      else if ( line[0] != 0x00 )
+         skipped ++;
+      line = next;
+   }
+   if ( skipped > 0 )
+      DEBUG(2, "%u lines without name and coordinates skipped", skipped );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Implicit k-d tree
+///--------------------------------------------------------------------------------------------------------------------
+static inline int32_t gazetteer_key( const Gazetteer_node* node, int axis )
+{
+   return axis ? node->lon : node->lat;
+}
+
+/// Reorder so that the node at 'nth' has smaller or equal keys before it and larger or equal after
+static void gazetteer_select( Gazetteer_node* nodes, size_t lo, size_t hi, size_t nth, int axis )
+{
+   while ( hi - lo > 1 )
+   {
+      int32_t pivot = gazetteer_key( &nodes[ lo + ( hi - lo ) / 2 ], axis );
+      size_t left = lo, right = hi - 1;
+
+      while ( left <= right )
+      {
+         while ( gazetteer_key( &nodes[left], axis ) < pivot )
+            left ++;
+         while ( gazetteer_key( &nodes[right], axis ) > pivot )
+            right --;
+         if ( left <= right )
+         {
+            Gazetteer_node swap = nodes[left];
+            nodes[left]  = nodes[right];
+            nodes[right] = swap;
+            left ++;
+            if ( right == 0 )
+               break;
+            right --;
+         }
+      }
+      // [lo, right] <= pivot <= [left, hi)
+      if ( nth <= right )
+         hi = right + 1;
+      else if ( nth >= left )
+         lo = left;
+      else
+         return;
+   }
+}
+
+static void gazetteer_tree( Gazetteer_node* nodes, size_t lo, size_t hi, int depth )
+{
+   while ( hi - lo > 1 )
+   {
+      size_t mid = lo + ( hi - lo ) / 2;
+      gazetteer_select( nodes, lo, hi, mid, depth & 1 );
+      gazetteer_tree( nodes, lo, mid, depth + 1 );
+      lo = mid + 1;
+      depth ++;
+   }
+}
+
+typedef struct
+{
+   int32_t  lat, lon;
+   double   scale_lat, scale_lon;   // meters per micro-degree
+   double   best;                   // squared distance, meters
+   const Gazetteer_node* node;
+} Gazetteer_query;
+
+static void gazetteer_search( const Gazetteer_node* nodes, size_t lo, size_t hi, int depth, Gazetteer_query* query )
+{
+   while ( hi > lo )
+   {
+      size_t mid = lo + ( hi - lo ) / 2;
+      const Gazetteer_node* node = &nodes[mid];
+      double dy = ( query->lat - node->lat ) * query->scale_lat;
+      double dx = ( query->lon - node->lon ) * query->scale_lon;
+      double distance = dx * dx + dy * dy;
+
+      if ( distance <= query->best )
+      {
+         query->best = distance;
+         query->node = node;
+      }
+
+      // near side first, far side only if the splitting plane is closer than the best
+      double plane = ( depth & 1 ) ? dx : dy;
+      if ( plane < 0 )
+      {
+         gazetteer_search( nodes, lo, mid, depth + 1, query );
+         lo = mid + 1;
+      }
+      else
+      {
+         gazetteer_search( nodes, mid + 1, hi, depth + 1, query );
+         hi = mid;
+      }
+      if ( plane * plane > query->best )
+         break;
+      depth ++;
+   }
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Index file
+///--------------------------------------------------------------------------------------------------------------------
+static bool gazetteer_build_index( const char* filename, const char* index_file, const struct stat* source )
+{
+   Gazetteer_build build;
+   Gazetteer_header header;
+
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   char* text = (char*)malloc( source->st_size + 1 );
+   bool ok = ( text != NULL ) && fread( text, 1, source->st_size, fid ) == (size_t)source->st_size;
+   fclose( fid );
+   if ( !ok )
+   {
+      ERROR("Cannot read file '%s'", filename );
+      free( text );
+      return false;
+   }
+   text[ source->st_size ] = 0x00;
+
+   memset( &build, 0, sizeof(build) );
+   ok = gazetteer_parse( &build, text );
+   free( text );
+   if ( ok && build.count == 0 )
+   {
+      ERROR("No places in '%s'", filename );
+      ok = false;
+   }
+   if ( ok )
+   {
+      gazetteer_tree( build.nodes, 0, build.count, 0 );
+
+      memset( &header, 0, sizeof(header) );
+      memcpy( header.magic, GAZETTEER_MAGIC, 4 );
+      header.count        = build.count;
+      header.source_size  = source->st_size;
+      header.source_mtime = source->st_mtime;
+      header.names_size   = build.names_size;
+
+      char* tmpname = (char*)malloc( strlen( index_file ) + 5 );
+      if ( tmpname == NULL )
+      {
+         ERROR("Out of memory!");
+         free( build.nodes );
+         free( build.names );
+         return false;
+      }
+      sprintf( tmpname, "%s.tmp", index_file );
+      fid = fopen( tmpname, "wb" );
+      ok = fid != NULL && fwrite( &header, sizeof(header), 1, fid ) == 1 &&
+           fwrite( build.nodes, sizeof(Gazetteer_node), build.count, fid ) == build.count &&
+           fwrite( build.names, 1, build.names_size, fid ) == build.names_size;
+      if ( fid != NULL && fclose( fid ) != 0 )
+         ok = false;
+      if ( !ok || rename( tmpname, index_file ) != 0 )
+      {
+         ERROR("Cannot write file '%s': %s", index_file, strerror(errno) );
+         unlink( tmpname );
+         ok = false;
+      }
+      free( tmpname );
+      DEBUG(3, "indexed %u places of '%s'", build.count, filename );
+   }
+   free( build.nodes );
+   free( build.names );
+   return ok;
+}
+
+/// Map the index, NULL if it is missing or does not match the gazetteer
+static Gazetteer* gazetteer_map( const char* index_file, const struct stat* source )
+{
+   struct stat info;
+   Gazetteer_header header;
+
+   int fd = open( index_file, O_RDONLY );
+   if ( fd < 0 )
+      return NULL;
+
+   bool ok = fstat( fd, &info ) == 0 && (size_t)info.st_size >= sizeof(header) &&
+             pread( fd, &header, sizeof(header), 0 ) == sizeof(header) &&
+             memcmp( header.magic, GAZETTEER_MAGIC, 4 ) == 0 &&
+             header.source_size == (uint64_t)source->st_size && header.source_mtime == (int64_t)source->st_mtime &&
+             (uint64_t)info.st_size == sizeof(header) + (uint64_t)header.count * sizeof(Gazetteer_node) + header.names_size;
+
+   Gazetteer* gazetteer = ok ? (Gazetteer*)calloc( 1, sizeof(Gazetteer) ) : NULL;
+   if ( gazetteer != NULL )
+   {
+      gazetteer->map_size = info.st_size;
+      gazetteer->map = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+      if ( gazetteer->map == MAP_FAILED )
+      {
+         ERROR("Cannot map file '%s': %s", index_file, strerror(errno) );
+         free( gazetteer );
+         gazetteer = NULL;
+      }
+   }
+   close( fd );
+   if ( gazetteer == NULL )
+      return NULL;
+
+   gazetteer->count = header.count;
+   gazetteer->nodes = (const Gazetteer_node*)( (const char*)gazetteer->map + sizeof(header) );
+   gazetteer->names = (const char*)( gazetteer->nodes + header.count );
+   return gazetteer;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Open gazetteer, the index '<filename>.idx' is built if it is missing or older than the gazetteer
+///--------------------------------------------------------------------------------------------------------------------
+Gazetteer* gazetteer_open( const char* filename )
+{
+   char index_file[ BUFFER_SIZE ];
+   struct stat source;
+
+   if ( stat( filename, &source ) != 0 )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      return NULL;
+   }
+   snprintf( index_file, sizeof(index_file), "%s.idx", filename );
+
+   Gazetteer* gazetteer = gazetteer_map( index_file, &source );
+   if ( gazetteer != NULL )
+      return gazetteer;
+
+   DEBUG(2, "building index '%s'", index_file );
+   if ( !gazetteer_build_index( filename, index_file, &source ) )
+      return NULL;
+   return gazetteer_map( index_file, &source );
+}
+
+unsigned int gazetteer_count( const Gazetteer* gazetteer )
+{
+   return gazetteer->count;
+}
+
+void gazetteer_close( Gazetteer* gazetteer )
+{
+   if ( gazetteer == NULL )
+      return;
+   munmap( gazetteer->map, gazetteer->map_size );
+   free( gazetteer );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Nearest place within radius meters, NULL if there is none. Distances are equirectangular at the latitude
+/// of the point, exact enough for the radii of place names.
+///--------------------------------------------------------------------------------------------------------------------
+const char* gazetteer_nearest( const Gazetteer* gazetteer, int32_t latitude, int32_t longitude, double radius,
+                               double* distance )
+{
+   Gazetteer_query query;
+
+   query.lat       = latitude;
+   query.lon       = longitude;
+   query.scale_lat = MICRODEG_METERS;
+   query.scale_lon = query.scale_lat * cos( latitude * MICRODEG_TO_RAD );
+   query.best      = radius * radius;
+   query.node      = NULL;
+   gazetteer_search( gazetteer->nodes, 0, gazetteer->count, 0, &query );
+
+   if ( query.node == NULL )
+      return NULL;
+   if ( distance != NULL )
+      *distance = sqrt( query.best );
+   return gazetteer->names + query.node->name;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Write the points with GPX <name> of the nearest place and <desc> of its distance. With 'ends_only' only the
+/// first and last point of each trip are named. Trip ends are printed.
+/// \returns number of named points or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long gazetteer_tag( const Gazetteer* gazetteer, const GPS_points* data, double radius, bool ends_only,
+                    GPS_writer* writer )
+{
+   unsigned int loop, trip_start = 0;
+   long named = 0;
+
+   for ( loop = 0; loop < data->npoints; loop ++ )
+   {
+      const GPS_point* point = &data->points[loop];
+      bool first = ( loop == 0 ) || GPS_point_epoch( point ) - GPS_point_epoch( point - 1 ) > GAZETTEER_TRIP_GAP;
+      bool last  = ( loop + 1 == data->npoints ) ||
+                   GPS_point_epoch( point + 1 ) - GPS_point_epoch( point ) > GAZETTEER_TRIP_GAP;
+      const char* name = NULL;
+      char desc[32];
+      double distance;
+
+      if ( !ends_only || first || last )
+         name = gazetteer_nearest( gazetteer, point->latitude, point->longitude, radius, &distance );
+      if ( name != NULL )
+      {
+         snprintf( desc, sizeof(desc), "%.0f m", distance );
+         named ++;
+      }
+      if ( !GPS_writer_append_named( writer, point, name, name != NULL ? desc : NULL ) )
+         return -1;
+
+      if ( first )
+         trip_start = loop;
+      if ( last )
+      {
+         const GPS_point* start = &data->points[ trip_start ];
+         const char* from = gazetteer_nearest( gazetteer, start->latitude, start->longitude, radius, NULL );
+         printf("  TRIP %04d-%02d-%02d %02d:%02d:%02d  %-30s -> %02d:%02d:%02d  %s\n", start->time[5], start->time[4],
+                start->time[3], start->time[2], start->time[1], start->time[0], from ? from : "-",
+                point->time[2], point->time[1], point->time[0], name ? name : "-" );
+      }
+   }
+   return named;
+}
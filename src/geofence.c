@@ -0,0 +1,1119 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MODULE_NAME "geofence"
+
+/// Fences are polygons with holes, read from WKT ('[<name>;]POLYGON((lon lat, ..))' or MULTIPOLYGON per line) or
+/// GeoJSON (Polygon and MultiPolygon geometries, fence named by property 'name'). Polygons are put to a uniform
+/// grid over their bounding box. A grid cell lists the polygons that touch it, marked inside when no edge of the
+/// polygon crosses the cell, so that point in polygon test is run only near the polygon edges.
+
+/// Grid cells per polygon vertex, and the bounds of the cell count
+#define GEOFENCE_CELLS_PER_VERTEX 4
+#define GEOFENCE_MIN_CELLS        1024
+#define GEOFENCE_MAX_CELLS        (1 << 22)
+/// Smallest cell side, micro-degrees
+#define GEOFENCE_MIN_CELL         16
+/// Cell entry flag, no point in polygon test is needed
+#define GEOFENCE_INSIDE           0x80000000u
+/// Points read from files at once
+#define GEOFENCE_CHUNK            TRACK_BLOCK_POINTS
+
+typedef struct
+{
+   int32_t lat, lon;
+} Geofence_vertex;
+
+typedef struct
+{
+   uint32_t fence;
+   uint32_t first_ring, nrings;
+   int32_t  lat0, lon0, lat1, lon1;
+} Geofence_polygon;
+
+struct Geofence
+{
+   char**            names;      // per fence
+   unsigned int      nfences;
+
+   Geofence_polygon* polygons;
+   unsigned int      npolygons;
+   uint32_t*         rings;      // first vertex of ring, nrings + 1 entries
+   unsigned int      nrings;
+   Geofence_vertex*  vertices;
+   unsigned int      nvertices;
+
+   // grid
+   int32_t           lat0, lon0;
+   int64_t           cell;       // side, micro-degrees
+   unsigned int      nx, ny;
+   uint32_t*         cell_first; // nx * ny + 1 entries
+   uint32_t*         entries;    // polygon | GEOFENCE_INSIDE
+};
+
+struct Geofence_tracker
+{
+   const Geofence*  fences;
+   const char*      device;
+   int64_t          dwell;
+   Geofence_handler handler;
+   void*            context;
+
+   uint32_t*        stamp;       // per fence, last point that hit the fence
+   uint32_t         now;
+   bool*            inside;      // per fence
+   int64_t*         enter;       // per fence, time of entry
+   uint32_t*        active;      // fences the device is in
+   bool*            dwelled;     // per active fence
+   unsigned int     nactive;
+   uint32_t*        hits;        // fences hit by the current point
+   long             events;
+};
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Building the fence set
+///--------------------------------------------------------------------------------------------------------------------
+static bool geofence_add_fence( Geofence* fences, const char* name, size_t len )
+{
+   if ( !GPS_array_grow( (void**)&fences->names, fences->nfences, sizeof(char*) ) )
+      return false;
+
+   char* copy = (char*)malloc( len + 1 );
+   if ( copy == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   memcpy( copy, name, len );
+   copy[len] = 0x00;
+   fences->names[ fences->nfences ++ ] = copy;
+   return true;
+}
+
+static bool geofence_add_polygon( Geofence* fences )
+{
+   if ( !GPS_array_grow( (void**)&fences->polygons, fences->npolygons, sizeof(Geofence_polygon) ) )
+      return false;
+
+   Geofence_polygon* polygon = &fences->polygons[ fences->npolygons ++ ];
+   polygon->fence      = fences->nfences - 1;
+   polygon->first_ring = fences->nrings;
+   polygon->nrings     = 0;
+   return true;
+}
+
+static bool geofence_add_vertex( Geofence* fences, double lon, double lat )
+{
+   if ( !GPS_array_grow( (void**)&fences->vertices, fences->nvertices, sizeof(Geofence_vertex) ) )
+      return false;
+
+   Geofence_vertex* vertex = &fences->vertices[ fences->nvertices ++ ];
+   vertex->lat = lrint( lat * 1e6 );
+   vertex->lon = lrint( lon * 1e6 );
+   return true;
+}
+
+/// Ring ends at the current vertex, the closing vertex is dropped. Rings with less than 3 vertices are ignored.
+static bool geofence_end_ring( Geofence* fences, unsigned int first )
+{
+   unsigned int count = fences->nvertices - first;
+   if ( count > 1 && memcmp( &fences->vertices[first], &fences->vertices[ fences->nvertices - 1 ],
+                             sizeof(Geofence_vertex) ) == 0 )
+   {
+      fences->nvertices --;
+      count --;
+   }
+   if ( count < 3 )
+   {
+      fences->nvertices = first;
+      return true;
+   }
+
+   if ( !GPS_array_grow( (void**)&fences->rings, fences->nrings, sizeof(uint32_t) ) )
+      return false;
+   fences->rings[ fences->nrings ++ ] = first;
+   fences->polygons[ fences->npolygons - 1 ].nrings ++;
+   return true;
+}
+
+/// Polygon ends after its rings, polygons without rings are dropped
+static void geofence_end_polygon( Geofence* fences )
+{
+   Geofence_polygon* polygon = &fences->polygons[ fences->npolygons - 1 ];
+   unsigned int loop;
+
+   if ( polygon->nrings == 0 )
+   {
+      fences->npolygons --;
+      return;
+   }
+
+   unsigned int first = fences->rings[ polygon->first_ring ];
+   polygon->lat0 = polygon->lat1 = fences->vertices[first].lat;
+   polygon->lon0 = polygon->lon1 = fences->vertices[first].lon;
+   for ( loop = first; loop < fences->nvertices; loop ++ )
+   {
+      const Geofence_vertex* vertex = &fences->vertices[loop];
+      polygon->lat0 = ( vertex->lat < polygon->lat0 ) ? vertex->lat : polygon->lat0;
+      polygon->lat1 = ( vertex->lat > polygon->lat1 ) ? vertex->lat : polygon->lat1;
+      polygon->lon0 = ( vertex->lon < polygon->lon0 ) ? vertex->lon : polygon->lon0;
+      polygon->lon1 = ( vertex->lon > polygon->lon1 ) ? vertex->lon : polygon->lon1;
+   }
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// WKT
+///--------------------------------------------------------------------------------------------------------------------
+static const char* geofence_skip( const char* pos )
+{
+   while ( isspace( (unsigned char)*pos ) )
+      pos ++;
+   return pos;
+}
+
+/// Fences being read from WKT, the ring being read starts at vertex 'first'
+typedef struct
+{
+   Geofence*    fences;
+   unsigned int first;
+} Geofence_wkt;
+
+static bool geofence_wkt_name( void* context, const char* name, size_t len, unsigned int linenum )
+{
+   Geofence_wkt* wkt = (Geofence_wkt*)context;
+   char auto_name[32];
+
+   if ( len > 0 )
+      return geofence_add_fence( wkt->fences, name, len );
+   return geofence_add_fence( wkt->fences, auto_name, snprintf( auto_name, sizeof(auto_name), "fence%u", linenum ) );
+}
+
+/// Level 1 is a ring, 2 a polygon
+static bool geofence_wkt_list( void* context, unsigned int level, bool open )
+{
+   Geofence_wkt* wkt = (Geofence_wkt*)context;
+
+   if ( level == 1 && open )
+      wkt->first = wkt->fences->nvertices;
+   else if ( level == 1 )
+      return geofence_end_ring( wkt->fences, wkt->first );
+   else if ( level == 2 && open )
+      return geofence_add_polygon( wkt->fences );
+   else if ( level == 2 )
+      geofence_end_polygon( wkt->fences );
+   return true;
+}
+
+static bool geofence_wkt_vertex( void* context, double lon, double lat )
+{
+   return geofence_add_vertex( ((Geofence_wkt*)context)->fences, lon, lat );
+}
+
+static bool geofence_wkt( Geofence* fences, char* text )
+{
+   static const Wkt_handler handler = { geofence_wkt_name, geofence_wkt_list, geofence_wkt_vertex };
+   Geofence_wkt wkt = { fences, 0 };
+
+   return wkt_read( text, "POLYGON", 2, &handler, &wkt );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// GeoJSON, only what is needed to find the polygons and their names
+///--------------------------------------------------------------------------------------------------------------------
+static const char* geofence_json_skip( const char* pos );
+
+static const char* geofence_json_string_end( const char* pos )
+{
+   for ( pos ++; *pos != '"'; pos ++ )
+   {
+      if ( *pos == 0x00 )
+         return NULL;
+      if ( *pos == '\\' && *(++ pos) == 0x00 )
+         return NULL;
+   }
+   return pos + 1;
+}
+
+/// Skip objects and arrays
+static const char* geofence_json_skip_list( const char* pos, char close )
+{
+   pos = geofence_skip( pos + 1 );
+   if ( *pos == close )
+      return pos + 1;
+
+   while ( pos != NULL )
+   {
+      pos = geofence_json_skip( pos );
+      if ( pos == NULL )
+         return NULL;
+      pos = geofence_skip( pos );
+      if ( close == '}' && *pos == ':' )
+      {
+         pos = geofence_json_skip( geofence_skip( pos + 1 ) );
+         if ( pos == NULL )
+            return NULL;
+         pos = geofence_skip( pos );
+      }
+      if ( *pos == close )
+         return pos + 1;
+      if ( *pos != ',' )
+         return NULL;
+      pos = geofence_skip( pos + 1 );
+   }
+   return NULL;
+}
+
+/// Skip any value, returns position after it or NULL when invalid
+static const char* geofence_json_skip( const char* pos )
+{
+   pos = geofence_skip( pos );
+   if ( *pos == '"' )
+      return geofence_json_string_end( pos );
+   if ( *pos == '{' )
+      return geofence_json_skip_list( pos, '}' );
+   if ( *pos == '[' )
+      return geofence_json_skip_list( pos, ']' );
+
+   const char* start = pos;
+   while ( *pos != 0x00 && strchr( ",}] \t\r\n", *pos ) == NULL )
+      pos ++;
+   return ( pos > start ) ? pos : NULL;
+}
+
+/// Value of member 'key' of object at 'object', NULL if not there
+static const char* geofence_json_member( const char* object, const char* key )
+{
+   size_t len = strlen( key );
+   const char* pos = geofence_skip( object );
+
+   if ( *pos != '{' )
+      return NULL;
+   pos = geofence_skip( pos + 1 );
+   while ( *pos == '"' )
+   {
+      const char* end = geofence_json_string_end( pos );
+      if ( end == NULL )
+         return NULL;
+      bool match = ( (size_t)(end - pos) == len + 2 && strncmp( pos + 1, key, len ) == 0 );
+
+      pos = geofence_skip( end );
+      if ( *pos != ':' )
+         return NULL;
+      pos = geofence_skip( pos + 1 );
+      if ( match )
+         return pos;
+
+      pos = geofence_json_skip( pos );
+      if ( pos == NULL )
+         return NULL;
+      pos = geofence_skip( pos );
+      if ( *pos != ',' )
+         return NULL;
+      pos = geofence_skip( pos + 1 );
+   }
+   return NULL;
+}
+
+/// True if the value is the string
+static bool geofence_json_is( const char* value, const char* text )
+{
+   size_t len = strlen( text );
+   return value != NULL && value[0] == '"' && strncmp( value + 1, text, len ) == 0 && value[ len + 1 ] == '"';
+}
+
+/// Calls 'element' for each element of the array, stops if it returns false
+static bool geofence_json_each( Geofence* fences, const char* array, unsigned int depth,
+                                bool (*element)( Geofence*, const char*, unsigned int ) )
+{
+   const char* pos = geofence_skip( array );
+   if ( *pos != '[' )
+      return false;
+
+   pos = geofence_skip( pos + 1 );
+   if ( *pos == ']' )
+      return true;
+   while ( true )
+   {
+      if ( !element( fences, pos, depth ) )
+         return false;
+      pos = geofence_json_skip( pos );
+      if ( pos == NULL )
+         return false;
+      pos = geofence_skip( pos );
+      if ( *pos == ']' )
+         return true;
+      if ( *pos != ',' )
+         return false;
+      pos = geofence_skip( pos + 1 );
+   }
+}
+
+/// depth 0 is position [lon, lat], 1 ring, 2 polygon, 3 multipolygon
+static bool geofence_json_coordinates( Geofence* fences, const char* value, unsigned int depth )
+{
+   if ( depth == 0 )
+   {
+      char* end;
+      const char* pos = geofence_skip( value );
+      if ( *pos != '[' )
+         return false;
+      double lon = strtod( pos + 1, &end );
+      pos = geofence_skip( end );
+      if ( *pos != ',' )
+         return false;
+      double lat = strtod( pos + 1, &end );
+      return end != pos + 1 && geofence_add_vertex( fences, lon, lat );
+   }
+   if ( depth == 1 )
+   {
+      unsigned int first = fences->nvertices;
+      return geofence_json_each( fences, value, 0, geofence_json_coordinates ) && geofence_end_ring( fences, first );
+   }
+   if ( depth == 2 )
+   {
+      if ( !geofence_add_polygon( fences ) || !geofence_json_each( fences, value, 1, geofence_json_coordinates ) )
+         return false;
+      geofence_end_polygon( fences );
+      return true;
+   }
+   return geofence_json_each( fences, value, 2, geofence_json_coordinates );
+}
+
+static bool geofence_json_geometry( Geofence* fences, const char* geometry, unsigned int depth )
+{
+   const char* type = geofence_json_member( geometry, "type" );
+
+   (void)depth;
+   if ( geofence_json_is( type, "Polygon" ) )
+      return geofence_json_coordinates( fences, geofence_json_member( geometry, "coordinates" ), 2 );
+   if ( geofence_json_is( type, "MultiPolygon" ) )
+      return geofence_json_coordinates( fences, geofence_json_member( geometry, "coordinates" ), 3 );
+   if ( geofence_json_is( type, "GeometryCollection" ) )
+      return geofence_json_each( fences, geofence_json_member( geometry, "geometries" ), 0, geofence_json_geometry );
+
+   DEBUG(3, "skipping geometry that is not a polygon");
+   return true;
+}
+
+static bool geofence_json_object( Geofence* fences, const char* object, unsigned int index )
+{
+   const char* type = geofence_json_member( object, "type" );
+   const char* name = NULL;
+   char auto_name[32];
+   size_t len;
+
+   (void)index;
+   if ( geofence_json_is( type, "FeatureCollection" ) )
+      return geofence_json_each( fences, geofence_json_member( object, "features" ), 0, geofence_json_object );
+
+   const char* properties = geofence_json_member( object, "properties" );
+   if ( properties != NULL )
+      name = geofence_json_member( properties, "name" );
+   if ( name != NULL && *name == '"' )
+   {
+      len = geofence_json_string_end( name ) - name - 2;
+      name ++;
+   }
+   else
+   {
+      name = auto_name;
+      len  = snprintf( auto_name, sizeof(auto_name), "fence%u", fences->nfences + 1 );
+   }
+   if ( !geofence_add_fence( fences, name, len ) )
+      return false;
+
+   if ( geofence_json_is( type, "Feature" ) )
+   {
+      const char* geometry = geofence_json_member( object, "geometry" );
+      return geometry == NULL || *geometry == 'n' || geofence_json_geometry( fences, geometry, 0 );
+   }
+   return geofence_json_geometry( fences, object, 0 );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Point in polygon, even-odd rule over all rings, exact in integers
+///--------------------------------------------------------------------------------------------------------------------
+static bool geofence_polygon_contains( const Geofence* fences, const Geofence_polygon* polygon, int32_t lat, int32_t lon )
+{
+   bool inside = false;
+   unsigned int ring;
+
+   for ( ring = polygon->first_ring; ring < polygon->first_ring + polygon->nrings; ring ++ )
+   {
+      const Geofence_vertex* vertices = fences->vertices + fences->rings[ring];
+      unsigned int count = fences->rings[ ring + 1 ] - fences->rings[ring];
+      unsigned int loop, prev = count - 1;
+
+      for ( loop = 0; loop < count; prev = loop ++ )
+      {
+         const Geofence_vertex* a = &vertices[loop];
+         const Geofence_vertex* b = &vertices[prev];
+         if ( ( a->lat > lat ) == ( b->lat > lat ) )
+            continue;
+
+         // crossing of the edge with the ray towards east
+         int64_t side = (int64_t)( lat - a->lat ) * ( b->lon - a->lon ) - (int64_t)( lon - a->lon ) * ( b->lat - a->lat );
+         if ( ( b->lat > a->lat ) ? side > 0 : side < 0 )
+            inside = !inside;
+      }
+   }
+   return inside;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Grid
+///--------------------------------------------------------------------------------------------------------------------
+typedef struct
+{
+   uint32_t cell;
+   uint32_t entry;
+} Geofence_pair;
+
+typedef struct
+{
+   Geofence_pair* pairs;
+   size_t         npairs;
+   size_t         capacity;
+} Geofence_pairs;
+
+static bool geofence_pair_add( Geofence_pairs* pairs, uint32_t cell, uint32_t entry )
+{
+   if ( pairs->npairs == pairs->capacity )
+   {
+      size_t capacity = ( pairs->capacity == 0 ) ? 4096 : pairs->capacity * 2;
+      Geofence_pair* more = (Geofence_pair*)realloc( pairs->pairs, capacity * sizeof(Geofence_pair) );
+      if ( more == NULL )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      pairs->pairs    = more;
+      pairs->capacity = capacity;
+   }
+   pairs->pairs[ pairs->npairs ].cell  = cell;
+   pairs->pairs[ pairs->npairs ].entry = entry;
+   pairs->npairs ++;
+   return true;
+}
+
+static inline int64_t geofence_cell_x( const Geofence* fences, int32_t lon )
+{
+   return ( (int64_t)lon - fences->lon0 ) / fences->cell;
+}
+
+static inline int64_t geofence_cell_y( const Geofence* fences, int32_t lat )
+{
+   return ( (int64_t)lat - fences->lat0 ) / fences->cell;
+}
+
+/// Mark the cells of the polygon bounding box (x0, y0, width) that the edge goes through
+static void geofence_mark_edge( const Geofence* fences, const Geofence_vertex* a, const Geofence_vertex* b,
+                                int64_t x0, int64_t y0, int64_t width, int64_t height, unsigned char* marks )
+{
+   int64_t ax = geofence_cell_x( fences, a->lon ), bx = geofence_cell_x( fences, b->lon );
+   int64_t x, y;
+
+   if ( ax > bx )
+   {
+      const Geofence_vertex* swap = a;
+      a = b;
+      b = swap;
+      ax = geofence_cell_x( fences, a->lon );
+      bx = geofence_cell_x( fences, b->lon );
+   }
+
+   for ( x = ax; x <= bx; x ++ )
+   {
+      // latitude range of the edge within the column, widened a bit against rounding
+      double lat0 = a->lat, lat1 = b->lat;
+      if ( ax != bx )
+      {
+         double left  = fences->lon0 + (double)x * fences->cell;
+         double right = left + fences->cell;
+         double slope = (double)( b->lat - a->lat ) / ( b->lon - a->lon );
+         double from  = ( left  > a->lon ) ? left  : a->lon;
+         double to    = ( right < b->lon ) ? right : b->lon;
+         lat0 = a->lat + ( from - a->lon ) * slope;
+         lat1 = a->lat + ( to   - a->lon ) * slope;
+      }
+      if ( lat0 > lat1 )
+      {
+         double swap = lat0;
+         lat0 = lat1;
+         lat1 = swap;
+      }
+      int64_t y_first = (int64_t)floor( ( lat0 - 1.0 - fences->lat0 ) / fences->cell ) - y0;
+      int64_t y_last  = (int64_t)floor( ( lat1 + 1.0 - fences->lat0 ) / fences->cell ) - y0;
+      y_first = ( y_first < 0 ) ? 0 : y_first;
+      y_last  = ( y_last >= height ) ? height - 1 : y_last;
+      for ( y = y_first; y <= y_last; y ++ )
+         marks[ y * width + ( x - x0 ) ] = 1;
+   }
+}
+
+/// Cells of single polygon: crossed by an edge, or inside
+static bool geofence_grid_polygon( const Geofence* fences, uint32_t index, Geofence_pairs* pairs )
+{
+   const Geofence_polygon* polygon = &fences->polygons[index];
+   int64_t x0 = geofence_cell_x( fences, polygon->lon0 ), x1 = geofence_cell_x( fences, polygon->lon1 );
+   int64_t y0 = geofence_cell_y( fences, polygon->lat0 ), y1 = geofence_cell_y( fences, polygon->lat1 );
+   int64_t width = x1 - x0 + 1, height = y1 - y0 + 1;
+   unsigned int ring, loop;
+   int64_t x, y;
+
+   unsigned char* marks = (unsigned char*)calloc( width * height, 1 );
+   if ( marks == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+
+   for ( ring = polygon->first_ring; ring < polygon->first_ring + polygon->nrings; ring ++ )
+   {
+      const Geofence_vertex* vertices = fences->vertices + fences->rings[ring];
+      unsigned int count = fences->rings[ ring + 1 ] - fences->rings[ring];
+      for ( loop = 0; loop < count; loop ++ )
+         geofence_mark_edge( fences, &vertices[loop], &vertices[ ( loop + 1 ) % count ], x0, y0, width, height, marks );
+   }
+
+   bool ok = true;
+   for ( y = 0; ok && y < height; y ++ )
+   {
+      // cells between crossed ones are all inside or all outside, test one of them
+      bool inside = false;
+      for ( x = 0; ok && x < width; x ++ )
+      {
+         uint32_t cell = ( y + y0 ) * fences->nx + ( x + x0 );
+         if ( marks[ y * width + x ] )
+         {
+            ok = geofence_pair_add( pairs, cell, index );
+            continue;
+         }
+         if ( x == 0 || marks[ y * width + x - 1 ] )
+         {
+            int32_t lat = fences->lat0 + ( y + y0 ) * fences->cell + fences->cell / 2;
+            int32_t lon = fences->lon0 + ( x + x0 ) * fences->cell + fences->cell / 2;
+            inside = geofence_polygon_contains( fences, polygon, lat, lon );
+         }
+         if ( inside )
+            ok = geofence_pair_add( pairs, cell, index | GEOFENCE_INSIDE );
+      }
+   }
+   free( marks );
+   return ok;
+}
+
+static bool geofence_grid( Geofence* fences )
+{
+   Geofence_pairs pairs;
+   unsigned int loop;
+   size_t ploop;
+
+   memset( &pairs, 0, sizeof(pairs) );
+   int32_t lat1 = fences->polygons[0].lat1, lon1 = fences->polygons[0].lon1;
+   fences->lat0 = fences->polygons[0].lat0;
+   fences->lon0 = fences->polygons[0].lon0;
+   for ( loop = 1; loop < fences->npolygons; loop ++ )
+   {
+      const Geofence_polygon* polygon = &fences->polygons[loop];
+      fences->lat0 = ( polygon->lat0 < fences->lat0 ) ? polygon->lat0 : fences->lat0;
+      fences->lon0 = ( polygon->lon0 < fences->lon0 ) ? polygon->lon0 : fences->lon0;
+      lat1 = ( polygon->lat1 > lat1 ) ? polygon->lat1 : lat1;
+      lon1 = ( polygon->lon1 > lon1 ) ? polygon->lon1 : lon1;
+   }
+
+   // square cells, about GEOFENCE_CELLS_PER_VERTEX per vertex
+   double cells = (double)fences->nvertices * GEOFENCE_CELLS_PER_VERTEX;
+   cells = ( cells < GEOFENCE_MIN_CELLS ) ? GEOFENCE_MIN_CELLS : ( cells > GEOFENCE_MAX_CELLS ) ? GEOFENCE_MAX_CELLS : cells;
+   double width  = (double)lon1 - fences->lon0 + 1;
+   double height = (double)lat1 - fences->lat0 + 1;
+   fences->cell = (int64_t)ceil( sqrt( width * height / cells ) );
+   fences->cell = ( fences->cell < GEOFENCE_MIN_CELL ) ? GEOFENCE_MIN_CELL : fences->cell;
+   while ( ( width / fences->cell + 1 ) * ( height / fences->cell + 1 ) > GEOFENCE_MAX_CELLS )
+      fences->cell *= 2;
+   fences->nx = (unsigned int)( ( (int64_t)lon1 - fences->lon0 ) / fences->cell + 1 );
+   fences->ny = (unsigned int)( ( (int64_t)lat1 - fences->lat0 ) / fences->cell + 1 );
+
+   for ( loop = 0; loop < fences->npolygons; loop ++ )
+   {
+      if ( !geofence_grid_polygon( fences, loop, &pairs ) )
+      {
+         free( pairs.pairs );
+         return false;
+      }
+   }
+
+   // compressed rows by cell, polygons of a cell in order
+   fences->cell_first = (uint32_t*)calloc( (size_t)fences->nx * fences->ny + 1, sizeof(uint32_t) );
+   fences->entries    = (uint32_t*)malloc( pairs.npairs * sizeof(uint32_t) + 1 );
+   if ( fences->cell_first == NULL || fences->entries == NULL || pairs.npairs >= GEOFENCE_INSIDE )
+   {
+      ERROR("Out of memory!");
+      free( pairs.pairs );
+      return false;
+   }
+   for ( ploop = 0; ploop < pairs.npairs; ploop ++ )
+      fences->cell_first[ pairs.pairs[ploop].cell + 1 ] ++;
+   for ( ploop = 0; ploop < (size_t)fences->nx * fences->ny; ploop ++ )
+      fences->cell_first[ ploop + 1 ] += fences->cell_first[ploop];
+
+   uint32_t* fill = (uint32_t*)malloc( (size_t)fences->nx * fences->ny * sizeof(uint32_t) );
+   if ( fill == NULL )
+   {
+      ERROR("Out of memory!");
+      free( pairs.pairs );
+      return false;
+   }
+   memcpy( fill, fences->cell_first, (size_t)fences->nx * fences->ny * sizeof(uint32_t) );
+   for ( ploop = 0; ploop < pairs.npairs; ploop ++ )
+      fences->entries[ fill[ pairs.pairs[ploop].cell ] ++ ] = pairs.pairs[ploop].entry;
+
+   DEBUG(3, "grid of %u x %u cells of %lld micro-degrees, %zu entries", fences->nx, fences->ny,
+         (long long)fences->cell, pairs.npairs );
+   free( fill );
+   free( pairs.pairs );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Load fences from WKT or GeoJSON file and build the index
+///--------------------------------------------------------------------------------------------------------------------
+Geofence* geofence_load( const char* filename )
+{
+   struct stat info;
+
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL || fstat( fileno( fid ), &info ) != 0 )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      if ( fid != NULL )
+         fclose( fid );
+      return NULL;
+   }
+
+   char* text = (char*)malloc( info.st_size + 1 );
+   Geofence* fences = (Geofence*)calloc( 1, sizeof(Geofence) );
+   bool ok = text != NULL && fences != NULL;
+   if ( !ok )
+      ERROR("Out of memory!");
+   else if ( fread( text, 1, info.st_size, fid ) != (size_t)info.st_size )
+   {
+      ERROR("Cannot read file '%s'", filename );
+      ok = false;
+   }
+   fclose( fid );
+
+   if ( ok )
+   {
+      text[ info.st_size ] = 0x00;
+      const char* first = geofence_skip( text );
+      if ( *first == '{' )
+      {
+         ok = geofence_json_object( fences, first, 0 );
+         if ( !ok )
+            ERROR("Invalid GeoJSON in '%s'", filename );
+      }
+      else
+         ok = geofence_wkt( fences, text );
+   }
+   free( text );
+
+   if ( ok && fences->npolygons == 0 )
+   {
+      ERROR("No polygons in '%s'", filename );
+      ok = false;
+   }
+   if ( ok )
+   {
+      // closing entry, so that ring sizes are differences
+      ok = GPS_array_grow( (void**)&fences->rings, fences->nrings, sizeof(uint32_t) );
+      if ( ok )
+         fences->rings[ fences->nrings ] = fences->nvertices;
+   }
+   if ( !ok || !geofence_grid( fences ) )
+   {
+      geofence_free( fences );
+      return NULL;
+   }
+
+   DEBUG(3, "loaded %u fences, %u polygons, %u vertices", fences->nfences, fences->npolygons, fences->nvertices );
+   return fences;
+}
+
+unsigned int geofence_count( const Geofence* fences )
+{
+   return fences->nfences;
+}
+
+void geofence_free( Geofence* fences )
+{
+   unsigned int loop;
+
+   if ( fences == NULL )
+      return;
+   for ( loop = 0; loop < fences->nfences; loop ++ )
+      free( fences->names[loop] );
+   free( fences->names );
+   free( fences->polygons );
+   free( fences->rings );
+   free( fences->vertices );
+   free( fences->cell_first );
+   free( fences->entries );
+   free( fences );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Tracking a device over its points
+///--------------------------------------------------------------------------------------------------------------------
+Geofence_tracker* geofence_tracker_open( const Geofence* fences, const char* device, int64_t dwell,
+                                         Geofence_handler handler, void* context )
+{
+   Geofence_tracker* tracker = (Geofence_tracker*)calloc( 1, sizeof(Geofence_tracker) );
+   if ( tracker != NULL )
+   {
+      tracker->stamp   = (uint32_t*)calloc( fences->nfences, sizeof(uint32_t) );
+      tracker->inside  = (bool*)calloc( fences->nfences, sizeof(bool) );
+      tracker->enter   = (int64_t*)malloc( fences->nfences * sizeof(int64_t) );
+      tracker->active  = (uint32_t*)malloc( fences->nfences * sizeof(uint32_t) );
+      tracker->dwelled = (bool*)malloc( fences->nfences * sizeof(bool) );
+      tracker->hits    = (uint32_t*)malloc( fences->nfences * sizeof(uint32_t) );
+   }
+   if ( tracker == NULL || tracker->stamp == NULL || tracker->inside == NULL || tracker->enter == NULL || tracker->active == NULL ||
+        tracker->dwelled == NULL || tracker->hits == NULL )
+   {
+      ERROR("Out of memory!");
+      geofence_tracker_close( tracker );
+      return NULL;
+   }
+   tracker->fences  = fences;
+   tracker->device  = device;
+   tracker->dwell   = dwell;
+   tracker->handler = handler;
+   tracker->context = context;
+   return tracker;
+}
+
+static void geofence_emit( Geofence_tracker* tracker, int type, uint32_t fence, const GPS_point* point, int64_t time )
+{
+   Geofence_event event;
+
+   event.type      = type;
+   event.fence     = tracker->fences->names[fence];
+   event.device    = tracker->device;
+   event.time      = time;
+   event.latitude  = point->latitude;
+   event.longitude = point->longitude;
+   event.duration  = ( type == GEOFENCE_ENTER ) ? 0 : time - tracker->enter[fence];
+   tracker->events ++;
+   tracker->handler( &event, tracker->context );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Next point of the device, points are expected in time order. Exits are reported before enters of the same point.
+/// Signature is that of GPS_point_sink, to be given to serial_download.
+///--------------------------------------------------------------------------------------------------------------------
+bool geofence_tracker_feed( const GPS_point* point, void* context )
+{
+   Geofence_tracker* tracker = (Geofence_tracker*)context;
+   const Geofence* fences = tracker->fences;
+   unsigned int nhits = 0;
+   unsigned int loop;
+
+   // stamps tell which fences were hit by this point, cleared when the counter wraps
+   if ( ++ tracker->now == 0 )
+   {
+      memset( tracker->stamp, 0, fences->nfences * sizeof(uint32_t) );
+      tracker->now = 1;
+   }
+
+   int64_t x = geofence_cell_x( fences, point->longitude );
+   int64_t y = geofence_cell_y( fences, point->latitude );
+   if ( point->longitude >= fences->lon0 && point->latitude >= fences->lat0 && x < fences->nx && y < fences->ny )
+   {
+      uint32_t cell = y * fences->nx + x;
+      uint32_t entry;
+      for ( entry = fences->cell_first[cell]; entry < fences->cell_first[ cell + 1 ]; entry ++ )
+      {
+         const Geofence_polygon* polygon = &fences->polygons[ fences->entries[entry] & ~GEOFENCE_INSIDE ];
+         if ( tracker->stamp[ polygon->fence ] == tracker->now )
+            continue;
+         if ( ( fences->entries[entry] & GEOFENCE_INSIDE ) == 0 )
+         {
+            if ( point->latitude < polygon->lat0 || point->latitude > polygon->lat1 ||
+                 point->longitude < polygon->lon0 || point->longitude > polygon->lon1 ||
+                 !geofence_polygon_contains( fences, polygon, point->latitude, point->longitude ) )
+               continue;
+         }
+         tracker->stamp[ polygon->fence ] = tracker->now;
+         tracker->hits[ nhits ++ ] = polygon->fence;
+      }
+   }
+
+   int64_t time = GPS_point_epoch( point );
+   for ( loop = 0; loop < tracker->nactive; )
+   {
+      uint32_t fence = tracker->active[loop];
+      if ( tracker->stamp[fence] != tracker->now )
+      {
+         geofence_emit( tracker, GEOFENCE_EXIT, fence, point, time );
+         tracker->inside[fence] = false;
+         tracker->nactive --;
+         tracker->active[loop]  = tracker->active[ tracker->nactive ];
+         tracker->dwelled[loop] = tracker->dwelled[ tracker->nactive ];
+         continue;
+      }
+      if ( !tracker->dwelled[loop] && tracker->dwell > 0 && time - tracker->enter[fence] >= tracker->dwell )
+      {
+         geofence_emit( tracker, GEOFENCE_DWELL, fence, point, time );
+         tracker->dwelled[loop] = true;
+      }
+      loop ++;
+   }
+
+   for ( loop = 0; loop < nhits; loop ++ )
+   {
+      uint32_t fence = tracker->hits[loop];
+      if ( tracker->inside[fence] )
+         continue;
+      tracker->inside[fence] = true;
+      tracker->enter[fence]  = time;
+      tracker->active[ tracker->nactive ]  = fence;
+      tracker->dwelled[ tracker->nactive ] = false;
+      tracker->nactive ++;
+      geofence_emit( tracker, GEOFENCE_ENTER, fence, point, time );
+   }
+   return true;
+}
+
+/// Closes the tracker, fences the device is still in are not reported. Returns number of events.
+long geofence_tracker_close( Geofence_tracker* tracker )
+{
+   long events = 0;
+
+   if ( tracker == NULL )
+      return 0;
+   events = tracker->events;
+   free( tracker->stamp );
+   free( tracker->inside );
+   free( tracker->enter );
+   free( tracker->active );
+   free( tracker->dwelled );
+   free( tracker->hits );
+   free( tracker );
+   return events;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Events as CSV: device,fence,event,time,latitude,longitude,duration
+///--------------------------------------------------------------------------------------------------------------------
+static int geofence_csv_field( char* out, size_t size, const char* text )
+{
+   size_t len = 0;
+
+   if ( strpbrk( text, ",\"\n" ) == NULL )
+      return snprintf( out, size, "%s", text );
+
+   // quoted, with quotes doubled
+   if ( len + 1 < size )
+      out[ len ++ ] = '"';
+   for ( ; *text != 0x00 && len + 3 < size; text ++ )
+   {
+      if ( *text == '"' )
+         out[ len ++ ] = '"';
+      out[ len ++ ] = *text;
+   }
+   out[ len ++ ] = '"';
+   out[ len ] = 0x00;
+   return len;
+}
+
+static int geofence_event_format( char* out, size_t size, const Geofence_event* event )
+{
+   static const char* types[] = { "", "enter", "exit", "dwell" };
+   char lat[16], lon[16];
+   GPS_point point;
+   int len;
+
+   GPS_point_set_epoch( &point, event->time );
+   lat[ GPS_format_microdeg( lat, event->latitude ) ] = 0x00;
+   lon[ GPS_format_microdeg( lon, event->longitude ) ] = 0x00;
+
+   len  = geofence_csv_field( out, size, event->device );
+   len += snprintf( out + len, size - len, "," );
+   len += geofence_csv_field( out + len, size - len, event->fence );
+   len += snprintf( out + len, size - len, ",%s,%04d-%02d-%02dT%02d:%02d:%02dZ,%s,%s,%lld\n", types[ event->type ],
+                    point.time[5], point.time[4], point.time[3], point.time[2], point.time[1], point.time[0],
+                    lat, lon, (long long)event->duration );
+   return ( len < (int)size ) ? len : (int)size - 1;
+}
+
+/// Geofence_handler writing to FILE* given as context
+void geofence_event_print( const Geofence_event* event, void* context )
+{
+   char line[ BUFFER_SIZE ];
+   fwrite( line, 1, geofence_event_format( line, sizeof(line), event ), (FILE*)context );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Batch over saved tracks and archives. Each track file is its own device, archive root directories have
+/// devices as subdirectories and their partitions are read in order of date. Devices are run in parallel and
+/// their events written in the order of the inputs.
+///--------------------------------------------------------------------------------------------------------------------
+typedef struct
+{
+   const Archive_device* input;
+
+   char*        events;
+   size_t       length;
+   size_t       capacity;
+   long         count;
+   bool         failed;
+} Geofence_stream;
+
+typedef struct
+{
+   const Geofence*  fences;
+   int64_t          dwell;
+   Archive_inputs   inputs;
+   Geofence_stream* streams;     // one per device of the inputs
+   unsigned int     nstreams;
+} Geofence_scan;
+
+/// Geofence_handler collecting the CSV lines of a stream
+static void geofence_stream_event( const Geofence_event* event, void* context )
+{
+   Geofence_stream* stream = (Geofence_stream*)context;
+   char line[ BUFFER_SIZE ];
+   int len = geofence_event_format( line, sizeof(line), event );
+
+   if ( stream->length + len > stream->capacity )
+   {
+      size_t capacity = ( stream->capacity == 0 ) ? 65536 : stream->capacity * 2;
+      char* more = (char*)realloc( stream->events, capacity );
+      if ( more == NULL )
+      {
+         stream->failed = true;
+         return;
+      }
+      stream->events   = more;
+      stream->capacity = capacity;
+   }
+   memcpy( stream->events + stream->length, line, len );
+   stream->length += len;
+}
+
+static void geofence_scan_stream( unsigned int index, void* context )
+{
+   Geofence_scan* scan = (Geofence_scan*)context;
+   Geofence_stream* stream = &scan->streams[index];
+   unsigned int loop;
+   int count, ploop;
+
+   GPS_point* points = (GPS_point*)malloc( GEOFENCE_CHUNK * sizeof(GPS_point) );
+   Geofence_tracker* tracker = geofence_tracker_open( scan->fences, stream->input->device, scan->dwell,
+                                                      geofence_stream_event, stream );
+   if ( points == NULL || tracker == NULL )
+   {
+      stream->failed = true;
+      free( points );
+      geofence_tracker_close( tracker );
+      return;
+   }
+
+   for ( loop = 0; loop < stream->input->nfiles && !stream->failed; loop ++ )
+   {
+      GPS_reader* reader = GPS_reader_open( stream->input->files[loop] );
+      if ( reader == NULL )
+      {
+         stream->failed = true;
+         break;
+      }
+      DEBUG(3, "device '%s': reading '%s'", stream->input->device, stream->input->files[loop] );
+      while ( (count = GPS_reader_read( reader, points, GEOFENCE_CHUNK )) > 0 )
+      {
+         for ( ploop = 0; ploop < count; ploop ++ )
+            geofence_tracker_feed( &points[ploop], tracker );
+      }
+      if ( count < 0 )
+         stream->failed = true;
+      GPS_reader_close( reader );
+   }
+   stream->count = geofence_tracker_close( tracker );
+   free( points );
+}
+
+static void geofence_scan_free( Geofence_scan* scan )
+{
+   unsigned int loop;
+
+   for ( loop = 0; loop < scan->nstreams; loop ++ )
+      free( scan->streams[loop].events );
+   free( scan->streams );
+   archive_inputs_free( &scan->inputs );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Run the fences over saved tracks and archives, writing events to CSV file
+/// \returns number of events or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long geofence_scan( const Geofence* fences, const char* output, const char* const* inputs, int ninputs, int64_t dwell )
+{
+   Geofence_scan scan;
+   unsigned int loop;
+   long events = 0;
+   bool ok = true;
+   int iloop;
+
+   memset( &scan, 0, sizeof(scan) );
+   scan.fences = fences;
+   scan.dwell  = dwell;
+   for ( iloop = 0; ok && iloop < ninputs; iloop ++ )
+      ok = archive_inputs_add( &scan.inputs, inputs[iloop] );
+
+   scan.streams = ok ? (Geofence_stream*)calloc( scan.inputs.ndevices + 1, sizeof(Geofence_stream) ) : NULL;
+   if ( ok && scan.streams == NULL )
+   {
+      ERROR("Out of memory!");
+      ok = false;
+   }
+   for ( loop = 0; ok && loop < scan.inputs.ndevices; loop ++ )
+      scan.streams[ scan.nstreams ++ ].input = &scan.inputs.devices[loop];
+
+   if ( ok )
+      workers_run( scan.nstreams, geofence_scan_stream, &scan );
+
+   FILE* fid = ok ? fopen( output, "wb" ) : NULL;
+   if ( ok && fid == NULL )
+   {
+      ERROR("Cannot open file '%s' for writing: %s", output, strerror(errno) );
+      ok = false;
+   }
+   if ( ok )
+      ok = fputs( GEOFENCE_CSV_HEADER, fid ) >= 0;
+   for ( loop = 0; ok && loop < scan.nstreams; loop ++ )
+   {
+      const Geofence_stream* stream = &scan.streams[loop];
+      if ( stream->failed )
+      {
+         ERROR("Events of device '%s' failed", stream->input->device );
+         ok = false;
+         break;
+      }
+      ok = fwrite( stream->events, 1, stream->length, fid ) == stream->length;
+      events += stream->count;
+   }
+   if ( fid != NULL && fclose( fid ) != 0 )
+      ok = false;
+
+   geofence_scan_free( &scan );
+   return ok ? events : -1;
+}
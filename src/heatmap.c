@@ -0,0 +1,822 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#define MODULE_NAME "heatmap"
+
+/// Points are projected to web mercator pixels of 256 x 256 tiles at the zoom level. Inputs are cut to units of
+/// at most one track store block, each thread takes units in turn and counts points to its own sparse set of
+/// tiles, allocated when first touched, and the sets are summed at the end. Counts are coloured with logarithmic
+/// ramp and written as single image, or as '<dir>/<zoom>/<x>/<y>' tiles when the output has no image extension.
+
+#define HEATMAP_TILE        256
+#define HEATMAP_TILE_PIXELS (HEATMAP_TILE*HEATMAP_TILE)
+#define HEATMAP_TILE_BYTES  (HEATMAP_TILE_PIXELS*sizeof(uint32_t))
+/// Largest single image, pixels
+#define HEATMAP_MAX_PIXELS  (8192*8192)
+/// Memory for the tiles of all threads, bytes
+#define HEATMAP_MEMORY      ((size_t)2048*1024*1024)
+/// Default zoom is the largest that keeps the image within this many pixels wide and high
+#define HEATMAP_AUTO_SIZE   2048
+#define HEATMAP_AUTO_ZOOM   18
+#define HEATMAP_MAX_LAT     85051128
+
+/// Output formats
+#define HEATMAP_PPM   1
+#define HEATMAP_PNG   2
+#define HEATMAP_TILES 3
+
+typedef struct
+{
+   int32_t lat0, lon0, lat1, lon1;
+} Heatmap_box;
+
+/// Part of the input handled at once
+typedef struct
+{
+   const Track_reader* reader;
+   unsigned int        block;
+   const GPS_point*    points;
+   unsigned int        npoints;
+} Heatmap_unit;
+
+/// Tiles touched by one thread, open addressing hash by tile number
+typedef struct
+{
+   uint64_t*    keys;       // x << 32 | y
+   uint32_t**   counts;     // HEATMAP_TILE_PIXELS counts per tile, NULL for empty slot
+   unsigned int size;
+   unsigned int used;
+} Heatmap_tiles;
+
+typedef struct
+{
+   Heatmap_unit*  units;
+   unsigned int   nunits;
+   unsigned int   next;        // next unit to take, atomic
+
+   // window in global pixels
+   int            zoom;
+   double         world;       // pixels around the globe
+   int64_t        x0, y0;
+   int64_t        width, height;
+   int32_t        lat0, lon0, lat1, lon1;
+
+   unsigned int   nparts;
+   Heatmap_tiles* tiles;       // per part
+   Heatmap_box*   boxes;       // bounding box per part
+   long*          drawn;
+   size_t         memory;      // bytes of all tiles, atomic
+   bool           bbox_only;
+   bool           failed;
+} Heatmap;
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Inputs, archive directories are searched for track store files
+///--------------------------------------------------------------------------------------------------------------------
+static bool heatmap_unit_add( Heatmap* map, const Track_reader* reader, unsigned int block, const GPS_point* points,
+                              unsigned int npoints )
+{
+   if ( (map->nunits & 1023) == 0 )
+   {
+      Heatmap_unit* more = (Heatmap_unit*)realloc( map->units, ( map->nunits + 1024 ) * sizeof(Heatmap_unit) );
+      if ( more == NULL )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      map->units = more;
+   }
+   Heatmap_unit* unit = &map->units[ map->nunits ++ ];
+   unit->reader  = reader;
+   unit->block   = block;
+   unit->points  = points;
+   unit->npoints = npoints;
+   return true;
+}
+
+typedef struct
+{
+   Track_reader** readers;
+   unsigned int   nreaders;
+   GPS_points*    tracks;
+   unsigned int   ntracks;
+} Heatmap_inputs;
+
+static bool heatmap_input_add( Heatmap* map, Heatmap_inputs* inputs, const char* filename )
+{
+   struct stat info;
+   unsigned int loop;
+
+   if ( stat( filename, &info ) == 0 && S_ISDIR( info.st_mode ) )
+   {
+      DIR* dir = opendir( filename );
+      struct dirent* entry;
+      bool ok = true;
+
+      if ( dir == NULL )
+      {
+         ERROR("Cannot open directory '%s': %s", filename, strerror(errno) );
+         return false;
+      }
+      while ( ok && (entry = readdir( dir )) != NULL )
+      {
+         char path[ BUFFER_SIZE ];
+         size_t len = strlen( entry->d_name );
+         if ( entry->d_name[0] == '.' || strstr( entry->d_name, ".tmp" ) != NULL )
+            continue;
+
+         snprintf( path, sizeof(path), "%s/%s", filename, entry->d_name );
+         if ( stat( path, &info ) == 0 && ( S_ISDIR( info.st_mode ) ||
+                                            ( len > 4 && strcmp( entry->d_name + len - 4, ".gts" ) == 0 ) ) )
+            ok = heatmap_input_add( map, inputs, path );
+      }
+      closedir( dir );
+      return ok;
+   }
+
+   if ( GPS_format_of( filename ) == GPS_FORMAT_TRACK )
+   {
+      Track_reader** more = (Track_reader**)realloc( inputs->readers, ( inputs->nreaders + 1 ) * sizeof(Track_reader*) );
+      if ( more == NULL )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      inputs->readers = more;
+
+      Track_reader* reader = track_reader_open( filename );
+      if ( reader == NULL )
+         return false;
+      inputs->readers[ inputs->nreaders ++ ] = reader;
+
+      for ( loop = 0; loop < track_reader_nblocks( reader ); loop ++ )
+      {
+         if ( !heatmap_unit_add( map, reader, loop, NULL, 0 ) )
+            return false;
+      }
+      return true;
+   }
+
+   // other formats are read whole and cut to units of block size
+   GPS_points* more = (GPS_points*)realloc( inputs->tracks, ( inputs->ntracks + 1 ) * sizeof(GPS_points) );
+   if ( more == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   inputs->tracks = more;
+
+   GPS_points* track = &inputs->tracks[ inputs->ntracks ];
+   GPS_points_init( track );
+   if ( !GPS_points_read( track, filename ) )
+      return false;
+   inputs->ntracks ++;
+
+   for ( loop = 0; loop < track->npoints; loop += TRACK_BLOCK_POINTS )
+   {
+      unsigned int count = ( track->npoints - loop < TRACK_BLOCK_POINTS ) ? track->npoints - loop : TRACK_BLOCK_POINTS;
+      if ( !heatmap_unit_add( map, NULL, 0, track->points + loop, count ) )
+         return false;
+   }
+   return true;
+}
+
+static void heatmap_inputs_free( Heatmap_inputs* inputs )
+{
+   unsigned int loop;
+
+   for ( loop = 0; loop < inputs->nreaders; loop ++ )
+      track_reader_close( inputs->readers[loop] );
+   for ( loop = 0; loop < inputs->ntracks; loop ++ )
+      GPS_points_free( &inputs->tracks[loop] );
+   free( inputs->readers );
+   free( inputs->tracks );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Web mercator
+///--------------------------------------------------------------------------------------------------------------------
+static inline double heatmap_x( double world, int32_t longitude )
+{
+   return ( longitude * MICRODEG_TO_DEG + 180.0 ) / 360.0 * world;
+}
+
+static inline double heatmap_y( double world, int32_t latitude )
+{
+   double lat = latitude * MICRODEG_TO_RAD;
+   return ( 0.5 - log( tan( M_PI / 4 + lat / 2 ) ) / ( 2 * M_PI ) ) * world;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Sparse tile sets
+///--------------------------------------------------------------------------------------------------------------------
+static inline unsigned int heatmap_slot( const Heatmap_tiles* tiles, uint64_t key )
+{
+   unsigned int slot = (unsigned int)( ( key * 0x9e3779b97f4a7c15ULL ) >> 32 ) & ( tiles->size - 1 );
+   while ( tiles->counts[slot] != NULL && tiles->keys[slot] != key )
+      slot = ( slot + 1 ) & ( tiles->size - 1 );
+   return slot;
+}
+
+/// Counts of the tile, allocated when missing. \returns NULL when out of memory
+static uint32_t* heatmap_tile( Heatmap* map, Heatmap_tiles* tiles, uint64_t key )
+{
+   unsigned int slot, loop;
+
+   if ( tiles->size > 0 )
+   {
+      slot = heatmap_slot( tiles, key );
+      if ( tiles->counts[slot] != NULL )
+         return tiles->counts[slot];
+   }
+
+   if ( __atomic_add_fetch( &map->memory, HEATMAP_TILE_BYTES, __ATOMIC_RELAXED ) > HEATMAP_MEMORY )
+   {
+      ERROR("Too many tiles, use smaller zoom or bounding box");
+      __atomic_sub_fetch( &map->memory, HEATMAP_TILE_BYTES, __ATOMIC_RELAXED );
+      return NULL;
+   }
+
+   // keep load under half
+   if ( 2 * ( tiles->used + 1 ) > tiles->size )
+   {
+      Heatmap_tiles grown;
+      grown.size   = tiles->size > 0 ? tiles->size * 2 : 64;
+      grown.used   = tiles->used;
+      grown.keys   = (uint64_t*)calloc( grown.size, sizeof(uint64_t) );
+      grown.counts = (uint32_t**)calloc( grown.size, sizeof(uint32_t*) );
+      if ( grown.keys == NULL || grown.counts == NULL )
+      {
+         ERROR("Out of memory!");
+         free( grown.keys );
+         free( grown.counts );
+         __atomic_sub_fetch( &map->memory, HEATMAP_TILE_BYTES, __ATOMIC_RELAXED );
+         return NULL;
+      }
+      for ( loop = 0; loop < tiles->size; loop ++ )
+      {
+         if ( tiles->counts[loop] == NULL )
+            continue;
+         slot = heatmap_slot( &grown, tiles->keys[loop] );
+         grown.keys[slot]   = tiles->keys[loop];
+         grown.counts[slot] = tiles->counts[loop];
+      }
+      free( tiles->keys );
+      free( tiles->counts );
+      *tiles = grown;
+   }
+
+   slot = heatmap_slot( tiles, key );
+   tiles->counts[slot] = (uint32_t*)calloc( HEATMAP_TILE_PIXELS, sizeof(uint32_t) );
+   if ( tiles->counts[slot] == NULL )
+   {
+      ERROR("Out of memory!");
+      __atomic_sub_fetch( &map->memory, HEATMAP_TILE_BYTES, __ATOMIC_RELAXED );
+      return NULL;
+   }
+   tiles->keys[slot] = key;
+   tiles->used ++;
+   return tiles->counts[slot];
+}
+
+/// Free counts of the tile, its memory is no longer counted
+static void heatmap_tile_free( Heatmap* map, uint32_t** counts )
+{
+   if ( *counts == NULL )
+      return;
+   free( *counts );
+   *counts = NULL;
+   __atomic_sub_fetch( &map->memory, HEATMAP_TILE_BYTES, __ATOMIC_RELAXED );
+}
+
+static void heatmap_tiles_free( Heatmap* map, Heatmap_tiles* tiles )
+{
+   unsigned int loop;
+   for ( loop = 0; loop < tiles->size; loop ++ )
+      heatmap_tile_free( map, &tiles->counts[loop] );
+   free( tiles->keys );
+   free( tiles->counts );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Count points of units to tiles of the part, or collect their bounding box
+///--------------------------------------------------------------------------------------------------------------------
+static void heatmap_part( unsigned int part, void* context )
+{
+   Heatmap* map = (Heatmap*)context;
+   GPS_point* block = (GPS_point*)malloc( TRACK_BLOCK_POINTS * sizeof(GPS_point) );
+   Heatmap_tiles* tiles = &map->tiles[part];
+   Heatmap_box* box = &map->boxes[part];
+   uint32_t* counts = NULL;
+   uint64_t tile = UINT64_MAX;
+   long drawn = 0;
+   unsigned int index, loop;
+
+   if ( block == NULL )
+   {
+      map->failed = true;
+      return;
+   }
+
+   while ( !map->failed && (index = __atomic_fetch_add( &map->next, 1, __ATOMIC_RELAXED )) < map->nunits )
+   {
+      const Heatmap_unit* unit = &map->units[index];
+      const GPS_point* points = unit->points;
+      int npoints = unit->npoints;
+
+      if ( unit->reader != NULL )
+      {
+         npoints = track_reader_block( unit->reader, unit->block, block );
+         points  = block;
+         if ( npoints < 0 )
+         {
+            map->failed = true;
+            break;
+         }
+      }
+
+      if ( map->bbox_only )
+      {
+         for ( loop = 0; loop < (unsigned int)npoints; loop ++ )
+         {
+            box->lat0 = ( points[loop].latitude  < box->lat0 ) ? points[loop].latitude  : box->lat0;
+            box->lat1 = ( points[loop].latitude  > box->lat1 ) ? points[loop].latitude  : box->lat1;
+            box->lon0 = ( points[loop].longitude < box->lon0 ) ? points[loop].longitude : box->lon0;
+            box->lon1 = ( points[loop].longitude > box->lon1 ) ? points[loop].longitude : box->lon1;
+         }
+         continue;
+      }
+
+      for ( loop = 0; loop < (unsigned int)npoints; loop ++ )
+      {
+         int32_t lat = points[loop].latitude, lon = points[loop].longitude;
+         if ( lat < map->lat0 || lat > map->lat1 || lon < map->lon0 || lon > map->lon1 )
+            continue;
+
+         int64_t x = (int64_t)heatmap_x( map->world, lon );
+         int64_t y = (int64_t)heatmap_y( map->world, lat );
+         if ( x < map->x0 || y < map->y0 || x >= map->x0 + map->width || y >= map->y0 + map->height )
+            continue;
+
+         // consecutive points are mostly in the same tile
+         uint64_t key = ( (uint64_t)( x / HEATMAP_TILE ) << 32 ) | (uint64_t)( y / HEATMAP_TILE );
+         if ( key != tile )
+         {
+            counts = heatmap_tile( map, tiles, key );
+            tile   = key;
+            if ( counts == NULL )
+            {
+               map->failed = true;
+               break;
+            }
+         }
+         counts[ ( y % HEATMAP_TILE ) * HEATMAP_TILE + x % HEATMAP_TILE ] ++;
+         drawn ++;
+      }
+   }
+   map->drawn[part] = drawn;
+   free( block );
+}
+
+/// Sum tiles of all parts to the first, \returns false when out of memory
+static bool heatmap_sum( Heatmap* map )
+{
+   unsigned int part, loop, pixel;
+
+   for ( part = 1; part < map->nparts; part ++ )
+   {
+      Heatmap_tiles* tiles = &map->tiles[part];
+      for ( loop = 0; loop < tiles->size; loop ++ )
+      {
+         if ( tiles->counts[loop] == NULL )
+            continue;
+
+         uint32_t* sum = heatmap_tile( map, &map->tiles[0], tiles->keys[loop] );
+         if ( sum == NULL )
+            return false;
+         for ( pixel = 0; pixel < HEATMAP_TILE_PIXELS; pixel ++ )
+            sum[pixel] += tiles->counts[loop][pixel];
+         heatmap_tile_free( map, &tiles->counts[loop] );
+      }
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Colour ramp from dark blue through red and yellow to white, logarithmic to count
+///--------------------------------------------------------------------------------------------------------------------
+static void heatmap_colour( uint32_t count, double log_max, unsigned char* rgba )
+{
+   static const double stops[4][3] = { { 0, 0, 128 }, { 255, 0, 0 }, { 255, 255, 0 }, { 255, 255, 255 } };
+
+   if ( count == 0 )
+   {
+      memset( rgba, 0, 4 );
+      return;
+   }
+
+   double t = ( log_max > 0 ) ? log( count ) / log_max : 1.0;
+   double pos = t * 3;
+   int stop = ( pos >= 3 ) ? 2 : (int)pos;
+   double f = pos - stop;
+   int loop;
+
+   for ( loop = 0; loop < 3; loop ++ )
+      rgba[loop] = (unsigned char)lrint( stops[stop][loop] + ( stops[stop+1][loop] - stops[stop][loop] ) * f );
+   rgba[3] = (unsigned char)lrint( 128 + 127 * t );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Image files, 'rgba' is width x height pixels with row stride 'stride' pixels
+///--------------------------------------------------------------------------------------------------------------------
+static bool heatmap_write_ppm( const char* filename, const unsigned char* rgba, unsigned int width, unsigned int height,
+                               unsigned int stride )
+{
+   unsigned int row, column;
+   FILE* fid = fopen( filename, "wb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s' for writing: %s", filename, strerror(errno) );
+      return false;
+   }
+
+   fprintf( fid, "P6\n%u %u\n255\n", width, height );
+   for ( row = 0; row < height; row ++ )
+   {
+      for ( column = 0; column < width; column ++ )
+         fwrite( rgba + 4 * ( (size_t)row * stride + column ), 1, 3, fid );
+   }
+   if ( fclose( fid ) != 0 )
+   {
+      ERROR("Cannot write file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   return true;
+}
+
+#ifdef HAVE_ZLIB
+static void png_put_u32( unsigned char* out, uint32_t value )
+{
+   out[0] = value >> 24;
+   out[1] = value >> 16;
+   out[2] = value >> 8;
+   out[3] = value;
+}
+
+static void png_chunk( FILE* fid, const char* type, const unsigned char* data, uint32_t len )
+{
+   unsigned char word[4];
+
+   png_put_u32( word, len );
+   fwrite( word, 1, 4, fid );
+   fwrite( type, 1, 4, fid );
+   fwrite( data, 1, len, fid );
+
+   uLong crc = crc32( 0, (const Bytef*)type, 4 );
+   crc = crc32( crc, data, len );
+   png_put_u32( word, crc );
+   fwrite( word, 1, 4, fid );
+}
+
+static bool heatmap_write_png( const char* filename, const unsigned char* rgba, unsigned int width, unsigned int height,
+                               unsigned int stride )
+{
+   size_t row_len = (size_t)width * 4 + 1;
+   uLongf packed_len = compressBound( row_len * height );
+   unsigned char* raw = (unsigned char*)malloc( row_len * height );
+   unsigned char* packed = (unsigned char*)malloc( packed_len );
+   unsigned char header[13];
+   unsigned int row;
+   bool ok = false;
+
+   if ( raw == NULL || packed == NULL )
+   {
+      ERROR("Out of memory!");
+      free( raw );
+      free( packed );
+      return false;
+   }
+
+   // filter type 0 for every row
+   for ( row = 0; row < height; row ++ )
+   {
+      raw[ row * row_len ] = 0;
+      memcpy( raw + row * row_len + 1, rgba + 4 * (size_t)row * stride, width * 4 );
+   }
+
+   FILE* fid = fopen( filename, "wb" );
+   if ( fid == NULL )
+      ERROR("Cannot open file '%s' for writing: %s", filename, strerror(errno) );
+   else if ( compress2( packed, &packed_len, raw, row_len * height, Z_BEST_SPEED ) != Z_OK )
+      ERROR("Cannot compress image '%s'", filename );
+   else
+   {
+      png_put_u32( header, width );
+      png_put_u32( header + 4, height );
+      header[8]  = 8;   // bits per channel
+      header[9]  = 6;   // RGBA
+      header[10] = 0;
+      header[11] = 0;
+      header[12] = 0;
+
+      fwrite( "\x89PNG\r\n\x1a\n", 1, 8, fid );
+      png_chunk( fid, "IHDR", header, 13 );
+      png_chunk( fid, "IDAT", packed, packed_len );
+      png_chunk( fid, "IEND", NULL, 0 );
+      ok = true;
+   }
+   if ( fid != NULL && fclose( fid ) != 0 )
+   {
+      ERROR("Cannot write file '%s': %s", filename, strerror(errno) );
+      ok = false;
+   }
+   free( raw );
+   free( packed );
+   return ok;
+}
+#endif
+
+static bool heatmap_write_image( const char* filename, int format, const unsigned char* rgba, unsigned int width,
+                                 unsigned int height, unsigned int stride )
+{
+#ifdef HAVE_ZLIB
+   if ( format == HEATMAP_PNG )
+      return heatmap_write_png( filename, rgba, width, height, stride );
+#endif
+   return heatmap_write_ppm( filename, rgba, width, height, stride );
+}
+
+/// Tiles with any points as '<dir>/<zoom>/<x>/<y>.<ext>', \returns false on failure
+static bool heatmap_write_tiles( const Heatmap* map, const char* dir, double log_max )
+{
+#ifdef HAVE_ZLIB
+   const char* ext = "png";
+   int format = HEATMAP_PNG;
+#else
+   const char* ext = "ppm";
+   int format = HEATMAP_PPM;
+#endif
+   const Heatmap_tiles* tiles = &map->tiles[0];
+   unsigned char rgba[ HEATMAP_TILE_PIXELS * 4 ];
+   char path[ BUFFER_SIZE ];
+   unsigned int loop, pixel;
+
+   snprintf( path, sizeof(path), "%s/%d", dir, map->zoom );
+   mkdir( dir, 0755 );
+   mkdir( path, 0755 );
+
+   for ( loop = 0; loop < tiles->size; loop ++ )
+   {
+      if ( tiles->counts[loop] == NULL )
+         continue;
+
+      unsigned long x = tiles->keys[loop] >> 32, y = tiles->keys[loop] & 0xffffffff;
+      snprintf( path, sizeof(path), "%s/%d/%lu", dir, map->zoom, x );
+      if ( mkdir( path, 0755 ) != 0 && errno != EEXIST )
+      {
+         ERROR("Cannot create directory '%s': %s", path, strerror(errno) );
+         return false;
+      }
+      snprintf( path, sizeof(path), "%s/%d/%lu/%lu.%s", dir, map->zoom, x, y, ext );
+
+      for ( pixel = 0; pixel < HEATMAP_TILE_PIXELS; pixel ++ )
+         heatmap_colour( tiles->counts[loop][pixel], log_max, rgba + 4 * pixel );
+      if ( !heatmap_write_image( path, format, rgba, HEATMAP_TILE, HEATMAP_TILE, HEATMAP_TILE ) )
+         return false;
+   }
+   DEBUG(3, "%u tiles written", tiles->used );
+   return true;
+}
+
+/// Window as single image
+static bool heatmap_write_window( const Heatmap* map, const char* filename, int format, double log_max )
+{
+   const Heatmap_tiles* tiles = &map->tiles[0];
+   unsigned int loop, row, column;
+
+   unsigned char* rgba = (unsigned char*)calloc( (size_t)map->width * map->height, 4 );
+   if ( rgba == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+
+   for ( loop = 0; loop < tiles->size; loop ++ )
+   {
+      if ( tiles->counts[loop] == NULL )
+         continue;
+
+      int64_t tx = ( tiles->keys[loop] >> 32 ) * HEATMAP_TILE - map->x0;
+      int64_t ty = ( tiles->keys[loop] & 0xffffffff ) * HEATMAP_TILE - map->y0;
+      for ( row = 0; row < HEATMAP_TILE; row ++ )
+      {
+         for ( column = 0; column < HEATMAP_TILE; column ++ )
+         {
+            int64_t x = tx + column, y = ty + row;
+            if ( x < 0 || y < 0 || x >= map->width || y >= map->height )
+               continue;
+            heatmap_colour( tiles->counts[loop][ row * HEATMAP_TILE + column ], log_max, rgba + 4 * ( y * map->width + x ) );
+         }
+      }
+   }
+
+   bool ok = heatmap_write_image( filename, format, rgba, map->width, map->height, map->width );
+   free( rgba );
+   return ok;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Pixel window of the bounding box at zoom, whole tiles for tile output. \returns false if too large for image
+///--------------------------------------------------------------------------------------------------------------------
+static bool heatmap_window( Heatmap* map, int zoom, bool tiles )
+{
+   map->zoom  = zoom;
+   map->world = (double)HEATMAP_TILE * ( 1 << zoom );
+
+   int64_t x0 = (int64_t)heatmap_x( map->world, map->lon0 );
+   int64_t x1 = (int64_t)heatmap_x( map->world, map->lon1 );
+   int64_t y0 = (int64_t)heatmap_y( map->world, map->lat1 );
+   int64_t y1 = (int64_t)heatmap_y( map->world, map->lat0 );
+   x1 = ( x1 >= map->world ) ? (int64_t)map->world - 1 : x1;
+   y1 = ( y1 >= map->world ) ? (int64_t)map->world - 1 : y1;
+   if ( tiles )
+   {
+      x0 = x0 / HEATMAP_TILE * HEATMAP_TILE;
+      y0 = y0 / HEATMAP_TILE * HEATMAP_TILE;
+      x1 = x1 / HEATMAP_TILE * HEATMAP_TILE + HEATMAP_TILE - 1;
+      y1 = y1 / HEATMAP_TILE * HEATMAP_TILE + HEATMAP_TILE - 1;
+   }
+
+   map->x0 = x0;
+   map->y0 = y0;
+   map->width  = x1 - x0 + 1;
+   map->height = y1 - y0 + 1;
+   return tiles || map->width * map->height <= HEATMAP_MAX_PIXELS;
+}
+
+static int heatmap_format_of( const char* filename )
+{
+   size_t len = strlen( filename );
+   if ( len > 4 && strcasecmp( filename + len - 4, ".ppm" ) == 0 )
+      return HEATMAP_PPM;
+   if ( len > 4 && strcasecmp( filename + len - 4, ".png" ) == 0 )
+      return HEATMAP_PNG;
+   return HEATMAP_TILES;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Bounding box of all points, in parallel
+///--------------------------------------------------------------------------------------------------------------------
+static bool heatmap_bbox( Heatmap* map )
+{
+   unsigned int loop;
+
+   for ( loop = 0; loop < map->nparts; loop ++ )
+   {
+      map->boxes[loop].lat0 = map->boxes[loop].lon0 = INT32_MAX;
+      map->boxes[loop].lat1 = map->boxes[loop].lon1 = INT32_MIN;
+   }
+   map->bbox_only = true;
+   workers_run( map->nparts, heatmap_part, map );
+   map->bbox_only = false;
+   map->next      = 0;
+
+   map->lat0 = map->lon0 = INT32_MAX;
+   map->lat1 = map->lon1 = INT32_MIN;
+   for ( loop = 0; loop < map->nparts; loop ++ )
+   {
+      map->lat0 = ( map->boxes[loop].lat0 < map->lat0 ) ? map->boxes[loop].lat0 : map->lat0;
+      map->lon0 = ( map->boxes[loop].lon0 < map->lon0 ) ? map->boxes[loop].lon0 : map->lon0;
+      map->lat1 = ( map->boxes[loop].lat1 > map->lat1 ) ? map->boxes[loop].lat1 : map->lat1;
+      map->lon1 = ( map->boxes[loop].lon1 > map->lon1 ) ? map->boxes[loop].lon1 : map->lon1;
+   }
+   if ( map->failed )
+      return false;
+   if ( map->lat0 > map->lat1 )
+   {
+      ERROR("No points to draw");
+      return false;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Count the points to tiles of the parts, sum and colour them and write the output
+///--------------------------------------------------------------------------------------------------------------------
+static bool heatmap_draw( Heatmap* map, const char* output, int format )
+{
+   const Heatmap_tiles* tiles = &map->tiles[0];
+   unsigned int loop, pixel;
+   uint32_t max = 0;
+
+   workers_run( map->nparts, heatmap_part, map );
+   if ( map->failed || !heatmap_sum( map ) )
+      return false;
+
+   for ( loop = 0; loop < tiles->size; loop ++ )
+   {
+      for ( pixel = 0; tiles->counts[loop] != NULL && pixel < HEATMAP_TILE_PIXELS; pixel ++ )
+         max = ( tiles->counts[loop][pixel] > max ) ? tiles->counts[loop][pixel] : max;
+   }
+
+   if ( format == HEATMAP_TILES )
+      return heatmap_write_tiles( map, output, log( max ) );
+   return heatmap_write_window( map, output, format, log( max ) );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Render points of the inputs (tracks or archive directories) to heatmap image or tiles
+/// \returns number of points drawn or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long heatmap_render( const char* output, const char* const* inputs, int ninputs, const Heatmap_options* options )
+{
+   Heatmap map;
+   Heatmap_inputs files;
+   int format = heatmap_format_of( output );
+   unsigned int loop;
+   bool ok = true;
+   long drawn = 0;
+   int input;
+
+#ifndef HAVE_ZLIB
+   if ( format == HEATMAP_PNG )
+   {
+      ERROR("PNG output needs zlib, use .ppm");
+      return -1;
+   }
+#endif
+
+   memset( &map, 0, sizeof(map) );
+   memset( &files, 0, sizeof(files) );
+   for ( input = 0; ok && input < ninputs; input ++ )
+      ok = heatmap_input_add( &map, &files, inputs[input] );
+
+   map.nparts = workers_count();
+   map.tiles  = (Heatmap_tiles*)calloc( map.nparts, sizeof(Heatmap_tiles) );
+   map.boxes  = (Heatmap_box*)calloc( map.nparts, sizeof(Heatmap_box) );
+   map.drawn  = (long*)calloc( map.nparts, sizeof(long) );
+   if ( ok && ( map.tiles == NULL || map.boxes == NULL || map.drawn == NULL ) )
+   {
+      ERROR("Out of memory!");
+      ok = false;
+   }
+
+   map.lat0 = options->lat0;
+   map.lon0 = options->lon0;
+   map.lat1 = options->lat1;
+   map.lon1 = options->lon1;
+   if ( ok && map.lat0 == 0 && map.lon0 == 0 && map.lat1 == 0 && map.lon1 == 0 )
+      ok = heatmap_bbox( &map );
+   map.lat0 = ( map.lat0 < -HEATMAP_MAX_LAT ) ? -HEATMAP_MAX_LAT : map.lat0;
+   map.lat1 = ( map.lat1 >  HEATMAP_MAX_LAT ) ?  HEATMAP_MAX_LAT : map.lat1;
+
+   if ( ok && options->zoom >= 0 )
+   {
+      ok = heatmap_window( &map, options->zoom, format == HEATMAP_TILES );
+      if ( !ok )
+         ERROR("Image of %lld x %lld pixels is too large, use smaller zoom or bounding box", (long long)map.width,
+               (long long)map.height );
+   }
+   else if ( ok )
+   {
+      int zoom;
+      for ( zoom = HEATMAP_AUTO_ZOOM; zoom > 0; zoom -- )
+      {
+         if ( heatmap_window( &map, zoom, format == HEATMAP_TILES ) && map.width <= HEATMAP_AUTO_SIZE &&
+              map.height <= HEATMAP_AUTO_SIZE )
+            break;
+      }
+      heatmap_window( &map, zoom, format == HEATMAP_TILES );
+   }
+
+   if ( ok )
+   {
+      DEBUG(3, "zoom %d, %lld x %lld pixels, %u units", map.zoom, (long long)map.width, (long long)map.height, map.nunits );
+      ok = heatmap_draw( &map, output, format );
+   }
+
+   for ( loop = 0; map.drawn != NULL && loop < map.nparts; loop ++ )
+      drawn += map.drawn[loop];
+   for ( loop = 0; map.tiles != NULL && loop < map.nparts; loop ++ )
+      heatmap_tiles_free( &map, &map.tiles[loop] );
+   free( map.tiles );
+   free( map.boxes );
+   free( map.drawn );
+   free( map.units );
+   heatmap_inputs_free( &files );
+   return ok ? drawn : -1;
+}
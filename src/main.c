@@ -26,15 +26,97 @@ typedef struct
  unsigned int param_int;
  const char* param_str;
  unsigned int mode;
+ int    nargs;   // parameters of modes working on saved files
+ char** args;
+ 
+ // options of download and archive modes
+ bool   show_stats;
+ const char* fence_file;   // geofences, events are written to events_file during download
+ const char* events_file;
+ int64_t     dwell;        // seconds inside a fence before dwell event
+ const char* places_file;  // gazetteer to name the downloaded points
+ double      radius;
+ bool        clear;        // clear the device once the download is on disk
+ const char* dem_dir;      // terrain heights replace the heights of the device
+ const char* feed_name;    // points are published to shared memory feed while downloaded
+ bool        rtree;        // database output fills the R*Tree
+ const char* history_file; // link telemetry of the session is appended to, NULL for the default
+ const char* metrics;      // TCP port or Unix socket serving metrics during download
+ const char* name;         // device name in the history, archive name by default
+ const char* manifest_file; // record hashes of the download, next to the output by default
+ double      confidence;   // of the spot check before clearing
+ double      fraction;     // of changed entries the spot check detects
+ bool        verify_archive; // verify mode checks the archive device args[2]
+ const char* index_file;   // spatial index the saved download is added to
 } Setup;
 
+/// Consumers of points while they are downloaded
+typedef struct
+{
+   Geofence_tracker* tracker;
+   GPS_writer*       writer;
+   Feed*             feed;
+   Verify_manifest*  manifest;
+   Geofence*         fences;       // of the tracker
+   FILE*             events;       // written by the tracker
+} Download_sinks;
+
 bool get_runmode_etc( int argc, char** argv, Setup* setup);
+bool get_options( int argc, char** argv, int first, Setup* setup );
+bool run_offline( Setup* setup );
+bool download_run( const Setup* setup, int serial_fd, unsigned char* buffer, Telemetry** telemetry );
+void download_abort( Download_sinks* sinks );
+bool download_sink( const GPS_point* point, void* context );
+bool download_elevate( const char* dem_dir, GPS_points* points );
+void download_saved( const char* filename, bool ok, void* context );
+GPS_writer* download_writer_open( const Setup* setup, bool* saved );
+void download_manifest_file( const Setup* setup, char* filename, size_t len );
+
+/// Tracks seen by query
+typedef struct
+{
+   struct
+   {
+      char*        name;
+      uint32_t     id;
+      unsigned int npoints;
+   } *tracks;
+   unsigned int ntracks;
+} Query_result;
 
 #define MODE_RESET    1
 #define MODE_QUERY    2
 #define MODE_SET      3
 #define MODE_DOWNLOAD 4
 #define MODE_CLEAR    5
+#define MODE_ARCHIVE  6
+#define MODE_VERIFY   7
+
+#define MODE_CONVERT  100
+#define MODE_INDEX    101
+#define MODE_SEARCH   102
+#define MODE_IMPORT   103
+#define MODE_EXTRACT  104
+#define MODE_STATS    105
+#define MODE_MERGE    106
+#define MODE_HEATMAP  107
+#define MODE_PYRAMID  108
+#define MODE_LOD      109
+#define MODE_GEOFENCE 110
+#define MODE_TAG      111
+#define MODE_ELEVATE  112
+#define MODE_EXPORT   113
+#define MODE_MATCH    114
+#define MODE_RESAMPLE 115
+#define MODE_JOIN     116
+#define MODE_STAYS    117
+#define MODE_HEALTH   118
+
+/// Modes that work on saved files, these do not open the device
+#define MODE_IS_OFFLINE(x) ( (x) >= MODE_CONVERT )
+
+/// Points kept in the shared memory feed for readers that fall behind, 2 MB
+#define DOWNLOAD_FEED_POINTS 65536
 
 
 ///-------------------------------------------------------------------------------------
@@ -46,7 +128,82 @@ void usage()
       printf("       query -- query device for the sampling rate\n");
       printf("       set   -- set the device sampling rate given in <param>\n");
       printf("       download -- download all data points from the device, save in GPX format to file <param>\n");
-      printf("       clear -- clear all data points from the device\n");
+      printf("       clear <output> | <root> <name> -- clear all data points from the device once they pass verify\n");
+      printf("             against the manifest of their download, takes --manifest, --confidence and --fraction\n");
+      printf("       archive <root> <name> -- download all data points, save to archive <root> as device <name>\n");
+      printf("       verify <output> | <root> <name> -- fetch a random sample of data points again and check them and\n");
+      printf("             the saved output against the manifest of the download, takes --manifest, --confidence,\n");
+      printf("             --fraction and --clear to clear the device only if the check passes\n");
+      printf("\n");
+      printf("       download and archive take options after the parameters:\n");
+      printf("       --stats -- print track statistics after download\n");
+      printf("       --fence <fences> <events.csv> -- write enter, exit and dwell events of the fences (WKT or GeoJSON\n");
+      printf("             polygons) as the points are downloaded\n");
+      printf("       --dwell <seconds> -- time inside a fence before dwell event (default 300, 0 for none)\n");
+      printf("       --places <gazetteer> -- name downloaded points by the nearest place of the gazetteer\n");
+      printf("       --radius <meters> -- largest distance to the named place (default 1000)\n");
+      printf("       --clear -- clear the device after the download has been saved, synced to disk and verified\n");
+      printf("       --manifest <file> -- record hashes of the download (default <output>.manifest or <root>/<name>.manifest)\n");
+      printf("       --confidence <p> -- of the verification before clearing (default 0.99)\n");
+      printf("       --fraction <f> -- smallest fraction of changed data points the verification detects (default 0.01)\n");
+      printf("       --dem <directory> -- replace heights by terrain heights of SRTM .hgt tiles in directory\n");
+      printf("       --shm <name> -- publish points to shared memory feed <name> as they are downloaded\n");
+      printf("       --rtree -- fill also the R*Tree of database output\n");
+      printf("       --index <index> -- add the saved download to spatial index file <index> (archive has its own)\n");
+      printf("       --history <file> -- append link telemetry to file (default $GEOTECH_HISTORY or ~/.geotech_history)\n");
+      printf("       --metrics <port or socket> -- serve Prometheus metrics on local TCP port or Unix socket\n");
+      printf("       --name <device> -- device name in the history (archive name by default)\n");
+      printf("\n");
+      printf("       The download output format is selected by file extension: .gpx (default), .csv,\n");
+      printf("       .gts (compressed track store) or .db (SQLite database, points are added as a new session).\n");
+      printf("       GPX and CSV are compressed when .gz or .zst is added.\n");
+      printf("\n");
+      printf("usage: ./geotech <mode> <params>, for modes working on saved files:\n");
+      printf("       convert <input> <output> -- convert saved track (.gpx or .gts) to another format\n");
+      printf("       index <index> <track> .. -- add saved tracks to spatial index file <index>\n");
+      printf("       query <index> box <lat0> <lon0> <lat1> <lon1> [<from> <to>]\n");
+      printf("       query <index> radius <lat> <lon> <meters> [<from> <to>]\n");
+      printf("             -- list indexed points in bounding box or radius, optionally only between given times\n");
+      printf("                (YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS)\n");
+      printf("       import <root> <name> <track> .. -- add saved tracks to archive <root> as device <name>\n");
+      printf("       extract <root> <name> <from> <to> <output> -- save archived points of device <name> between\n");
+      printf("             given times to <output>, a date only <to> means end of that day\n");
+      printf("       stats [--flat] <track> .. -- print distance, times, speeds, ascent and bounding box of tracks,\n");
+      printf("             --flat uses faster equirectangular distances instead of haversine\n");
+      printf("       merge [--memory <MB>] [--tolerance <meters>] <output> <track> .. -- merge tracks by time to one\n");
+      printf("             output, dropping points of same second within tolerance (default 1 m) of each other.\n");
+      printf("             Inputs larger than the memory budget (default 256 MB) are sorted through temporary files.\n");
+      printf("       heatmap [--zoom <z>] [--box <lat0> <lon0> <lat1> <lon1>] <output> <track or archive> ..\n");
+      printf("             -- render point density of tracks and archive directories to <output>.png, <output>.ppm,\n");
+      printf("                or to tiles <output>/<z>/<x>/<y>.png for other names\n");
+      printf("       pyramid <track> <output.gtp> -- build levels of detail of the track for display\n");
+      printf("       lod <pyramid> <zoom> [<lat0> <lon0> <lat1> <lon1>] <output> [--max-points <n>]\n");
+      printf("             -- save points of the level for the zoom within the viewport, using coarser level if\n");
+      printf("                the view would have more than <n> (default 5000) points\n");
+      printf("       geofence [--dwell <seconds>] <fences> <events.csv> <track or archive> ..\n");
+      printf("             -- write enter, exit and dwell events of each track, or each device of archive <root>,\n");
+      printf("                in the fences (WKT or GeoJSON polygons) to <events.csv>\n");
+      printf("       tag [--radius <meters>] [--ends] <gazetteer> <track> <output> -- name points by the nearest place\n");
+      printf("             within radius (default 1000 m) of gazetteer CSV 'name,lat,lon' or GeoNames dump, --ends\n");
+      printf("             names only the first and last points of trips\n");
+      printf("       elevate <dem directory> <track> <output> -- replace heights by terrain heights of SRTM .hgt tiles\n");
+      printf("       elevate <dem directory> <archive root> -- replace heights of all archived points in place\n");
+      printf("       export [--rtree] <output.db> <track or archive> .. -- load tracks and archives to SQLite database,\n");
+      printf("             each track and each device of an archive as a session, --rtree fills also an R*Tree\n");
+      printf("       match [--radius <meters>] <roads> <track> <output> [<edges.csv>] -- snap points to the roads\n");
+      printf("             (WKT line strings) within radius (default 50 m) along the most likely route, travel\n");
+      printf("             times of the road segments driven are saved to <edges.csv>\n");
+      printf("       resample [--step <s>] [--max-gap <s>] <track>[@<offset s>] <output> -- interpolate the track to\n");
+      printf("             points every step (default 1 s) of the clock, shifted by offset seconds, over gaps up to\n");
+      printf("             max-gap (default 60 s)\n");
+      printf("       join [--step <s>] [--max-gap <s>] <output> <track>[@<offset s>] .. -- resample tracks of devices\n");
+      printf("             to the same times and save them side by side as rows of <output>.csv or <output>.bin\n");
+      printf("       stays [--distance <m>] [--duration <s>] [--eps <m>] [--min-visits <n>] <places.csv> <visits.csv>\n");
+      printf("             <track or archive> .. -- find where devices stayed within distance (default 100 m) for\n");
+      printf("             duration (default 300 s), cluster stays with at least min-visits (default 2) within eps\n");
+      printf("             (default 50 m) to recurring places and save the places and the stays of each session\n");
+      printf("       health [--history <file>] -- report sessions, speed and errors of the link history per port and\n");
+      printf("             per device, marking those to check\n");
       exit(1);
 }
 
@@ -58,10 +215,7 @@ int main(int argc, char** argv)
 {
     Setup setup;
    
-   int tries ;
-   
    int serial_fd = 0;
-   int ret;
    unsigned char* buffer = NULL;
    
    if (!get_runmode_etc( argc, argv, &setup))
@@ -75,19 +229,39 @@ int main(int argc, char** argv)
       return false; 
    }
    
+   if ( MODE_IS_OFFLINE( setup.mode ) )
+   {
+      free( buffer );
+      return run_offline( &setup ) ? 0 : 1;
+   }
+   
+   static const char* mode_names[] = { "", "reset", "query", "set", "download", "clear", "archive", "verify" };
+   Telemetry* telemetry = NULL;
    if ( setup.mode != MODE_RESET )
    {
+      bool archive = ( setup.mode == MODE_ARCHIVE || setup.verify_archive );
+      const char* name = ( setup.name == NULL && archive ) ? setup.args[2] : setup.name;
+      telemetry = telemetry_start( setup.history_file, setup.device, name, mode_names[ setup.mode ],
+                                   setup.metrics );
+      if ( telemetry == NULL )
+      {
+         free(buffer);
+         return 1;
+      }
       if ( serial_init_highspeed( setup.device, buffer,  &serial_fd ) != true )
       {
+         telemetry_end( telemetry, false );
          free(buffer);
          return 1;
       }
    }
+   bool session_ok = true;
    
    if ( setup.mode == MODE_QUERY )
    {
       unsigned int sample = 0;
-      if (serial_query_sampling( serial_fd, buffer, &sample ) != 0)
+      session_ok = ( serial_query_sampling( serial_fd, buffer, &sample ) == 0 );
+      if (!session_ok)
       {
          ERROR("Query failed!\n");
       }
@@ -100,7 +274,8 @@ int main(int argc, char** argv)
    }   
    else if ( setup.mode == MODE_SET )
    {
-      if (serial_set_sampling( serial_fd, buffer, setup.param_int ) != 0)
+      session_ok = ( serial_set_sampling( serial_fd, buffer, setup.param_int ) == 0 );
+      if (!session_ok)
       {
          ERROR("Set failed!\n");
       }
@@ -111,46 +286,37 @@ int main(int argc, char** argv)
          printf("---------------------------------------------------------------------------------------\n");
       }
    }  
-   else if ( setup.mode == MODE_DOWNLOAD )
+   else if ( setup.mode == MODE_DOWNLOAD || setup.mode == MODE_ARCHIVE )
    {
-      GPS_points datapoints;
-      
-      GPS_points_init( &datapoints );
-      
-      if (serial_download( serial_fd, buffer, &datapoints ) != 0)
-      {
-         ERROR("Download failed!\n");
-      }
-      else
-      {
-         printf("---------------------------------------------------------------------------------------\n");
-         printf("  DOWNLOAD DONE: %d datapoints aquired. Saving to file '%s'\n", datapoints.npoints, setup.param_str );
-         printf("---------------------------------------------------------------------------------------\n");
-      }
-      
-      if (!GPS_points_write( &datapoints, setup.param_str ))
-         return 1;
-      
-      GPS_points_free( &datapoints );
+      session_ok = download_run( &setup, serial_fd, buffer, &telemetry );
    }  
-   else if ( setup.mode == MODE_CLEAR )
+   else if ( setup.mode == MODE_VERIFY || setup.mode == MODE_CLEAR )
    {
-      if (serial_clear_datapoints( serial_fd, buffer ) != 0)
+      char manifest_file[ BUFFER_SIZE ];
+      download_manifest_file( &setup, manifest_file, sizeof(manifest_file) );
+      session_ok = verify_device( serial_fd, buffer, manifest_file, setup.param_str,
+                                  setup.verify_archive ? setup.args[2] : NULL, setup.confidence, setup.fraction );
+      if ( !session_ok && setup.clear )
+      {
+         ERROR("Verification failed, device not cleared");
+      }
+      else if ( setup.clear && serial_clear_datapoints( serial_fd, buffer ) != 0 )
       {
          ERROR("CLEAR failed!\n");
+         session_ok = false;
       }
-      else
+      else if ( setup.clear )
       {
-         printf("---------------------------------------------------------------------------------------\n");
          printf("  DEVICE CLEARED \n");
          printf("---------------------------------------------------------------------------------------\n");
       }
    }
-          
+   
+   telemetry_end( telemetry, session_ok );
    serial_reset( serial_fd, buffer ) ;
    close( serial_fd );
    free(buffer),
-   exit(0);
+   exit( session_ok ? 0 : 1 );
 }
 
 
@@ -160,10 +326,142 @@ int main(int argc, char** argv)
 ///-------------------------------------------------------------------------------
 bool get_runmode_etc( int argc, char** argv, Setup* setup)
 {
-   if (argc < 3)
+   if (argc < 3 && !( argc == 2 && strcasecmp( "health", argv[1] ) == 0 ))
       usage();
    
-   setup->device = argv[1];
+   memset( setup, 0, sizeof(Setup) );
+   setup->nargs  = argc - 2;
+   setup->args   = argv + 2;
+   
+   if (strcasecmp("convert", argv[1] ) == 0 )
+   {
+      if ( argc != 4 )
+         usage();
+      
+      setup->mode = MODE_CONVERT;
+      return true;
+   }
+   else if (strcasecmp("index", argv[1] ) == 0 )
+   {
+      if ( argc < 4 )
+         usage();
+      
+      setup->mode = MODE_INDEX;
+      return true;
+   }
+   else if (strcasecmp("query", argv[1] ) == 0 )
+   {
+      // query <index> box|radius <3 or 4 numbers> [<from> <to>]
+      int nvalues = ( argc >= 4 && strcasecmp( argv[3], "radius" ) == 0 ) ? 3 : 4;
+      if ( argc != 4 + nvalues && argc != 6 + nvalues )
+         usage();
+      
+      setup->mode = MODE_SEARCH;
+      return true;
+   }
+   else if (strcasecmp("import", argv[1] ) == 0 )
+   {
+      if ( argc < 5 )
+         usage();
+      
+      setup->mode = MODE_IMPORT;
+      return true;
+   }
+   else if (strcasecmp("extract", argv[1] ) == 0 )
+   {
+      if ( argc != 7 )
+         usage();
+      
+      setup->mode = MODE_EXTRACT;
+      return true;
+   }
+   else if (strcasecmp("stats", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_STATS;
+      return true;
+   }
+   else if (strcasecmp("merge", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_MERGE;
+      return true;
+   }
+   else if (strcasecmp("heatmap", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_HEATMAP;
+      return true;
+   }
+   else if (strcasecmp("pyramid", argv[1] ) == 0 )
+   {
+      if ( argc != 4 )
+         usage();
+      
+      setup->mode = MODE_PYRAMID;
+      return true;
+   }
+   else if (strcasecmp("geofence", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_GEOFENCE;
+      return true;
+   }
+   else if (strcasecmp("tag", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_TAG;
+      return true;
+   }
+   else if (strcasecmp("elevate", argv[1] ) == 0 )
+   {
+      if ( argc != 4 && argc != 5 )
+         usage();
+      
+      setup->mode = MODE_ELEVATE;
+      return true;
+   }
+   else if (strcasecmp("export", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_EXPORT;
+      return true;
+   }
+   else if (strcasecmp("match", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_MATCH;
+      return true;
+   }
+   else if (strcasecmp("resample", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_RESAMPLE;
+      return true;
+   }
+   else if (strcasecmp("join", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_JOIN;
+      return true;
+   }
+   else if (strcasecmp("stays", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_STAYS;
+      return true;
+   }
+   else if (strcasecmp("health", argv[1] ) == 0 )
+   {
+      setup->mode = MODE_HEALTH;
+      return true;
+   }
+   else if (strcasecmp("lod", argv[1] ) == 0 )
+   {
+      // lod <pyramid> <zoom> [4 numbers] <output> [--max-points <n>]
+      int nargs = ( argc >= 3 && strcasecmp( argv[argc-2], "--max-points" ) == 0 ) ? argc - 4 : argc - 2;
+      if ( nargs != 3 && nargs != 7 )
+         usage();
+      
+      setup->mode = MODE_LOD;
+      return true;
+   }
+   
+   setup->device     = argv[1];
+   setup->dwell      = 300;
+   setup->radius     = 1000.0;
+   setup->confidence = 0.99;
+   setup->fraction   = 0.01;
    
    if (strcasecmp("reset", argv[2] ) == 0 )
    {
@@ -192,16 +490,39 @@ bool get_runmode_etc( int argc, char** argv, Setup* setup)
    {
       setup->mode = MODE_DOWNLOAD;
       
-      if ( argc != 4 )
+      if ( argc < 4 || !get_options( argc, argv, 4, setup ) )
+         usage();
+      
+      setup->param_str = argv[3] ;
+   }   
+   else if (strcasecmp("archive", argv[2] ) == 0 )
+   {
+      setup->mode = MODE_ARCHIVE;
+      
+      if ( argc < 5 || !get_options( argc, argv, 5, setup ) )
          usage();
       
       setup->param_str = argv[3] ;
    }   
+   else if (strcasecmp("verify", argv[2] ) == 0 )
+   {
+      setup->mode = MODE_VERIFY;
+      
+      // verify <output> or verify <root> <name>, then options
+      setup->verify_archive = ( argc >= 5 && strncmp( argv[4], "--", 2 ) != 0 );
+      if ( argc < 4 || !get_options( argc, argv, setup->verify_archive ? 5 : 4, setup ) )
+         usage();
+      
+      setup->param_str = argv[3] ;
+   }
    else if (strcasecmp("clear", argv[2] ) == 0 )
    {
-      setup->mode = MODE_CLEAR;
+      setup->mode  = MODE_CLEAR;
+      setup->clear = true;
       
-      if ( argc != 3 )
+      // the device is cleared only after its saved download passes verify, clear takes what verify takes
+      setup->verify_archive = ( argc >= 5 && strncmp( argv[4], "--", 2 ) != 0 );
+      if ( argc < 4 || !get_options( argc, argv, setup->verify_archive ? 5 : 4, setup ) )
          usage();
       
       setup->param_str = argv[3] ;
@@ -212,4 +533,1081 @@ bool get_runmode_etc( int argc, char** argv, Setup* setup)
       return false;
    }
    return true;
-}   
\ No newline at end of file
+}   
+
+///-------------------------------------------------------------------------------
+/// Options given after the mode parameters, from argv[first] on
+///-------------------------------------------------------------------------------
+bool get_options( int argc, char** argv, int first, Setup* setup )
+{
+   int loop;
+   
+   for ( loop = first; loop < argc; loop ++ )
+   {
+      if (strcasecmp("--stats", argv[loop] ) == 0 )
+      {
+         setup->show_stats = true;
+      }
+      else if (strcasecmp("--fence", argv[loop] ) == 0 && loop + 2 < argc )
+      {
+         setup->fence_file  = argv[ ++ loop ];
+         setup->events_file = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--dwell", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->dwell = atol( argv[ ++ loop ] );
+      }
+      else if (strcasecmp("--places", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->places_file = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--radius", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->radius = atof( argv[ ++ loop ] );
+      }
+      else if (strcasecmp("--clear", argv[loop] ) == 0 )
+      {
+         setup->clear = true;
+      }
+      else if (strcasecmp("--dem", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->dem_dir = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--shm", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->feed_name = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--rtree", argv[loop] ) == 0 )
+      {
+         setup->rtree = true;
+      }
+      else if (strcasecmp("--history", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->history_file = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--metrics", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->metrics = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--name", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->name = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--index", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->index_file = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--manifest", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->manifest_file = argv[ ++ loop ];
+      }
+      else if (strcasecmp("--confidence", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->confidence = atof( argv[ ++ loop ] );
+         if ( setup->confidence <= 0.0 || setup->confidence >= 1.0 )
+            return false;
+      }
+      else if (strcasecmp("--fraction", argv[loop] ) == 0 && loop + 1 < argc )
+      {
+         setup->fraction = atof( argv[ ++ loop ] );
+         if ( setup->fraction <= 0.0 || setup->fraction > 1.0 )
+            return false;
+      }
+      else
+      {
+         ERROR("Unknown option: %s", argv[loop] );
+         return false;
+      }
+   }
+   return true;
+}
+
+///-------------------------------------------------------------------------------
+/// Download or archive session: transfer the points, save them and clear the
+/// device if asked. Telemetry of the transfer is ended here. \returns false if
+/// any step failed.
+///-------------------------------------------------------------------------------
+bool download_run( const Setup* setup, int serial_fd, unsigned char* buffer, Telemetry** telemetry )
+{
+   GPS_points datapoints;
+   GPS_arena arena;
+   Download_sinks sinks = { NULL, NULL, NULL, NULL, NULL, NULL };
+   char manifest_file[ BUFFER_SIZE ];
+   bool downloaded = false;
+   bool saved = false;
+   
+   GPS_points_init( &datapoints );
+   GPS_arena_init( &arena, GPS_arena_backing() );
+   
+   if ( setup->fence_file != NULL )
+   {
+      sinks.fences = geofence_load( setup->fence_file );
+      if ( sinks.fences == NULL )
+      {
+         download_abort( &sinks );
+         return false;
+      }
+      sinks.events = fopen( setup->events_file, "wb" );
+      if ( sinks.events == NULL )
+      {
+         ERROR("Cannot open file '%s' for writing: %s", setup->events_file, strerror(errno) );
+         download_abort( &sinks );
+         return false;
+      }
+      fputs( GEOFENCE_CSV_HEADER, sinks.events );
+      sinks.tracker = geofence_tracker_open( sinks.fences, setup->mode == MODE_ARCHIVE ? setup->args[2] : setup->device,
+                                             setup->dwell, geofence_event_print, sinks.events );
+      if ( sinks.tracker == NULL )
+      {
+         download_abort( &sinks );
+         return false;
+      }
+   }
+   
+   // plain download is written while transferring, the disk works during the serial transfer
+   if ( setup->mode == MODE_DOWNLOAD && setup->places_file == NULL && setup->dem_dir == NULL )
+   {
+      sinks.writer = download_writer_open( setup, &saved );
+      if ( sinks.writer == NULL )
+      {
+         download_abort( &sinks );
+         return false;
+      }
+   }
+   
+   if ( setup->feed_name != NULL )
+   {
+      sinks.feed = feed_create( setup->feed_name, setup->mode == MODE_ARCHIVE ? setup->args[2] : setup->device,
+                                DOWNLOAD_FEED_POINTS );
+      if ( sinks.feed == NULL )
+      {
+         download_abort( &sinks );
+         return false;
+      }
+   }
+   
+   download_manifest_file( setup, manifest_file, sizeof(manifest_file) );
+   sinks.manifest = verify_manifest_open( manifest_file );
+   if ( sinks.manifest == NULL )
+   {
+      download_abort( &sinks );
+      return false;
+   }
+   
+   bool transferred = ( serial_download( serial_fd, buffer, &arena, download_sink, &sinks ) == 0 );
+   // readers of the feed see the end of the download right away
+   feed_close( sinks.feed );
+   sinks.feed = NULL;
+   telemetry_end( *telemetry, transferred );
+   *telemetry = NULL;
+   if (!transferred)
+   {
+      ERROR("Download failed!\n");
+   }
+   else if (!GPS_arena_to_points( &arena, &datapoints ))
+   {
+      ERROR("Download failed!\n");
+   }
+   else if ( setup->dem_dir != NULL && !download_elevate( setup->dem_dir, &datapoints ) )
+   {
+      ERROR("Elevation failed!\n");
+   }
+   else
+   {
+      downloaded = true;
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  DOWNLOAD DONE: %d datapoints aquired. Saving to %s '%s'\n", datapoints.npoints,
+             setup->mode == MODE_ARCHIVE ? "archive" : "file", setup->param_str );
+      printf("---------------------------------------------------------------------------------------\n");
+      serial_timing_print();
+      printf("---------------------------------------------------------------------------------------\n");
+      
+      Track_stats stats;
+      if ( setup->show_stats && track_stats( &datapoints, STATS_KERNEL_HAVERSINE, &stats ) )
+      {
+         track_stats_print( &stats );
+         printf("---------------------------------------------------------------------------------------\n");
+      }
+   }
+   
+   if ( sinks.tracker != NULL )
+   {
+      long count = geofence_tracker_close( sinks.tracker );
+      bool ok = ( fclose( sinks.events ) == 0 );
+      geofence_free( sinks.fences );
+      sinks.tracker = NULL;
+      sinks.events  = NULL;
+      sinks.fences  = NULL;
+      if ( !ok )
+      {
+         ERROR("Cannot write file '%s': %s", setup->events_file, strerror(errno) );
+         GPS_points_free( &datapoints );
+         GPS_arena_free( &arena );
+         download_abort( &sinks );
+         return false;
+      }
+      printf("  GEOFENCE: %ld events saved to file '%s'\n", count, setup->events_file );
+      printf("---------------------------------------------------------------------------------------\n");
+   }
+   
+   if ( sinks.writer != NULL && !downloaded )
+   {
+      // a failed download leaves the previous file in place
+      GPS_writer_abort( sinks.writer );
+   }
+   else if ( sinks.writer != NULL )
+   {
+      saved = GPS_writer_close( sinks.writer ) && saved;
+   }
+   else if ( !downloaded )
+   {
+      saved = false;
+   }
+   else if ( setup->mode == MODE_ARCHIVE )
+   {
+      saved = archive_write( setup->param_str, setup->args[2], &datapoints );
+   }
+   else if ( setup->places_file != NULL )
+   {
+      Gazetteer* places = gazetteer_open( setup->places_file );
+      GPS_writer* writer = ( places != NULL ) ? download_writer_open( setup, &saved ) : NULL;
+      if ( writer != NULL )
+      {
+         if ( gazetteer_tag( places, &datapoints, setup->radius, false, writer ) >= 0 )
+            saved = GPS_writer_close( writer );
+         else
+            GPS_writer_abort( writer );
+      }
+      gazetteer_close( places );
+   }
+   else
+   {
+      GPS_writer* writer = download_writer_open( setup, &saved );
+      if ( writer != NULL && GPS_writer_append_points( writer, datapoints.points, datapoints.npoints ) )
+         saved = GPS_writer_close( writer );
+      else if ( writer != NULL )
+         GPS_writer_abort( writer );
+   }
+   sinks.writer = NULL;
+   
+   // the spatial index grows with each download that lands
+   bool indexed = true;
+   if ( saved && setup->index_file != NULL && setup->mode == MODE_DOWNLOAD )
+   {
+      const char* name = setup->param_str;
+      indexed = spatial_index_add( setup->index_file, &name, &datapoints, 1 );
+      if ( !indexed )
+         ERROR("Download not added to index '%s'", setup->index_file );
+   }
+   
+   GPS_points_free( &datapoints );
+   GPS_arena_free( &arena );
+   bool manifested = verify_manifest_close( sinks.manifest, downloaded && saved );
+   if ( !saved || !indexed )
+   {
+      if ( setup->clear )
+         ERROR("Download not saved, device not cleared");
+      return false;
+   }
+   
+   // wiping the device waits for the data to be on disk and to match the device
+   if ( !setup->clear )
+      return manifested;
+   if ( !manifested )
+   {
+      ERROR("Manifest not saved, device not cleared");
+      return false;
+   }
+   if ( !verify_device( serial_fd, buffer, manifest_file, setup->param_str,
+                        setup->mode == MODE_ARCHIVE ? setup->args[2] : NULL, setup->confidence, setup->fraction ) )
+   {
+      ERROR("Verification failed, device not cleared");
+      return false;
+   }
+   if ( serial_clear_datapoints( serial_fd, buffer ) != 0 )
+   {
+      ERROR("CLEAR failed!\n");
+      return false;
+   }
+   printf("  DEVICE CLEARED \n");
+   printf("---------------------------------------------------------------------------------------\n");
+   return true;
+}
+
+///-------------------------------------------------------------------------------
+/// Release the sinks of a download that stopped: the new output is dropped, the
+/// manifest is not recorded, events so far are kept
+///-------------------------------------------------------------------------------
+void download_abort( Download_sinks* sinks )
+{
+   if ( sinks->writer != NULL )
+      GPS_writer_abort( sinks->writer );
+   if ( sinks->manifest != NULL )
+      verify_manifest_close( sinks->manifest, false );
+   if ( sinks->tracker != NULL )
+      geofence_tracker_close( sinks->tracker );
+   if ( sinks->events != NULL )
+      fclose( sinks->events );
+   geofence_free( sinks->fences );
+   feed_close( sinks->feed );
+   memset( sinks, 0, sizeof(Download_sinks) );
+}
+
+///-------------------------------------------------------------------------------
+/// Feed downloaded point to shared memory feed, fence tracker and output file
+///-------------------------------------------------------------------------------
+bool download_sink( const GPS_point* point, void* context )
+{
+   Download_sinks* sinks = (Download_sinks*)context;
+   
+   if ( sinks->feed != NULL )
+      feed_publish( point, sinks->feed );
+   if ( sinks->manifest != NULL && !verify_manifest_add( sinks->manifest, point ) )
+      return false;
+   if ( sinks->tracker != NULL && !geofence_tracker_feed( point, sinks->tracker ) )
+      return false;
+   return sinks->writer == NULL || GPS_writer_append( sinks->writer, point );
+}
+
+///-------------------------------------------------------------------------------
+/// Manifest of the download: given with --manifest, next to the output file or
+/// next to the device directory of the archive
+///-------------------------------------------------------------------------------
+void download_manifest_file( const Setup* setup, char* filename, size_t len )
+{
+   if ( setup->manifest_file != NULL )
+      snprintf( filename, len, "%s", setup->manifest_file );
+   else if ( setup->mode == MODE_ARCHIVE || setup->verify_archive )
+      snprintf( filename, len, "%s/%s.manifest", setup->param_str, setup->args[2] );
+   else
+      snprintf( filename, len, "%s.manifest", setup->param_str );
+}
+
+///-------------------------------------------------------------------------------
+/// Output file of download, 'saved' is set when it is on disk
+///-------------------------------------------------------------------------------
+GPS_writer* download_writer_open( const Setup* setup, bool* saved )
+{
+   GPS_writer* writer = GPS_writer_open( setup->param_str );
+   if ( writer == NULL )
+      return NULL;
+   
+   GPS_writer_notify( writer, download_saved, saved );
+   GPS_writer_session( writer, setup->device, setup->rtree );
+   return writer;
+}
+
+///-------------------------------------------------------------------------------
+/// Replace heights of the device by terrain heights
+///-------------------------------------------------------------------------------
+bool download_elevate( const char* dem_dir, GPS_points* points )
+{
+   Dem* dem = dem_open( dem_dir );
+   if ( dem == NULL )
+      return false;
+   
+   long count = dem_elevate( dem, points->points, points->npoints );
+   dem_close( dem );
+   if ( count >= 0 )
+      printf("  ELEVATION: %ld of %u datapoints given terrain height\n", count, points->npoints );
+   return count >= 0;
+}
+
+///-------------------------------------------------------------------------------
+/// Output of the download is durable, the device may be cleared
+///-------------------------------------------------------------------------------
+void download_saved( const char* filename, bool ok, void* context )
+{
+   *(bool*)context = ok;
+   DEBUG(3, "Output '%s' %s", filename, ok ? "synced to disk" : "failed" );
+}
+
+///-------------------------------------------------------------------------------
+/// Print single query hit, and collect the tracks
+///-------------------------------------------------------------------------------
+void query_print_hit( const char* track, uint32_t track_id, int64_t time, int32_t latitude, int32_t longitude, void* context )
+{
+   Query_result* result = (Query_result*)context;
+   GPS_point point;
+   char lat[16], lon[16];
+   unsigned int loop;
+   
+   GPS_point_set_epoch( &point, time );
+   lat[ GPS_format_microdeg( lat, latitude ) ] = 0x00;
+   lon[ GPS_format_microdeg( lon, longitude ) ] = 0x00;
+   printf("%s, %04d-%02d-%02dT%02d:%02d:%02dZ, %s, %s\n", track, point.time[5], point.time[4], point.time[3], 
+          point.time[2], point.time[1], point.time[0], lat, lon );
+   
+   for ( loop = 0; loop < result->ntracks; loop ++ )
+   {
+      if ( result->tracks[loop].id == track_id )
+         break;
+   }
+   if ( loop == result->ntracks )
+   {
+      void* more = realloc( result->tracks, (result->ntracks + 1) * sizeof(result->tracks[0]) );
+      if ( more == NULL )
+         return;
+      result->tracks = more;
+      result->tracks[loop].name    = strdup( track );
+      result->tracks[loop].id      = track_id;
+      result->tracks[loop].npoints = 0;
+      result->ntracks ++;
+   }
+   result->tracks[loop].npoints ++;
+}
+
+///-------------------------------------------------------------------------------
+/// Modes working on saved files
+///-------------------------------------------------------------------------------
+bool run_offline( Setup* setup )
+{
+   if ( setup->mode == MODE_CONVERT )
+   {
+      GPS_points datapoints;
+      
+      GPS_points_init( &datapoints );
+      if ( !GPS_points_read( &datapoints, setup->args[0] ) )
+         return false;
+      
+      bool ok = GPS_points_write( &datapoints, setup->args[1] );
+      if ( ok )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         printf("  CONVERT DONE: %d datapoints saved to file '%s'\n", datapoints.npoints, setup->args[1] );
+         printf("---------------------------------------------------------------------------------------\n");
+      }
+      GPS_points_free( &datapoints );
+      return ok;
+   }
+   
+   else if ( setup->mode == MODE_INDEX )
+   {
+      int ntracks = setup->nargs - 1;
+      GPS_points* tracks = (GPS_points*)calloc( ntracks, sizeof(GPS_points) );
+      int loop;
+      bool ok = tracks != NULL;
+      unsigned int npoints = 0;
+      
+      for ( loop = 0; ok && loop < ntracks; loop ++ )
+      {
+         ok = GPS_points_read( &tracks[loop], setup->args[ 1 + loop ] );
+         npoints += tracks[loop].npoints;
+      }
+      
+      ok = ok && spatial_index_add( setup->args[0], (const char* const*)setup->args + 1, tracks, ntracks );
+      if ( ok )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         printf("  INDEX DONE: %d tracks, %d datapoints added to '%s'\n", ntracks, npoints, setup->args[0] );
+         printf("---------------------------------------------------------------------------------------\n");
+      }
+      
+      for ( loop = 0; tracks != NULL && loop < ntracks; loop ++ )
+         GPS_points_free( &tracks[loop] );
+      free( tracks );
+      return ok;
+   }
+   else if ( setup->mode == MODE_SEARCH )
+   {
+      Spatial_query query;
+      Query_result result;
+      char** time_args;
+      
+      memset( &query, 0, sizeof(query) );
+      memset( &result, 0, sizeof(result) );
+      query.from = INT64_MIN;
+      query.to   = INT64_MAX;
+      
+      if ( strcasecmp( setup->args[1], "radius" ) == 0 )
+      {
+         if ( !GPS_parse_microdeg( setup->args[2], GPS_LATITUDE_MAX, &query.lat0 ) ||
+              !GPS_parse_microdeg( setup->args[3], GPS_LONGITUDE_MAX, &query.lon0 ) )
+         {
+            ERROR("Invalid coordinates");
+            return false;
+         }
+         query.radius = atof( setup->args[4] );
+         time_args    = setup->args + 5;
+         if ( query.radius <= 0 )
+         {
+            ERROR("Radius must be positive");
+            return false;
+         }
+      }
+      else if ( strcasecmp( setup->args[1], "box" ) == 0 )
+      {
+         if ( !GPS_parse_microdeg( setup->args[2], GPS_LATITUDE_MAX, &query.lat0 ) ||
+              !GPS_parse_microdeg( setup->args[3], GPS_LONGITUDE_MAX, &query.lon0 ) ||
+              !GPS_parse_microdeg( setup->args[4], GPS_LATITUDE_MAX, &query.lat1 ) ||
+              !GPS_parse_microdeg( setup->args[5], GPS_LONGITUDE_MAX, &query.lon1 ) )
+         {
+            ERROR("Invalid coordinates");
+            return false;
+         }
+         time_args  = setup->args + 6;
+         if ( query.lat0 > query.lat1 || query.lon0 > query.lon1 )
+         {
+            ERROR("Bounding box must be given as lower left and upper right corner");
+            return false;
+         }
+      }
+      else
+      {
+         ERROR("Unknown query type: %s", setup->args[1] );
+         return false;
+      }
+      
+      if ( time_args < setup->args + setup->nargs )
+      {
+         if ( !GPS_parse_time( time_args[0], &query.from ) || !GPS_parse_time( time_args[1], &query.to ) )
+            return false;
+      }
+      
+      long found = spatial_index_query( setup->args[0], &query, query_print_hit, &result );
+      if ( found < 0 )
+         return false;
+      
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  QUERY DONE: %ld datapoints found\n", found );
+      for ( unsigned int loop = 0; loop < result.ntracks; loop ++ )
+      {
+         printf("  %8u  %s\n", result.tracks[loop].npoints, result.tracks[loop].name );
+         free( result.tracks[loop].name );
+      }
+      printf("---------------------------------------------------------------------------------------\n");
+      free( result.tracks );
+      return true;
+   }
+   
+   else if ( setup->mode == MODE_IMPORT )
+   {
+      int loop;
+      
+      for ( loop = 2; loop < setup->nargs; loop ++ )
+      {
+         GPS_points datapoints;
+         
+         GPS_points_init( &datapoints );
+         if ( !GPS_points_read( &datapoints, setup->args[loop] ) )
+            return false;
+         
+         bool ok = archive_write( setup->args[0], setup->args[1], &datapoints );
+         printf("  IMPORTED: %d datapoints from '%s'\n", datapoints.npoints, setup->args[loop] );
+         GPS_points_free( &datapoints );
+         if ( !ok )
+            return false;
+      }
+      return true;
+   }
+   else if ( setup->mode == MODE_EXTRACT )
+   {
+      int64_t from, to;
+      
+      if ( !GPS_parse_time( setup->args[2], &from ) || !GPS_parse_time( setup->args[3], &to ) )
+         return false;
+      
+      // date only means whole day
+      if ( strchr( setup->args[3], 'T' ) == NULL )
+         to = to + 86399;
+      
+      GPS_writer* writer = GPS_writer_open( setup->args[4] );
+      if ( writer == NULL )
+         return false;
+      GPS_writer_session( writer, setup->args[1], false );
+      
+      long found = archive_extract( setup->args[0], setup->args[1], from, to, writer );
+      if ( found < 0 )
+      {
+         GPS_writer_abort( writer );
+         return false;
+      }
+      if ( !GPS_writer_close( writer ) )
+         return false;
+      
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  EXTRACT DONE: %ld datapoints saved to file '%s'\n", found, setup->args[4] );
+      printf("---------------------------------------------------------------------------------------\n");
+      return true;
+   }
+   
+   else if ( setup->mode == MODE_STATS )
+   {
+      int kernel = STATS_KERNEL_HAVERSINE;
+      int loop;
+      
+      for ( loop = 0; loop < setup->nargs; loop ++ )
+      {
+         GPS_points datapoints;
+         Track_stats stats;
+         
+         if ( strcasecmp( setup->args[loop], "--flat" ) == 0 )
+         {
+            kernel = STATS_KERNEL_EQUIRECTANGULAR;
+            continue;
+         }
+         
+         GPS_points_init( &datapoints );
+         if ( !GPS_points_read( &datapoints, setup->args[loop] ) )
+            return false;
+         
+         bool ok = track_stats( &datapoints, kernel, &stats );
+         if ( ok )
+         {
+            printf("---------------------------------------------------------------------------------------\n");
+            printf("  TRACK '%s'\n", setup->args[loop] );
+            track_stats_print( &stats );
+            printf("---------------------------------------------------------------------------------------\n");
+         }
+         GPS_points_free( &datapoints );
+         if ( !ok )
+            return false;
+      }
+      return true;
+   }
+   
+   else if ( setup->mode == MODE_MERGE )
+   {
+      Merge_options options;
+      Merge_result result;
+      int loop = 0;
+      
+      options.memory    = 0;
+      options.tolerance = 1.0;
+      for ( ; loop + 1 < setup->nargs && strncmp( setup->args[loop], "--", 2 ) == 0; loop += 2 )
+      {
+         if ( strcasecmp( setup->args[loop], "--memory" ) == 0 )
+            options.memory = (size_t)atol( setup->args[loop+1] ) * 1024 * 1024;
+         else if ( strcasecmp( setup->args[loop], "--tolerance" ) == 0 )
+            options.tolerance = atof( setup->args[loop+1] );
+         else
+         {
+            ERROR("Unknown option: %s", setup->args[loop] );
+            return false;
+         }
+      }
+      if ( setup->nargs - loop < 2 )
+         usage();
+      
+      long written = merge_tracks( setup->args[loop], (const char* const*)setup->args + loop + 1, 
+                                   setup->nargs - loop - 1, &options, &result );
+      if ( written < 0 )
+         return false;
+      
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  MERGE DONE: %ld datapoints saved to file '%s'\n", written, setup->args[loop] );
+      printf("  %ld datapoints read from %d tracks, %ld duplicates dropped, %u sorted runs\n", result.read, 
+             setup->nargs - loop - 1, result.dropped, result.runs );
+      printf("---------------------------------------------------------------------------------------\n");
+      return true;
+   }
+   
+   else if ( setup->mode == MODE_HEATMAP )
+   {
+      Heatmap_options options;
+      int loop = 0;
+      
+      memset( &options, 0, sizeof(options) );
+      options.zoom = -1;
+      while ( loop < setup->nargs && strncmp( setup->args[loop], "--", 2 ) == 0 )
+      {
+         if ( strcasecmp( setup->args[loop], "--zoom" ) == 0 && loop + 1 < setup->nargs )
+         {
+            options.zoom = atoi( setup->args[loop+1] );
+            loop += 2;
+            if ( options.zoom < 0 || options.zoom > 24 )
+            {
+               ERROR("Zoom must be between 0 and 24");
+               return false;
+            }
+         }
+         else if ( strcasecmp( setup->args[loop], "--box" ) == 0 && loop + 4 < setup->nargs )
+         {
+            if ( !GPS_parse_microdeg( setup->args[loop+1], GPS_LATITUDE_MAX, &options.lat0 ) || 
+                 !GPS_parse_microdeg( setup->args[loop+2], GPS_LONGITUDE_MAX, &options.lon0 ) ||
+                 !GPS_parse_microdeg( setup->args[loop+3], GPS_LATITUDE_MAX, &options.lat1 ) || 
+                 !GPS_parse_microdeg( setup->args[loop+4], GPS_LONGITUDE_MAX, &options.lon1 ) )
+            {
+               ERROR("Invalid coordinates");
+               return false;
+            }
+            loop += 5;
+            if ( options.lat0 >= options.lat1 || options.lon0 >= options.lon1 )
+            {
+               ERROR("Bounding box must be given as lower left and upper right corner");
+               return false;
+            }
+         }
+         else
+         {
+            ERROR("Unknown option: %s", setup->args[loop] );
+            return false;
+         }
+      }
+      if ( setup->nargs - loop < 2 )
+         usage();
+      
+      long drawn = heatmap_render( setup->args[loop], (const char* const*)setup->args + loop + 1,
+                                   setup->nargs - loop - 1, &options );
+      if ( drawn < 0 )
+         return false;
+      
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  HEATMAP DONE: %ld datapoints drawn to '%s'\n", drawn, setup->args[loop] );
+      printf("---------------------------------------------------------------------------------------\n");
+      return true;
+   }
+   
+   else if ( setup->mode == MODE_PYRAMID )
+   {
+      GPS_points datapoints;
+      
+      GPS_points_init( &datapoints );
+      if ( !GPS_points_read( &datapoints, setup->args[0] ) )
+         return false;
+      
+      bool ok = pyramid_build( setup->args[1], &datapoints );
+      if ( ok )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         printf("  PYRAMID DONE: %d datapoints saved to file '%s'\n", datapoints.npoints, setup->args[1] );
+         printf("---------------------------------------------------------------------------------------\n");
+      }
+      GPS_points_free( &datapoints );
+      return ok;
+   }
+   else if ( setup->mode == MODE_LOD )
+   {
+      Pyramid_view view;
+      int nargs = setup->nargs;
+      
+      view.max_points = 5000;
+      if ( strcasecmp( setup->args[ nargs - 2 ], "--max-points" ) == 0 )
+      {
+         view.max_points = atoi( setup->args[ nargs - 1 ] );
+         nargs -= 2;
+      }
+      
+      view.zoom = atoi( setup->args[1] );
+      view.lat0 = view.lon0 = INT32_MIN;
+      view.lat1 = view.lon1 = INT32_MAX;
+      if ( nargs == 7 && ( !GPS_parse_microdeg( setup->args[2], GPS_LATITUDE_MAX, &view.lat0 ) || 
+                           !GPS_parse_microdeg( setup->args[3], GPS_LONGITUDE_MAX, &view.lon0 ) ||
+                           !GPS_parse_microdeg( setup->args[4], GPS_LATITUDE_MAX, &view.lat1 ) || 
+                           !GPS_parse_microdeg( setup->args[5], GPS_LONGITUDE_MAX, &view.lon1 ) ) )
+      {
+         ERROR("Invalid coordinates");
+         return false;
+      }
+      
+      const char* output = setup->args[ nargs - 1 ];
+      GPS_writer* writer = GPS_writer_open( output );
+      if ( writer == NULL )
+         return false;
+      
+      long found = pyramid_extract( setup->args[0], &view, writer );
+      if ( found < 0 )
+      {
+         GPS_writer_abort( writer );
+         return false;
+      }
+      if ( !GPS_writer_close( writer ) )
+         return false;
+      
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  LOD DONE: %ld datapoints saved to file '%s'\n", found, output );
+      printf("---------------------------------------------------------------------------------------\n");
+      return true;
+   }
+   
+   else if ( setup->mode == MODE_GEOFENCE )
+   {
+      int64_t dwell = 300;
+      int loop = 0;
+      
+      for ( ; loop + 1 < setup->nargs && strncmp( setup->args[loop], "--", 2 ) == 0; loop += 2 )
+      {
+         if ( strcasecmp( setup->args[loop], "--dwell" ) == 0 )
+            dwell = atol( setup->args[loop+1] );
+         else
+         {
+            ERROR("Unknown option: %s", setup->args[loop] );
+            return false;
+         }
+      }
+      if ( setup->nargs - loop < 3 )
+         usage();
+      
+      Geofence* fences = geofence_load( setup->args[loop] );
+      if ( fences == NULL )
+         return false;
+      
+      long events = geofence_scan( fences, setup->args[loop+1], (const char* const*)setup->args + loop + 2,
+                                   setup->nargs - loop - 2, dwell );
+      if ( events >= 0 )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         printf("  GEOFENCE DONE: %ld events of %u fences saved to file '%s'\n", events, geofence_count( fences ),
+                setup->args[loop+1] );
+         printf("---------------------------------------------------------------------------------------\n");
+      }
+      geofence_free( fences );
+      return events >= 0;
+   }
+   
+   else if ( setup->mode == MODE_TAG )
+   {
+      GPS_points datapoints;
+      double radius = 1000.0;
+      bool ends_only = false;
+      int loop = 0;
+      
+      for ( ; loop < setup->nargs && strncmp( setup->args[loop], "--", 2 ) == 0; loop ++ )
+      {
+         if ( strcasecmp( setup->args[loop], "--radius" ) == 0 && loop + 1 < setup->nargs )
+            radius = atof( setup->args[ ++ loop ] );
+         else if ( strcasecmp( setup->args[loop], "--ends" ) == 0 )
+            ends_only = true;
+         else
+         {
+            ERROR("Unknown option: %s", setup->args[loop] );
+            return false;
+         }
+      }
+      if ( setup->nargs - loop != 3 )
+         usage();
+      
+      Gazetteer* places = gazetteer_open( setup->args[loop] );
+      if ( places == NULL )
+         return false;
+      
+      GPS_points_init( &datapoints );
+      GPS_writer* writer = GPS_points_read( &datapoints, setup->args[loop+1] ) ? GPS_writer_open( setup->args[loop+2] ) 
+                                                                             : NULL;
+      long named = -1;
+      if ( writer != NULL )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         named = gazetteer_tag( places, &datapoints, radius, ends_only, writer );
+         if ( named < 0 )
+            GPS_writer_abort( writer );
+         else if ( !GPS_writer_close( writer ) )
+            named = -1;
+      }
+      if ( named >= 0 )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         printf("  TAG DONE: %ld of %u datapoints named from %u places, saved to file '%s'\n", named, 
+                datapoints.npoints, gazetteer_count( places ), setup->args[loop+2] );
+         printf("---------------------------------------------------------------------------------------\n");
+      }
+      GPS_points_free( &datapoints );
+      gazetteer_close( places );
+      return named >= 0;
+   }
+   
+   else if ( setup->mode == MODE_ELEVATE )
+   {
+      GPS_points datapoints;
+      long count = -1;
+      
+      Dem* dem = dem_open( setup->args[0] );
+      if ( dem == NULL )
+         return false;
+      
+      GPS_points_init( &datapoints );
+      if ( setup->nargs == 2 )
+         count = dem_elevate_tree( dem, setup->args[1] );
+      else if ( GPS_points_read( &datapoints, setup->args[1] ) )
+      {
+         count = dem_elevate( dem, datapoints.points, datapoints.npoints );
+         if ( count >= 0 && !GPS_points_write( &datapoints, setup->args[2] ) )
+            count = -1;
+      }
+      if ( count >= 0 )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         printf("  ELEVATE DONE: %ld datapoints given terrain height, saved to %s '%s'\n", count,
+                setup->nargs == 2 ? "archive" : "file", setup->args[ setup->nargs - 1 ] );
+         printf("---------------------------------------------------------------------------------------\n");
+      }
+      GPS_points_free( &datapoints );
+      dem_close( dem );
+      return count >= 0;
+   }
+   
+   else if ( setup->mode == MODE_EXPORT )
+   {
+      bool rtree = ( setup->nargs > 0 && strcasecmp( setup->args[0], "--rtree" ) == 0 );
+      int first = rtree ? 1 : 0;
+      if ( setup->nargs - first < 2 )
+         usage();
+      
+      long count = database_export( setup->args[first], (const char* const*)setup->args + first + 1,
+                                    setup->nargs - first - 1, rtree );
+      if ( count < 0 )
+         return false;
+      
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  EXPORT DONE: %ld datapoints saved to database '%s'\n", count, setup->args[first] );
+      printf("---------------------------------------------------------------------------------------\n");
+      return true;
+   }
+   
+   else if ( setup->mode == MODE_MATCH )
+   {
+      GPS_points datapoints;
+      double radius = 50.0;
+      int loop = 0;
+      
+      for ( ; loop < setup->nargs && strncmp( setup->args[loop], "--", 2 ) == 0; loop ++ )
+      {
+         if ( strcasecmp( setup->args[loop], "--radius" ) == 0 && loop + 1 < setup->nargs )
+            radius = atof( setup->args[ ++ loop ] );
+         else
+         {
+            ERROR("Unknown option: %s", setup->args[loop] );
+            return false;
+         }
+      }
+      if ( setup->nargs - loop != 3 && setup->nargs - loop != 4 )
+         usage();
+      const char* edges_file = ( setup->nargs - loop == 4 ) ? setup->args[loop+3] : NULL;
+      
+      Roads* roads = roads_open( setup->args[loop] );
+      if ( roads == NULL )
+         return false;
+      
+      GPS_points_init( &datapoints );
+      GPS_writer* writer = GPS_points_read( &datapoints, setup->args[loop+1] ) ? GPS_writer_open( setup->args[loop+2] )
+                                                                             : NULL;
+      long matched = -1;
+      if ( writer != NULL )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         matched = roads_match( roads, &datapoints, radius, writer, edges_file );
+         if ( matched < 0 )
+            GPS_writer_abort( writer );
+         else if ( !GPS_writer_close( writer ) )
+            matched = -1;
+      }
+      if ( matched >= 0 )
+      {
+         printf("---------------------------------------------------------------------------------------\n");
+         printf("  MATCH DONE: %ld of %u datapoints matched to %u road segments, saved to file '%s'\n", matched,
+                datapoints.npoints, roads_count( roads ), setup->args[loop+2] );
+         printf("---------------------------------------------------------------------------------------\n");
+      }
+      GPS_points_free( &datapoints );
+      roads_close( roads );
+      return matched >= 0;
+   }
+   
+   else if ( setup->mode == MODE_RESAMPLE || setup->mode == MODE_JOIN )
+   {
+      Resample_options options;
+      int loop = 0;
+      
+      options.step    = 1;
+      options.max_gap = 60;
+      for ( ; loop + 1 < setup->nargs && strncmp( setup->args[loop], "--", 2 ) == 0; loop += 2 )
+      {
+         if ( strcasecmp( setup->args[loop], "--step" ) == 0 )
+            options.step = atol( setup->args[loop+1] );
+         else if ( strcasecmp( setup->args[loop], "--max-gap" ) == 0 )
+            options.max_gap = atol( setup->args[loop+1] );
+         else
+         {
+            ERROR("Unknown option: %s", setup->args[loop] );
+            return false;
+         }
+      }
+      
+      if ( setup->mode == MODE_JOIN )
+      {
+         if ( setup->nargs - loop < 2 )
+            usage();
+         long rows = resample_join( setup->args[loop], (const char* const*)setup->args + loop + 1,
+                                    setup->nargs - loop - 1, &options );
+         if ( rows < 0 )
+            return false;
+         
+         printf("---------------------------------------------------------------------------------------\n");
+         printf("  JOIN DONE: %ld rows of %d tracks saved to file '%s'\n", rows, setup->nargs - loop - 1,
+                setup->args[loop] );
+         printf("---------------------------------------------------------------------------------------\n");
+         return true;
+      }
+      
+      if ( setup->nargs - loop != 2 )
+         usage();
+      GPS_writer* writer = GPS_writer_open( setup->args[loop+1] );
+      if ( writer == NULL )
+         return false;
+      long count = resample_track( setup->args[loop], &options, writer );
+      if ( count < 0 )
+      {
+         GPS_writer_abort( writer );
+         return false;
+      }
+      if ( !GPS_writer_close( writer ) )
+         return false;
+      
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  RESAMPLE DONE: %ld datapoints every %lld s saved to file '%s'\n", count, (long long)options.step,
+             setup->args[loop+1] );
+      printf("---------------------------------------------------------------------------------------\n");
+      return true;
+   }
+   
+   else if ( setup->mode == MODE_STAYS )
+   {
+      Stays_options options;
+      long nstays = 0;
+      int loop = 0;
+      
+      options.distance   = 100.0;
+      options.duration   = 300;
+      options.eps        = 50.0;
+      options.min_visits = 2;
+      for ( ; loop + 1 < setup->nargs && strncmp( setup->args[loop], "--", 2 ) == 0; loop += 2 )
+      {
+         if ( strcasecmp( setup->args[loop], "--distance" ) == 0 )
+            options.distance = atof( setup->args[loop+1] );
+         else if ( strcasecmp( setup->args[loop], "--duration" ) == 0 )
+            options.duration = atol( setup->args[loop+1] );
+         else if ( strcasecmp( setup->args[loop], "--eps" ) == 0 )
+            options.eps = atof( setup->args[loop+1] );
+         else if ( strcasecmp( setup->args[loop], "--min-visits" ) == 0 )
+            options.min_visits = atoi( setup->args[loop+1] );
+         else
+         {
+            ERROR("Unknown option: %s", setup->args[loop] );
+            return false;
+         }
+      }
+      if ( setup->nargs - loop < 3 || options.eps <= 0 )
+         usage();
+      
+      long places = stays_scan( setup->args[loop], setup->args[loop+1], (const char* const*)setup->args + loop + 2,
+                                setup->nargs - loop - 2, &options, &nstays );
+      if ( places < 0 )
+         return false;
+      
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  STAYS DONE: %ld stays at %ld recurring places, saved to files '%s' and '%s'\n", nstays, places,
+             setup->args[loop], setup->args[loop+1] );
+      printf("---------------------------------------------------------------------------------------\n");
+      return true;
+   }
+   else if ( setup->mode == MODE_HEALTH )
+   {
+      if ( setup->nargs != 0 && ( setup->nargs != 2 || strcasecmp( setup->args[0], "--history" ) != 0 ) )
+         usage();
+      
+      return telemetry_health( setup->nargs == 2 ? setup->args[1] : NULL ) >= 0;
+   }
+   
+   ERROR("Unkown mode: %d ", setup->mode );
+   return false;
+}
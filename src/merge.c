@@ -0,0 +1,408 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include <unistd.h>
+
+#define MODULE_NAME "merge"
+
+/// Tracks are merged with an external sort:
+///   - input points are read in chunks to a buffer of the memory budget
+///   - a full buffer is sorted by time and position, duplicates dropped, and spilled as run '<output>.run<N>.gts'
+///   - runs are k-way merged to the output, in several passes if there are more than the budget allows at once
+/// When all points fit in the budget nothing is spilled and the sorted buffer is written straight to output.
+
+/// Default memory budget, bytes
+#define MERGE_MEMORY     (256*1024*1024)
+/// Most runs merged at once
+#define MERGE_MAX_FANIN  64
+/// Points of same second kept for near duplicate checks
+#define MERGE_RECENT     8
+
+typedef struct
+{
+   int64_t  time;
+   int32_t  latitude;
+   int32_t  longitude;
+   uint32_t index;
+} Merge_key;
+
+/// Position in a sorted run being merged
+typedef struct
+{
+   Track_reader* reader;
+   unsigned int  block;
+   GPS_point*    points;
+   int           count;
+   int           pos;
+   Merge_key     key;
+} Merge_cursor;
+
+/// Sorted output with duplicate removal
+typedef struct
+{
+   GPS_writer*  writer;
+   double       tolerance;
+   GPS_point    recent[ MERGE_RECENT ];
+   unsigned int nrecent;
+   int64_t      recent_time;
+   long         written;
+   long         dropped;
+} Merge_output;
+
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+static inline int merge_key_compare( const Merge_key* a, const Merge_key* b )
+{
+   if ( a->time != b->time )
+      return a->time < b->time ? -1 : 1;
+   if ( a->latitude != b->latitude )
+      return a->latitude < b->latitude ? -1 : 1;
+   if ( a->longitude != b->longitude )
+      return a->longitude < b->longitude ? -1 : 1;
+   return 0;
+}
+
+static int merge_key_qsort( const void* a, const void* b )
+{
+   return merge_key_compare( (const Merge_key*)a, (const Merge_key*)b );
+}
+
+static inline void merge_key_of( const GPS_point* point, uint32_t index, Merge_key* key )
+{
+   key->time      = GPS_point_epoch( point );
+   key->latitude  = point->latitude;
+   key->longitude = point->longitude;
+   key->index     = index;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Output of points in sorted order. Point is a duplicate when a point of the same second already written is
+/// within the tolerance, with zero tolerance only exact duplicates are dropped.
+///--------------------------------------------------------------------------------------------------------------------
+static bool merge_output_open( Merge_output* output, const char* filename, double tolerance )
+{
+   memset( output, 0, sizeof(Merge_output) );
+   output->tolerance = tolerance;
+   output->writer    = GPS_writer_open( filename );
+   return output->writer != NULL;
+}
+
+static bool merge_is_duplicate( const Merge_output* output, const GPS_point* point )
+{
+   unsigned int loop;
+   unsigned int count = output->nrecent < MERGE_RECENT ? output->nrecent : MERGE_RECENT;
+
+   for ( loop = 0; loop < count; loop ++ )
+   {
+      const GPS_point* recent = &output->recent[loop];
+      if ( recent->latitude == point->latitude && recent->longitude == point->longitude )
+         return true;
+      if ( output->tolerance > 0 )
+      {
+         double dy = ( (int64_t)point->latitude - recent->latitude ) * MICRODEG_METERS;
+         double dx = ( (int64_t)point->longitude - recent->longitude ) * MICRODEG_METERS *
+                     cos( point->latitude * MICRODEG_TO_RAD );
+         if ( dx*dx + dy*dy <= output->tolerance * output->tolerance )
+            return true;
+      }
+   }
+   return false;
+}
+
+static bool merge_output_append( Merge_output* output, const GPS_point* point, int64_t time )
+{
+   if ( output->nrecent > 0 && time == output->recent_time )
+   {
+      if ( merge_is_duplicate( output, point ) )
+      {
+         output->dropped ++;
+         return true;
+      }
+   }
+   else
+   {
+      output->nrecent     = 0;
+      output->recent_time = time;
+   }
+   output->recent[ output->nrecent ++ % MERGE_RECENT ] = *point;
+
+   output->written ++;
+   return GPS_writer_append( output->writer, point );
+}
+
+/// Keep the file when all points were written, drop it otherwise
+static bool merge_output_close( Merge_output* output, bool ok )
+{
+   if ( ok )
+      return GPS_writer_close( output->writer );
+   GPS_writer_abort( output->writer );
+   return false;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Sort the buffered points and write them to file, \returns false on failure
+///--------------------------------------------------------------------------------------------------------------------
+static bool merge_spill( const GPS_points* buffer, Merge_key* keys, const char* filename, double tolerance, long* dropped )
+{
+   Merge_output output;
+   unsigned int loop;
+   bool ok = true;
+
+   for ( loop = 0; loop < buffer->npoints; loop ++ )
+      merge_key_of( &buffer->points[loop], loop, &keys[loop] );
+   qsort( keys, buffer->npoints, sizeof(Merge_key), merge_key_qsort );
+
+   if ( !merge_output_open( &output, filename, tolerance ) )
+      return false;
+   for ( loop = 0; ok && loop < buffer->npoints; loop ++ )
+      ok = merge_output_append( &output, &buffer->points[ keys[loop].index ], keys[loop].time );
+
+   *dropped += output.dropped;
+   DEBUG(3, "%u points sorted to '%s', %ld duplicates", buffer->npoints, filename, output.dropped );
+   return merge_output_close( &output, ok );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// K-way merge of sorted runs
+///--------------------------------------------------------------------------------------------------------------------
+/// Move cursor to next point, \returns false at end of run or on failure
+static bool merge_cursor_next( Merge_cursor* cursor, bool* failed )
+{
+   if ( ++ cursor->pos >= cursor->count )
+   {
+      if ( cursor->block >= track_reader_nblocks( cursor->reader ) )
+         return false;
+      cursor->count = track_reader_block( cursor->reader, cursor->block ++, cursor->points );
+      cursor->pos   = 0;
+      if ( cursor->count <= 0 )
+      {
+         *failed = cursor->count < 0;
+         return false;
+      }
+   }
+   merge_key_of( &cursor->points[ cursor->pos ], 0, &cursor->key );
+   return true;
+}
+
+static void merge_heap_down( Merge_cursor** heap, unsigned int size, unsigned int index )
+{
+   while ( true )
+   {
+      unsigned int child = index * 2 + 1;
+      if ( child >= size )
+         break;
+      if ( child + 1 < size && merge_key_compare( &heap[child+1]->key, &heap[child]->key ) < 0 )
+         child ++;
+      if ( merge_key_compare( &heap[index]->key, &heap[child]->key ) <= 0 )
+         break;
+
+      Merge_cursor* swap = heap[index];
+      heap[index] = heap[child];
+      heap[child] = swap;
+      index = child;
+   }
+}
+
+static bool merge_runs( char* const* runs, unsigned int nruns, const char* filename, double tolerance, long* written,
+                        long* dropped )
+{
+   Merge_cursor*  cursors = (Merge_cursor*)calloc( nruns, sizeof(Merge_cursor) );
+   Merge_cursor** heap    = (Merge_cursor**)calloc( nruns, sizeof(Merge_cursor*) );
+   Merge_output output;
+   unsigned int loop, size = 0;
+   bool failed = ( cursors == NULL || heap == NULL );
+
+   if ( failed )
+      ERROR("Out of memory!");
+
+   for ( loop = 0; !failed && loop < nruns; loop ++ )
+   {
+      Merge_cursor* cursor = &cursors[loop];
+      cursor->reader = track_reader_open( runs[loop] );
+      cursor->points = (GPS_point*)malloc( TRACK_BLOCK_POINTS * sizeof(GPS_point) );
+      cursor->pos    = -1;
+      if ( cursor->reader == NULL || cursor->points == NULL )
+      {
+         failed = true;
+         break;
+      }
+      if ( merge_cursor_next( cursor, &failed ) )
+         heap[ size ++ ] = cursor;
+   }
+   for ( loop = size; loop > 0; loop -- )
+      merge_heap_down( heap, size, loop - 1 );
+
+   if ( !failed && merge_output_open( &output, filename, tolerance ) )
+   {
+      while ( size > 0 && !failed )
+      {
+         Merge_cursor* cursor = heap[0];
+         if ( !merge_output_append( &output, &cursor->points[ cursor->pos ], cursor->key.time ) )
+            failed = true;
+         if ( !merge_cursor_next( cursor, &failed ) )
+            heap[0] = heap[ -- size ];
+         merge_heap_down( heap, size, 0 );
+      }
+      *written  = output.written;
+      *dropped += output.dropped;
+      failed = !merge_output_close( &output, !failed );
+   }
+   else
+   {
+      failed = true;
+   }
+
+   for ( loop = 0; cursors != NULL && loop < nruns; loop ++ )
+   {
+      if ( cursors[loop].reader != NULL )
+         track_reader_close( cursors[loop].reader );
+      free( cursors[loop].points );
+   }
+   free( cursors );
+   free( heap );
+   return !failed;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Run files
+///--------------------------------------------------------------------------------------------------------------------
+/// Add name of next run file to the list, \returns the name or NULL on failure
+static const char* merge_run_add( char*** runs, unsigned int* nruns, const char* output )
+{
+   char name[ BUFFER_SIZE ];
+   char** more = (char**)realloc( *runs, ( *nruns + 1 ) * sizeof(char*) );
+   if ( more == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+   *runs = more;
+
+   snprintf( name, sizeof(name), "%s.run%u.gts", output, *nruns );
+   if ( (more[ *nruns ] = strdup( name )) == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+   return more[ (*nruns) ++ ];
+}
+
+static void merge_runs_free( char** runs, unsigned int first, unsigned int last )
+{
+   unsigned int loop;
+   for ( loop = first; loop < last; loop ++ )
+   {
+      unlink( runs[loop] );
+      free( runs[loop] );
+      runs[loop] = NULL;
+   }
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Merge tracks by time to one output, dropping duplicate points
+/// \returns number of points written or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long merge_tracks( const char* output, const char* const* inputs, int ninputs, const Merge_options* options,
+                   Merge_result* result )
+{
+   size_t memory = options->memory > 0 ? options->memory : MERGE_MEMORY;
+   size_t capacity = memory / ( sizeof(GPS_point) + sizeof(Merge_key) );
+   unsigned int fanin = memory / ( TRACK_BLOCK_POINTS * sizeof(GPS_point) );
+   GPS_points buffer;
+   Merge_key* keys;
+   char** runs = NULL;
+   const char* run;
+   unsigned int nruns = 0, first = 0;
+   bool ok = true;
+   int loop;
+
+   capacity = capacity < TRACK_BLOCK_POINTS ? TRACK_BLOCK_POINTS : capacity > UINT32_MAX ? UINT32_MAX : capacity;
+   fanin    = fanin < 2 ? 2 : fanin > MERGE_MAX_FANIN ? MERGE_MAX_FANIN : fanin;
+   memset( result, 0, sizeof(Merge_result) );
+
+   GPS_points_init( &buffer );
+   buffer.points = (GPS_point*)malloc( capacity * sizeof(GPS_point) );
+   keys          = (Merge_key*)malloc( capacity * sizeof(Merge_key) );
+   if ( buffer.points == NULL || keys == NULL )
+   {
+      ERROR("Out of memory!");
+      free( keys );
+      GPS_points_free( &buffer );
+      return -1;
+   }
+
+   // read all inputs, spilling sorted runs whenever the buffer is full
+   for ( loop = 0; ok && loop < ninputs; loop ++ )
+   {
+      GPS_reader* reader = GPS_reader_open( inputs[loop] );
+      int count = 0;
+      if ( reader == NULL )
+      {
+         ok = false;
+         break;
+      }
+
+      while ( ok && (count = GPS_reader_read( reader, buffer.points + buffer.npoints, capacity - buffer.npoints )) > 0 )
+      {
+         buffer.npoints += count;
+         result->read   += count;
+         if ( buffer.npoints < capacity )
+            continue;
+
+         run = merge_run_add( &runs, &nruns, output );
+         ok  = run != NULL && merge_spill( &buffer, keys, run, options->tolerance, &result->dropped );
+         buffer.npoints = 0;
+      }
+      GPS_reader_close( reader );
+      ok = ok && count == 0;
+   }
+
+   // everything fits in memory
+   if ( ok && nruns == 0 )
+   {
+      ok = merge_spill( &buffer, keys, output, options->tolerance, &result->dropped );
+      result->written = result->read - result->dropped;
+   }
+   else if ( ok && buffer.npoints > 0 )
+   {
+      run = merge_run_add( &runs, &nruns, output );
+      ok  = run != NULL && merge_spill( &buffer, keys, run, options->tolerance, &result->dropped );
+   }
+   free( keys );
+   GPS_points_free( &buffer );
+   result->runs = nruns;
+
+   // merge passes until the rest can be merged at once
+   while ( ok && nruns - first > fanin )
+   {
+      long written = 0;
+      run = merge_run_add( &runs, &nruns, output );
+      if ( run == NULL )
+      {
+         ok = false;
+         break;
+      }
+
+      DEBUG(3, "merging runs %u .. %u to '%s'", first, first + fanin - 1, run );
+      ok = merge_runs( runs + first, fanin, run, options->tolerance, &written, &result->dropped );
+      merge_runs_free( runs, first, first + fanin );
+      first += fanin;
+   }
+
+   if ( ok && nruns > first )
+   {
+      DEBUG(3, "merging %u runs to '%s'", nruns - first, output );
+      ok = merge_runs( runs + first, nruns - first, output, options->tolerance, &result->written, &result->dropped );
+   }
+
+   merge_runs_free( runs, first, nruns );
+   free( runs );
+   if ( !ok )
+      ERROR("Merge to '%s' failed", output );
+   return ok ? result->written : -1;
+}
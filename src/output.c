@@ -0,0 +1,773 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define MODULE_NAME "output"
+
+/// Output is copied to large aligned buffers. A full buffer is handed to the kernel through io_uring, or to a
+/// writer thread when io_uring is not available, and the caller goes on filling the next one, so the disk works
+/// while the data is being downloaded and formatted. New files are written under a temporary name that is synced
+/// and renamed over the target only when everything is on disk: the target is either the old file or the complete
+/// new one, and output_close returning true means the data survives a crash.
+///
+/// GEOTECH_IO=thread selects the writer thread also when io_uring is available.
+///
+/// Files named .gz or .zst are compressed on the way. The data is cut to blocks that are compressed independently
+/// on the workers, a batch at a time, and written in order: each block is a gzip member or a zstd frame, and their
+/// concatenation is a valid stream for the usual tools.
+
+#define OUTPUT_BUFFER_SIZE  ((size_t)1024*1024)
+#define OUTPUT_BUFFERS      4
+#define OUTPUT_ALIGN        4096
+
+#define OUTPUT_BLOCK_SIZE   ((size_t)1024*1024)
+#define OUTPUT_GZIP_LEVEL   6
+#define OUTPUT_ZSTD_LEVEL   3
+
+typedef struct
+{
+   unsigned char* data;
+   size_t   len;       // bytes in the buffer
+   size_t   done;      // bytes already written
+   uint64_t offset;    // file offset of data[0]
+   bool     busy;      // submitted and not yet written
+} Output_buffer;
+
+/// Block of compressed output
+typedef struct
+{
+   unsigned char* data;
+   size_t len;
+   unsigned char* packed;
+   size_t packed_len;     // zero if compression failed
+} Output_block;
+
+#ifdef HAVE_IO_URING
+typedef struct
+{
+   int fd;
+   unsigned int* sq_tail;
+   unsigned int* sq_mask;
+   unsigned int* sq_array;
+   unsigned int* cq_head;
+   unsigned int* cq_tail;
+   unsigned int* cq_mask;
+   struct io_uring_sqe* sqes;
+   struct io_uring_cqe* cqes;
+
+   void*  sq_ring;
+   size_t sq_size;
+   void*  cq_ring;     // same as sq_ring when the kernel maps both at once
+   size_t cq_size;
+   size_t sqes_size;
+} Output_ring;
+#endif
+
+struct Output
+{
+   int   fd;
+   char* filename;
+   char* tmpname;      // written under this name and renamed at close, NULL when writing in place
+   bool  regular;      // only regular files are synced
+
+   Output_buffer buffers[ OUTPUT_BUFFERS ];
+   unsigned int  current;
+   uint64_t      offset;   // file offset of the current buffer
+   int           error;    // errno of the first failure, read and written atomically
+
+   // compression, blocks are filled in order and compressed when all are full
+   int           codec;
+   Output_block* blocks;
+   unsigned int  nblocks;
+   unsigned int  filled;
+   size_t        packed_size;
+
+#ifdef HAVE_IO_URING
+   Output_ring* ring;
+#endif
+
+   // writer thread, used when there is no ring
+   bool            threaded;
+   pthread_t       thread;
+   pthread_mutex_t lock;
+   pthread_cond_t  cond;
+   unsigned int    queue[ OUTPUT_BUFFERS ];
+   unsigned int    queue_head;
+   unsigned int    queue_count;
+   bool            stop;
+};
+
+static void output_fail( Output* output, int error )
+{
+   int none = 0;
+   if ( __atomic_compare_exchange_n( &output->error, &none, error, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST ) )
+      ERROR("Cannot write file '%s': %s", output->filename, strerror(error) );
+}
+
+static bool output_failed( Output* output )
+{
+   return __atomic_load_n( &output->error, __ATOMIC_SEQ_CST ) != 0;
+}
+
+/// Write rest of the buffer, false on failure
+static bool output_pwrite( Output* output, Output_buffer* buffer )
+{
+   while ( buffer->done < buffer->len )
+   {
+      ssize_t written = pwrite( output->fd, buffer->data + buffer->done, buffer->len - buffer->done,
+                                buffer->offset + buffer->done );
+      if ( written < 0 && errno == EINTR )
+         continue;
+      if ( written <= 0 )
+      {
+         output_fail( output, written < 0 ? errno : ENOSPC );
+         return false;
+      }
+      buffer->done += written;
+   }
+   return true;
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// IO_URING
+///--------------------------------------------------------------------------------------------------------------------
+#ifdef HAVE_IO_URING
+static void output_ring_free( Output_ring* ring )
+{
+   if ( ring->sqes != NULL )
+      munmap( ring->sqes, ring->sqes_size );
+   if ( ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring )
+      munmap( ring->cq_ring, ring->cq_size );
+   if ( ring->sq_ring != NULL )
+      munmap( ring->sq_ring, ring->sq_size );
+   close( ring->fd );
+   free( ring );
+}
+
+/// Ring of OUTPUT_BUFFERS entries, NULL if the kernel cannot do io_uring writes
+static Output_ring* output_ring_open( void )
+{
+   struct io_uring_params params;
+   Output_ring* ring;
+
+   memset( &params, 0, sizeof(params) );
+   int fd = syscall( __NR_io_uring_setup, OUTPUT_BUFFERS, &params );
+   if ( fd < 0 )
+   {
+      DEBUG(3, "io_uring not available: %s", strerror(errno) );
+      return NULL;
+   }
+   // plain writes came with the same kernel release as this feature
+   ring = ( params.features & IORING_FEAT_RW_CUR_POS ) ? (Output_ring*)calloc( 1, sizeof(Output_ring) ) : NULL;
+   if ( ring == NULL )
+   {
+      close( fd );
+      return NULL;
+   }
+   ring->fd        = fd;
+   ring->sq_size   = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+   ring->cq_size   = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+   ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+   if ( params.features & IORING_FEAT_SINGLE_MMAP )
+      ring->sq_size = ring->cq_size = ( ring->sq_size > ring->cq_size ) ? ring->sq_size : ring->cq_size;
+
+   ring->sq_ring = mmap( NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING );
+   if ( ring->sq_ring == MAP_FAILED )
+      ring->sq_ring = NULL;
+   else if ( params.features & IORING_FEAT_SINGLE_MMAP )
+      ring->cq_ring = ring->sq_ring;
+   else
+   {
+      ring->cq_ring = mmap( NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                            IORING_OFF_CQ_RING );
+      ring->cq_ring = ( ring->cq_ring == MAP_FAILED ) ? NULL : ring->cq_ring;
+   }
+   ring->sqes = (struct io_uring_sqe*)mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            fd, IORING_OFF_SQES );
+   ring->sqes = ( (void*)ring->sqes == MAP_FAILED ) ? NULL : ring->sqes;
+   if ( ring->sq_ring == NULL || ring->cq_ring == NULL || ring->sqes == NULL )
+   {
+      DEBUG(3, "Cannot map io_uring: %s", strerror(errno) );
+      output_ring_free( ring );
+      return NULL;
+   }
+
+   unsigned char* sq = (unsigned char*)ring->sq_ring;
+   unsigned char* cq = (unsigned char*)ring->cq_ring;
+   ring->sq_tail  = (unsigned int*)( sq + params.sq_off.tail );
+   ring->sq_mask  = (unsigned int*)( sq + params.sq_off.ring_mask );
+   ring->sq_array = (unsigned int*)( sq + params.sq_off.array );
+   ring->cq_head  = (unsigned int*)( cq + params.cq_off.head );
+   ring->cq_tail  = (unsigned int*)( cq + params.cq_off.tail );
+   ring->cq_mask  = (unsigned int*)( cq + params.cq_off.ring_mask );
+   ring->cqes     = (struct io_uring_cqe*)( cq + params.cq_off.cqes );
+   return ring;
+}
+
+static int output_ring_enter( Output_ring* ring, unsigned int submit, unsigned int wait )
+{
+   int ret;
+   do
+   {
+      ret = syscall( __NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+   }
+   while ( ret < 0 && errno == EINTR );
+   return ret;
+}
+
+/// Queue write of the rest of the buffer. Only OUTPUT_BUFFERS writes are in flight, the rings never overflow.
+static void output_ring_submit( Output* output, unsigned int index )
+{
+   Output_ring* ring = output->ring;
+   Output_buffer* buffer = &output->buffers[index];
+   unsigned int tail = *ring->sq_tail;
+   unsigned int slot = tail & *ring->sq_mask;
+   struct io_uring_sqe* sqe = &ring->sqes[slot];
+
+   memset( sqe, 0, sizeof(struct io_uring_sqe) );
+   sqe->opcode    = IORING_OP_WRITE;
+   sqe->fd        = output->fd;
+   sqe->addr      = (uint64_t)(uintptr_t)( buffer->data + buffer->done );
+   sqe->len       = buffer->len - buffer->done;
+   sqe->off       = buffer->offset + buffer->done;
+   sqe->user_data = index;
+   ring->sq_array[slot] = slot;
+   __atomic_store_n( ring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+   if ( output_ring_enter( ring, 1, 0 ) < 0 )
+   {
+      // nothing more is submitted after a failure, the queued entry is dropped with the ring
+      output_fail( output, errno );
+      buffer->busy = false;
+   }
+}
+
+/// Handle completed writes, waiting for at least one
+static void output_ring_reap( Output* output )
+{
+   Output_ring* ring = output->ring;
+
+   if ( output_ring_enter( ring, 0, 1 ) < 0 )
+   {
+      unsigned int loop;
+      output_fail( output, errno );
+      for ( loop = 0; loop < OUTPUT_BUFFERS; loop ++ )
+         output->buffers[loop].busy = false;
+      return;
+   }
+
+   unsigned int head = *ring->cq_head;
+   unsigned int tail = __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE );
+   for ( ; head != tail; head ++ )
+   {
+      const struct io_uring_cqe* cqe = &ring->cqes[ head & *ring->cq_mask ];
+      Output_buffer* buffer = &output->buffers[ cqe->user_data ];
+      if ( cqe->res <= 0 )
+      {
+         output_fail( output, cqe->res < 0 ? -cqe->res : ENOSPC );
+         buffer->busy = false;
+         continue;
+      }
+      buffer->done += cqe->res;
+      if ( buffer->done < buffer->len )
+         output_ring_submit( output, cqe->user_data );
+      else
+         buffer->busy = false;
+   }
+   __atomic_store_n( ring->cq_head, head, __ATOMIC_RELEASE );
+}
+#endif
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// WRITER THREAD
+///--------------------------------------------------------------------------------------------------------------------
+static void* output_thread( void* context )
+{
+   Output* output = (Output*)context;
+
+   pthread_mutex_lock( &output->lock );
+   while ( true )
+   {
+      while ( output->queue_count == 0 && !output->stop )
+         pthread_cond_wait( &output->cond, &output->lock );
+      if ( output->queue_count == 0 )
+         break;
+
+      Output_buffer* buffer = &output->buffers[ output->queue[ output->queue_head ] ];
+      pthread_mutex_unlock( &output->lock );
+
+      if ( !output_failed( output ) )
+         output_pwrite( output, buffer );
+
+      pthread_mutex_lock( &output->lock );
+      buffer->busy = false;
+      output->queue_head = ( output->queue_head + 1 ) % OUTPUT_BUFFERS;
+      output->queue_count --;
+      pthread_cond_broadcast( &output->cond );
+   }
+   pthread_mutex_unlock( &output->lock );
+   return NULL;
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+static void output_submit( Output* output, unsigned int index )
+{
+   Output_buffer* buffer = &output->buffers[index];
+
+   if ( output_failed( output ) )
+      return;
+   buffer->done = 0;
+   buffer->busy = true;
+#ifdef HAVE_IO_URING
+   if ( output->ring != NULL )
+   {
+      output_ring_submit( output, index );
+      return;
+   }
+#endif
+   if ( output->threaded )
+   {
+      pthread_mutex_lock( &output->lock );
+      output->queue[ ( output->queue_head + output->queue_count ) % OUTPUT_BUFFERS ] = index;
+      output->queue_count ++;
+      pthread_cond_broadcast( &output->cond );
+      pthread_mutex_unlock( &output->lock );
+      return;
+   }
+   output_pwrite( output, buffer );
+   buffer->busy = false;
+}
+
+/// Wait until the buffer is written
+static void output_wait( Output* output, unsigned int index )
+{
+   Output_buffer* buffer = &output->buffers[index];
+
+#ifdef HAVE_IO_URING
+   if ( output->ring != NULL )
+   {
+      while ( buffer->busy )
+         output_ring_reap( output );
+      return;
+   }
+#endif
+   if ( output->threaded )
+   {
+      pthread_mutex_lock( &output->lock );
+      while ( buffer->busy )
+         pthread_cond_wait( &output->cond, &output->lock );
+      pthread_mutex_unlock( &output->lock );
+   }
+}
+
+static void output_start( Output* output )
+{
+#ifdef HAVE_IO_URING
+   const char* env = getenv( "GEOTECH_IO" );
+   if ( env == NULL || strcmp( env, "thread" ) != 0 )
+      output->ring = output_ring_open();
+   if ( output->ring != NULL )
+      return;
+#endif
+   pthread_mutex_init( &output->lock, NULL );
+   pthread_cond_init( &output->cond, NULL );
+   output->threaded = ( pthread_create( &output->thread, NULL, output_thread, output ) == 0 );
+   if ( !output->threaded )
+   {
+      pthread_cond_destroy( &output->cond );
+      pthread_mutex_destroy( &output->lock );
+   }
+}
+
+static void output_stop( Output* output )
+{
+#ifdef HAVE_IO_URING
+   if ( output->ring != NULL )
+      output_ring_free( output->ring );
+   output->ring = NULL;
+#endif
+   if ( output->threaded )
+   {
+      pthread_mutex_lock( &output->lock );
+      output->stop = true;
+      pthread_cond_broadcast( &output->cond );
+      pthread_mutex_unlock( &output->lock );
+      pthread_join( output->thread, NULL );
+      pthread_cond_destroy( &output->cond );
+      pthread_mutex_destroy( &output->lock );
+      output->threaded = false;
+   }
+}
+
+static void output_free( Output* output )
+{
+   unsigned int loop;
+
+   if ( output->fd >= 0 )
+      close( output->fd );
+   for ( loop = 0; loop < OUTPUT_BUFFERS; loop ++ )
+      free( output->buffers[loop].data );
+   for ( loop = 0; output->blocks != NULL && loop < output->nblocks; loop ++ )
+   {
+      free( output->blocks[loop].data );
+      free( output->blocks[loop].packed );
+   }
+   free( output->blocks );
+   free( output->filename );
+   free( output->tmpname );
+   free( output );
+}
+
+/// Worst case size of compressed block
+static size_t output_packed_size( int codec )
+{
+#ifdef HAVE_ZLIB
+   if ( codec == OUTPUT_GZIP )
+      return compressBound( OUTPUT_BLOCK_SIZE ) + 32;   // gzip header and trailer are longer than zlib's
+#endif
+#ifdef HAVE_ZSTD
+   if ( codec == OUTPUT_ZSTD )
+      return ZSTD_compressBound( OUTPUT_BLOCK_SIZE );
+#endif
+   return 0;
+}
+
+static bool output_blocks_alloc( Output* output, int codec )
+{
+   unsigned int loop;
+
+   output->codec       = codec;
+   output->packed_size = output_packed_size( codec );
+   output->nblocks     = workers_count();
+   output->blocks      = (Output_block*)calloc( output->nblocks, sizeof(Output_block) );
+   if ( output->blocks == NULL )
+      return false;
+   for ( loop = 0; loop < output->nblocks; loop ++ )
+   {
+      output->blocks[loop].data   = (unsigned char*)malloc( OUTPUT_BLOCK_SIZE );
+      output->blocks[loop].packed = (unsigned char*)malloc( output->packed_size );
+      if ( output->blocks[loop].data == NULL || output->blocks[loop].packed == NULL )
+         return false;
+   }
+   return true;
+}
+
+static Output* output_create( const char* filename, bool replace, int64_t offset, int codec )
+{
+   unsigned int loop;
+   struct stat info;
+
+   Output* output = (Output*)calloc( 1, sizeof(Output) );
+   if ( output == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+   output->fd       = -1;
+   output->filename = strdup( filename );
+   output->tmpname  = replace ? (char*)malloc( strlen( filename ) + 5 ) : NULL;
+   bool ok = ( output->filename != NULL && ( output->tmpname != NULL || !replace ) );
+   for ( loop = 0; ok && loop < OUTPUT_BUFFERS; loop ++ )
+      ok = ( posix_memalign( (void**)&output->buffers[loop].data, OUTPUT_ALIGN, OUTPUT_BUFFER_SIZE ) == 0 );
+   if ( ok && codec != OUTPUT_PLAIN )
+      ok = output_blocks_alloc( output, codec );
+   if ( !ok )
+   {
+      ERROR("Out of memory!");
+      output_free( output );
+      return NULL;
+   }
+
+   if ( replace )
+   {
+      sprintf( output->tmpname, "%s.tmp", filename );
+      output->fd = open( output->tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+   }
+   else
+      output->fd = open( filename, O_WRONLY );
+   if ( output->fd < 0 || fstat( output->fd, &info ) != 0 )
+   {
+      ERROR("Cannot open file '%s' for writing: %s", replace ? output->tmpname : filename, strerror(errno) );
+      output_free( output );
+      return NULL;
+   }
+   output->regular = S_ISREG( info.st_mode );
+   output->offset  = ( offset > 0 ) ? offset : 0;
+
+   output_start( output );
+   return output;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// New file, replacing the existing one only when closed successfully. Devices and pipes are written directly.
+///--------------------------------------------------------------------------------------------------------------------
+Output* output_open( const char* filename )
+{
+   struct stat info;
+   bool special = ( stat( filename, &info ) == 0 && !S_ISREG( info.st_mode ) );
+   int codec = output_codec_of( filename );
+
+   if ( codec != OUTPUT_PLAIN && output_packed_size( codec ) == 0 )
+   {
+      ERROR("Cannot write '%s': compiled without %s", filename, codec == OUTPUT_GZIP ? "zlib" : "zstd" );
+      return NULL;
+   }
+   return output_create( filename, !special, 0, codec );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Write inside an existing file from given offset on, the file is not truncated
+///--------------------------------------------------------------------------------------------------------------------
+Output* output_open_at( const char* filename, int64_t offset )
+{
+   return output_create( filename, false, offset, OUTPUT_PLAIN );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Compression of the file name extension: .gz or .zst
+///--------------------------------------------------------------------------------------------------------------------
+int output_codec_of( const char* filename )
+{
+   const char* ext = strrchr( filename, '.' );
+
+   if ( ext != NULL && strcasecmp( ext, ".gz" ) == 0 )
+      return OUTPUT_GZIP;
+   if ( ext != NULL && strcasecmp( ext, ".zst" ) == 0 )
+      return OUTPUT_ZSTD;
+   return OUTPUT_PLAIN;
+}
+
+/// Append to the file as it is
+static bool output_put( Output* output, const void* data, size_t len )
+{
+   const unsigned char* bytes = (const unsigned char*)data;
+
+   if ( output_failed( output ) )
+      return false;
+   while ( len > 0 )
+   {
+      Output_buffer* buffer = &output->buffers[ output->current ];
+      size_t copy = OUTPUT_BUFFER_SIZE - buffer->len;
+      copy = ( copy < len ) ? copy : len;
+      memcpy( buffer->data + buffer->len, bytes, copy );
+      buffer->len += copy;
+      bytes += copy;
+      len   -= copy;
+
+      if ( buffer->len == OUTPUT_BUFFER_SIZE )
+      {
+         buffer->offset = output->offset;
+         output->offset += buffer->len;
+         output_submit( output, output->current );
+
+         output->current = ( output->current + 1 ) % OUTPUT_BUFFERS;
+         output_wait( output, output->current );
+         output->buffers[ output->current ].len = 0;
+      }
+   }
+   return !output_failed( output );
+}
+
+static void output_pack_job( unsigned int index, void* context )
+{
+   Output* output = (Output*)context;
+   Output_block* block = &output->blocks[index];
+
+   block->packed_len = 0;
+#ifdef HAVE_ZLIB
+   if ( output->codec == OUTPUT_GZIP )
+   {
+      z_stream stream;
+      memset( &stream, 0, sizeof(stream) );
+      // window bits over 15 ask for gzip header and trailer
+      if ( deflateInit2( &stream, OUTPUT_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+         return;
+      stream.next_in   = block->data;
+      stream.avail_in  = block->len;
+      stream.next_out  = block->packed;
+      stream.avail_out = output->packed_size;
+      if ( deflate( &stream, Z_FINISH ) == Z_STREAM_END )
+         block->packed_len = stream.total_out;
+      deflateEnd( &stream );
+   }
+#endif
+#ifdef HAVE_ZSTD
+   if ( output->codec == OUTPUT_ZSTD )
+   {
+      size_t len = ZSTD_compress( block->packed, output->packed_size, block->data, block->len, OUTPUT_ZSTD_LEVEL );
+      block->packed_len = ZSTD_isError( len ) ? 0 : len;
+   }
+#endif
+}
+
+/// Compress the filled blocks in parallel and write them in order
+static void output_pack_flush( Output* output )
+{
+   unsigned int loop;
+
+   workers_run( output->filled, output_pack_job, output );
+   for ( loop = 0; loop < output->filled; loop ++ )
+   {
+      Output_block* block = &output->blocks[loop];
+      if ( block->packed_len == 0 )
+         output_fail( output, ENOMEM );
+      else
+         output_put( output, block->packed, block->packed_len );
+      block->len = 0;
+   }
+   output->filled = 0;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Append data. The write itself may happen later, false if an earlier write has failed.
+///--------------------------------------------------------------------------------------------------------------------
+bool output_write( Output* output, const void* data, size_t len )
+{
+   const unsigned char* bytes = (const unsigned char*)data;
+
+   if ( output->codec == OUTPUT_PLAIN )
+      return output_put( output, data, len );
+   if ( output_failed( output ) )
+      return false;
+   while ( len > 0 )
+   {
+      Output_block* block = &output->blocks[ output->filled ];
+      size_t copy = OUTPUT_BLOCK_SIZE - block->len;
+      copy = ( copy < len ) ? copy : len;
+      memcpy( block->data + block->len, bytes, copy );
+      block->len += copy;
+      bytes += copy;
+      len   -= copy;
+
+      if ( block->len == OUTPUT_BLOCK_SIZE && ++ output->filled == output->nblocks )
+         output_pack_flush( output );
+   }
+   return !output_failed( output );
+}
+
+static bool output_sync_directory( const char* filename )
+{
+   char* path = strdup( filename );
+   if ( path == NULL )
+      return false;
+
+   char* slash = strrchr( path, '/' );
+   if ( slash == NULL )
+      strcpy( path, "." );
+   else
+      slash[ slash == path ? 1 : 0 ] = 0x00;
+
+   int fd = open( path, O_RDONLY | O_DIRECTORY );
+   bool ok = ( fd >= 0 && ( fsync( fd ) == 0 || errno == EINVAL ) );
+   if ( fd >= 0 )
+      close( fd );
+   free( path );
+   return ok;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Remove the file and sync its directory, so that the removal is on disk before anything written after it.
+/// A file that is not there is fine.
+///--------------------------------------------------------------------------------------------------------------------
+bool output_remove( const char* filename )
+{
+   if ( unlink( filename ) != 0 && errno != ENOENT )
+   {
+      ERROR("Cannot remove '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   if ( !output_sync_directory( filename ) )
+   {
+      ERROR("Cannot sync directory of '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Wait for the writes, sync the file and move it in place. The handler, if given, is called with the result once
+/// the data is durable or has failed; on failure the temporary file is removed and the target is left as it was.
+/// Frees the output.
+///--------------------------------------------------------------------------------------------------------------------
+bool output_close( Output* output, Output_done done, void* context )
+{
+   Output_buffer* buffer;
+   unsigned int loop;
+
+   if ( output->codec != OUTPUT_PLAIN && !output_failed( output ) )
+   {
+      if ( output->blocks[ output->filled ].len > 0 )
+         output->filled ++;
+      output_pack_flush( output );
+   }
+
+   buffer = &output->buffers[ output->current ];
+   if ( buffer->len > 0 )
+   {
+      buffer->offset = output->offset;
+      output->offset += buffer->len;
+      output_submit( output, output->current );
+   }
+   for ( loop = 0; loop < OUTPUT_BUFFERS; loop ++ )
+      output_wait( output, loop );
+   output_stop( output );
+
+   if ( !output_failed( output ) && output->regular && fsync( output->fd ) != 0 )
+      output_fail( output, errno );
+   if ( close( output->fd ) != 0 )
+      output_fail( output, errno );
+   output->fd = -1;
+
+   if ( output->tmpname != NULL )
+   {
+      if ( !output_failed( output ) && rename( output->tmpname, output->filename ) != 0 )
+         output_fail( output, errno );
+      if ( !output_failed( output ) && !output_sync_directory( output->filename ) )
+         output_fail( output, errno );
+      if ( output_failed( output ) )
+         unlink( output->tmpname );
+   }
+
+   bool ok = !output_failed( output );
+   DEBUG(3, "Closed '%s', %llu bytes%s", output->filename, (unsigned long long)output->offset, ok ? "" : ", failed" );
+   if ( done != NULL )
+      done( output->filename, ok, context );
+   output_free( output );
+   return ok;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Close without keeping anything: new file is removed, in place writes already done stay. Frees the output.
+///--------------------------------------------------------------------------------------------------------------------
+void output_abort( Output* output )
+{
+   int none = 0;
+   __atomic_compare_exchange_n( &output->error, &none, ECANCELED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+   output_close( output, NULL, NULL );
+}
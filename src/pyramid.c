@@ -0,0 +1,454 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define MODULE_NAME "pyramid"
+
+/// Level of detail pyramid of one track, native byte order:
+///   header    : "GTP1", uint32 number of levels, uint64 reserved
+///   directory : per level Pyramid_level
+///   levels    : track store of the level points, followed by Pyramid_box of each of its blocks
+/// Level 0 has all points. Each further level is Douglas-Peucker simplification to half a pixel at its zoom, and
+/// is only kept when it clearly has fewer points than the previous one. The simplification is computed once: every
+/// point gets the largest tolerance that still keeps it, and a level is the points above its tolerance.
+
+#define PYRAMID_MAGIC      "GTP1"
+#define PYRAMID_HEADER     16
+/// Zoom of the full resolution level
+#define PYRAMID_FULL_ZOOM  255
+/// Most detailed simplified level
+#define PYRAMID_MAX_ZOOM   18
+#define PYRAMID_MAX_LEVELS ( PYRAMID_MAX_ZOOM + 2 )
+/// Level is kept only if it has at most this share of points of the previous level
+#define PYRAMID_REDUCTION  0.75
+/// Points simplified as one piece, pieces are done in parallel and their end points always kept
+#define PYRAMID_PIECE      65536
+/// Ground meters per pixel at zoom 0 on equator
+#define PYRAMID_PIXEL      156543.034
+
+typedef struct
+{
+   int32_t  zoom;         // level is exact to half pixel at this and lower zooms
+   uint32_t npoints;
+   uint32_t nblocks;
+   uint32_t reserved;
+   uint64_t track;        // offset of track store
+   uint64_t boxes;        // offset of block boxes, end of track store
+} Pyramid_level;
+
+typedef struct
+{
+   int32_t  lat0, lon0, lat1, lon1;
+   uint32_t npoints;
+} Pyramid_box;
+
+typedef struct
+{
+   const GPS_points* data;
+   float*            tolerance;
+   unsigned int      npieces;
+} Pyramid_job;
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Douglas-Peucker over points first .. last, both kept. Distances are in meters on local plane.
+///--------------------------------------------------------------------------------------------------------------------
+static double pyramid_distance( const GPS_point* point, const GPS_point* a, const GPS_point* b, double kx )
+{
+   double px = ( (int64_t)point->longitude - a->longitude ) * kx;
+   double py = ( (int64_t)point->latitude  - a->latitude  ) * MICRODEG_METERS;
+   double dx = ( (int64_t)b->longitude - a->longitude ) * kx;
+   double dy = ( (int64_t)b->latitude  - a->latitude  ) * MICRODEG_METERS;
+   double len = dx*dx + dy*dy;
+   double t = ( len > 0 ) ? ( px*dx + py*dy ) / len : 0.0;
+
+   t = ( t < 0 ) ? 0 : ( t > 1 ) ? 1 : t;
+   px -= t * dx;
+   py -= t * dy;
+   return sqrt( px*px + py*py );
+}
+
+static void pyramid_piece( unsigned int piece, void* context )
+{
+   Pyramid_job* job = (Pyramid_job*)context;
+   const GPS_point* points = job->data->points;
+   float* tolerance = job->tolerance;
+   unsigned int first = piece * PYRAMID_PIECE;
+   unsigned int last  = ( first + PYRAMID_PIECE < job->data->npoints ) ? first + PYRAMID_PIECE : job->data->npoints - 1;
+   unsigned int loop;
+
+   // stack of segments to split, depth is bounded by number of points
+   unsigned int* stack = (unsigned int*)malloc( 2 * ( last - first + 1 ) * sizeof(unsigned int) );
+   unsigned int depth = 0;
+   if ( stack == NULL )
+   {
+      // keep all points
+      for ( loop = first; loop <= last; loop ++ )
+         tolerance[loop] = INFINITY;
+      return;
+   }
+
+   double kx = MICRODEG_METERS * cos( points[ ( first + last ) / 2 ].latitude * MICRODEG_TO_RAD );
+   tolerance[first] = INFINITY;
+   tolerance[last]  = INFINITY;
+   stack[ depth ++ ] = first;
+   stack[ depth ++ ] = last;
+
+   while ( depth > 0 )
+   {
+      unsigned int b = stack[ -- depth ];
+      unsigned int a = stack[ -- depth ];
+      unsigned int split = a;
+      double max = -1;
+      if ( b <= a + 1 )
+         continue;
+
+      for ( loop = a + 1; loop < b; loop ++ )
+      {
+         double distance = pyramid_distance( &points[loop], &points[a], &points[b], kx );
+         if ( distance > max )
+         {
+            max   = distance;
+            split = loop;
+         }
+      }
+
+      // point stays as long as the segment it splits is kept
+      float parent = ( tolerance[a] < tolerance[b] ) ? tolerance[a] : tolerance[b];
+      tolerance[split] = ( max < parent ) ? max : parent;
+      if ( max == 0 )
+      {
+         for ( loop = a + 1; loop < b; loop ++ )
+            tolerance[loop] = 0;
+         continue;
+      }
+      stack[ depth ++ ] = a;
+      stack[ depth ++ ] = split;
+      stack[ depth ++ ] = split;
+      stack[ depth ++ ] = b;
+   }
+   free( stack );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Write points above tolerance as track store at end of file, with box of each block after it
+///--------------------------------------------------------------------------------------------------------------------
+static bool pyramid_write_level( const char* filename, const GPS_points* data, const float* tolerance, double limit,
+                                 Pyramid_level* level )
+{
+   struct stat info;
+   Pyramid_box* boxes = NULL;
+   unsigned int loop;
+
+   if ( stat( filename, &info ) != 0 )
+   {
+      ERROR("Cannot write file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   level->track   = info.st_size;
+   level->npoints = 0;
+   level->nblocks = 0;
+
+   Track_writer* writer = track_writer_open_at( filename, level->track );
+   if ( writer == NULL )
+      return false;
+
+   bool ok = true;
+   for ( loop = 0; ok && loop < data->npoints; loop ++ )
+   {
+      const GPS_point* point = &data->points[loop];
+      if ( tolerance != NULL && tolerance[loop] <= limit )
+         continue;
+
+      if ( level->npoints % TRACK_BLOCK_POINTS == 0 )
+      {
+         Pyramid_box* more = (Pyramid_box*)realloc( boxes, ( level->nblocks + 1 ) * sizeof(Pyramid_box) );
+         if ( more == NULL )
+         {
+            ERROR("Out of memory!");
+            ok = false;
+            break;
+         }
+         boxes = more;
+         Pyramid_box* box = &boxes[ level->nblocks ++ ];
+         box->lat0 = box->lat1 = point->latitude;
+         box->lon0 = box->lon1 = point->longitude;
+         box->npoints = 0;
+      }
+
+      Pyramid_box* box = &boxes[ level->nblocks - 1 ];
+      box->lat0 = ( point->latitude  < box->lat0 ) ? point->latitude  : box->lat0;
+      box->lat1 = ( point->latitude  > box->lat1 ) ? point->latitude  : box->lat1;
+      box->lon0 = ( point->longitude < box->lon0 ) ? point->longitude : box->lon0;
+      box->lon1 = ( point->longitude > box->lon1 ) ? point->longitude : box->lon1;
+      box->npoints ++;
+      level->npoints ++;
+      ok = track_writer_append( writer, point );
+   }
+   ok = track_writer_close( writer ) && ok;
+
+   if ( ok && stat( filename, &info ) == 0 )
+   {
+      level->boxes = info.st_size;
+      FILE* fid = fopen( filename, "ab" );
+      ok = ( fid != NULL ) && fwrite( boxes, sizeof(Pyramid_box), level->nblocks, fid ) == level->nblocks;
+      if ( fid == NULL || fclose( fid ) != 0 || !ok )
+      {
+         ERROR("Cannot write file '%s': %s", filename, strerror(errno) );
+         ok = false;
+      }
+   }
+   free( boxes );
+   return ok;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Build pyramid of levels of detail of the track
+///--------------------------------------------------------------------------------------------------------------------
+bool pyramid_build( const char* filename, const GPS_points* data )
+{
+   Pyramid_level levels[ PYRAMID_MAX_LEVELS ];
+   unsigned char header[ PYRAMID_HEADER ];
+   Pyramid_job job;
+   unsigned int nlevels = 0, loop;
+   int zoom;
+   bool ok = true;
+
+   if ( data->npoints == 0 )
+   {
+      ERROR("No points for pyramid '%s'", filename );
+      return false;
+   }
+
+   job.data      = data;
+   job.npieces   = ( data->npoints - 1 + PYRAMID_PIECE - 1 ) / PYRAMID_PIECE;
+   job.tolerance = (float*)malloc( data->npoints * sizeof(float) );
+   if ( job.tolerance == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   job.tolerance[0] = INFINITY;
+   workers_run( job.npieces, pyramid_piece, &job );
+
+   // header and directory are written again when the levels are known
+   FILE* fid = fopen( filename, "wb" );
+   memset( levels, 0, sizeof(levels) );
+   memset( header, 0, sizeof(header) );
+   if ( fid == NULL || fwrite( header, PYRAMID_HEADER, 1, fid ) != 1 || fwrite( levels, sizeof(levels), 1, fid ) != 1 ||
+        fclose( fid ) != 0 )
+   {
+      ERROR("Cannot write file '%s': %s", filename, strerror(errno) );
+      free( job.tolerance );
+      return false;
+   }
+
+   int32_t lat0 = data->points[0].latitude, lat1 = lat0;
+   for ( loop = 1; loop < data->npoints; loop ++ )
+   {
+      lat0 = ( data->points[loop].latitude < lat0 ) ? data->points[loop].latitude : lat0;
+      lat1 = ( data->points[loop].latitude > lat1 ) ? data->points[loop].latitude : lat1;
+   }
+   double coslat = cos( ( (int64_t)lat0 + lat1 ) / 2 * MICRODEG_TO_RAD );
+
+   levels[0].zoom = PYRAMID_FULL_ZOOM;
+   ok = pyramid_write_level( filename, data, NULL, 0, &levels[ nlevels ++ ] );
+
+   for ( zoom = PYRAMID_MAX_ZOOM; ok && zoom >= 0 && levels[ nlevels - 1 ].npoints > 2; zoom -- )
+   {
+      double limit = 0.5 * PYRAMID_PIXEL * coslat / ( 1 << zoom );
+      unsigned int count = 0;
+      for ( loop = 0; loop < data->npoints; loop ++ )
+         count += job.tolerance[loop] > limit;
+      if ( count > PYRAMID_REDUCTION * levels[ nlevels - 1 ].npoints )
+         continue;
+
+      levels[ nlevels ].zoom = zoom;
+      ok = pyramid_write_level( filename, data, job.tolerance, limit, &levels[ nlevels ++ ] );
+      DEBUG(3, "level %u for zoom %d: %u points", nlevels - 1, zoom, count );
+   }
+   free( job.tolerance );
+
+   fid = ok ? fopen( filename, "r+b" ) : NULL;
+   ok = ( fid != NULL );
+   if ( ok )
+   {
+      uint32_t count = nlevels;
+      memcpy( header, PYRAMID_MAGIC, 4 );
+      memcpy( header + 4, &count, 4 );
+      ok = fwrite( header, PYRAMID_HEADER, 1, fid ) == 1 && fwrite( levels, sizeof(levels), 1, fid ) == 1;
+      ok = ( fclose( fid ) == 0 ) && ok;
+   }
+   if ( !ok )
+   {
+      ERROR("Cannot write file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Extract
+///--------------------------------------------------------------------------------------------------------------------
+static bool pyramid_read_directory( const char* filename, Pyramid_level* levels, unsigned int* nlevels )
+{
+   unsigned char header[ PYRAMID_HEADER ];
+   uint32_t count = 0;
+
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   bool ok = fread( header, PYRAMID_HEADER, 1, fid ) == 1 && fread( levels, sizeof(Pyramid_level), PYRAMID_MAX_LEVELS,
+                                                                      fid ) == PYRAMID_MAX_LEVELS;
+   fclose( fid );
+
+   memcpy( &count, header + 4, 4 );
+   if ( !ok || memcmp( header, PYRAMID_MAGIC, 4 ) != 0 || count == 0 || count > PYRAMID_MAX_LEVELS )
+   {
+      ERROR("File '%s' is not a track pyramid", filename );
+      return false;
+   }
+   *nlevels = count;
+   return true;
+}
+
+static bool pyramid_read_boxes( const char* filename, const Pyramid_level* level, Pyramid_box* boxes )
+{
+   FILE* fid = fopen( filename, "rb" );
+   bool ok = fid != NULL && fseeko( fid, level->boxes, SEEK_SET ) == 0 &&
+             fread( boxes, sizeof(Pyramid_box), level->nblocks, fid ) == level->nblocks;
+   if ( fid != NULL )
+      fclose( fid );
+   if ( !ok )
+      ERROR("Cannot read levels of '%s'", filename );
+   return ok;
+}
+
+static inline bool pyramid_box_overlaps( const Pyramid_view* view, int32_t lat0, int32_t lon0, int32_t lat1, int32_t lon1 )
+{
+   return !( lat1 < view->lat0 || lat0 > view->lat1 || lon1 < view->lon0 || lon0 > view->lon1 );
+}
+
+/// Union of two block boxes overlaps the view, so segments between the blocks may cross it
+static inline bool pyramid_blocks_overlap( const Pyramid_view* view, const Pyramid_box* a, const Pyramid_box* b )
+{
+   return pyramid_box_overlaps( view, a->lat0 < b->lat0 ? a->lat0 : b->lat0, a->lon0 < b->lon0 ? a->lon0 : b->lon0,
+                                a->lat1 > b->lat1 ? a->lat1 : b->lat1, a->lon1 > b->lon1 ? a->lon1 : b->lon1 );
+}
+
+/// Segment from a to b may cross the view
+static inline bool pyramid_segment_overlaps( const Pyramid_view* view, const GPS_point* a, const GPS_point* b )
+{
+   return pyramid_box_overlaps( view, a->latitude < b->latitude ? a->latitude : b->latitude,
+                                a->longitude < b->longitude ? a->longitude : b->longitude,
+                                a->latitude > b->latitude ? a->latitude : b->latitude,
+                                a->longitude > b->longitude ? a->longitude : b->longitude );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Write points of the coarsest level exact at the zoom, or coarser if the view would have more than max_points.
+/// Points are written if a segment to or from them may cross the view, so lines leaving the view are drawn.
+/// \returns number of points written or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long pyramid_extract( const char* filename, const Pyramid_view* view, GPS_writer* writer )
+{
+   Pyramid_level levels[ PYRAMID_MAX_LEVELS ];
+   Pyramid_box* boxes = NULL;
+   GPS_point* points;
+   GPS_point previous;
+   unsigned int nlevels, level, block;
+   bool has_previous = false, previous_written = false;
+   long written = 0;
+   int loop;
+
+   if ( !pyramid_read_directory( filename, levels, &nlevels ) )
+      return -1;
+
+   // coarsest level still exact at the zoom
+   for ( level = nlevels - 1; level > 0 && levels[level].zoom < view->zoom; level -- )
+      ;
+
+   // go coarser while too many points would be in view
+   for ( ; level < nlevels; level ++ )
+   {
+      unsigned long count = 0;
+      free( boxes );
+      boxes = (Pyramid_box*)malloc( levels[level].nblocks * sizeof(Pyramid_box) + 1 );
+      if ( boxes == NULL || !pyramid_read_boxes( filename, &levels[level], boxes ) )
+      {
+         free( boxes );
+         return -1;
+      }
+      for ( block = 0; block < levels[level].nblocks; block ++ )
+      {
+         if ( pyramid_box_overlaps( view, boxes[block].lat0, boxes[block].lon0, boxes[block].lat1, boxes[block].lon1 ) )
+            count += boxes[block].npoints;
+      }
+      if ( view->max_points == 0 || count <= view->max_points || level == nlevels - 1 )
+         break;
+   }
+   DEBUG(3, "level %u of zoom %d, %u points", level, levels[level].zoom, levels[level].npoints );
+
+   Track_reader* reader = track_reader_open_at( filename, levels[level].track, levels[level].boxes - levels[level].track );
+   points = (GPS_point*)malloc( TRACK_BLOCK_POINTS * sizeof(GPS_point) );
+   if ( reader == NULL || points == NULL )
+   {
+      if ( reader != NULL )
+         track_reader_close( reader );
+      free( points );
+      free( boxes );
+      return -1;
+   }
+
+   bool ok = true;
+   for ( block = 0; ok && block < levels[level].nblocks; block ++ )
+   {
+      // points of the block are needed if a segment to them crosses the view
+      const Pyramid_box* box = &boxes[block];
+      if ( !pyramid_blocks_overlap( view, box, block > 0 ? box - 1 : box ) &&
+           !pyramid_blocks_overlap( view, box, block + 1 < levels[level].nblocks ? box + 1 : box ) )
+      {
+         has_previous = false;
+         continue;
+      }
+
+      int count = track_reader_block( reader, block, points );
+      ok = count >= 0;
+
+      for ( loop = 0; ok && loop < count; loop ++ )
+      {
+         bool from_previous = has_previous && pyramid_segment_overlaps( view, &previous, &points[loop] );
+         bool in = from_previous || pyramid_segment_overlaps( view, &points[loop], &points[loop] ) ||
+                   ( loop + 1 < count && pyramid_segment_overlaps( view, &points[loop], &points[ loop + 1 ] ) );
+
+         // previous point was left out, but the segment from it crosses the view
+         if ( from_previous && !previous_written )
+         {
+            ok = GPS_writer_append( writer, &previous );
+            written ++;
+         }
+         if ( in && ok )
+         {
+            ok = GPS_writer_append( writer, &points[loop] );
+            written ++;
+         }
+         previous         = points[loop];
+         previous_written = in;
+         has_previous     = true;
+      }
+   }
+
+   track_reader_close( reader );
+   free( points );
+   free( boxes );
+   return ok ? written : -1;
+}
@@ -0,0 +1,449 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#define MODULE_NAME "resample"
+
+/// Tracks are resampled to a uniform time grid: multiples of the step in epoch seconds, so the grids of different
+/// tracks are the same. The position at a grid time is interpolated linearly between the points before and after
+/// it, no position is made up over gaps longer than max_gap. Points are read in chunks as they are needed, so a
+/// track of any length is resampled in constant memory. Points are expected in time order, points not later
+/// than the one before are skipped.
+///
+/// Clocks of devices drift, the offset in seconds is added to the times of the track before resampling.
+///
+/// Join reads a resampler per track and merges them by time, writing a row for each grid time any track has a
+/// position for. CSV rows are 'time,<name>_lat,<name>_lon,<name>_height,..' with empty fields for tracks without
+/// position. Binary output (name ending with .bin) is a header followed by fixed size rows:
+///
+///    char     magic[4]     "GTJ1"
+///    uint32_t ntracks
+///    int64_t  step
+///    char     names[]      zero terminated name of each track
+///    rows:    int64_t time, ntracks x { int32_t latitude, longitude, height }, INT32_MIN when no position
+
+#define RESAMPLE_CHUNK       4096
+#define RESAMPLE_JOIN_MAGIC  "GTJ1"
+#define RESAMPLE_NO_POSITION INT32_MIN
+
+struct Resampler
+{
+   GPS_reader* reader;
+   GPS_point*  points;     // chunk read
+   int         count, pos;
+
+   GPS_point   a, b;       // points around the next grid time
+   double      ta, tb;     // their times with offset
+   bool        have_a, have_b;
+
+   int64_t     step;
+   int64_t     max_gap;
+   double      offset;
+   int64_t     next;       // grid time
+};
+
+/// Next point later than a to b, false at end or on failure
+static bool resample_read( Resampler* resampler, bool* failed )
+{
+   while ( true )
+   {
+      if ( resampler->pos >= resampler->count )
+      {
+         resampler->count = GPS_reader_read( resampler->reader, resampler->points, RESAMPLE_CHUNK );
+         resampler->pos   = 0;
+         if ( resampler->count <= 0 )
+         {
+            *failed = resampler->count < 0;
+            return false;
+         }
+      }
+      const GPS_point* point = &resampler->points[ resampler->pos ++ ];
+      double time = GPS_point_epoch( point ) + resampler->offset;
+      if ( !resampler->have_a || time > resampler->ta )
+      {
+         resampler->b  = *point;
+         resampler->tb = time;
+         return true;
+      }
+   }
+}
+
+static int64_t resample_grid_ceil( double time, int64_t step )
+{
+   return (int64_t)ceil( time / step ) * step;
+}
+
+static int32_t resample_lerp( int32_t a, int32_t b, double fraction )
+{
+   return a + (int32_t)lround( ( (double)b - a ) * fraction );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Open resampling of a track to grid of step seconds, not interpolating over gaps longer than max_gap seconds.
+/// Offset seconds are added to the times of the track.
+///--------------------------------------------------------------------------------------------------------------------
+Resampler* resample_open( const char* filename, int64_t step, int64_t max_gap, double offset )
+{
+   bool failed = false;
+
+   if ( step <= 0 )
+   {
+      ERROR("Invalid resampling step %lld", (long long)step );
+      return NULL;
+   }
+   Resampler* resampler = (Resampler*)calloc( 1, sizeof(Resampler) );
+   if ( resampler == NULL || ( resampler->points = (GPS_point*)malloc( RESAMPLE_CHUNK * sizeof(GPS_point) ) ) == NULL )
+   {
+      ERROR("Out of memory!");
+      free( resampler );
+      return NULL;
+   }
+   resampler->step    = step;
+   resampler->max_gap = max_gap;
+   resampler->offset  = offset;
+   resampler->reader  = GPS_reader_open( filename );
+   if ( resampler->reader == NULL )
+   {
+      resample_close( resampler );
+      return NULL;
+   }
+
+   resampler->have_b = resample_read( resampler, &failed );
+   if ( failed )
+   {
+      resample_close( resampler );
+      return NULL;
+   }
+   resampler->next = resampler->have_b ? resample_grid_ceil( resampler->tb, step ) : 0;
+   return resampler;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Position at the next grid time, the time of the point is the grid time.
+/// \returns 1 for a point, 0 at end of track, -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+int resample_next( Resampler* resampler, GPS_point* point )
+{
+   bool failed = false;
+
+   while ( resampler->have_b )
+   {
+      if ( resampler->have_a && resampler->next < resampler->tb )
+      {
+         // next is in [ta, tb), within the gap unless the gap is too long
+         if ( resampler->next == resampler->ta )
+            *point = resampler->a;
+         else if ( resampler->tb - resampler->ta <= resampler->max_gap )
+         {
+            double fraction = ( resampler->next - resampler->ta ) / ( resampler->tb - resampler->ta );
+            int32_t lon_b = resampler->b.longitude;
+            // shorter way over the antimeridian
+            if ( (int64_t)lon_b - resampler->a.longitude > 180000000 )
+               lon_b -= 360000000;
+            else if ( (int64_t)resampler->a.longitude - lon_b > 180000000 )
+               lon_b += 360000000;
+
+            *point = resampler->a;
+            point->latitude  = resample_lerp( resampler->a.latitude, resampler->b.latitude, fraction );
+            point->longitude = resample_lerp( resampler->a.longitude, lon_b, fraction );
+            point->height    = resample_lerp( resampler->a.height, resampler->b.height, fraction );
+            if ( point->longitude > 180000000 )
+               point->longitude -= 360000000;
+            else if ( point->longitude < -180000000 )
+               point->longitude += 360000000;
+         }
+         else
+         {
+            resampler->next = resample_grid_ceil( resampler->tb, resampler->step );
+            continue;
+         }
+         GPS_point_set_epoch( point, resampler->next );
+         resampler->next += resampler->step;
+         return 1;
+      }
+
+      // move on to the gap after b
+      resampler->a      = resampler->b;
+      resampler->ta     = resampler->tb;
+      resampler->have_a = true;
+      resampler->have_b = resample_read( resampler, &failed );
+      if ( failed )
+         return -1;
+   }
+
+   // last point is on the grid
+   if ( resampler->have_a && resampler->next == resampler->ta )
+   {
+      *point = resampler->a;
+      GPS_point_set_epoch( point, resampler->next );
+      resampler->have_a = false;
+      return 1;
+   }
+   return 0;
+}
+
+void resample_close( Resampler* resampler )
+{
+   if ( resampler == NULL )
+      return;
+   if ( resampler->reader != NULL )
+      GPS_reader_close( resampler->reader );
+   free( resampler->points );
+   free( resampler );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Resample track to the writer. \returns number of points written or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long resample_track( const char* filename, const Resample_options* options, GPS_writer* writer )
+{
+   char name[ BUFFER_SIZE ];
+   GPS_point point;
+   double offset = 0.0;
+   long count = 0;
+   int ret;
+
+   resample_input( filename, name, sizeof(name), &offset );
+   Resampler* resampler = resample_open( name, options->step, options->max_gap, offset );
+   if ( resampler == NULL )
+      return -1;
+
+   while ( (ret = resample_next( resampler, &point )) > 0 )
+   {
+      if ( !GPS_writer_append( writer, &point ) )
+      {
+         ret = -1;
+         break;
+      }
+      count ++;
+   }
+   resample_close( resampler );
+   return ( ret < 0 ) ? -1 : count;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Input of the form '<track>[@<offset seconds>]' to file name and offset
+///--------------------------------------------------------------------------------------------------------------------
+void resample_input( const char* input, char* filename, size_t len, double* offset )
+{
+   const char* at = strrchr( input, '@' );
+   char* end = NULL;
+
+   *offset = 0.0;
+   if ( at != NULL )
+      *offset = strtod( at + 1, &end );
+   if ( at == NULL || end == at + 1 || *end != 0x00 )
+      at = input + strlen( input );
+   snprintf( filename, len, "%.*s", (int)( at - input ), input );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// JOIN
+///--------------------------------------------------------------------------------------------------------------------
+typedef struct
+{
+   Resampler* resampler;
+   GPS_point  point;       // next position
+   int64_t    time;
+   bool       valid;
+} Resample_track;
+
+static bool resample_is_binary( const char* filename )
+{
+   size_t len = strlen( filename );
+
+   // compression extension is not part of the format
+   if ( output_codec_of( filename ) != OUTPUT_PLAIN )
+   {
+      const char* dot = strrchr( filename, '.' );
+      len = dot - filename;
+   }
+   return len >= 4 && strncasecmp( filename + len - 4, ".bin", 4 ) == 0;
+}
+
+/// Name of the track for the columns, file name without directory and extension
+static void resample_track_name( const char* filename, char* name, size_t len )
+{
+   const char* base = strrchr( filename, '/' );
+   base = ( base != NULL ) ? base + 1 : filename;
+   const char* dot = strchr( base, '.' );
+   size_t size = ( dot != NULL && dot != base ) ? (size_t)( dot - base ) : strlen( base );
+   snprintf( name, len, "%.*s", (int)size, base );
+}
+
+static bool resample_join_header( Output* output, bool binary, const char* const* inputs, int ninputs, int64_t step )
+{
+   char filename[ BUFFER_SIZE ], name[ BUFFER_SIZE ], text[ 3 * BUFFER_SIZE + 64 ];
+   double offset;
+   int loop;
+   bool ok = true;
+
+   if ( binary )
+   {
+      uint32_t count = ninputs;
+      ok = output_write( output, RESAMPLE_JOIN_MAGIC, 4 ) && output_write( output, &count, sizeof(count) ) &&
+           output_write( output, &step, sizeof(step) );
+   }
+   else
+      ok = output_write( output, "time", 4 );
+
+   for ( loop = 0; ok && loop < ninputs; loop ++ )
+   {
+      resample_input( inputs[loop], filename, sizeof(filename), &offset );
+      resample_track_name( filename, name, sizeof(name) );
+      if ( binary )
+         ok = output_write( output, name, strlen( name ) + 1 );
+      else if ( strpbrk( name, ",\"" ) != NULL )
+      {
+         // names are quoted only when they have to
+         char quoted[ 2 * BUFFER_SIZE + 2 ];
+         char* pos = quoted;
+         const char* from;
+         for ( from = name; *from != 0x00; from ++ )
+         {
+            if ( *from == '"' )
+               *pos++ = '"';
+            *pos++ = *from;
+         }
+         *pos = 0x00;
+         int len = snprintf( text, sizeof(text), ",\"%s_lat\",\"%s_lon\",\"%s_height\"", quoted, quoted, quoted );
+         ok = output_write( output, text, ( len < (int)sizeof(text) ) ? len : (int)sizeof(text) - 1 );
+      }
+      else
+      {
+         int len = snprintf( text, sizeof(text), ",%s_lat,%s_lon,%s_height", name, name, name );
+         ok = output_write( output, text, ( len < (int)sizeof(text) ) ? len : (int)sizeof(text) - 1 );
+      }
+   }
+   if ( ok && !binary )
+      ok = output_write( output, "\n", 1 );
+   return ok;
+}
+
+/// Row of the tracks that have a position at the time
+static bool resample_join_row( Output* output, bool binary, const Resample_track* tracks, int ntracks, int64_t time,
+                               char* row )
+{
+   char* pos = row;
+   int loop;
+
+   if ( binary )
+   {
+      memcpy( pos, &time, sizeof(time) );
+      pos += sizeof(time);
+      for ( loop = 0; loop < ntracks; loop ++ )
+      {
+         bool here = tracks[loop].valid && tracks[loop].time == time;
+         int32_t values[3] = { here ? tracks[loop].point.latitude  : RESAMPLE_NO_POSITION,
+                               here ? tracks[loop].point.longitude : RESAMPLE_NO_POSITION,
+                               here ? tracks[loop].point.height    : RESAMPLE_NO_POSITION };
+         memcpy( pos, values, sizeof(values) );
+         pos += sizeof(values);
+      }
+      return output_write( output, row, pos - row );
+   }
+
+   GPS_point stamp;
+   GPS_point_set_epoch( &stamp, time );
+   pos += sprintf( pos, "%04d-%02d-%02dT%02d:%02d:%02dZ", stamp.time[5], stamp.time[4], stamp.time[3], stamp.time[2],
+                   stamp.time[1], stamp.time[0] );
+   for ( loop = 0; loop < ntracks; loop ++ )
+   {
+      if ( tracks[loop].valid && tracks[loop].time == time )
+      {
+         *pos++ = ',';
+         pos += GPS_format_microdeg( pos, tracks[loop].point.latitude );
+         *pos++ = ',';
+         pos += GPS_format_microdeg( pos, tracks[loop].point.longitude );
+         pos += sprintf( pos, ",%d", tracks[loop].point.height );
+      }
+      else
+      {
+         memcpy( pos, ",,,", 3 );
+         pos += 3;
+      }
+   }
+   *pos++ = '\n';
+   return output_write( output, row, pos - row );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Resample the tracks '<track>[@<offset seconds>]' to the same grid and write them side by side to CSV or binary
+/// output. Memory used does not depend on the length of the tracks. \returns number of rows or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long resample_join( const char* output_file, const char* const* inputs, int ninputs, const Resample_options* options )
+{
+   char filename[ BUFFER_SIZE ];
+   bool binary = resample_is_binary( output_file );
+   double offset;
+   long rows = 0;
+   int loop;
+   bool ok = true;
+
+   Resample_track* tracks = (Resample_track*)calloc( ninputs, sizeof(Resample_track) );
+   // time, and for each track three numbers of up to 12 characters and separators
+   char* row = (char*)malloc( 32 + (size_t)ninputs * 48 );
+   if ( tracks == NULL || row == NULL )
+   {
+      ERROR("Out of memory!");
+      free( tracks );
+      free( row );
+      return -1;
+   }
+
+   for ( loop = 0; ok && loop < ninputs; loop ++ )
+   {
+      resample_input( inputs[loop], filename, sizeof(filename), &offset );
+      tracks[loop].resampler = resample_open( filename, options->step, options->max_gap, offset );
+      ok = ( tracks[loop].resampler != NULL );
+      if ( ok )
+      {
+         int ret = resample_next( tracks[loop].resampler, &tracks[loop].point );
+         tracks[loop].valid = ( ret > 0 );
+         tracks[loop].time  = GPS_point_epoch( &tracks[loop].point );
+         ok = ( ret >= 0 );
+      }
+   }
+
+   Output* output = ok ? output_open( output_file ) : NULL;
+   ok = ( output != NULL ) && resample_join_header( output, binary, inputs, ninputs, options->step );
+
+   while ( ok )
+   {
+      // streaming merge, the earliest grid time of the tracks is the next row
+      int64_t time = INT64_MAX;
+      for ( loop = 0; loop < ninputs; loop ++ )
+         if ( tracks[loop].valid && tracks[loop].time < time )
+            time = tracks[loop].time;
+      if ( time == INT64_MAX )
+         break;
+
+      ok = resample_join_row( output, binary, tracks, ninputs, time, row );
+      rows ++;
+      for ( loop = 0; ok && loop < ninputs; loop ++ )
+      {
+         if ( !tracks[loop].valid || tracks[loop].time != time )
+            continue;
+         int ret = resample_next( tracks[loop].resampler, &tracks[loop].point );
+         tracks[loop].valid = ( ret > 0 );
+         tracks[loop].time  = GPS_point_epoch( &tracks[loop].point );
+         ok = ( ret >= 0 );
+      }
+   }
+
+   if ( output != NULL && !ok )
+      output_abort( output );
+   else if ( output != NULL )
+      ok = output_close( output, NULL, NULL );
+
+   for ( loop = 0; loop < ninputs; loop ++ )
+      resample_close( tracks[loop].resampler );
+   free( tracks );
+   free( row );
+   DEBUG(2, "%ld rows of %d tracks joined with step %lld s", rows, ninputs, (long long)options->step );
+   return ok ? rows : -1;
+}
@@ -0,0 +1,1117 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MODULE_NAME "roads"
+
+/// Road network for map matching. Roads are read from WKT lines 'name;LINESTRING(lon lat, ..)' or MULTILINESTRING,
+/// as exported from an OSM extract, and built once to the graph file '<roads>.idx' that is used as long as the
+/// roads are unchanged (the graph file can also be given alone). Line vertices with the same coordinates are the
+/// same node, so roads are connected where they share a vertex. Each pair of consecutive vertices is a segment,
+/// travelled both ways. A grid over the area lists the segments crossing each cell.
+///
+/// Graph file: header, nodes, segments, adjacency index, adjacency, cell index, cell entries, zero terminated names.
+/// The adjacency of node n is adjacency[ index[n] .. index[n+1] ), the same for cells.
+///
+/// Tracks are matched with a hidden Markov model: the candidates of a point are the nearest segments within
+/// the search radius, at most ROADS_CANDIDATES of them. A candidate is likely when it is near the point
+/// (gaussian of the distance), and a move between candidates of consecutive points is likely when the route
+/// between them along the roads is about as long as the straight line between the points (exponential of the
+/// difference). Routes are searched with Dijkstra bounded by a few times the straight distance. Viterbi finds
+/// the most likely sequence. When no candidate of a point can be reached from the previous ones, or the time
+/// gap is too long, the chain is broken and matching starts anew.
+
+#define ROADS_MAGIC       "GTR1"
+
+#define ROADS_CELL_MIN    1000        // micro-degrees
+#define ROADS_CANDIDATES  8
+#define ROADS_SIGMA       10.0        // meters, deviation of point from the road
+#define ROADS_BETA        10.0        // meters, scale of route and straight distance difference
+#define ROADS_MAX_GAP     120         // seconds, longer gaps break the chain
+#define ROADS_NO_NODE     UINT32_MAX
+
+typedef struct
+{
+   char     magic[4];
+   uint32_t nnodes;
+   uint32_t nsegments;
+   uint32_t cols, rows;
+   int32_t  lat0, lon0;    // micro-degrees, corner of the grid
+   int32_t  cell;          // micro-degrees
+   uint32_t nentries;      // segments in cells
+   uint32_t reserved;
+   uint64_t source_size;
+   int64_t  source_mtime;
+   uint64_t names_size;
+} Roads_header;
+
+typedef struct
+{
+   int32_t lat, lon;       // micro-degrees
+} Roads_node;
+
+typedef struct
+{
+   uint32_t a, b;          // nodes
+   uint32_t name;          // offset in names
+   float    length;        // meters
+} Roads_segment;
+
+struct Roads
+{
+   void*                map;
+   size_t               map_size;
+   Roads_header         header;
+   const Roads_node*    nodes;
+   const Roads_segment* segments;
+   const uint32_t*      adjacency_index;
+   const uint32_t*      adjacency;
+   const uint32_t*      cell_index;
+   const uint32_t*      cells;
+   const char*          names;
+};
+
+typedef struct
+{
+   Roads_node*    nodes;
+   unsigned int   nnodes;
+   Roads_segment* segments;
+   unsigned int   nsegments;
+   char*          names;
+   size_t         names_size;
+   size_t         names_capacity;
+
+   // node of coordinates, open addressing
+   uint32_t*      table;
+   size_t         table_size;
+
+   uint32_t       name;       // of the line being read
+   uint32_t       previous;   // node, ROADS_NO_NODE at start of line
+} Roads_build;
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Reading roads
+///--------------------------------------------------------------------------------------------------------------------
+static bool roads_grow( void** array, unsigned int count, size_t size )
+{
+   if ( (count & 0xFFFF) != 0 )
+      return true;
+   void* more = realloc( *array, ( count + 0x10000 ) * size );
+   if ( more == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   *array = more;
+   return true;
+}
+
+static inline size_t roads_hash( int32_t lat, int32_t lon, size_t mask )
+{
+   uint64_t key = ( (uint64_t)(uint32_t)lat << 32 ) | (uint32_t)lon;
+   key ^= key >> 33;
+   key *= 0xff51afd7ed558ccdULL;
+   key ^= key >> 33;
+   return key & mask;
+}
+
+static bool roads_table_grow( Roads_build* build )
+{
+   size_t size = ( build->table_size == 0 ) ? 0x10000 : build->table_size * 2;
+   uint32_t* table = (uint32_t*)malloc( size * sizeof(uint32_t) );
+   unsigned int loop;
+
+   if ( table == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   memset( table, 0xFF, size * sizeof(uint32_t) );
+   for ( loop = 0; loop < build->nnodes; loop ++ )
+   {
+      size_t slot = roads_hash( build->nodes[loop].lat, build->nodes[loop].lon, size - 1 );
+      while ( table[slot] != ROADS_NO_NODE )
+         slot = ( slot + 1 ) & ( size - 1 );
+      table[slot] = loop;
+   }
+   free( build->table );
+   build->table      = table;
+   build->table_size = size;
+   return true;
+}
+
+/// Node of the coordinates, added if new
+static uint32_t roads_node( Roads_build* build, int32_t lat, int32_t lon )
+{
+   if ( 2 * ( build->nnodes + 1 ) > build->table_size && !roads_table_grow( build ) )
+      return ROADS_NO_NODE;
+
+   size_t slot = roads_hash( lat, lon, build->table_size - 1 );
+   for ( ; build->table[slot] != ROADS_NO_NODE; slot = ( slot + 1 ) & ( build->table_size - 1 ) )
+   {
+      const Roads_node* node = &build->nodes[ build->table[slot] ];
+      if ( node->lat == lat && node->lon == lon )
+         return build->table[slot];
+   }
+   if ( !roads_grow( (void**)&build->nodes, build->nnodes, sizeof(Roads_node) ) )
+      return ROADS_NO_NODE;
+   build->nodes[ build->nnodes ].lat = lat;
+   build->nodes[ build->nnodes ].lon = lon;
+   build->table[slot] = build->nnodes;
+   return build->nnodes ++;
+}
+
+static double roads_distance( const Roads_node* a, const Roads_node* b )
+{
+   double scale_lat = MICRODEG_METERS;
+   double scale_lon = scale_lat * cos( ( (double)a->lat + b->lat ) / 2 * MICRODEG_TO_RAD );
+   double dy = ( (double)b->lat - a->lat ) * scale_lat;
+   double dx = ( (double)b->lon - a->lon ) * scale_lon;
+   return sqrt( dx * dx + dy * dy );
+}
+
+static bool roads_add_vertex( Roads_build* build, double lon, double lat )
+{
+   if ( lat < -90.0 || lat > 90.0 || lon < -180.0 || lon > 180.0 )
+      return false;
+
+   uint32_t node = roads_node( build, (int32_t)lround( lat * 1e6 ), (int32_t)lround( lon * 1e6 ) );
+   if ( node == ROADS_NO_NODE )
+      return false;
+   if ( build->previous != ROADS_NO_NODE && build->previous != node )
+   {
+      if ( !roads_grow( (void**)&build->segments, build->nsegments, sizeof(Roads_segment) ) )
+         return false;
+      Roads_segment* segment = &build->segments[ build->nsegments ++ ];
+      segment->a      = build->previous;
+      segment->b      = node;
+      segment->name   = build->name;
+      segment->length = roads_distance( &build->nodes[ segment->a ], &build->nodes[ segment->b ] );
+   }
+   build->previous = node;
+   return true;
+}
+
+static bool roads_add_name( Roads_build* build, const char* name, size_t len )
+{
+   if ( build->names_size + len + 1 > build->names_capacity )
+   {
+      size_t capacity = ( build->names_capacity + len + 1 ) * 2;
+      char* more = (char*)realloc( build->names, capacity );
+      if ( more == NULL || build->names_size + len + 1 > UINT32_MAX )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      build->names = more;
+      build->names_capacity = capacity;
+   }
+   build->name = build->names_size;
+   memcpy( build->names + build->names_size, name, len );
+   build->names[ build->names_size + len ] = 0x00;
+   build->names_size += len + 1;
+   return true;
+}
+
+static bool roads_wkt_name( void* context, const char* name, size_t len, unsigned int linenum )
+{
+   (void)linenum;
+   return roads_add_name( (Roads_build*)context, name, len );
+}
+
+/// Level 1 is a line string, its first vertex starts a road
+static bool roads_wkt_list( void* context, unsigned int level, bool open )
+{
+   if ( level == 1 && open )
+      ((Roads_build*)context)->previous = ROADS_NO_NODE;
+   return true;
+}
+
+static bool roads_wkt_vertex( void* context, double lon, double lat )
+{
+   return roads_add_vertex( (Roads_build*)context, lon, lat );
+}
+
+static bool roads_wkt( Roads_build* build, char* text )
+{
+   static const Wkt_handler handler = { roads_wkt_name, roads_wkt_list, roads_wkt_vertex };
+
+   return wkt_read( text, "LINESTRING", 1, &handler, build );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Graph file
+///--------------------------------------------------------------------------------------------------------------------
+
+/// Cells of the segment bounding box
+static void roads_cell_range( const Roads_header* header, const Roads_node* a, const Roads_node* b,
+                              uint32_t* col0, uint32_t* col1, uint32_t* row0, uint32_t* row1 )
+{
+   int32_t lat0 = ( a->lat < b->lat ) ? a->lat : b->lat;
+   int32_t lat1 = ( a->lat < b->lat ) ? b->lat : a->lat;
+   int32_t lon0 = ( a->lon < b->lon ) ? a->lon : b->lon;
+   int32_t lon1 = ( a->lon < b->lon ) ? b->lon : a->lon;
+
+   *row0 = ( (int64_t)lat0 - header->lat0 ) / header->cell;
+   *row1 = ( (int64_t)lat1 - header->lat0 ) / header->cell;
+   *col0 = ( (int64_t)lon0 - header->lon0 ) / header->cell;
+   *col1 = ( (int64_t)lon1 - header->lon0 ) / header->cell;
+}
+
+/// Counts to start offsets, index has count + 1 entries
+static void roads_offsets( uint32_t* index, size_t count )
+{
+   uint32_t sum = 0;
+   size_t loop;
+
+   for ( loop = 0; loop <= count; loop ++ )
+   {
+      uint32_t value = index[loop];
+      index[loop] = sum;
+      sum += value;
+   }
+}
+
+static bool roads_write( const Roads_build* build, Roads_header* header, const char* index_file )
+{
+   unsigned int loop;
+   uint32_t col0, col1, row0, row1, col, row;
+   int32_t lat0 = INT32_MAX, lon0 = INT32_MAX, lat1 = INT32_MIN, lon1 = INT32_MIN;
+
+   for ( loop = 0; loop < build->nnodes; loop ++ )
+   {
+      lat0 = ( build->nodes[loop].lat < lat0 ) ? build->nodes[loop].lat : lat0;
+      lat1 = ( build->nodes[loop].lat > lat1 ) ? build->nodes[loop].lat : lat1;
+      lon0 = ( build->nodes[loop].lon < lon0 ) ? build->nodes[loop].lon : lon0;
+      lon1 = ( build->nodes[loop].lon > lon1 ) ? build->nodes[loop].lon : lon1;
+   }
+
+   // cells grow until there are about as many as segments
+   header->lat0 = lat0;
+   header->lon0 = lon0;
+   header->cell = ROADS_CELL_MIN;
+   while ( true )
+   {
+      header->rows = ( (int64_t)lat1 - lat0 ) / header->cell + 1;
+      header->cols = ( (int64_t)lon1 - lon0 ) / header->cell + 1;
+      if ( (uint64_t)header->rows * header->cols <= 2 * (uint64_t)build->nsegments + 1024 )
+         break;
+      header->cell = header->cell * 2;
+   }
+   size_t ncells = (size_t)header->rows * header->cols;
+
+   uint32_t* adjacency_index = (uint32_t*)calloc( build->nnodes + 1, sizeof(uint32_t) );
+   uint32_t* adjacency       = (uint32_t*)malloc( 2 * (size_t)build->nsegments * sizeof(uint32_t) + 1 );
+   uint32_t* cell_index      = (uint32_t*)calloc( ncells + 1, sizeof(uint32_t) );
+   uint32_t* cells           = NULL;
+   bool ok = ( adjacency_index != NULL && adjacency != NULL && cell_index != NULL );
+
+   if ( ok )
+   {
+      // count, offsets and fill, the index is moved back by the fill
+      for ( loop = 0; loop < build->nsegments; loop ++ )
+      {
+         adjacency_index[ build->segments[loop].a ] ++;
+         adjacency_index[ build->segments[loop].b ] ++;
+         roads_cell_range( header, &build->nodes[ build->segments[loop].a ], &build->nodes[ build->segments[loop].b ],
+                           &col0, &col1, &row0, &row1 );
+         for ( row = row0; row <= row1; row ++ )
+            for ( col = col0; col <= col1; col ++ )
+               cell_index[ (size_t)row * header->cols + col ] ++;
+      }
+      roads_offsets( adjacency_index, build->nnodes );
+      roads_offsets( cell_index, ncells );
+      header->nentries = cell_index[ ncells ];
+      cells = (uint32_t*)malloc( (size_t)header->nentries * sizeof(uint32_t) + 1 );
+      ok = ( cells != NULL );
+   }
+   if ( ok )
+   {
+      for ( loop = 0; loop < build->nsegments; loop ++ )
+      {
+         adjacency[ adjacency_index[ build->segments[loop].a ] ++ ] = loop;
+         adjacency[ adjacency_index[ build->segments[loop].b ] ++ ] = loop;
+         roads_cell_range( header, &build->nodes[ build->segments[loop].a ], &build->nodes[ build->segments[loop].b ],
+                           &col0, &col1, &row0, &row1 );
+         for ( row = row0; row <= row1; row ++ )
+            for ( col = col0; col <= col1; col ++ )
+               cells[ cell_index[ (size_t)row * header->cols + col ] ++ ] = loop;
+      }
+      memmove( adjacency_index + 1, adjacency_index, build->nnodes * sizeof(uint32_t) );
+      adjacency_index[0] = 0;
+      memmove( cell_index + 1, cell_index, ncells * sizeof(uint32_t) );
+      cell_index[0] = 0;
+   }
+   else
+      ERROR("Out of memory!");
+
+   if ( ok )
+   {
+      char* tmpname = (char*)malloc( strlen( index_file ) + 5 );
+      if ( tmpname == NULL )
+      {
+         ERROR("Out of memory!");
+         free( adjacency_index );
+         free( adjacency );
+         free( cell_index );
+         free( cells );
+         return false;
+      }
+      sprintf( tmpname, "%s.tmp", index_file );
+      FILE* fid = fopen( tmpname, "wb" );
+      ok = fid != NULL && fwrite( header, sizeof(Roads_header), 1, fid ) == 1 &&
+           fwrite( build->nodes, sizeof(Roads_node), build->nnodes, fid ) == build->nnodes &&
+           fwrite( build->segments, sizeof(Roads_segment), build->nsegments, fid ) == build->nsegments &&
+           fwrite( adjacency_index, sizeof(uint32_t), build->nnodes + 1, fid ) == build->nnodes + 1 &&
+           fwrite( adjacency, sizeof(uint32_t), 2 * (size_t)build->nsegments, fid ) == 2 * (size_t)build->nsegments &&
+           fwrite( cell_index, sizeof(uint32_t), ncells + 1, fid ) == ncells + 1 &&
+           fwrite( cells, sizeof(uint32_t), header->nentries, fid ) == header->nentries &&
+           fwrite( build->names, 1, build->names_size, fid ) == build->names_size;
+      if ( fid != NULL && fclose( fid ) != 0 )
+         ok = false;
+      if ( !ok || rename( tmpname, index_file ) != 0 )
+      {
+         ERROR("Cannot write file '%s': %s", index_file, strerror(errno) );
+         unlink( tmpname );
+         ok = false;
+      }
+      free( tmpname );
+   }
+   free( adjacency_index );
+   free( adjacency );
+   free( cell_index );
+   free( cells );
+   return ok;
+}
+
+static bool roads_build( const char* filename, const char* index_file, const struct stat* source )
+{
+   Roads_build build;
+   Roads_header header;
+
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   char* text = (char*)malloc( source->st_size + 1 );
+   bool ok = ( text != NULL ) && fread( text, 1, source->st_size, fid ) == (size_t)source->st_size;
+   fclose( fid );
+   if ( !ok )
+   {
+      ERROR("Cannot read file '%s'", filename );
+      free( text );
+      return false;
+   }
+   text[ source->st_size ] = 0x00;
+
+   memset( &build, 0, sizeof(build) );
+   ok = roads_wkt( &build, text );
+   free( text );
+   if ( ok && build.nsegments == 0 )
+   {
+      ERROR("No roads in '%s'", filename );
+      ok = false;
+   }
+   if ( ok )
+   {
+      memset( &header, 0, sizeof(header) );
+      memcpy( header.magic, ROADS_MAGIC, 4 );
+      header.nnodes       = build.nnodes;
+      header.nsegments    = build.nsegments;
+      header.source_size  = source->st_size;
+      header.source_mtime = source->st_mtime;
+      header.names_size   = build.names_size;
+      ok = roads_write( &build, &header, index_file );
+      DEBUG(2, "%u road segments and %u nodes of '%s' in %u x %u cells", build.nsegments, build.nnodes, filename,
+            header.cols, header.rows );
+   }
+   free( build.nodes );
+   free( build.segments );
+   free( build.names );
+   free( build.table );
+   return ok;
+}
+
+/// Map the graph, NULL if it is missing or does not match the roads. Without source any graph file is taken.
+static Roads* roads_map( const char* index_file, const struct stat* source )
+{
+   struct stat info;
+   Roads_header header;
+
+   int fd = open( index_file, O_RDONLY );
+   if ( fd < 0 )
+      return NULL;
+
+   bool ok = fstat( fd, &info ) == 0 && (size_t)info.st_size >= sizeof(header) &&
+             pread( fd, &header, sizeof(header), 0 ) == sizeof(header) &&
+             memcmp( header.magic, ROADS_MAGIC, 4 ) == 0 &&
+             ( source == NULL || ( header.source_size == (uint64_t)source->st_size &&
+                                   header.source_mtime == (int64_t)source->st_mtime ) ) &&
+             (uint64_t)info.st_size == sizeof(header) + (uint64_t)header.nnodes * sizeof(Roads_node) +
+                                       (uint64_t)header.nsegments * sizeof(Roads_segment) +
+                                       ( header.nnodes + 1 + 2 * (uint64_t)header.nsegments ) * sizeof(uint32_t) +
+                                       ( (uint64_t)header.cols * header.rows + 1 + header.nentries ) * sizeof(uint32_t) +
+                                       header.names_size;
+
+   Roads* roads = ok ? (Roads*)calloc( 1, sizeof(Roads) ) : NULL;
+   if ( roads != NULL )
+   {
+      roads->map_size = info.st_size;
+      roads->map = mmap( NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+      if ( roads->map == MAP_FAILED )
+      {
+         ERROR("Cannot map file '%s': %s", index_file, strerror(errno) );
+         free( roads );
+         roads = NULL;
+      }
+   }
+   close( fd );
+   if ( roads == NULL )
+      return NULL;
+
+   roads->header          = header;
+   roads->nodes           = (const Roads_node*)( (const char*)roads->map + sizeof(header) );
+   roads->segments        = (const Roads_segment*)( roads->nodes + header.nnodes );
+   roads->adjacency_index = (const uint32_t*)( roads->segments + header.nsegments );
+   roads->adjacency       = roads->adjacency_index + header.nnodes + 1;
+   roads->cell_index      = roads->adjacency + 2 * (size_t)header.nsegments;
+   roads->cells           = roads->cell_index + (size_t)header.cols * header.rows + 1;
+   roads->names           = (const char*)( roads->cells + header.nentries );
+   return roads;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Open road network, the graph '<filename>.idx' is built if it is missing or older than the roads. A graph
+/// file is also opened as such.
+///--------------------------------------------------------------------------------------------------------------------
+Roads* roads_open( const char* filename )
+{
+   char index_file[ BUFFER_SIZE ];
+   struct stat source;
+
+   if ( stat( filename, &source ) != 0 )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      return NULL;
+   }
+   Roads* roads = roads_map( filename, NULL );
+   if ( roads != NULL )
+      return roads;
+
+   snprintf( index_file, sizeof(index_file), "%s.idx", filename );
+   roads = roads_map( index_file, &source );
+   if ( roads != NULL )
+      return roads;
+
+   DEBUG(2, "building road graph '%s'", index_file );
+   if ( !roads_build( filename, index_file, &source ) )
+      return NULL;
+   return roads_map( index_file, &source );
+}
+
+unsigned int roads_count( const Roads* roads )
+{
+   return roads->header.nsegments;
+}
+
+void roads_close( Roads* roads )
+{
+   if ( roads == NULL )
+      return;
+   munmap( roads->map, roads->map_size );
+   free( roads );
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Matching
+///--------------------------------------------------------------------------------------------------------------------
+typedef struct
+{
+   uint32_t segment;
+   float    fraction;    // position along the segment from a to b
+   float    distance;    // meters from the point
+   int32_t  lat, lon;    // position on the segment
+   int      back;        // candidate of the previous step, -1 at start of chain
+   double   score;       // log probability of the best sequence ending here
+} Roads_candidate;
+
+typedef struct
+{
+   unsigned int point;
+   unsigned int first;   // candidates
+   unsigned int count;
+   bool         start;   // of chain
+   int          chosen;
+} Roads_step;
+
+typedef struct
+{
+   double   cost;
+   uint32_t node;
+} Roads_heap_entry;
+
+typedef struct
+{
+   const Roads*      roads;
+   double            radius;
+
+   // search state by node, valid when stamp matches
+   double*           cost;
+   uint32_t*         via;       // segment reached by, ROADS_NO_NODE from the start candidate
+   uint32_t*         stamp;
+   uint32_t          current;
+   uint32_t*         seen;      // segments already taken as candidates, by stamp
+   uint32_t*         path;      // segments of a route back from its end, a route visits a node once at most
+   Roads_heap_entry* heap;
+   size_t            nheap;
+   size_t            heap_capacity;
+
+   Roads_step*       steps;
+   unsigned int      nsteps;
+   Roads_candidate*  candidates;
+   unsigned int      ncandidates;
+   unsigned int      breaks;
+} Roads_matcher;
+
+/// Edge row of the travel time CSV, pieces of route on the same segment are joined
+typedef struct
+{
+   FILE*    fid;
+   uint32_t segment;       // ROADS_NO_NODE when there is no row
+   double   entered, left; // epoch seconds
+   double   meters;
+   long     rows;
+} Roads_edges;
+
+static bool roads_heap_push( Roads_matcher* matcher, double cost, uint32_t node )
+{
+   if ( matcher->nheap == matcher->heap_capacity )
+   {
+      size_t capacity = matcher->heap_capacity * 2 + 256;
+      Roads_heap_entry* more = (Roads_heap_entry*)realloc( matcher->heap, capacity * sizeof(Roads_heap_entry) );
+      if ( more == NULL )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      matcher->heap = more;
+      matcher->heap_capacity = capacity;
+   }
+   size_t pos = matcher->nheap ++;
+   while ( pos > 0 && matcher->heap[ ( pos - 1 ) / 2 ].cost > cost )
+   {
+      matcher->heap[pos] = matcher->heap[ ( pos - 1 ) / 2 ];
+      pos = ( pos - 1 ) / 2;
+   }
+   matcher->heap[pos].cost = cost;
+   matcher->heap[pos].node = node;
+   return true;
+}
+
+static Roads_heap_entry roads_heap_pop( Roads_matcher* matcher )
+{
+   Roads_heap_entry top = matcher->heap[0];
+   Roads_heap_entry last = matcher->heap[ -- matcher->nheap ];
+   size_t pos = 0;
+
+   while ( true )
+   {
+      size_t child = 2 * pos + 1;
+      if ( child >= matcher->nheap )
+         break;
+      if ( child + 1 < matcher->nheap && matcher->heap[ child + 1 ].cost < matcher->heap[child].cost )
+         child ++;
+      if ( matcher->heap[child].cost >= last.cost )
+         break;
+      matcher->heap[pos] = matcher->heap[child];
+      pos = child;
+   }
+   if ( matcher->nheap > 0 )
+      matcher->heap[pos] = last;
+   return top;
+}
+
+static inline bool roads_reached( const Roads_matcher* matcher, uint32_t node )
+{
+   return matcher->stamp[node] == matcher->current;
+}
+
+static bool roads_relax( Roads_matcher* matcher, uint32_t node, double cost, uint32_t via )
+{
+   if ( roads_reached( matcher, node ) && matcher->cost[node] <= cost )
+      return true;
+   matcher->stamp[node] = matcher->current;
+   matcher->cost[node]  = cost;
+   matcher->via[node]   = via;
+   return roads_heap_push( matcher, cost, node );
+}
+
+/// Shortest routes from the candidate position to nodes, up to 'limit' meters or until all targets are settled.
+/// \returns false when out of memory
+static bool roads_search( Roads_matcher* matcher, const Roads_candidate* from, const Roads_candidate* targets,
+                          unsigned int ntargets, double limit )
+{
+   const Roads* roads = matcher->roads;
+   const Roads_segment* segment = &roads->segments[ from->segment ];
+   unsigned int remaining = 2 * ntargets;
+
+   matcher->current ++;
+   matcher->nheap = 0;
+   if ( !roads_relax( matcher, segment->a, from->fraction * segment->length, ROADS_NO_NODE ) ||
+        !roads_relax( matcher, segment->b, ( 1.0 - from->fraction ) * segment->length, ROADS_NO_NODE ) )
+      return false;
+
+   while ( matcher->nheap > 0 && remaining > 0 )
+   {
+      Roads_heap_entry entry = roads_heap_pop( matcher );
+      if ( entry.cost > limit )
+         break;
+      if ( entry.cost > matcher->cost[ entry.node ] )
+         continue;
+
+      unsigned int loop;
+      for ( loop = 0; loop < ntargets; loop ++ )
+      {
+         const Roads_segment* target = &roads->segments[ targets[loop].segment ];
+         remaining -= ( target->a == entry.node ) + ( target->b == entry.node );
+      }
+
+      uint32_t edge;
+      for ( edge = roads->adjacency_index[ entry.node ]; edge < roads->adjacency_index[ entry.node + 1 ]; edge ++ )
+      {
+         const Roads_segment* next = &roads->segments[ roads->adjacency[edge] ];
+         uint32_t node = ( next->a == entry.node ) ? next->b : next->a;
+         if ( !roads_relax( matcher, node, entry.cost + next->length, roads->adjacency[edge] ) )
+            return false;
+      }
+   }
+   return true;
+}
+
+/// Length of route from the searched candidate to the target, HUGE_VAL if not reached. 'end' is the node the
+/// route enters the target segment from, ROADS_NO_NODE when it stays on the segment of the start.
+static double roads_route( const Roads_matcher* matcher, const Roads_candidate* from, const Roads_candidate* to,
+                           uint32_t* end )
+{
+   const Roads_segment* segment = &matcher->roads->segments[ to->segment ];
+   double best = HUGE_VAL;
+
+   *end = ROADS_NO_NODE;
+   if ( from->segment == to->segment )
+      best = fabs( from->fraction - to->fraction ) * segment->length;
+   if ( roads_reached( matcher, segment->a ) && matcher->cost[ segment->a ] + to->fraction * segment->length < best )
+   {
+      best = matcher->cost[ segment->a ] + to->fraction * segment->length;
+      *end = segment->a;
+   }
+   if ( roads_reached( matcher, segment->b ) &&
+        matcher->cost[ segment->b ] + ( 1.0 - to->fraction ) * segment->length < best )
+   {
+      best = matcher->cost[ segment->b ] + ( 1.0 - to->fraction ) * segment->length;
+      *end = segment->b;
+   }
+   return best;
+}
+
+/// Nearest segments within radius as candidates of the point, at most ROADS_CANDIDATES
+static bool roads_candidates( Roads_matcher* matcher, const GPS_point* point )
+{
+   const Roads* roads = matcher->roads;
+   const Roads_header* header = &roads->header;
+   Roads_candidate found[ ROADS_CANDIDATES ];
+   unsigned int nfound = 0, loop;
+
+   double scale_lat = MICRODEG_METERS;
+   double scale_lon = scale_lat * cos( point->latitude * MICRODEG_TO_RAD );
+   int64_t reach_lat = (int64_t)( matcher->radius / scale_lat ) + 1;
+   int64_t reach_lon = (int64_t)( matcher->radius / scale_lon ) + 1;
+   int64_t row0 = ( point->latitude - reach_lat - (int64_t)header->lat0 ) / header->cell;
+   int64_t row1 = ( point->latitude + reach_lat - (int64_t)header->lat0 ) / header->cell;
+   int64_t col0 = ( point->longitude - reach_lon - (int64_t)header->lon0 ) / header->cell;
+   int64_t col1 = ( point->longitude + reach_lon - (int64_t)header->lon0 ) / header->cell;
+   row0 = ( row0 < 0 ) ? 0 : row0;
+   col0 = ( col0 < 0 ) ? 0 : col0;
+   row1 = ( row1 >= header->rows ) ? (int64_t)header->rows - 1 : row1;
+   col1 = ( col1 >= header->cols ) ? (int64_t)header->cols - 1 : col1;
+
+   matcher->current ++;
+   for ( int64_t row = row0; row <= row1; row ++ )
+   {
+      for ( int64_t col = col0; col <= col1; col ++ )
+      {
+         size_t cell = (size_t)row * header->cols + col;
+         uint32_t entry;
+         for ( entry = roads->cell_index[cell]; entry < roads->cell_index[ cell + 1 ]; entry ++ )
+         {
+            uint32_t index = roads->cells[entry];
+            if ( matcher->seen[index] == matcher->current )
+               continue;
+            matcher->seen[index] = matcher->current;
+
+            // projection in local meters around the point
+            const Roads_segment* segment = &roads->segments[index];
+            const Roads_node* a = &roads->nodes[ segment->a ];
+            const Roads_node* b = &roads->nodes[ segment->b ];
+            double ax = ( (double)a->lon - point->longitude ) * scale_lon, ay = ( (double)a->lat - point->latitude ) * scale_lat;
+            double bx = ( (double)b->lon - point->longitude ) * scale_lon, by = ( (double)b->lat - point->latitude ) * scale_lat;
+            double dx = bx - ax, dy = by - ay;
+            double length2 = dx * dx + dy * dy;
+            double t = ( length2 > 0 ) ? -( ax * dx + ay * dy ) / length2 : 0.0;
+            t = ( t < 0 ) ? 0 : ( ( t > 1 ) ? 1 : t );
+            double px = ax + t * dx, py = ay + t * dy;
+            double distance = sqrt( px * px + py * py );
+            if ( distance > matcher->radius )
+               continue;
+            if ( nfound == ROADS_CANDIDATES && distance >= found[ nfound - 1 ].distance )
+               continue;
+
+            // sorted insert
+            unsigned int pos = ( nfound < ROADS_CANDIDATES ) ? nfound ++ : nfound - 1;
+            while ( pos > 0 && found[ pos - 1 ].distance > distance )
+            {
+               found[pos] = found[ pos - 1 ];
+               pos --;
+            }
+            found[pos].segment  = index;
+            found[pos].fraction = t;
+            found[pos].distance = distance;
+            found[pos].lat      = a->lat + (int32_t)lround( t * ( (double)b->lat - a->lat ) );
+            found[pos].lon      = a->lon + (int32_t)lround( t * ( (double)b->lon - a->lon ) );
+            found[pos].back     = -1;
+            found[pos].score    = -HUGE_VAL;
+         }
+      }
+   }
+
+   if ( nfound == 0 )
+      return true;
+   if ( ( matcher->ncandidates & 0xFFFF ) + ROADS_CANDIDATES > 0x10000 || matcher->ncandidates == 0 )
+   {
+      // room for a whole step at a time
+      size_t capacity = ( ( matcher->ncandidates + ROADS_CANDIDATES ) | 0xFFFF ) + 1;
+      Roads_candidate* more = (Roads_candidate*)realloc( matcher->candidates, capacity * sizeof(Roads_candidate) );
+      if ( more == NULL )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      matcher->candidates = more;
+   }
+   if ( !roads_grow( (void**)&matcher->steps, matcher->nsteps, sizeof(Roads_step) ) )
+      return false;
+
+   Roads_step* step = &matcher->steps[ matcher->nsteps ++ ];
+   step->first  = matcher->ncandidates;
+   step->count  = nfound;
+   step->start  = false;
+   step->chosen = -1;
+   for ( loop = 0; loop < nfound; loop ++ )
+      matcher->candidates[ matcher->ncandidates ++ ] = found[loop];
+   return true;
+}
+
+static inline double roads_emission( const Roads_candidate* candidate )
+{
+   double z = candidate->distance / ROADS_SIGMA;
+   return -0.5 * z * z;
+}
+
+/// Most likely candidates of a chain ending at step 'last', following the back pointers
+static void roads_backtrack( Roads_matcher* matcher, unsigned int last )
+{
+   Roads_step* step = &matcher->steps[last];
+   unsigned int loop;
+   int best = 0;
+
+   for ( loop = 1; loop < step->count; loop ++ )
+      if ( matcher->candidates[ step->first + loop ].score > matcher->candidates[ step->first + best ].score )
+         best = loop;
+   while ( true )
+   {
+      step->chosen = best;
+      if ( step->start )
+         break;
+      best = matcher->candidates[ step->first + best ].back;
+      step --;
+   }
+}
+
+/// Viterbi over the steps, \returns false when out of memory
+static bool roads_viterbi( Roads_matcher* matcher, const GPS_point* points )
+{
+   unsigned int loop, i, j;
+
+   for ( loop = 0; loop < matcher->nsteps; loop ++ )
+   {
+      Roads_step* step = &matcher->steps[loop];
+      Roads_candidate* current = &matcher->candidates[ step->first ];
+      bool reached = false;
+
+      if ( loop > 0 )
+      {
+         const Roads_step* previous = &matcher->steps[ loop - 1 ];
+         const Roads_candidate* before = &matcher->candidates[ previous->first ];
+         const GPS_point* a = &points[ previous->point ];
+         const GPS_point* b = &points[ step->point ];
+         int64_t gap = GPS_point_epoch( b ) - GPS_point_epoch( a );
+         Roads_node na = { a->latitude, a->longitude }, nb = { b->latitude, b->longitude };
+         double straight = roads_distance( &na, &nb );
+         double limit = 2 * straight + 2 * matcher->radius + 100.0;
+
+         for ( i = 0; gap <= ROADS_MAX_GAP && i < previous->count; i ++ )
+         {
+            if ( before[i].score == -HUGE_VAL )
+               continue;
+            if ( !roads_search( matcher, &before[i], current, step->count, limit ) )
+               return false;
+            for ( j = 0; j < step->count; j ++ )
+            {
+               uint32_t end;
+               double route = roads_route( matcher, &before[i], &current[j], &end );
+               if ( route == HUGE_VAL )
+                  continue;
+               double score = before[i].score - fabs( route - straight ) / ROADS_BETA + roads_emission( &current[j] );
+               if ( score > current[j].score )
+               {
+                  current[j].score = score;
+                  current[j].back  = i;
+                  reached = true;
+               }
+            }
+         }
+         if ( !reached )
+         {
+            roads_backtrack( matcher, loop - 1 );
+            matcher->breaks ++;
+         }
+      }
+      if ( !reached )
+      {
+         step->start = true;
+         for ( j = 0; j < step->count; j ++ )
+         {
+            current[j].score = roads_emission( &current[j] );
+            current[j].back  = -1;
+         }
+      }
+   }
+   if ( matcher->nsteps > 0 )
+      roads_backtrack( matcher, matcher->nsteps - 1 );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Travel times of edges
+///--------------------------------------------------------------------------------------------------------------------
+static void roads_edges_flush( const Roads* roads, Roads_edges* edges )
+{
+   GPS_point entered, left;
+
+   if ( edges->segment == ROADS_NO_NODE || edges->fid == NULL )
+      return;
+   GPS_point_set_epoch( &entered, (int64_t)floor( edges->entered + 0.5 ) );
+   GPS_point_set_epoch( &left, (int64_t)floor( edges->left + 0.5 ) );
+
+   const char* name = roads->names + roads->segments[ edges->segment ].name;
+   fprintf( edges->fid, "%u,", edges->segment );
+   if ( strpbrk( name, ",\"\n" ) != NULL )
+   {
+      fputc( '"', edges->fid );
+      for ( ; *name != 0x00; name ++ )
+      {
+         if ( *name == '"' )
+            fputc( '"', edges->fid );
+         fputc( *name, edges->fid );
+      }
+      fputc( '"', edges->fid );
+   }
+   else
+      fputs( name, edges->fid );
+   fprintf( edges->fid, ",%04d-%02d-%02dT%02d:%02d:%02dZ,%04d-%02d-%02dT%02d:%02d:%02dZ,%.1f,%.1f\n",
+            entered.time[5], entered.time[4], entered.time[3], entered.time[2], entered.time[1], entered.time[0],
+            left.time[5], left.time[4], left.time[3], left.time[2], left.time[1], left.time[0],
+            edges->left - edges->entered, edges->meters );
+   edges->rows ++;
+   edges->segment = ROADS_NO_NODE;
+}
+
+/// Piece of the route travelled on a segment between the times
+static void roads_edges_add( const Roads* roads, Roads_edges* edges, uint32_t segment, double meters,
+                             double entered, double left )
+{
+   if ( edges->segment != segment )
+   {
+      roads_edges_flush( roads, edges );
+      edges->segment = segment;
+      edges->entered = entered;
+      edges->meters  = 0;
+   }
+   edges->left    = left;
+   edges->meters += meters;
+}
+
+/// Route between the chosen candidates of consecutive steps as pieces of segments, time shared by length.
+/// \returns false when out of memory
+static bool roads_edges_route( Roads_matcher* matcher, Roads_edges* edges, const Roads_candidate* from,
+                               const Roads_candidate* to, double t0, double t1 )
+{
+   const Roads* roads = matcher->roads;
+   uint32_t* path = matcher->path;
+   unsigned int npath = 0;
+   uint32_t end, node;
+
+   // same search as in Viterbi, this time the path is followed back
+   Roads_node na = { from->lat, from->lon }, nb = { to->lat, to->lon };
+   double limit = 2 * roads_distance( &na, &nb ) + 2 * matcher->radius + 100.0;
+   if ( !roads_search( matcher, from, to, 1, limit ) )
+      return false;
+   double total = roads_route( matcher, from, to, &end );
+   if ( total == HUGE_VAL )
+      return true;
+
+   if ( end == ROADS_NO_NODE || total <= 0 )
+   {
+      roads_edges_add( roads, edges, to->segment, total, t0, t1 );
+      return true;
+   }
+   for ( node = end; matcher->via[node] != ROADS_NO_NODE; )
+   {
+      const Roads_segment* segment = &roads->segments[ matcher->via[node] ];
+      path[ npath ++ ] = matcher->via[node];
+      node = ( segment->a == node ) ? segment->b : segment->a;
+   }
+
+   // start segment to the node the route leaves it from, the path in order, and the target segment
+   const Roads_segment* first = &roads->segments[ from->segment ];
+   const Roads_segment* last  = &roads->segments[ to->segment ];
+   double rate = ( t1 - t0 ) / total;
+   double at = t0;
+   double meters = ( node == first->a ) ? from->fraction * first->length : ( 1.0 - from->fraction ) * first->length;
+   roads_edges_add( roads, edges, from->segment, meters, at, at + meters * rate );
+   at += meters * rate;
+   while ( npath > 0 )
+   {
+      const Roads_segment* segment = &roads->segments[ path[ -- npath ] ];
+      roads_edges_add( roads, edges, path[ npath ], segment->length, at, at + segment->length * rate );
+      at += segment->length * rate;
+   }
+   meters = ( end == last->a ) ? to->fraction * last->length : ( 1.0 - to->fraction ) * last->length;
+   roads_edges_add( roads, edges, to->segment, meters, at, t1 );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Match points to the roads within radius meters and write them snapped on the roads, points without road are
+/// written as they are. The travel time of each road segment driven is written to CSV file 'edges_file', if given.
+/// \returns number of points matched or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long roads_match( const Roads* roads, const GPS_points* points, double radius, GPS_writer* writer,
+                  const char* edges_file )
+{
+   Roads_matcher matcher;
+   Roads_edges edges;
+   FILE* edges_fid = NULL;
+   unsigned int loop;
+   bool ok = true;
+
+   memset( &matcher, 0, sizeof(matcher) );
+   matcher.roads  = roads;
+   matcher.radius = radius;
+   matcher.cost   = (double*)malloc( roads->header.nnodes * sizeof(double) + 1 );
+   matcher.via    = (uint32_t*)malloc( roads->header.nnodes * sizeof(uint32_t) + 1 );
+   matcher.stamp  = (uint32_t*)calloc( roads->header.nnodes + 1, sizeof(uint32_t) );
+   matcher.seen   = (uint32_t*)calloc( roads->header.nsegments + 1, sizeof(uint32_t) );
+   matcher.path   = (uint32_t*)malloc( roads->header.nnodes * sizeof(uint32_t) + 1 );
+   if ( matcher.cost == NULL || matcher.via == NULL || matcher.stamp == NULL || matcher.seen == NULL ||
+        matcher.path == NULL )
+   {
+      ERROR("Out of memory!");
+      ok = false;
+   }
+
+   for ( loop = 0; ok && loop < points->npoints; loop ++ )
+   {
+      unsigned int nsteps = matcher.nsteps;
+      ok = roads_candidates( &matcher, &points->points[loop] );
+      if ( ok && matcher.nsteps > nsteps )
+         matcher.steps[ nsteps ].point = loop;
+   }
+   if ( ok )
+      ok = roads_viterbi( &matcher, points->points );
+
+   memset( &edges, 0, sizeof(edges) );
+   edges.segment = ROADS_NO_NODE;
+   if ( ok && edges_file != NULL )
+   {
+      edges_fid = fopen( edges_file, "wb" );
+      if ( edges_fid == NULL )
+      {
+         ERROR("Cannot open file '%s': %s", edges_file, strerror(errno) );
+         ok = false;
+      }
+      else
+         fputs( "edge,name,entered,left,seconds,meters\n", edges_fid );
+   }
+   edges.fid = edges_fid;
+
+   unsigned int step = 0;
+   for ( loop = 0; ok && loop < points->npoints; loop ++ )
+   {
+      GPS_point point = points->points[loop];
+      if ( step < matcher.nsteps && matcher.steps[step].point == loop )
+      {
+         const Roads_step* current = &matcher.steps[step];
+         const Roads_candidate* chosen = &matcher.candidates[ current->first + current->chosen ];
+         point.latitude  = chosen->lat;
+         point.longitude = chosen->lon;
+
+         if ( edges_fid != NULL && !current->start )
+         {
+            const Roads_step* previous = &matcher.steps[ step - 1 ];
+            if ( !roads_edges_route( &matcher, &edges, &matcher.candidates[ previous->first + previous->chosen ],
+                                     chosen, GPS_point_epoch( &points->points[ previous->point ] ),
+                                     GPS_point_epoch( &points->points[loop] ) ) )
+            {
+               ok = false;
+               break;
+            }
+         }
+         else if ( edges_fid != NULL )
+            roads_edges_flush( roads, &edges );
+         step ++;
+      }
+      ok = GPS_writer_append( writer, &point );
+   }
+   roads_edges_flush( roads, &edges );
+   if ( edges_fid != NULL && fclose( edges_fid ) != 0 )
+   {
+      ERROR("Cannot write file '%s': %s", edges_file, strerror(errno) );
+      ok = false;
+   }
+
+   long matched = ok ? (long)matcher.nsteps : -1;
+   DEBUG(2, "%u points matched in %u chains, %ld edge rows", matcher.nsteps, matcher.breaks + ( matcher.nsteps > 0 ),
+         edges.rows );
+   free( matcher.cost );
+   free( matcher.via );
+   free( matcher.stamp );
+   free( matcher.seen );
+   free( matcher.path );
+   free( matcher.heap );
+   free( matcher.steps );
+   free( matcher.candidates );
+   return matched;
+}
@@ -8,6 +8,11 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>                    
+#include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
                     
 #include "common.h"
 
@@ -20,13 +25,60 @@
 
 #include "messages.h"
 
-static bool compare_responce( const unsigned char* input, const unsigned char* orig, unsigned int orig_len, unsigned int msg_len ) ;
-static int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsigned int* red_bytes);
-
 static bool serial_write(int serial_fd,  const unsigned char* message, unsigned int len) ;
+static int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsigned int* red_bytes, int cmd);
 static int serial_set_highspeed( int serial_fd , unsigned char* buffer  );
 static void print_message( unsigned char* buffer, int len );
 
+static double serial_time_now( void );
+static void serial_timing_sample( int cmd );
+static void serial_timing_backoff( int cmd );
+
+static const char* serial_cmd_names[ SERIAL_CMD_COUNT ] = { "handshake", "reset", "sampling", "download", "entry" };
+static Serial_timing serial_timing[ SERIAL_CMD_COUNT ];
+static bool          serial_timing_ready = false;
+
+/// Link counters of the session, the decode thread adds to them too
+static Serial_counters serial_counters;
+#define SERIAL_COUNT( field, n ) __atomic_add_fetch( &serial_counters.field, (n), __ATOMIC_RELAXED )
+
+/// Time of last completed write and whether any read has timed out after it
+static double serial_write_time  = 0.0;
+static bool   serial_write_retry = false;
+
+/// A download is done by two threads: the calling thread only talks to the device and queues the raw entries,
+/// a decode thread checks, converts and prints them and gives the points to the arena and sink. A slow consumer
+/// does not delay the next request on the wire until the queue is full. The queue has one producer and one
+/// consumer, both only advance their own counter; a side that has to wait sleeps on a futex that the other
+/// side wakes only when someone waits.
+
+#define SERIAL_ENTRY_SIZE    20
+#define SERIAL_ENTRY_TRIES   10     // reads of an entry before it is given up
+#define SERIAL_QUEUE_ENTRIES 4096   // power of two
+
+typedef struct
+{
+   uint32_t value;     // changes on every post
+   uint32_t waiting;
+} Serial_signal;
+
+typedef struct
+{
+   unsigned char  entries[ SERIAL_QUEUE_ENTRIES ][ SERIAL_ENTRY_SIZE ];
+   
+   uint32_t       head __attribute__((aligned(64)));   // entries queued, by the I/O thread
+   uint32_t       done;                                // no more entries come
+   Serial_signal  filled;
+   
+   uint32_t       tail __attribute__((aligned(64)));   // entries decoded, by the decode thread
+   int            status;                              // failure of the decode thread, it stops
+   Serial_signal  emptied;
+   
+   GPS_arena*     data;
+   GPS_point_sink sink;
+   void*          context;
+} Serial_queue;
+
 
 
 ///--------------------------------------------------------------------------------------------------------------------
@@ -44,16 +96,19 @@ int serial_clear_datapoints( int serial_fd, unsigned char* buffer )
 }
 
 
-float convert_float( const unsigned char* buffer )
+///--------------------------------------------------------------------------------------------------------------------
+/// Coordinate in micro-degrees, kept exact as fixed point
+///--------------------------------------------------------------------------------------------------------------------
+int32_t convert_coordinate( const unsigned char* buffer )
 {
-   uint64_t value = 0;
+   uint32_t value = 0;
    value = value + buffer[0];
    value = value + (buffer[1] << 8);
    value = value + (buffer[2] << 16) ;
-   value = value + (buffer[3] << 24);
+   value = value + ((uint32_t)buffer[3] << 24);
    
-   //printf("Map value of %x %x %x %x -> %ld\n", buffer[0], buffer[1], buffer[2], buffer[3], value  );
-   return value*0.000001;
+   //printf("Map value of %x %x %x %x -> %u\n", buffer[0], buffer[1], buffer[2], buffer[3], value  );
+   return (int32_t)value;
 }
 
 void convert_time( int32_t* date, const unsigned char* buffer )
@@ -89,16 +144,218 @@ unsigned char calculate_entry_checksum( const unsigned char* buffer )
    return sum;
 }
 
+/// Point of a downloaded entry, the checksum is checked by the caller
+static void serial_entry_point( const unsigned char* entry, GPS_point* point )
+{
+   point->longitude = convert_coordinate( &entry[3] );
+   point->latitude  = convert_coordinate( &entry[7] );
+   point->height    = entry[11] + (entry[12]<<8);
+   convert_time( (int32_t*)&point->time, &entry[15] );
+}
+
+static void serial_signal_post( Serial_signal* signal )
+{
+   __atomic_add_fetch( &signal->value, 1, __ATOMIC_SEQ_CST );
+   if ( __atomic_load_n( &signal->waiting, __ATOMIC_SEQ_CST ) > 0 )
+      syscall( SYS_futex, &signal->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+}
+
+/// Sleep unless the signal has been posted after 'seen' was loaded
+static void serial_signal_wait( Serial_signal* signal, uint32_t seen )
+{
+   __atomic_add_fetch( &signal->waiting, 1, __ATOMIC_SEQ_CST );
+   syscall( SYS_futex, &signal->value, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0 );
+   __atomic_sub_fetch( &signal->waiting, 1, __ATOMIC_SEQ_CST );
+}
+
+static uint32_t serial_signal_load( Serial_signal* signal )
+{
+   return __atomic_load_n( &signal->value, __ATOMIC_SEQ_CST );
+}
+
 ///--------------------------------------------------------------------------------------------------------------------
-/// Download all datapoints from the device
+/// Queue raw entry, waits while the queue is full. False if the decode thread has stopped.
+///--------------------------------------------------------------------------------------------------------------------
+static bool serial_queue_push( Serial_queue* queue, const unsigned char* entry )
+{
+   uint32_t head = queue->head;
+   
+   while ( true )
+   {
+      uint32_t seen = serial_signal_load( &queue->emptied );
+      if ( __atomic_load_n( &queue->status, __ATOMIC_ACQUIRE ) != 0 )
+         return false;
+      if ( head - __atomic_load_n( &queue->tail, __ATOMIC_ACQUIRE ) < SERIAL_QUEUE_ENTRIES )
+         break;
+      serial_signal_wait( &queue->emptied, seen );
+   }
+   memcpy( queue->entries[ head & ( SERIAL_QUEUE_ENTRIES - 1 ) ], entry, SERIAL_ENTRY_SIZE );
+   __atomic_store_n( &queue->head, head + 1, __ATOMIC_RELEASE );
+   serial_signal_post( &queue->filled );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Check and convert one entry, 1 if it is broken and -1 if the point could not be stored
+///--------------------------------------------------------------------------------------------------------------------
+static int serial_decode_entry( Serial_queue* queue, const unsigned char* entry )
+{
+   if ( entry[19] != calculate_entry_checksum( entry ) )
+   {
+      ERROR("Serial DOWNLOAD READ failed at CHECKSUM!");
+      SERIAL_COUNT( checksum_errors, 1 );
+      return 1;
+   }
+   
+   GPS_point* point = GPS_arena_append( queue->data );
+   if ( point == NULL )
+      return -1;
+   
+   serial_entry_point( entry, point );
+   
+   char lon[16], lat[16];
+   lon[ GPS_format_microdeg( lon, point->longitude ) ] = 0x00;
+   lat[ GPS_format_microdeg( lat, point->latitude ) ] = 0x00;
+   printf("Downloaded entry LON %s LAT %s HEI %d \n", lon, lat, point->height );
+   SERIAL_COUNT( points, 1 );
+   
+   if ( queue->sink != NULL && !queue->sink( point, queue->context ) )
+   {
+      ERROR("Serial DOWNLOAD stopped by the consumer!");
+      return -1;
+   }
+   return 0;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Decode thread, runs until the queue is done and empty or an entry fails
+///--------------------------------------------------------------------------------------------------------------------
+static void* serial_decode_thread( void* context )
+{
+   Serial_queue* queue = (Serial_queue*)context;
+   uint32_t tail = queue->tail;
+   
+   while ( true )
+   {
+      uint32_t seen = serial_signal_load( &queue->filled );
+      uint32_t head = __atomic_load_n( &queue->head, __ATOMIC_ACQUIRE );
+      if ( head == tail )
+      {
+         // the last entry is queued before done is set
+         if ( __atomic_load_n( &queue->done, __ATOMIC_ACQUIRE ) &&
+              __atomic_load_n( &queue->head, __ATOMIC_ACQUIRE ) == tail )
+            break;
+         serial_signal_wait( &queue->filled, seen );
+         continue;
+      }
+      
+      for ( ; tail != head; tail ++ )
+      {
+         int status = serial_decode_entry( queue, queue->entries[ tail & ( SERIAL_QUEUE_ENTRIES - 1 ) ] );
+         if ( status != 0 )
+         {
+            __atomic_store_n( &queue->status, status, __ATOMIC_RELEASE );
+            serial_signal_post( &queue->emptied );
+            return NULL;
+         }
+         __atomic_store_n( &queue->tail, tail + 1, __ATOMIC_RELEASE );
+         serial_signal_post( &queue->emptied );
+      }
+   }
+   return NULL;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Request entry 'index' of the download, the entry is read to the start of buffer
+/// \returns 0 on success, 1 if no whole entry came in SERIAL_ENTRY_TRIES reads and -1 if the device cannot be
+///          read or written
 ///--------------------------------------------------------------------------------------------------------------------
-int serial_download( int serial_fd, unsigned char* buffer, GPS_points* data )
+static int serial_request_entry( int serial_fd, unsigned char* buffer, int index )
 {
+   unsigned char request[ 24 ];
    unsigned int red = 0;
-   int loop;
+   
+   // THE message is: 0x23, 0x23, 0xf7, <ascii index entry> 0x2a <check item> 0x0d, 0x0a
+   // g = ( mod(i,10) + 39 ) + (i >= 10).*(49 + floor(mod(i,100)/10) - 1) + ( i>= 100).*(49 + floor(mod(i,1000)/100) - 1) + (i>=1000).*(49 + floor(i/1000) - 1)
+   DEBUG(4,"downloading item %d ", index );
+   memcpy( request, msg_download_entry, 3 );
+   int len = sprintf( (char*)request + 3, "%d*", index );
+   request[ 3 + len + 0] = DOWNLOAD_GET_CHECK( index );
+   request[ 3 + len + 1] = 0x0d;
+   request[ 3 + len + 2] = 0x0a;
+   request[ 3 + len + 3] = 0x00;
+   
+   print_message( request, len + 6 );
+   
+   if (!serial_write( serial_fd, request, 3 + len + 3))
+   {
+      ERROR("Serial DOWNLOAD start failed at write!");
+      return -1;
+   }
+   
+   // then download the responce, a late answer is waited for again but an answer cut short is asked again whole
+   int ret    = 1;
+   int tries  = 0;
+   for ( tries = 0; tries < SERIAL_ENTRY_TRIES; tries ++ )
+   {
+      ret = serial_read( serial_fd, buffer, SERIAL_ENTRY_SIZE, &red, SERIAL_CMD_ENTRY ); 
+      if (  ret == -1)
+      {
+         ERROR("Serial DOWNLOAD READ failed at write!");
+         return -1;
+      }
+      
+      if ( ret == 0 )
+      {
+         break;
+      }
+      SERIAL_COUNT( retries, 1 );
+      
+      if ( ret == 2 && tries + 1 < SERIAL_ENTRY_TRIES )
+      {
+         DEBUG(3, "entry %d stalled after %u bytes, asking again", index, red );
+         if (!serial_write( serial_fd, request, 3 + len + 3))
+         {
+            ERROR("Serial DOWNLOAD start failed at write!");
+            return -1;
+         }
+      }
+   }
+   if ( ret != 0 )
+   {
+      ERROR("Serial entry %d not received in %d tries!", index, SERIAL_ENTRY_TRIES );
+      return 1;
+   }
+   return 0;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Request the entries one by one and queue them to the decode thread
+///--------------------------------------------------------------------------------------------------------------------
+static int serial_download_entries( int serial_fd, unsigned char* buffer, int count, Serial_queue* queue )
+{
    int ploop;
    
-   DEBUG(2,"CALL: download samples ");
+   for ( ploop = 0; ploop < count; ploop ++ )
+   {
+      if ( serial_request_entry( serial_fd, buffer, ploop ) != 0 )
+         return -1;
+      
+      // a failed entry has been reported by the decode thread
+      if ( !serial_queue_push( queue, buffer ) )
+         return 0;
+   }
+   return 0;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Start a download, the device answers with the number of its entries
+/// \returns 0 on success, 1 if the answer is not understood and -1 if the device cannot be written
+///--------------------------------------------------------------------------------------------------------------------
+int serial_download_count( int serial_fd, unsigned char* buffer, int* count )
+{
+   unsigned int red = 0;
+   int loop;
    
    memcpy( buffer, msg_download_start, 7 );
    if ( !serial_write(serial_fd, buffer, 7) != 0)
@@ -107,7 +364,7 @@ int serial_download( int serial_fd, unsigned char* buffer, GPS_points* data )
       return -1;
    }
    
-   if ( serial_read( serial_fd, buffer, 0, &red ) != 0 )
+   if ( serial_read( serial_fd, buffer, 0, &red, SERIAL_CMD_DOWNLOAD ) != 0 )
    {
       ERROR("Serial DOWNLOAD failed at read!");
       return 1; 
@@ -153,93 +410,83 @@ int serial_download( int serial_fd, unsigned char* buffer, GPS_points* data )
    
    if ( number1 == 0 && number1 == number2 )
    {
-      data->npoints = 0;
+      *count = 0;
       return 0;
    }
-   else if ( number1 > 0 && number2 == number1 + 1 )
-   {
-      data->npoints = number1;
-   }
-   else
+   else if ( number1 <= 0 || number2 != number1 + 1 )
    {
       ERROR("Unexpected numbers parsed : %d , %d " , number1, number2 );
       return 1;
    }   
+   *count = number1;
+   return 0;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Fetch entry 'index' again after serial_download_count, without downloading the others.
+/// \returns 0 on success, 1 if the entry is broken and -1 if the device does not answer
+///--------------------------------------------------------------------------------------------------------------------
+int serial_fetch_entry( int serial_fd, unsigned char* buffer, int index, GPS_point* point )
+{
+   if ( serial_request_entry( serial_fd, buffer, index ) != 0 )
+      return -1;
    
-   // then download the points
-   data->points = (GPS_point*)malloc( data->npoints * sizeof(GPS_point) );
+   if ( buffer[19] != calculate_entry_checksum( buffer ) )
+   {
+      ERROR("Serial entry %d failed at CHECKSUM!", index );
+      SERIAL_COUNT( checksum_errors, 1 );
+      return 1;
+   }
+   serial_entry_point( buffer, point );
+   return 0;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Download all datapoints from the device to the arena. Each point is also given to 'sink' as soon as it is
+/// decoded, if not NULL. The count reported by the device only bounds the loop, memory is taken as points arrive.
+/// The entries are decoded and consumed in a thread of their own while the next ones are requested.
+///--------------------------------------------------------------------------------------------------------------------
+int serial_download( int serial_fd, unsigned char* buffer, GPS_arena* data, GPS_point_sink sink, void* context )
+{
+   int count = 0;
    
-   // THE message is: 0x23, 0x23, 0xf7, <ascii index entry> 0x2a <check item> 0x0d, 0x0a
-   // g = ( mod(i,10) + 39 ) + (i >= 10).*(49 + floor(mod(i,100)/10) - 1) + ( i>= 100).*(49 + floor(mod(i,1000)/100) - 1) + (i>=1000).*(49 + floor(i/1000) - 1)
-   GPS_point* points = data->points;
+   DEBUG(2,"CALL: download samples ");
    
-   for ( ploop = 0; ploop < data->npoints; ploop ++ )
-   {
-      DEBUG(4,"downloading item %d ", ploop );
-      memcpy( buffer, msg_download_entry, 3 );
-      int len = sprintf( (char*)buffer + 3, "%d*", ploop );
-      buffer[ 3 + len + 0] = DOWNLOAD_GET_CHECK( ploop );
-      buffer[ 3 + len + 1] = 0x0d;
-      buffer[ 3 + len + 2] = 0x0a;
-      buffer[ 3 + len + 3] = 0x00;
+   int status = serial_download_count( serial_fd, buffer, &count );
+   if ( status != 0 || count == 0 )
+      return status;
    
-      print_message( buffer, len + 6 );
-      
-      if (!serial_write( serial_fd, buffer, 3 + len + 3))
-      {
-         ERROR("Serial DOWNLOAD start failed at write!");
-         return -1;
-      }
-      
-      // then download the responce
-      int offset = 0;
-      int ret    = 0;
-      int tries  = 0;
-      for ( tries = 0; tries < 10; tries ++ )
-      {
-         ret = serial_read( serial_fd, buffer + offset , 20 - offset , &red ); 
-         if (  ret == -1)
-         {
-            ERROR("Serial DOWNLOAD READ failed at write!");
-            return -1;
-         }
-         
-         if ( ret == 1 )
-         {
-            offset = offset + red;
-         }
-         
-         if ( ret == 0 || offset >= 20  )
-         {
-            break;
-         }
-         
-      }
-      
-      for ( loop = 20; loop < 32; loop ++ )
-         buffer[loop]=0x00;
-      
-      if ( buffer[19] != calculate_entry_checksum( buffer ) )
-      {
-         ERROR("Serial DOWNLOAD READ failed at CHECKSUM!");
-         return 1;
-      }
-      
-      points[ ploop ].longitude = convert_float( &buffer[3] );
-      points[ ploop ].latitude  = convert_float( &buffer[7] );
-      points[ ploop ].height    = buffer[11] + (buffer[12]<<8);
-      convert_time( (int32_t*)&points[ploop].time, &buffer[15] );
-      
-      //convert_time( points->
-      // print_message( buffer, 32 );
-      printf("Downloaded entry LON %.06f LAT %.06f HEI %f \n", points[ploop].longitude, points[ploop].latitude, points[ploop].height );
+   Serial_queue* queue = NULL;
+   pthread_t decoder;
+   if ( posix_memalign( (void**)&queue, 64, sizeof(Serial_queue) ) != 0 )
+   {
+      ERROR("Out of memory!");
+      return -1;
+   }
+   memset( queue, 0, sizeof(Serial_queue) );
+   queue->data    = data;
+   queue->sink    = sink;
+   queue->context = context;
+   if ( pthread_create( &decoder, NULL, serial_decode_thread, queue ) != 0 )
+   {
+      ERROR("Cannot start decode thread!");
+      free( queue );
+      return -1;
    }
-
    
-   return 0;
+   int ret = serial_download_entries( serial_fd, buffer, count, queue );
+   
+   // the entries already queued are decoded before returning
+   __atomic_store_n( &queue->done, 1, __ATOMIC_RELEASE );
+   serial_signal_post( &queue->filled );
+   pthread_join( decoder, NULL );
+   
+   if ( ret == 0 )
+      ret = queue->status;
+   free( queue );
+   return ret;
 }
 
-
 ///--------------------------------------------------------------------------------------------------------------------
 /// Query for device sample rate
 ///--------------------------------------------------------------------------------------------------------------------
@@ -278,7 +525,7 @@ int serial_set_sampling( int serial_fd, unsigned char* buffer, int sample )
    
    unsigned int red = 0;
    
-   if ( serial_read( serial_fd, buffer, 7, &red ) != 0 )
+   if ( serial_read( serial_fd, buffer, 7, &red, SERIAL_CMD_SAMPLING ) != 0 )
    {
       ERROR("Serial SET failed at read!");
       return 1; 
@@ -311,7 +558,7 @@ int serial_query_sampling( int serial_fd, unsigned char* buffer, unsigned int* s
 
    
    unsigned int red = 0;
-   if ( serial_read( serial_fd, buffer, 0, &red ) != 0 )
+   if ( serial_read( serial_fd, buffer, 0, &red, SERIAL_CMD_SAMPLING ) != 0 )
    {
       ERROR("Serial query failed at read!");
       return 1; 
@@ -354,9 +601,12 @@ bool serial_init_highspeed( const char* device, unsigned char* buffer, int* seri
    int serial_fd;
    int tries = 0;
    int mode = MODE_SERIAL_TRY_HIGHSPEED;
+   double started = serial_time_now();
    
    for ( tries = 0; tries < 5; tries ++ )
    {
+      if ( tries > 0 )
+         SERIAL_COUNT( retries, 1 );
       serial_fd = open( device, O_RDWR | O_NOCTTY | O_NONBLOCK );
       if ( serial_fd <= 0)
       {
@@ -416,6 +666,7 @@ bool serial_init_highspeed( const char* device, unsigned char* buffer, int* seri
       }
    }
    
+   serial_counters.handshake = serial_time_now() - started;
    if ( tries == 5 )
       return false;
    
@@ -479,7 +730,7 @@ int serial_reset( int serial_fd , unsigned char* buffer  )
    }
    
    unsigned int red = 0;
-   if ( serial_read( serial_fd, buffer, 7, &red ) < 0 )
+   if ( serial_read( serial_fd, buffer, 7, &red, SERIAL_CMD_RESET ) < 0 )
    {
       ERROR("Serial reset failed at read!");
       return 1; 
@@ -517,7 +768,7 @@ int serial_set_highspeed( int serial_fd , unsigned char* buffer  )
    }
    
    
-   if ( serial_read( serial_fd, buffer, 7, &red  ) != 0 )
+   if ( serial_read( serial_fd, buffer, 7, &red, SERIAL_CMD_HANDSHAKE ) != 0 )
    {
       ERROR("Serial speed raising failed at read!");
       return 1; 
@@ -541,7 +792,7 @@ int serial_set_highspeed( int serial_fd , unsigned char* buffer  )
       return -1; 
    }
    
-   if ( serial_read( serial_fd, buffer, 8, &red ) != 0 )
+   if ( serial_read( serial_fd, buffer, 8, &red, SERIAL_CMD_HANDSHAKE ) != 0 )
    {
       ERROR("Serial speed raising failed at read!");
       return 1; 
@@ -601,6 +852,14 @@ bool serial_write(int serial_fd,  const unsigned char* message, unsigned int len
    int ret = 0;
    errno = 0;
    unsigned int loop = 0;
+   
+   // stale input goes before the request, a flush after it could drop an answer that came back already
+   if ( tcflush(serial_fd, TCIFLUSH) != 0 )
+   {
+      ERROR(" Command tcflush failed: %s", strerror(errno ) );
+      return false;
+   }
+   
    while ( loop < len )
    {   
       ret = write( serial_fd, (char*)(&message[loop]), len - loop);
@@ -623,25 +882,26 @@ bool serial_write(int serial_fd,  const unsigned char* message, unsigned int len
       }
       
       loop = loop + ret;
+      SERIAL_COUNT( bytes_written, ret );
       continue;
    }
    
-   if ( tcflush(serial_fd, TCIFLUSH) != 0 )
-   {
-      ERROR(" Command tcflush failed: %s", strerror(errno ) );
-      return -1;
-   }
-   
+   serial_write_time  = serial_time_now();
+   serial_write_retry = false;
    return true;   
 }  
 
       
 ///--------------------------------------------------------------------------------------------------------------------
+/// \param cmd request type, selects the round trip estimate used for the timeout
 /// \returns 0 -- success, we red what we wanted
-///          1 -- failure, we didn't get enough red before timeout was reached
+///          1 -- failure, the answer did not start before timeout was reached
+///          2 -- failure, the answer started but stalled or did not end, a framing error
 ///         -1 -- failure, system error, bailout
+/// Only an answer that did not start backs the timeout off, a message that stalls midway says nothing of the
+/// round trip (RFC 6298).
 ///--------------------------------------------------------------------------------------------------------------------      
-int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsigned int* red_bytes)
+static int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsigned int* red_bytes, int cmd)
 { 
    struct timeval timeout;
    fd_set  fdset_read;
@@ -669,17 +929,30 @@ int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsi
    while( offset < max_len )
    {
       FD_SET(serial_fd,  &fdset_read );
-      timeout.tv_sec  = 0;
-      timeout.tv_usec = 1000000 * SERIAL_WAIT_FOR_COMM ;
+      // the round trip estimate bounds only the wait for the answer, a message that has started may stall a while
+      double wait = serial_timing_get( cmd )->rto;
+      if ( message_start_found && wait < SERIAL_WAIT_BYTES )
+         wait = SERIAL_WAIT_BYTES;
+      long wait_usec  = 1000000 * wait;
+      timeout.tv_sec  = wait_usec / 1000000;
+      timeout.tv_usec = wait_usec % 1000000;
       
       // printf("Doing select with offset %d \n", offset );
       
       ret = select( max_fd_num, &fdset_read, NULL, NULL, &timeout );
       
       // timeout
-      if ( ret == 0 )
+      if ( ret == 0 && message_start_found )
+      {
+          DEBUG(4, "read: message stalled after %d bytes", offset );
+          *red_bytes = offset;
+          return 2;
+      }
+      else if ( ret == 0 )
       {
-          DEBUG(4, "read: timeout reached");
+          DEBUG(4, "read: timeout reached with no answer" );
+          serial_timing_backoff( cmd );
+          *red_bytes = 0;
           return 1;
       }
       else if ( ret < 0 )
@@ -707,6 +980,7 @@ int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsi
             ERROR("Serial is failing: %s", strerror( errno ) );
             return -1; 
          }
+         SERIAL_COUNT( bytes_read, red );
          
          
          if ( GLOBAL_debug_level >= 5 )
@@ -732,7 +1006,7 @@ int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsi
             {
                DEBUG(4, "read: msg start found at %d" ,  loop );
                // move data from loop -> 0.
-               memmove( &buffer[0], &buffer[loop], red - loop );
+               memmove( &buffer[0], &buffer[loop], offset + red - loop );
                offset = offset + (red - loop);
             }   
             else
@@ -765,6 +1039,7 @@ int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsi
                   DEBUG(4, "read: msg end found at %d ", loop );
                   buffer[ loop + 2 ] = 0x0;
                   *red_bytes = loop + 2;
+                  serial_timing_sample( cmd );
                   return 0;
                }
             }
@@ -777,10 +1052,12 @@ int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsi
    if ( search_for_end == true )
    {
       DEBUG(4, "read: no msg end found and buffer is FULL" );
-      return 1;
+      *red_bytes = offset;
+      return 2;
    }
    
    *red_bytes = offset;
+   serial_timing_sample( cmd );
    
    return 0;
 }
@@ -788,6 +1065,124 @@ int serial_read(int serial_fd, unsigned char* buffer, unsigned int max_len, unsi
       
       
 
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+static double serial_time_now( void )
+{
+   struct timeval now;
+   gettimeofday( &now, NULL );
+   return now.tv_sec + now.tv_usec * 0.000001;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Round trip estimation, see RFC 6298. Each request type gets its own estimate, since device answers entry
+/// requests much faster than for example the handshake.
+///--------------------------------------------------------------------------------------------------------------------
+static void serial_timing_init( void )
+{
+   int loop;
+   for ( loop = 0; loop < SERIAL_CMD_COUNT; loop ++ )
+   {
+      serial_timing[loop].srtt     = 0.0;
+      serial_timing[loop].rttvar   = 0.0;
+      serial_timing[loop].rto      = SERIAL_WAIT_FOR_COMM;
+      serial_timing[loop].samples  = 0;
+      serial_timing[loop].timeouts = 0;
+   }
+   serial_timing_ready = true;
+}
+
+const Serial_timing* serial_timing_get( int cmd )
+{
+   if ( !serial_timing_ready )
+      serial_timing_init();
+   
+   return &serial_timing[ cmd ];
+}
+
+const char* serial_timing_name( int cmd )
+{
+   return serial_cmd_names[ cmd ];
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Counters of the link since the start, read while a download is running by the metrics endpoint
+///--------------------------------------------------------------------------------------------------------------------
+void serial_counters_get( Serial_counters* counters )
+{
+   counters->bytes_read      = __atomic_load_n( &serial_counters.bytes_read, __ATOMIC_RELAXED );
+   counters->bytes_written   = __atomic_load_n( &serial_counters.bytes_written, __ATOMIC_RELAXED );
+   counters->points          = __atomic_load_n( &serial_counters.points, __ATOMIC_RELAXED );
+   counters->retries         = __atomic_load_n( &serial_counters.retries, __ATOMIC_RELAXED );
+   counters->checksum_errors = __atomic_load_n( &serial_counters.checksum_errors, __ATOMIC_RELAXED );
+   counters->handshake       = serial_counters.handshake;
+}
+
+static double serial_timing_clamp( double rto )
+{
+   if ( rto < SERIAL_WAIT_MIN )
+      return SERIAL_WAIT_MIN;
+   if ( rto > SERIAL_WAIT_MAX )
+      return SERIAL_WAIT_MAX;
+   return rto;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Feed the time from last write to complete responce. Karn's rule: responces that needed a timeout are not measured
+///--------------------------------------------------------------------------------------------------------------------
+static void serial_timing_sample( int cmd )
+{
+   Serial_timing* timing = (Serial_timing*)serial_timing_get( cmd );
+   
+   if ( serial_write_retry || serial_write_time == 0.0 )
+      return;
+   
+   double rtt = serial_time_now() - serial_write_time;
+   
+   if ( timing->samples == 0 )
+   {
+      timing->srtt   = rtt;
+      timing->rttvar = rtt / 2;
+   }
+   else
+   {
+      double diff = timing->srtt - rtt;
+      timing->rttvar = 0.75 * timing->rttvar + 0.25 * ( diff < 0 ? -diff : diff );
+      timing->srtt   = 0.875 * timing->srtt + 0.125 * rtt;
+   }
+   timing->samples ++;
+   timing->rto = serial_timing_clamp( timing->srtt + 4 * timing->rttvar );
+   
+   DEBUG(5, "rtt %s: sample %.06f srtt %.06f rto %.06f", serial_cmd_names[cmd], rtt, timing->srtt, timing->rto );
+}
+
+static void serial_timing_backoff( int cmd )
+{
+   Serial_timing* timing = (Serial_timing*)serial_timing_get( cmd );
+   
+   timing->timeouts ++;
+   timing->rto = serial_timing_clamp( timing->rto * 2 );
+   serial_write_retry = true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+void serial_timing_print( void )
+{
+   int loop;
+   
+   printf("  REQUEST     SAMPLES  TIMEOUTS   SRTT (ms)  RTTVAR (ms)  TIMEOUT (ms)\n");
+   for ( loop = 0; loop < SERIAL_CMD_COUNT; loop ++ )
+   {
+      const Serial_timing* timing = serial_timing_get( loop );
+      if ( timing->samples == 0 && timing->timeouts == 0 )
+         continue;
+      
+      printf("  %-10s %8u %9u %11.03f %12.03f %13.03f\n", serial_cmd_names[loop], timing->samples, timing->timeouts, 
+             timing->srtt * 1000, timing->rttvar * 1000, timing->rto * 1000 );
+   }
+}
+
 void print_message( unsigned char* buffer, int len )
 {
    if ( GLOBAL_debug_level >= 4 )
@@ -0,0 +1,490 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MODULE_NAME "spatial"
+
+/// Index file is a header followed by sorted runs, each download adds one run:
+///   header : "GSI1", uint32 number of runs, uint64 reserved
+///   run    : "GSR1", uint32 number of records, uint64 reserved, records sorted by grid cell
+/// Records are in native byte order so that the file can be used directly from memory map.
+/// Names of the indexed tracks are in sidecar file '<index>.tracks', one per line, line number is the track id.
+/// Both files are replaced whole, the names first: a crash between the two leaves names no record refers to yet,
+/// never records whose track has no name or the name of another track.
+///
+/// The grid has 65536 x 65536 cells over the globe, cell number is row << 16 | column so that each grid row of a
+/// bounding box is one continuous range in a run.
+
+#define SPATIAL_MAGIC      "GSI1"
+#define SPATIAL_RUN_MAGIC  "GSR1"
+#define SPATIAL_HEADER     16
+/// Runs are merged to one when there are more than this
+#define SPATIAL_MAX_RUNS   8
+#define SPATIAL_GRID       65536
+
+typedef struct
+{
+   uint32_t cell;
+   uint32_t track;
+   int32_t  latitude;   // micro-degrees
+   int32_t  longitude;  // micro-degrees
+   int64_t  time;
+} Spatial_record;
+
+typedef struct
+{
+   char*    filename;
+   unsigned char* data;
+   size_t   size;
+   uint32_t nruns;
+   const Spatial_record** runs;
+   uint32_t* run_sizes;
+} Spatial_index;
+
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+static uint32_t spatial_row( int64_t latitude )
+{
+   int64_t row = ( latitude + 90000000 ) * SPATIAL_GRID / 180000000;
+   if ( row < 0 )
+      return 0;
+   if ( row >= SPATIAL_GRID )
+      return SPATIAL_GRID - 1;
+   return (uint32_t)row;
+}
+
+static uint32_t spatial_column( int64_t longitude )
+{
+   int64_t column = ( longitude + 180000000 ) * SPATIAL_GRID / 360000000;
+   if ( column < 0 )
+      return 0;
+   if ( column >= SPATIAL_GRID )
+      return SPATIAL_GRID - 1;
+   return (uint32_t)column;
+}
+
+static int spatial_record_compare( const void* a, const void* b )
+{
+   const Spatial_record* ra = (const Spatial_record*)a;
+   const Spatial_record* rb = (const Spatial_record*)b;
+
+   if ( ra->cell != rb->cell )
+      return ra->cell < rb->cell ? -1 : 1;
+   if ( ra->track != rb->track )
+      return ra->track < rb->track ? -1 : 1;
+   return (ra->time > rb->time) - (ra->time < rb->time);
+}
+
+/// Distance in meters of points given in micro-degrees
+static double spatial_distance( int32_t lat0, int32_t lon0, int32_t lat1, int32_t lon1 )
+{
+   const double scale = MICRODEG_TO_RAD;
+   double dlat = ( (int64_t)lat1 - lat0 ) * scale;
+   double dlon = ( (int64_t)lon1 - lon0 ) * scale;
+   double a = sin( dlat/2 ) * sin( dlat/2 ) + cos( lat0 * scale ) * cos( lat1 * scale ) * sin( dlon/2 ) * sin( dlon/2 );
+   return 2 * EARTH_RADIUS * asin( sqrt( a ) );
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Map index file, missing file is an empty index
+///--------------------------------------------------------------------------------------------------------------------
+static void spatial_unmap( Spatial_index* index )
+{
+   if ( index->data != NULL )
+      munmap( index->data, index->size );
+   free( index->runs );
+   free( index->run_sizes );
+   index->data      = NULL;
+   index->runs      = NULL;
+   index->run_sizes = NULL;
+   index->nruns     = 0;
+}
+
+static bool spatial_map( Spatial_index* index, const char* filename )
+{
+   struct stat info;
+   uint32_t loop;
+
+   memset( index, 0, sizeof(Spatial_index) );
+   index->filename = (char*)filename;
+
+   int fd = open( filename, O_RDONLY );
+   if ( fd < 0 && errno == ENOENT )
+      return true;
+   if ( fd < 0 )
+   {
+      ERROR("Cannot open index '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   if ( fstat( fd, &info ) != 0 || info.st_size < SPATIAL_HEADER )
+   {
+      ERROR("File '%s' is not a spatial index", filename );
+      close( fd );
+      return false;
+   }
+
+   index->size = info.st_size;
+   index->data = (unsigned char*)mmap( NULL, index->size, PROT_READ, MAP_SHARED, fd, 0 );
+   close( fd );
+   if ( index->data == MAP_FAILED )
+   {
+      ERROR("Cannot map index '%s': %s", filename, strerror(errno) );
+      index->data = NULL;
+      return false;
+   }
+
+   if ( memcmp( index->data, SPATIAL_MAGIC, 4 ) != 0 )
+   {
+      ERROR("File '%s' is not a spatial index", filename );
+      spatial_unmap( index );
+      return false;
+   }
+
+   index->nruns     = *(const uint32_t*)( index->data + 4 );
+   index->runs      = (const Spatial_record**)malloc( (index->nruns + 1) * sizeof(Spatial_record*) );
+   index->run_sizes = (uint32_t*)malloc( (index->nruns + 1) * sizeof(uint32_t) );
+   if ( index->runs == NULL || index->run_sizes == NULL )
+   {
+      ERROR("Out of memory!");
+      spatial_unmap( index );
+      return false;
+   }
+
+   size_t offset = SPATIAL_HEADER;
+   for ( loop = 0; loop < index->nruns; loop ++ )
+   {
+      if ( offset + SPATIAL_HEADER > index->size || memcmp( index->data + offset, SPATIAL_RUN_MAGIC, 4 ) != 0 )
+         break;
+
+      index->run_sizes[loop] = *(const uint32_t*)( index->data + offset + 4 );
+      index->runs[loop]      = (const Spatial_record*)( index->data + offset + SPATIAL_HEADER );
+      offset = offset + SPATIAL_HEADER + (size_t)index->run_sizes[loop] * sizeof(Spatial_record);
+      if ( offset > index->size )
+         break;
+   }
+   if ( loop != index->nruns )
+   {
+      ERROR("Index '%s' is corrupted", filename );
+      spatial_unmap( index );
+      return false;
+   }
+   return true;
+}
+
+static void spatial_tracks_free( char** names, int ntracks )
+{
+   int loop;
+   for ( loop = 0; loop < ntracks; loop ++ )
+      free( names[loop] );
+   free( names );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Track names, \returns number of names read or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+static int spatial_tracks_read( const char* index_file, char*** names )
+{
+   char filename[ BUFFER_SIZE ];
+   char line[ BUFFER_SIZE ];
+   int ntracks = 0;
+   int max_tracks = 64;
+
+   snprintf( filename, sizeof(filename), "%s.tracks", index_file );
+   *names = (char**)malloc( max_tracks * sizeof(char*) );
+   if ( *names == NULL )
+      return -1;
+
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL && errno == ENOENT )
+      return 0;
+   if ( fid == NULL )
+   {
+      free( *names );
+      return -1;
+   }
+
+   // a name missing would shift the ids of all after it
+   while ( fgets( line, sizeof(line), fid ) != NULL )
+   {
+      line[ strcspn( line, "\r\n" ) ] = 0x00;
+      if ( ntracks == max_tracks )
+      {
+         max_tracks = max_tracks * 2;
+         char** more = (char**)realloc( *names, max_tracks * sizeof(char*) );
+         if ( more == NULL )
+            break;
+         *names = more;
+      }
+      if ( ( (*names)[ ntracks ] = strdup( line ) ) == NULL )
+         break;
+      ntracks ++;
+   }
+   bool ok = !ferror( fid ) && feof( fid );
+   fclose( fid );
+   if ( !ok )
+   {
+      ERROR("Cannot read file '%s'", filename );
+      spatial_tracks_free( *names, ntracks );
+      return -1;
+   }
+   return ntracks;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Replace the track list with the old names and the new ones after them
+///--------------------------------------------------------------------------------------------------------------------
+static bool spatial_tracks_write( const char* index_file, char** old_names, int nold, const char* const* names,
+                                  int nnames )
+{
+   char filename[ BUFFER_SIZE ];
+   int loop;
+   bool ok = true;
+
+   snprintf( filename, sizeof(filename), "%s.tracks", index_file );
+   Output* output = output_open( filename );
+   if ( output == NULL )
+      return false;
+   for ( loop = 0; ok && loop < nold + nnames; loop ++ )
+   {
+      const char* name = ( loop < nold ) ? old_names[loop] : names[ loop - nold ];
+      ok = output_write( output, name, strlen( name ) ) && output_write( output, "\n", 1 );
+   }
+   if ( !ok )
+   {
+      output_abort( output );
+      return false;
+   }
+   return output_close( output, NULL, NULL );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Write index with given runs to temporary file and move it over the old one
+///--------------------------------------------------------------------------------------------------------------------
+static bool spatial_write( const char* filename, const Spatial_record** runs, const uint32_t* run_sizes, uint32_t nruns )
+{
+   unsigned char header[ SPATIAL_HEADER ];
+   uint32_t loop;
+   bool ok = true;
+
+   Output* output = output_open( filename );
+   if ( output == NULL )
+      return false;
+
+   memset( header, 0, SPATIAL_HEADER );
+   memcpy( header, SPATIAL_MAGIC, 4 );
+   memcpy( header + 4, &nruns, 4 );
+   ok = output_write( output, header, SPATIAL_HEADER );
+
+   for ( loop = 0; ok && loop < nruns; loop ++ )
+   {
+      memset( header, 0, SPATIAL_HEADER );
+      memcpy( header, SPATIAL_RUN_MAGIC, 4 );
+      memcpy( header + 4, &run_sizes[loop], 4 );
+      ok = output_write( output, header, SPATIAL_HEADER ) &&
+           output_write( output, runs[loop], (size_t)run_sizes[loop] * sizeof(Spatial_record) );
+   }
+
+   if ( !ok )
+   {
+      ERROR("Cannot write index '%s'", filename );
+      output_abort( output );
+      return false;
+   }
+   return output_close( output, NULL, NULL );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Add tracks to index as one new sorted run. When there are too many runs all are merged to one.
+///--------------------------------------------------------------------------------------------------------------------
+bool spatial_index_add( const char* index_file, const char* const* names, const GPS_points* tracks, int ntracks )
+{
+   Spatial_index index;
+   char** old_names = NULL;
+   int loop;
+   unsigned int ploop;
+   uint32_t rloop;
+   size_t nrecords = 0;
+
+   int first_track = spatial_tracks_read( index_file, &old_names );
+   if ( first_track < 0 )
+   {
+      ERROR("Cannot read track list of index '%s'", index_file );
+      return false;
+   }
+   // names of the new ids are on disk before any record refers to them
+   bool named = spatial_tracks_write( index_file, old_names, first_track, names, ntracks );
+   spatial_tracks_free( old_names, first_track );
+   if ( !named )
+      return false;
+
+   if ( !spatial_map( &index, index_file ) )
+      return false;
+
+   for ( loop = 0; loop < ntracks; loop ++ )
+      nrecords += tracks[loop].npoints;
+
+   bool compact = index.nruns + 1 > SPATIAL_MAX_RUNS;
+   if ( compact )
+   {
+      for ( rloop = 0; rloop < index.nruns; rloop ++ )
+         nrecords += index.run_sizes[rloop];
+   }
+
+   Spatial_record* records = (Spatial_record*)malloc( nrecords * sizeof(Spatial_record) + 1 );
+   if ( records == NULL )
+   {
+      ERROR("Out of memory!");
+      spatial_unmap( &index );
+      return false;
+   }
+
+   size_t count = 0;
+   for ( loop = 0; loop < ntracks; loop ++ )
+   {
+      for ( ploop = 0; ploop < tracks[loop].npoints; ploop ++ )
+      {
+         const GPS_point* point = &tracks[loop].points[ploop];
+         Spatial_record* record = &records[ count ++ ];
+         record->cell      = ( spatial_row( point->latitude ) << 16 ) | spatial_column( point->longitude );
+         record->track     = first_track + loop;
+         record->latitude  = point->latitude;
+         record->longitude = point->longitude;
+         record->time      = GPS_point_epoch( point );
+      }
+   }
+   if ( compact )
+   {
+      for ( rloop = 0; rloop < index.nruns; rloop ++ )
+      {
+         memcpy( &records[count], index.runs[rloop], index.run_sizes[rloop] * sizeof(Spatial_record) );
+         count += index.run_sizes[rloop];
+      }
+   }
+   qsort( records, count, sizeof(Spatial_record), spatial_record_compare );
+
+   // new run goes last, or alone when compacted
+   uint32_t nruns = compact ? 0 : index.nruns;
+   const Spatial_record** runs = (const Spatial_record**)malloc( (nruns + 1) * sizeof(Spatial_record*) );
+   uint32_t* run_sizes = (uint32_t*)malloc( (nruns + 1) * sizeof(uint32_t) );
+   bool ok = runs != NULL && run_sizes != NULL;
+   if ( ok )
+   {
+      for ( rloop = 0; rloop < nruns; rloop ++ )
+      {
+         runs[rloop]      = index.runs[rloop];
+         run_sizes[rloop] = index.run_sizes[rloop];
+      }
+      runs[nruns]      = records;
+      run_sizes[nruns] = count;
+      ok = spatial_write( index_file, runs, run_sizes, nruns + 1 );
+   }
+   free( runs );
+   free( run_sizes );
+   free( records );
+   spatial_unmap( &index );
+
+   if ( !ok )
+      return false;
+
+   DEBUG(2, "indexed %zu points, %s", count, compact ? "runs merged" : "new run added" );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// First record of the run with cell >= given
+///--------------------------------------------------------------------------------------------------------------------
+static uint32_t spatial_lower_bound( const Spatial_record* run, uint32_t size, uint32_t cell )
+{
+   uint32_t low = 0, high = size;
+   while ( low < high )
+   {
+      uint32_t middle = low + ( high - low ) / 2;
+      if ( run[middle].cell < cell )
+         low = middle + 1;
+      else
+         high = middle;
+   }
+   return low;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Find indexed points in bounding box or within radius, and in time window
+/// \returns number of points found or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long spatial_index_query( const char* index_file, const Spatial_query* query, Spatial_hit hit, void* context )
+{
+   Spatial_index index;
+   char** names = NULL;
+   int64_t lat0 = query->lat0, lon0 = query->lon0;
+   int64_t lat1 = query->lat1, lon1 = query->lon1;
+   uint32_t rloop, row, loop;
+   long found = 0;
+
+   if ( query->radius > 0 )
+   {
+      double dlat = query->radius / EARTH_RADIUS * 180.0 / M_PI;
+      double coslat = cos( ( fabs( query->lat0 * MICRODEG_TO_DEG ) + dlat ) * M_PI / 180.0 );
+      double dlon = coslat > 0.000001 ? dlat / coslat : 180.0;
+      lat0 = query->lat0 - (int64_t)ceil( dlat * 1000000 );
+      lat1 = query->lat0 + (int64_t)ceil( dlat * 1000000 );
+      lon0 = query->lon0 - (int64_t)ceil( dlon * 1000000 );
+      lon1 = query->lon0 + (int64_t)ceil( dlon * 1000000 );
+   }
+
+   int ntracks = spatial_tracks_read( index_file, &names );
+   if ( ntracks < 0 )
+   {
+      ERROR("Cannot read track list of index '%s'", index_file );
+      return -1;
+   }
+   if ( !spatial_map( &index, index_file ) )
+   {
+      spatial_tracks_free( names, ntracks );
+      return -1;
+   }
+
+   uint32_t col0 = spatial_column( lon0 ), col1 = spatial_column( lon1 );
+
+   for ( rloop = 0; rloop < index.nruns; rloop ++ )
+   {
+      const Spatial_record* run = index.runs[rloop];
+      uint32_t size = index.run_sizes[rloop];
+
+      for ( row = spatial_row( lat0 ); row <= spatial_row( lat1 ); row ++ )
+      {
+         uint32_t last = ( row << 16 ) | col1;
+         for ( loop = spatial_lower_bound( run, size, ( row << 16 ) | col0 ); loop < size && run[loop].cell <= last; loop ++ )
+         {
+            const Spatial_record* record = &run[loop];
+
+            if ( record->latitude < lat0 || record->latitude > lat1 || record->longitude < lon0 || record->longitude > lon1 )
+               continue;
+            if ( record->time < query->from || record->time > query->to )
+               continue;
+            if ( query->radius > 0 &&
+                 spatial_distance( query->lat0, query->lon0, record->latitude, record->longitude ) > query->radius )
+               continue;
+
+            found ++;
+            if ( hit != NULL )
+               hit( record->track < (uint32_t)ntracks ? names[record->track] : "?", record->track, record->time,
+                    record->latitude, record->longitude, context );
+         }
+      }
+   }
+
+   spatial_unmap( &index );
+   spatial_tracks_free( names, ntracks );
+   return found;
+}
@@ -0,0 +1,740 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+
+#define MODULE_NAME "stays"
+
+/// Stay points are where a device sat still: points that stay within distance of the first of them for at least
+/// the duration. They are found in a single pass over the points of each device, keeping only the running sums
+/// of the stay being followed. The stay point is the mean of its points. A stay that starts where the previous
+/// one ended, at the same place, is the same stay cut by a stray point.
+///
+/// Stay points of all devices are then clustered to recurring places with DBSCAN: a stay with at least min_visits
+/// stays (itself included) within eps is a core, cores within eps of each other are the same place and other
+/// stays within eps of a core belong to its place. The neighbours are found through a grid of cells with
+/// diagonal eps, so all stays of a cell are within eps of each other: a cell of min_visits stays is all cores,
+/// and only the 21 cells around can hold neighbours. Places are joined cell by cell instead of stay by stay.
+///
+/// Each track file is its own device and session, archive root directories have devices as subdirectories and
+/// each partition file of a device is a session. Devices are read in parallel.
+
+#define STAYS_CHUNK    TRACK_BLOCK_POINTS
+#define STAYS_NOWHERE  -1
+
+typedef struct
+{
+   int32_t  latitude, longitude;   // micro-degrees, mean of the points
+   int64_t  arrived, left;         // epoch seconds
+   uint32_t points;
+   uint32_t session;               // file of the device where the stay started
+   int32_t  place;                 // STAYS_NOWHERE for stays that do not recur
+} Stay;
+
+typedef struct
+{
+   const Archive_device* input;
+   unsigned int first_session;     // index of the first file in all sessions
+
+   Stay*        stays;
+   unsigned int nstays;
+   bool         failed;
+} Stays_stream;
+
+typedef struct
+{
+   const Stays_options* options;
+   Archive_inputs       inputs;
+   Stays_stream*        streams;        // one per device of the inputs
+   unsigned int         nstreams;
+} Stays_scan;
+
+/// Stay being followed
+typedef struct
+{
+   GPS_point anchor;
+   double    sum_lat, sum_lon;
+   int64_t   first, last;
+   uint32_t  count;
+   uint32_t  session;
+} Stays_tracker;
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Stay point detection
+///--------------------------------------------------------------------------------------------------------------------
+static double stays_distance( int32_t lat0, int32_t lon0, int32_t lat1, int32_t lon1 )
+{
+   double scale_lat = MICRODEG_METERS;
+   double scale_lon = scale_lat * cos( ( (double)lat0 + lat1 ) / 2 * MICRODEG_TO_RAD );
+   double dy = ( (double)lat1 - lat0 ) * scale_lat;
+   double dx = ( (double)lon1 - lon0 ) * scale_lon;
+   return sqrt( dx * dx + dy * dy );
+}
+
+static void stays_tracker_start( Stays_tracker* tracker, const GPS_point* point, int64_t time, uint32_t session )
+{
+   tracker->anchor  = *point;
+   tracker->sum_lat = point->latitude;
+   tracker->sum_lon = point->longitude;
+   tracker->first   = time;
+   tracker->last    = time;
+   tracker->count   = 1;
+   tracker->session = session;
+}
+
+/// Stay followed so far to the stream, if it lasted long enough
+static bool stays_tracker_flush( Stays_tracker* tracker, Stays_stream* stream, int64_t duration, double distance )
+{
+   if ( tracker->count == 0 || tracker->last - tracker->first < duration )
+      return true;
+
+   int32_t latitude  = (int32_t)lround( tracker->sum_lat / tracker->count );
+   int32_t longitude = (int32_t)lround( tracker->sum_lon / tracker->count );
+   Stay* stay = ( stream->nstays > 0 ) ? &stream->stays[ stream->nstays - 1 ] : NULL;
+
+   // stay that was cut by a stray point goes on where the previous one ended
+   if ( stay != NULL && tracker->first - stay->left <= duration &&
+        stays_distance( stay->latitude, stay->longitude, latitude, longitude ) <= distance )
+   {
+      double weight = (double)tracker->count / ( stay->points + tracker->count );
+      stay->latitude  += (int32_t)lround( ( (double)latitude - stay->latitude ) * weight );
+      stay->longitude += (int32_t)lround( ( (double)longitude - stay->longitude ) * weight );
+      stay->left       = tracker->last;
+      stay->points    += tracker->count;
+      return true;
+   }
+
+   if ( !GPS_array_grow( (void**)&stream->stays, stream->nstays, sizeof(Stay) ) )
+      return false;
+   stay = &stream->stays[ stream->nstays ++ ];
+   stay->latitude  = latitude;
+   stay->longitude = longitude;
+   stay->arrived   = tracker->first;
+   stay->left      = tracker->last;
+   stay->points    = tracker->count;
+   stay->session   = tracker->session;
+   stay->place     = STAYS_NOWHERE;
+   return true;
+}
+
+static bool stays_tracker_feed( Stays_tracker* tracker, Stays_stream* stream, const Stays_options* options,
+                                const GPS_point* point, uint32_t session )
+{
+   int64_t time = GPS_point_epoch( point );
+
+   if ( tracker->count == 0 )
+   {
+      stays_tracker_start( tracker, point, time, session );
+      return true;
+   }
+   if ( time < tracker->last )
+      return true;
+   if ( stays_distance( tracker->anchor.latitude, tracker->anchor.longitude, point->latitude,
+                        point->longitude ) <= options->distance )
+   {
+      tracker->sum_lat += point->latitude;
+      tracker->sum_lon += point->longitude;
+      tracker->last     = time;
+      tracker->count ++;
+      return true;
+   }
+   bool ok = stays_tracker_flush( tracker, stream, options->duration, options->distance );
+   stays_tracker_start( tracker, point, time, session );
+   return ok;
+}
+
+static void stays_scan_stream( unsigned int index, void* context )
+{
+   Stays_scan* scan = (Stays_scan*)context;
+   Stays_stream* stream = &scan->streams[index];
+   Stays_tracker tracker;
+   unsigned int loop;
+   int count, ploop;
+
+   GPS_point* points = (GPS_point*)malloc( STAYS_CHUNK * sizeof(GPS_point) );
+   if ( points == NULL )
+   {
+      stream->failed = true;
+      return;
+   }
+   memset( &tracker, 0, sizeof(tracker) );
+
+   // the stay goes on from a partition to the next
+   for ( loop = 0; loop < stream->input->nfiles && !stream->failed; loop ++ )
+   {
+      GPS_reader* reader = GPS_reader_open( stream->input->files[loop] );
+      if ( reader == NULL )
+      {
+         stream->failed = true;
+         break;
+      }
+      DEBUG(3, "device '%s': reading '%s'", stream->input->device, stream->input->files[loop] );
+      while ( (count = GPS_reader_read( reader, points, STAYS_CHUNK )) > 0 )
+      {
+         for ( ploop = 0; ploop < count && !stream->failed; ploop ++ )
+            stream->failed = !stays_tracker_feed( &tracker, stream, scan->options, &points[ploop],
+                                                  stream->first_session + loop );
+      }
+      if ( count < 0 )
+         stream->failed = true;
+      GPS_reader_close( reader );
+   }
+   if ( !stream->failed )
+      stream->failed = !stays_tracker_flush( &tracker, stream, scan->options->duration,
+                                                 scan->options->distance );
+   free( points );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Grid DBSCAN
+///--------------------------------------------------------------------------------------------------------------------
+typedef struct
+{
+   int64_t  key;      // row and column of the cell
+   uint32_t stay;
+} Stays_entry;
+
+typedef struct
+{
+   const Stay*  stays;
+   unsigned int nstays;
+   double       eps;
+   unsigned int min_visits;
+
+   double*      x;        // meters
+   double*      y;
+   Stays_entry* entries;  // stays sorted by cell
+   uint32_t*    cell_start;
+   unsigned int ncells;
+   uint32_t*    table;    // cell of key, open addressing
+   size_t       table_mask;
+   bool*        core;
+   uint32_t*    parent;   // union-find of cells
+} Stays_dbscan;
+
+static inline int64_t stays_key( int32_t row, int32_t col )
+{
+   return ( (int64_t)row << 32 ) | (uint32_t)col;
+}
+
+static inline size_t stays_hash( int64_t key, size_t mask )
+{
+   uint64_t value = (uint64_t)key;
+   value ^= value >> 33;
+   value *= 0xff51afd7ed558ccdULL;
+   value ^= value >> 33;
+   return value & mask;
+}
+
+static int stays_entry_compare( const void* a, const void* b )
+{
+   const Stays_entry* ea = (const Stays_entry*)a;
+   const Stays_entry* eb = (const Stays_entry*)b;
+   if ( ea->key != eb->key )
+      return ( ea->key < eb->key ) ? -1 : 1;
+   return ( ea->stay < eb->stay ) ? -1 : ( ea->stay > eb->stay );
+}
+
+/// Cell of the row and column, UINT32_MAX if there are no stays in it
+static uint32_t stays_cell( const Stays_dbscan* dbscan, int32_t row, int32_t col )
+{
+   int64_t key = stays_key( row, col );
+   size_t slot = stays_hash( key, dbscan->table_mask );
+
+   for ( ; dbscan->table[slot] != UINT32_MAX; slot = ( slot + 1 ) & dbscan->table_mask )
+   {
+      if ( dbscan->entries[ dbscan->cell_start[ dbscan->table[slot] ] ].key == key )
+         return dbscan->table[slot];
+   }
+   return UINT32_MAX;
+}
+
+/// Cells that can have stays within eps of the cell: 5 x 5 around it without the corners
+static unsigned int stays_neighbours( const Stays_dbscan* dbscan, uint32_t cell, uint32_t* cells )
+{
+   int64_t key = dbscan->entries[ dbscan->cell_start[cell] ].key;
+   int32_t row = (int32_t)( key >> 32 ), col = (int32_t)(uint32_t)key;
+   unsigned int count = 0;
+   int dr, dc;
+
+   for ( dr = -2; dr <= 2; dr ++ )
+   {
+      for ( dc = -2; dc <= 2; dc ++ )
+      {
+         if ( ( dr == -2 || dr == 2 ) && ( dc == -2 || dc == 2 ) )
+            continue;
+         uint32_t other = stays_cell( dbscan, row + dr, col + dc );
+         if ( other != UINT32_MAX )
+            cells[ count ++ ] = other;
+      }
+   }
+   return count;
+}
+
+static inline bool stays_near( const Stays_dbscan* dbscan, uint32_t a, uint32_t b )
+{
+   double dx = dbscan->x[a] - dbscan->x[b];
+   double dy = dbscan->y[a] - dbscan->y[b];
+   return dx * dx + dy * dy <= dbscan->eps * dbscan->eps;
+}
+
+static uint32_t stays_find( uint32_t* parent, uint32_t cell )
+{
+   while ( parent[cell] != cell )
+   {
+      parent[cell] = parent[ parent[cell] ];
+      cell = parent[cell];
+   }
+   return cell;
+}
+
+static bool stays_grid( Stays_dbscan* dbscan )
+{
+   unsigned int loop;
+   double side = dbscan->eps / M_SQRT2;
+
+   for ( loop = 0; loop < dbscan->nstays; loop ++ )
+   {
+      // local projection, distances within eps are what matter
+      double lat = dbscan->stays[loop].latitude * MICRODEG_TO_RAD;
+      double lon = dbscan->stays[loop].longitude * MICRODEG_TO_RAD;
+      dbscan->y[loop] = lat * EARTH_RADIUS;
+      dbscan->x[loop] = lon * EARTH_RADIUS * cos( lat );
+      dbscan->entries[loop].key  = stays_key( (int32_t)floor( dbscan->y[loop] / side ),
+                                              (int32_t)floor( dbscan->x[loop] / side ) );
+      dbscan->entries[loop].stay = loop;
+   }
+   qsort( dbscan->entries, dbscan->nstays, sizeof(Stays_entry), stays_entry_compare );
+
+   for ( loop = 0; loop < dbscan->nstays; loop ++ )
+   {
+      if ( loop == 0 || dbscan->entries[loop].key != dbscan->entries[ loop - 1 ].key )
+         dbscan->cell_start[ dbscan->ncells ++ ] = loop;
+   }
+   dbscan->cell_start[ dbscan->ncells ] = dbscan->nstays;
+
+   size_t size = 16;
+   while ( size < 2 * (size_t)dbscan->ncells )
+      size = size * 2;
+   dbscan->table = (uint32_t*)malloc( size * sizeof(uint32_t) );
+   dbscan->parent = (uint32_t*)malloc( ( dbscan->ncells + 1 ) * sizeof(uint32_t) );
+   if ( dbscan->table == NULL || dbscan->parent == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   memset( dbscan->table, 0xFF, size * sizeof(uint32_t) );
+   dbscan->table_mask = size - 1;
+   for ( loop = 0; loop < dbscan->ncells; loop ++ )
+   {
+      size_t slot = stays_hash( dbscan->entries[ dbscan->cell_start[loop] ].key, dbscan->table_mask );
+      while ( dbscan->table[slot] != UINT32_MAX )
+         slot = ( slot + 1 ) & dbscan->table_mask;
+      dbscan->table[slot] = loop;
+      dbscan->parent[loop] = loop;
+   }
+   return true;
+}
+
+/// Cores: all stays of cells with min_visits stays, others by counting neighbours up to min_visits
+static void stays_cores( Stays_dbscan* dbscan )
+{
+   uint32_t cells[25];
+   unsigned int cell, loop, nloop;
+
+   for ( cell = 0; cell < dbscan->ncells; cell ++ )
+   {
+      uint32_t start = dbscan->cell_start[cell], end = dbscan->cell_start[ cell + 1 ];
+      if ( end - start >= dbscan->min_visits )
+      {
+         for ( loop = start; loop < end; loop ++ )
+            dbscan->core[ dbscan->entries[loop].stay ] = true;
+         continue;
+      }
+      unsigned int ncells = stays_neighbours( dbscan, cell, cells );
+      for ( loop = start; loop < end; loop ++ )
+      {
+         uint32_t stay = dbscan->entries[loop].stay;
+         unsigned int count = end - start;
+         for ( nloop = 0; nloop < ncells && count < dbscan->min_visits; nloop ++ )
+         {
+            uint32_t other;
+            if ( cells[nloop] == cell )
+               continue;
+            for ( other = dbscan->cell_start[ cells[nloop] ];
+                  other < dbscan->cell_start[ cells[nloop] + 1 ] && count < dbscan->min_visits; other ++ )
+               count += stays_near( dbscan, stay, dbscan->entries[other].stay );
+         }
+         dbscan->core[stay] = ( count >= dbscan->min_visits );
+      }
+   }
+}
+
+/// Neighbouring cells are the same place when any of their cores are within eps
+static void stays_join( Stays_dbscan* dbscan )
+{
+   uint32_t cells[25];
+   unsigned int cell, nloop;
+
+   for ( cell = 0; cell < dbscan->ncells; cell ++ )
+   {
+      unsigned int ncells = stays_neighbours( dbscan, cell, cells );
+      for ( nloop = 0; nloop < ncells; nloop ++ )
+      {
+         uint32_t other = cells[nloop];
+         if ( other <= cell || stays_find( dbscan->parent, cell ) == stays_find( dbscan->parent, other ) )
+            continue;
+
+         bool joined = false;
+         uint32_t a, b;
+         for ( a = dbscan->cell_start[cell]; a < dbscan->cell_start[ cell + 1 ] && !joined; a ++ )
+         {
+            uint32_t sa = dbscan->entries[a].stay;
+            if ( !dbscan->core[sa] )
+               continue;
+            for ( b = dbscan->cell_start[other]; b < dbscan->cell_start[ other + 1 ] && !joined; b ++ )
+            {
+               uint32_t sb = dbscan->entries[b].stay;
+               joined = dbscan->core[sb] && stays_near( dbscan, sa, sb );
+            }
+         }
+         if ( joined )
+            dbscan->parent[ stays_find( dbscan->parent, other ) ] = stays_find( dbscan->parent, cell );
+      }
+   }
+}
+
+/// Place of the cell of the stay, border stays take the place of the nearest core within eps
+static uint32_t stays_place_cell( Stays_dbscan* dbscan, uint32_t stay, uint32_t cell )
+{
+   uint32_t cells[25];
+   unsigned int nloop;
+   uint32_t other, best = UINT32_MAX;
+   double best_distance = HUGE_VAL;
+
+   if ( dbscan->core[stay] )
+      return stays_find( dbscan->parent, cell );
+
+   unsigned int ncells = stays_neighbours( dbscan, cell, cells );
+   for ( nloop = 0; nloop < ncells; nloop ++ )
+   {
+      for ( other = dbscan->cell_start[ cells[nloop] ]; other < dbscan->cell_start[ cells[nloop] + 1 ]; other ++ )
+      {
+         uint32_t core = dbscan->entries[other].stay;
+         if ( !dbscan->core[core] )
+            continue;
+         double dx = dbscan->x[stay] - dbscan->x[core], dy = dbscan->y[stay] - dbscan->y[core];
+         double distance = dx * dx + dy * dy;
+         if ( distance <= dbscan->eps * dbscan->eps && distance < best_distance )
+         {
+            best_distance = distance;
+            best = stays_find( dbscan->parent, cells[nloop] );
+         }
+      }
+   }
+   return best;
+}
+
+/// Cluster the stays, setting their place. Places are numbered in order of their first stay.
+/// \returns number of places or -1 on failure
+static long stays_dbscan( Stay* stays, unsigned int nstays, const Stays_options* options )
+{
+   Stays_dbscan dbscan;
+   unsigned int loop;
+   long nplaces = 0;
+
+   memset( &dbscan, 0, sizeof(dbscan) );
+   dbscan.stays      = stays;
+   dbscan.nstays     = nstays;
+   dbscan.eps        = options->eps;
+   dbscan.min_visits = ( options->min_visits > 0 ) ? options->min_visits : 1;
+   dbscan.x          = (double*)malloc( ( nstays + 1 ) * sizeof(double) );
+   dbscan.y          = (double*)malloc( ( nstays + 1 ) * sizeof(double) );
+   dbscan.entries    = (Stays_entry*)malloc( ( nstays + 1 ) * sizeof(Stays_entry) );
+   dbscan.cell_start = (uint32_t*)malloc( ( nstays + 1 ) * sizeof(uint32_t) );
+   dbscan.core       = (bool*)calloc( nstays + 1, sizeof(bool) );
+   uint32_t* cell_of = (uint32_t*)malloc( ( nstays + 1 ) * sizeof(uint32_t) );
+   int32_t* numbers  = NULL;
+
+   bool ok = dbscan.x != NULL && dbscan.y != NULL && dbscan.entries != NULL && dbscan.cell_start != NULL &&
+             dbscan.core != NULL && cell_of != NULL;
+   if ( !ok )
+      ERROR("Out of memory!");
+   ok = ok && stays_grid( &dbscan );
+   if ( ok )
+   {
+      numbers = (int32_t*)malloc( ( dbscan.ncells + 1 ) * sizeof(int32_t) );
+      ok = ( numbers != NULL );
+   }
+   if ( ok )
+   {
+      stays_cores( &dbscan );
+      stays_join( &dbscan );
+
+      for ( loop = 0; loop < dbscan.ncells; loop ++ )
+      {
+         uint32_t entry;
+         numbers[loop] = STAYS_NOWHERE;
+         for ( entry = dbscan.cell_start[loop]; entry < dbscan.cell_start[ loop + 1 ]; entry ++ )
+            cell_of[ dbscan.entries[entry].stay ] = loop;
+      }
+      for ( loop = 0; loop < nstays; loop ++ )
+      {
+         uint32_t root = stays_place_cell( &dbscan, loop, cell_of[loop] );
+         if ( root == UINT32_MAX )
+            continue;
+         if ( numbers[root] == STAYS_NOWHERE )
+            numbers[root] = nplaces ++;
+         stays[loop].place = numbers[root];
+      }
+      DEBUG(2, "%u stays in %u cells, %ld places", nstays, dbscan.ncells, nplaces );
+   }
+
+   free( dbscan.x );
+   free( dbscan.y );
+   free( dbscan.entries );
+   free( dbscan.cell_start );
+   free( dbscan.core );
+   free( dbscan.table );
+   free( dbscan.parent );
+   free( cell_of );
+   free( numbers );
+   return ok ? nplaces : -1;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Output
+///--------------------------------------------------------------------------------------------------------------------
+typedef struct
+{
+   double   sum_lat, sum_lon;
+   uint32_t visits;
+   uint32_t sessions;
+   uint32_t last_session;
+   int64_t  seconds;
+   int64_t  first, last;
+} Stays_place;
+
+static int stays_time( char* out, int64_t time )
+{
+   GPS_point point;
+   GPS_point_set_epoch( &point, time );
+   return sprintf( out, "%04d-%02d-%02dT%02d:%02d:%02dZ", point.time[5], point.time[4], point.time[3],
+                   point.time[2], point.time[1], point.time[0] );
+}
+
+/// Field quoted as CSV when it has to be
+static void stays_csv_field( FILE* fid, const char* text )
+{
+   if ( strpbrk( text, ",\"\n" ) == NULL )
+   {
+      fputs( text, fid );
+      return;
+   }
+   fputc( '"', fid );
+   for ( ; *text != 0x00; text ++ )
+   {
+      if ( *text == '"' )
+         fputc( '"', fid );
+      fputc( *text, fid );
+   }
+   fputc( '"', fid );
+}
+
+static FILE* stays_open( const char* filename, const char* header )
+{
+   FILE* fid = fopen( filename, "wb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s' for writing: %s", filename, strerror(errno) );
+      return NULL;
+   }
+   fputs( header, fid );
+   return fid;
+}
+
+static bool stays_close( FILE* fid, const char* filename )
+{
+   if ( fclose( fid ) != 0 )
+   {
+      ERROR("Cannot write file '%s': %s", filename, strerror(errno) );
+      return false;
+   }
+   return true;
+}
+
+/// Places as gazetteer CSV, so that they can name points (tag, --places)
+static bool stays_write_places( const char* filename, const Stays_scan* scan, long nplaces )
+{
+   Stays_place* places = (Stays_place*)calloc( nplaces + 1, sizeof(Stays_place) );
+   unsigned int loop, sloop;
+   long ploop;
+
+   if ( places == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+   for ( ploop = 0; ploop < nplaces; ploop ++ )
+      places[ploop].last_session = UINT32_MAX;
+   for ( loop = 0; loop < scan->nstreams; loop ++ )
+   {
+      for ( sloop = 0; sloop < scan->streams[loop].nstays; sloop ++ )
+      {
+         const Stay* stay = &scan->streams[loop].stays[sloop];
+         if ( stay->place == STAYS_NOWHERE )
+            continue;
+         Stays_place* place = &places[ stay->place ];
+         place->sum_lat += stay->latitude;
+         place->sum_lon += stay->longitude;
+         place->seconds += stay->left - stay->arrived;
+         place->first    = ( place->visits == 0 || stay->arrived < place->first ) ? stay->arrived : place->first;
+         place->last     = ( place->visits == 0 || stay->left > place->last ) ? stay->left : place->last;
+         place->visits ++;
+         if ( place->last_session != stay->session )
+            place->sessions ++;
+         place->last_session = stay->session;
+      }
+   }
+
+   FILE* fid = stays_open( filename, STAYS_PLACES_CSV_HEADER );
+   if ( fid == NULL )
+   {
+      free( places );
+      return false;
+   }
+   for ( ploop = 0; ploop < nplaces; ploop ++ )
+   {
+      char lat[16], lon[16], first[32], last[32];
+      lat[ GPS_format_microdeg( lat, (int32_t)lround( places[ploop].sum_lat / places[ploop].visits ) ) ] = 0x00;
+      lon[ GPS_format_microdeg( lon, (int32_t)lround( places[ploop].sum_lon / places[ploop].visits ) ) ] = 0x00;
+      stays_time( first, places[ploop].first );
+      stays_time( last, places[ploop].last );
+      fprintf( fid, "place %ld,%s,%s,%u,%u,%lld,%s,%s\n", ploop + 1, lat, lon, places[ploop].visits,
+               places[ploop].sessions, (long long)places[ploop].seconds, first, last );
+   }
+   free( places );
+   return stays_close( fid, filename );
+}
+
+/// Stays of each session in order of time
+static bool stays_write_visits( const char* filename, const Stays_scan* scan )
+{
+   unsigned int loop, sloop;
+
+   FILE* fid = stays_open( filename, STAYS_VISITS_CSV_HEADER );
+   if ( fid == NULL )
+      return false;
+   for ( loop = 0; loop < scan->nstreams; loop ++ )
+   {
+      const Stays_stream* stream = &scan->streams[loop];
+      for ( sloop = 0; sloop < stream->nstays; sloop ++ )
+      {
+         const Stay* stay = &stream->stays[sloop];
+         char lat[16], lon[16], arrived[32], left[32];
+         lat[ GPS_format_microdeg( lat, stay->latitude ) ] = 0x00;
+         lon[ GPS_format_microdeg( lon, stay->longitude ) ] = 0x00;
+         stays_time( arrived, stay->arrived );
+         stays_time( left, stay->left );
+
+         stays_csv_field( fid, stream->input->device );
+         fputc( ',', fid );
+         stays_csv_field( fid, stream->input->files[ stay->session - stream->first_session ] );
+         if ( stay->place != STAYS_NOWHERE )
+            fprintf( fid, ",place %d", stay->place + 1 );
+         else
+            fputc( ',', fid );
+         fprintf( fid, ",%s,%s,%lld,%s,%s,%u\n", arrived, left, (long long)( stay->left - stay->arrived ), lat, lon,
+                  stay->points );
+      }
+   }
+   return stays_close( fid, filename );
+}
+
+static void stays_scan_free( Stays_scan* scan )
+{
+   unsigned int loop;
+
+   for ( loop = 0; loop < scan->nstreams; loop ++ )
+      free( scan->streams[loop].stays );
+   free( scan->streams );
+   archive_inputs_free( &scan->inputs );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Find the stay points of tracks and archives, cluster them to recurring places and write the places and the
+/// visits of each session as CSV. \returns number of places or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long stays_scan( const char* places_file, const char* visits_file, const char* const* inputs, int ninputs,
+                 const Stays_options* options, long* nstays )
+{
+   Stays_scan scan;
+   unsigned int loop, total = 0;
+   long nplaces = -1;
+   bool ok = true;
+   int iloop;
+
+   memset( &scan, 0, sizeof(scan) );
+   scan.options = options;
+   for ( iloop = 0; ok && iloop < ninputs; iloop ++ )
+      ok = archive_inputs_add( &scan.inputs, inputs[iloop] );
+
+   // sessions are the files of all devices in order
+   scan.streams = ok ? (Stays_stream*)calloc( scan.inputs.ndevices + 1, sizeof(Stays_stream) ) : NULL;
+   if ( ok && scan.streams == NULL )
+   {
+      ERROR("Out of memory!");
+      ok = false;
+   }
+   for ( loop = 0; ok && loop < scan.inputs.ndevices; loop ++ )
+   {
+      scan.streams[loop].input = &scan.inputs.devices[loop];
+      scan.streams[loop].first_session = ( loop == 0 ) ? 0 : scan.streams[loop - 1].first_session +
+                                                              scan.inputs.devices[loop - 1].nfiles;
+      scan.nstreams ++;
+   }
+
+   if ( ok )
+      workers_run( scan.nstreams, stays_scan_stream, &scan );
+   for ( loop = 0; ok && loop < scan.nstreams; loop ++ )
+   {
+      if ( scan.streams[loop].failed )
+      {
+         ERROR("Stays of device '%s' failed", scan.streams[loop].input->device );
+         ok = false;
+      }
+      total += scan.streams[loop].nstays;
+   }
+
+   // clustered in one array, places are numbered in the order of the inputs
+   Stay* stays = ok ? (Stay*)malloc( ( (size_t)total + 1 ) * sizeof(Stay) ) : NULL;
+   if ( ok && stays == NULL )
+      ERROR("Out of memory!");
+   if ( stays != NULL )
+   {
+      unsigned int at = 0;
+      for ( loop = 0; loop < scan.nstreams; loop ++ )
+      {
+         memcpy( stays + at, scan.streams[loop].stays, scan.streams[loop].nstays * sizeof(Stay) );
+         at += scan.streams[loop].nstays;
+      }
+      nplaces = stays_dbscan( stays, total, options );
+      at = 0;
+      for ( loop = 0; nplaces >= 0 && loop < scan.nstreams; loop ++ )
+      {
+         memcpy( scan.streams[loop].stays, stays + at, scan.streams[loop].nstays * sizeof(Stay) );
+         at += scan.streams[loop].nstays;
+      }
+      free( stays );
+   }
+
+   if ( nplaces >= 0 && ( !stays_write_places( places_file, &scan, nplaces ) ||
+                          !stays_write_visits( visits_file, &scan ) ) )
+      nplaces = -1;
+   if ( nstays != NULL )
+      *nstays = total;
+   stays_scan_free( &scan );
+   return nplaces;
+}
@@ -0,0 +1,574 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MODULE_NAME "telemetry"
+
+/// Every session with a device leaves a record of how the link did to the history file, by default
+/// '$HOME/.geotech_history' or $GEOTECH_HISTORY (empty for none). Records are of fixed size and appended with a
+/// single write, so sessions running at the same time on other ports do not mix their records.
+///
+/// While a session runs its counters can be served in Prometheus text format on a local TCP port (address given
+/// as a number, bound to 127.0.0.1) or Unix socket (address given as a path). Every connection gets the current
+/// values, whatever the request.
+
+#define TELEMETRY_MAGIC       "GTH1"
+#define TELEMETRY_HISTORY     ".geotech_history"
+#define TELEMETRY_RESPONSE    16384
+#define TELEMETRY_REQUEST_MS  1000
+
+typedef struct
+{
+   char     magic[4];
+   uint32_t size;             // of the record, older records are shorter
+   int64_t  started;          // epoch seconds
+   char     port[64];
+   char     device[32];
+   char     mode[12];
+   uint32_t ok;
+   float    handshake;        // seconds
+   float    seconds;          // length of the session
+   uint64_t bytes_read;
+   uint64_t bytes_written;
+   uint64_t points;
+   uint32_t retries;
+   uint32_t timeouts;
+   uint32_t checksum_errors;
+   uint32_t reserved;
+} Telemetry_record;
+
+struct Telemetry
+{
+   Telemetry_record record;
+   struct timespec  start;
+   char*            history;
+
+   // metrics endpoint
+   int              listen_fd;
+   int              stop[2];     // pipe, closing the write end stops the server
+   char*            socket_path;
+   pthread_t        server;
+   bool             serving;
+};
+
+static double telemetry_elapsed( const struct timespec* start )
+{
+   struct timespec now;
+   clock_gettime( CLOCK_MONOTONIC, &now );
+   return ( now.tv_sec - start->tv_sec ) + ( now.tv_nsec - start->tv_nsec ) * 1e-9;
+}
+
+/// History file of the option, environment or home directory, NULL for none
+static char* telemetry_history_file( const char* history )
+{
+   char path[ BUFFER_SIZE ];
+
+   if ( history == NULL )
+      history = getenv( "GEOTECH_HISTORY" );
+   if ( history == NULL && getenv( "HOME" ) != NULL )
+   {
+      snprintf( path, sizeof(path), "%s/%s", getenv( "HOME" ), TELEMETRY_HISTORY );
+      history = path;
+   }
+   return ( history != NULL && history[0] != 0x00 ) ? strdup( history ) : NULL;
+}
+
+static uint32_t telemetry_timeouts( void )
+{
+   uint32_t timeouts = 0;
+   int cmd;
+
+   for ( cmd = 0; cmd < SERIAL_CMD_COUNT; cmd ++ )
+      timeouts += serial_timing_get( cmd )->timeouts;
+   return timeouts;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// METRICS ENDPOINT
+///--------------------------------------------------------------------------------------------------------------------
+
+/// Label value with backslash, quote and new line escaped
+static int telemetry_label( char* out, size_t size, const char* value )
+{
+   size_t len = 0;
+
+   for ( ; *value != 0x00 && len + 3 < size; value ++ )
+   {
+      if ( *value == '\\' || *value == '"' )
+         out[ len ++ ] = '\\';
+      if ( *value == '\n' )
+      {
+         out[ len ++ ] = '\\';
+         out[ len ++ ] = 'n';
+         continue;
+      }
+      out[ len ++ ] = *value;
+   }
+   out[len] = 0x00;
+   return len;
+}
+
+static int telemetry_metric( char* out, size_t size, const char* name, const char* type, const char* help,
+                             const char* labels, double value )
+{
+   int len = snprintf( out, size, "# HELP %s %s\n# TYPE %s %s\n%s{%s} %.17g\n", name, help, name, type, name,
+                       labels, value );
+   return ( len < (int)size ) ? len : (int)size - 1;
+}
+
+/// Current values in Prometheus text format
+static int telemetry_format( const Telemetry* telemetry, char* out, size_t size )
+{
+   char port[ 2 * sizeof(telemetry->record.port) ], device[ 2 * sizeof(telemetry->record.device) ];
+   char labels[ 512 ], cmd_labels[ 600 ];
+   Serial_counters counters;
+   double elapsed = telemetry_elapsed( &telemetry->start );
+   int len = 0, cmd;
+
+   serial_counters_get( &counters );
+   telemetry_label( port, sizeof(port), telemetry->record.port );
+   telemetry_label( device, sizeof(device), telemetry->record.device );
+   snprintf( labels, sizeof(labels), "port=\"%s\",device=\"%s\"", port, device );
+
+   len += telemetry_metric( out + len, size - len, "geotech_session_start_time_seconds", "gauge",
+                            "Start of the session since epoch.", labels, telemetry->record.started );
+   len += telemetry_metric( out + len, size - len, "geotech_link_handshake_seconds", "gauge",
+                            "Time to open and set up the link.", labels, counters.handshake );
+   len += telemetry_metric( out + len, size - len, "geotech_link_read_bytes_total", "counter",
+                            "Bytes read from the device.", labels, counters.bytes_read );
+   len += telemetry_metric( out + len, size - len, "geotech_link_written_bytes_total", "counter",
+                            "Bytes written to the device.", labels, counters.bytes_written );
+   len += telemetry_metric( out + len, size - len, "geotech_link_read_bytes_per_second", "gauge",
+                            "Bytes read per second over the session.", labels,
+                            elapsed > 0 ? counters.bytes_read / elapsed : 0.0 );
+   len += telemetry_metric( out + len, size - len, "geotech_download_points_total", "counter",
+                            "Entries downloaded and decoded.", labels, counters.points );
+   len += telemetry_metric( out + len, size - len, "geotech_link_retries_total", "counter",
+                            "Entry reads and handshakes tried again.", labels, counters.retries );
+   len += telemetry_metric( out + len, size - len, "geotech_link_checksum_errors_total", "counter",
+                            "Entries with wrong checksum.", labels, counters.checksum_errors );
+
+   static const char* names[]  = { "geotech_link_timeouts_total", "geotech_link_rtt_seconds",
+                                   "geotech_link_timeout_seconds" };
+   static const char* types[]  = { "counter", "gauge", "gauge" };
+   static const char* helps[]  = { "Reads that timed out.", "Smoothed round trip time.",
+                                   "Current read timeout." };
+   int metric;
+   for ( metric = 0; metric < 3; metric ++ )
+   {
+      len += snprintf( out + len, size - len, "# HELP %s %s\n# TYPE %s %s\n", names[metric], helps[metric],
+                       names[metric], types[metric] );
+      for ( cmd = 0; cmd < SERIAL_CMD_COUNT && len < (int)size; cmd ++ )
+      {
+         const Serial_timing* timing = serial_timing_get( cmd );
+         double value = ( metric == 0 ) ? timing->timeouts : ( metric == 1 ) ? timing->srtt : timing->rto;
+         snprintf( cmd_labels, sizeof(cmd_labels), "%s,cmd=\"%s\"", labels, serial_timing_name( cmd ) );
+         len += snprintf( out + len, size - len, "%s{%s} %.17g\n", names[metric], cmd_labels, value );
+      }
+      len = ( len < (int)size ) ? len : (int)size - 1;
+   }
+   return len;
+}
+
+static void telemetry_serve( Telemetry* telemetry, int fd )
+{
+   static const char header[] = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                "Connection: close\r\n\r\n";
+   char* response = (char*)malloc( TELEMETRY_RESPONSE );
+   char request[ BUFFER_SIZE ];
+   struct pollfd ready = { fd, POLLIN, 0 };
+
+   // a plain connection without request gets the values too
+   if ( poll( &ready, 1, TELEMETRY_REQUEST_MS ) > 0 )
+   {
+      ssize_t ret = recv( fd, request, sizeof(request), 0 );
+      (void)ret;
+   }
+   if ( response != NULL )
+   {
+      size_t len = sizeof(header) - 1;
+      memcpy( response, header, len );
+      len += telemetry_format( telemetry, response + len, TELEMETRY_RESPONSE - len );
+
+      size_t sent = 0;
+      while ( sent < len )
+      {
+         ssize_t ret = send( fd, response + sent, len - sent, MSG_NOSIGNAL );
+         if ( ret <= 0 && errno != EINTR )
+            break;
+         sent += ( ret > 0 ) ? ret : 0;
+      }
+   }
+   free( response );
+   shutdown( fd, SHUT_RDWR );
+   close( fd );
+}
+
+static void* telemetry_server( void* context )
+{
+   Telemetry* telemetry = (Telemetry*)context;
+   struct pollfd fds[2] = { { telemetry->listen_fd, POLLIN, 0 }, { telemetry->stop[0], POLLIN, 0 } };
+
+   while ( true )
+   {
+      if ( poll( fds, 2, -1 ) < 0 )
+      {
+         if ( errno == EINTR )
+            continue;
+         ERROR("Metrics endpoint failed: %s", strerror(errno) );
+         break;
+      }
+      if ( fds[1].revents != 0 )
+         break;
+      if ( fds[0].revents & POLLIN )
+      {
+         int fd = accept( telemetry->listen_fd, NULL, NULL );
+         if ( fd >= 0 )
+            telemetry_serve( telemetry, fd );
+      }
+   }
+   return NULL;
+}
+
+/// Listen on TCP port of localhost or Unix socket
+static bool telemetry_listen( Telemetry* telemetry, const char* address )
+{
+   const char* pos;
+
+   for ( pos = address; isdigit( (unsigned char)*pos ); pos ++ )
+      ;
+   if ( *pos == 0x00 && pos != address )
+   {
+      struct sockaddr_in inet;
+      int on = 1;
+      memset( &inet, 0, sizeof(inet) );
+      inet.sin_family      = AF_INET;
+      inet.sin_port        = htons( atoi( address ) );
+      inet.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+      telemetry->listen_fd = socket( AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+      if ( telemetry->listen_fd >= 0 )
+         setsockopt( telemetry->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+      if ( telemetry->listen_fd < 0 || bind( telemetry->listen_fd, (struct sockaddr*)&inet, sizeof(inet) ) != 0 )
+      {
+         ERROR("Cannot listen on port %s: %s", address, strerror(errno) );
+         return false;
+      }
+   }
+   else
+   {
+      struct sockaddr_un local;
+      memset( &local, 0, sizeof(local) );
+      local.sun_family = AF_UNIX;
+      if ( strlen( address ) >= sizeof(local.sun_path) )
+      {
+         ERROR("Socket path '%s' is too long", address );
+         return false;
+      }
+      strcpy( local.sun_path, address );
+      unlink( address );
+      telemetry->listen_fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+      if ( telemetry->listen_fd < 0 || bind( telemetry->listen_fd, (struct sockaddr*)&local, sizeof(local) ) != 0 )
+      {
+         ERROR("Cannot listen on socket '%s': %s", address, strerror(errno) );
+         return false;
+      }
+      telemetry->socket_path = strdup( address );
+   }
+   if ( listen( telemetry->listen_fd, 16 ) != 0 )
+   {
+      ERROR("Cannot listen on '%s': %s", address, strerror(errno) );
+      return false;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// SESSION
+///--------------------------------------------------------------------------------------------------------------------
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Start the record of a session with the device at port. History NULL for the default file, metrics address
+/// NULL for no endpoint. Failing endpoint fails the start, the session does not run without the metrics asked for.
+///--------------------------------------------------------------------------------------------------------------------
+Telemetry* telemetry_start( const char* history, const char* port, const char* device, const char* mode,
+                            const char* metrics )
+{
+   Telemetry* telemetry = (Telemetry*)calloc( 1, sizeof(Telemetry) );
+   if ( telemetry == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+   memcpy( telemetry->record.magic, TELEMETRY_MAGIC, 4 );
+   telemetry->record.size    = sizeof(Telemetry_record);
+   telemetry->record.started = time( NULL );
+   snprintf( telemetry->record.port, sizeof(telemetry->record.port), "%s", port != NULL ? port : "" );
+   snprintf( telemetry->record.device, sizeof(telemetry->record.device), "%s", device != NULL ? device : "" );
+   snprintf( telemetry->record.mode, sizeof(telemetry->record.mode), "%s", mode != NULL ? mode : "" );
+   clock_gettime( CLOCK_MONOTONIC, &telemetry->start );
+   telemetry->history   = telemetry_history_file( history );
+   telemetry->listen_fd = -1;
+   telemetry->stop[0]   = -1;
+   telemetry->stop[1]   = -1;
+
+   if ( metrics != NULL )
+   {
+      bool ok = telemetry_listen( telemetry, metrics ) && pipe( telemetry->stop ) == 0;
+      if ( ok && pthread_create( &telemetry->server, NULL, telemetry_server, telemetry ) != 0 )
+      {
+         ERROR("Cannot start metrics endpoint");
+         ok = false;
+      }
+      telemetry->serving = ok;
+      if ( !ok )
+      {
+         telemetry_end( telemetry, false );
+         return NULL;
+      }
+      DEBUG(2, "metrics served on '%s'", metrics );
+   }
+   return telemetry;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// End the session: stop the endpoint and append the record to the history. Failing history is only reported,
+/// it does not fail the session. \returns false if the record could not be written.
+///--------------------------------------------------------------------------------------------------------------------
+bool telemetry_end( Telemetry* telemetry, bool ok )
+{
+   Serial_counters counters;
+   bool written = true;
+
+   if ( telemetry == NULL )
+      return true;
+   if ( telemetry->serving )
+   {
+      close( telemetry->stop[1] );
+      telemetry->stop[1] = -1;
+      pthread_join( telemetry->server, NULL );
+   }
+   if ( telemetry->stop[0] >= 0 )
+      close( telemetry->stop[0] );
+   if ( telemetry->stop[1] >= 0 )
+      close( telemetry->stop[1] );
+   if ( telemetry->listen_fd >= 0 )
+      close( telemetry->listen_fd );
+   if ( telemetry->socket_path != NULL )
+      unlink( telemetry->socket_path );
+
+   serial_counters_get( &counters );
+   Telemetry_record* record = &telemetry->record;
+   record->ok              = ok;
+   record->handshake       = counters.handshake;
+   record->seconds         = telemetry_elapsed( &telemetry->start );
+   record->bytes_read      = counters.bytes_read;
+   record->bytes_written   = counters.bytes_written;
+   record->points          = counters.points;
+   record->retries         = counters.retries;
+   record->timeouts        = telemetry_timeouts();
+   record->checksum_errors = counters.checksum_errors;
+
+   if ( telemetry->history != NULL )
+   {
+      int fd = open( telemetry->history, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644 );
+      written = fd >= 0 && write( fd, record, sizeof(Telemetry_record) ) == sizeof(Telemetry_record);
+      if ( fd >= 0 && close( fd ) != 0 )
+         written = false;
+      if ( !written )
+         ERROR("Cannot write history '%s': %s", telemetry->history, strerror(errno) );
+   }
+   free( telemetry->history );
+   free( telemetry->socket_path );
+   free( telemetry );
+   return written;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// HEALTH REPORT
+///--------------------------------------------------------------------------------------------------------------------
+typedef struct
+{
+   char     name[64];
+   uint32_t sessions;
+   uint32_t failed;
+   double   handshake;
+   double   seconds;
+   uint64_t bytes_read;
+   uint64_t points;
+   uint64_t retries;
+   uint64_t timeouts;
+   uint64_t checksum_errors;
+   int64_t  last;
+   double   rate;          // bytes per second
+} Telemetry_group;
+
+typedef struct
+{
+   Telemetry_group* groups;
+   unsigned int     ngroups;
+   unsigned int     capacity;
+} Telemetry_groups;
+
+static bool telemetry_group_add( Telemetry_groups* groups, const char* name, const Telemetry_record* record )
+{
+   Telemetry_group* group = NULL;
+   unsigned int loop;
+
+   for ( loop = 0; loop < groups->ngroups && group == NULL; loop ++ )
+      if ( strcmp( groups->groups[loop].name, name ) == 0 )
+         group = &groups->groups[loop];
+
+   if ( group == NULL )
+   {
+      if ( groups->ngroups == groups->capacity )
+      {
+         unsigned int capacity = groups->capacity * 2 + 16;
+         Telemetry_group* more = (Telemetry_group*)realloc( groups->groups, capacity * sizeof(Telemetry_group) );
+         if ( more == NULL )
+         {
+            ERROR("Out of memory!");
+            return false;
+         }
+         groups->groups   = more;
+         groups->capacity = capacity;
+      }
+      group = &groups->groups[ groups->ngroups ++ ];
+      memset( group, 0, sizeof(Telemetry_group) );
+      snprintf( group->name, sizeof(group->name), "%s", name );
+   }
+   group->sessions ++;
+   group->failed          += !record->ok;
+   group->handshake       += record->handshake;
+   group->seconds         += record->seconds;
+   group->bytes_read      += record->bytes_read;
+   group->points          += record->points;
+   group->retries         += record->retries;
+   group->timeouts        += record->timeouts;
+   group->checksum_errors += record->checksum_errors;
+   group->last             = ( record->started > group->last ) ? record->started : group->last;
+   return true;
+}
+
+static int telemetry_rate_compare( const void* a, const void* b )
+{
+   double ra = *(const double*)a, rb = *(const double*)b;
+   return ( ra < rb ) ? -1 : ( ra > rb );
+}
+
+/// Groups that fail, retry or are slow compared to the others are marked to be checked
+static void telemetry_groups_print( Telemetry_groups* groups, const char* title )
+{
+   double* rates = (double*)malloc( ( groups->ngroups + 1 ) * sizeof(double) );
+   unsigned int loop, nrates = 0;
+   double median = 0.0;
+
+   for ( loop = 0; loop < groups->ngroups; loop ++ )
+   {
+      Telemetry_group* group = &groups->groups[loop];
+      group->rate = ( group->seconds > 0 ) ? group->bytes_read / group->seconds : 0.0;
+      if ( rates != NULL && group->bytes_read > 0 )
+         rates[ nrates ++ ] = group->rate;
+   }
+   if ( rates != NULL && nrates > 0 )
+   {
+      qsort( rates, nrates, sizeof(double), telemetry_rate_compare );
+      median = rates[ nrates / 2 ];
+   }
+   free( rates );
+
+   printf("  %-24s %8s %6s %10s %10s %8s %8s %8s %-20s %s\n", title, "sessions", "failed", "handshake",
+          "bytes/s", "retries", "timeouts", "checksum", "last", "status");
+   for ( loop = 0; loop < groups->ngroups; loop ++ )
+   {
+      const Telemetry_group* group = &groups->groups[loop];
+      GPS_point last;
+      char when[32];
+      GPS_point_set_epoch( &last, group->last );
+      snprintf( when, sizeof(when), "%04d-%02d-%02dT%02d:%02d:%02dZ", last.time[5], last.time[4], last.time[3],
+                last.time[2], last.time[1], last.time[0] );
+
+      bool failing  = group->failed * 5 > group->sessions;
+      bool errors   = group->checksum_errors > 0 || ( group->retries + group->timeouts ) * 100 > group->points + 100;
+      bool slow     = group->bytes_read > 0 && group->rate < median / 2;
+      const char* status = failing ? "CHECK: fails" : errors ? "CHECK: errors" : slow ? "CHECK: slow" : "ok";
+
+      printf("  %-24s %8u %6u %9.2fs %10.0f %8llu %8llu %8llu %-20s %s\n", group->name[0] ? group->name : "-",
+             group->sessions, group->failed, group->handshake / group->sessions, group->rate,
+             (unsigned long long)group->retries, (unsigned long long)group->timeouts,
+             (unsigned long long)group->checksum_errors, when, status );
+   }
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Print the history summed per port and per device. \returns number of sessions or -1 on failure
+///--------------------------------------------------------------------------------------------------------------------
+long telemetry_health( const char* history )
+{
+   Telemetry_groups ports, devices;
+   Telemetry_record record;
+   long sessions = 0, skipped = 0;
+
+   char* filename = telemetry_history_file( history );
+   if ( filename == NULL )
+   {
+      ERROR("No history file");
+      return -1;
+   }
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      free( filename );
+      return -1;
+   }
+
+   memset( &ports, 0, sizeof(ports) );
+   memset( &devices, 0, sizeof(devices) );
+   bool ok = true;
+   while ( ok && fread( &record, sizeof(record), 1, fid ) == 1 )
+   {
+      if ( memcmp( record.magic, TELEMETRY_MAGIC, 4 ) != 0 || record.size != sizeof(record) )
+      {
+         skipped ++;
+         continue;
+      }
+      record.port[ sizeof(record.port) - 1 ] = 0x00;
+      record.device[ sizeof(record.device) - 1 ] = 0x00;
+      ok = telemetry_group_add( &ports, record.port, &record ) &&
+           telemetry_group_add( &devices, record.device, &record );
+      sessions ++;
+   }
+   fclose( fid );
+   if ( skipped > 0 )
+      DEBUG(2, "%ld broken records skipped in '%s'", skipped, filename );
+
+   if ( ok )
+   {
+      printf("---------------------------------------------------------------------------------------\n");
+      printf("  HEALTH of %ld sessions in '%s'\n", sessions, filename );
+      printf("---------------------------------------------------------------------------------------\n");
+      telemetry_groups_print( &ports, "port" );
+      printf("---------------------------------------------------------------------------------------\n");
+      telemetry_groups_print( &devices, "device" );
+      printf("---------------------------------------------------------------------------------------\n");
+   }
+   free( ports.groups );
+   free( devices.groups );
+   free( filename );
+   return ok ? sessions : -1;
+}
@@ -0,0 +1,1475 @@
+#define _GNU_SOURCE   // pseudo terminals of the fake device
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "common.h"
+#define MODULE_NAME "test"
+
+/// Behaviour checks of the library, run by ctest. Each group works in a directory of its own and exits with 0 when
+/// all of its checks passed, failed checks are printed with their line.
+
+///-------------------------------------------------------------------------------------
+int GLOBAL_debug_level = 0;
+
+/// Epoch of the first point of the made up tracks, 2012-04-14 10:00:00
+#define TEST_EPOCH 1334397600
+
+static int test_failures = 0;
+
+#define CHECK( condition ) test_check( (condition), #condition, __LINE__ )
+
+static bool test_check( bool ok, const char* condition, int line )
+{
+   if ( !ok )
+   {
+      printf("test.c:%d: check failed: %s\n", line, condition );
+      test_failures ++;
+   }
+   return ok;
+}
+
+///-------------------------------------------------------------------------------------
+/// HELPERS
+///-------------------------------------------------------------------------------------
+static const char* test_path( const char* dir, const char* name )
+{
+   static char paths[4][ BUFFER_SIZE ];
+   static int next = 0;
+   char* path = paths[ next ++ % 4 ];
+
+   snprintf( path, BUFFER_SIZE, "%s/%s", dir, name );
+   return path;
+}
+
+static bool test_exists( const char* filename )
+{
+   return access( filename, F_OK ) == 0;
+}
+
+/// Whole file to memory, zero terminated, NULL if it cannot be read
+static char* test_read_file( const char* filename, size_t* len )
+{
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL )
+      return NULL;
+   fseek( fid, 0, SEEK_END );
+   long size = ftell( fid );
+   fseek( fid, 0, SEEK_SET );
+   char* data = (char*)malloc( size + 1 );
+   if ( data != NULL && fread( data, 1, size, fid ) != (size_t)size )
+   {
+      free( data );
+      data = NULL;
+   }
+   fclose( fid );
+   if ( data != NULL )
+   {
+      data[size] = 0x00;
+      if ( len != NULL )
+         *len = size;
+   }
+   return data;
+}
+
+static bool test_write_file( const char* filename, const char* text )
+{
+   FILE* fid = fopen( filename, "wb" );
+   if ( fid == NULL )
+      return false;
+   bool ok = ( fputs( text, fid ) >= 0 );
+   return ( fclose( fid ) == 0 ) && ok;
+}
+
+static bool test_same_files( const char* a, const char* b )
+{
+   size_t alen = 0, blen = 0;
+   char* adata = test_read_file( a, &alen );
+   char* bdata = test_read_file( b, &blen );
+   bool same = ( adata != NULL && bdata != NULL && alen == blen && memcmp( adata, bdata, alen ) == 0 );
+   free( adata );
+   free( bdata );
+   return same;
+}
+
+static bool test_same_point( const GPS_point* a, const GPS_point* b )
+{
+   return a->latitude == b->latitude && a->longitude == b->longitude && a->height == b->height &&
+          GPS_point_epoch( a ) == GPS_point_epoch( b );
+}
+
+static void test_point( GPS_point* point, int64_t epoch, int32_t latitude, int32_t longitude, int32_t height )
+{
+   memset( point, 0, sizeof(GPS_point) );
+   point->latitude  = latitude;
+   point->longitude = longitude;
+   point->height    = height;
+   GPS_point_set_epoch( point, epoch );
+}
+
+static bool test_points_alloc( GPS_points* points, unsigned int npoints )
+{
+   GPS_points_init( points );
+   points->points = (GPS_point*)calloc( npoints ? npoints : 1, sizeof(GPS_point) );
+   points->npoints = ( points->points != NULL ) ? npoints : 0;
+   return points->points != NULL;
+}
+
+/// Track that walks north east one point a second
+static bool test_walk( GPS_points* points, unsigned int npoints, int64_t start, int32_t latitude, int32_t longitude )
+{
+   unsigned int loop;
+
+   if ( !test_points_alloc( points, npoints ) )
+      return false;
+   for ( loop = 0; loop < npoints; loop ++ )
+      test_point( &points->points[loop], start + loop, latitude + loop * 7, longitude + loop * 13, 30 + loop / 10 );
+   return true;
+}
+
+
+///-------------------------------------------------------------------------------------
+/// FORMATS: micro-degree text, track store and GPX round trips, parallel formatting
+///-------------------------------------------------------------------------------------
+static void test_formats_microdeg( void )
+{
+   static const struct
+   {
+      const char* text;
+      bool        ok;
+      int32_t     value;
+   } parses[] =
+   {
+      { "60.123456",      true,  60123456 },
+      { "60.1234565",     true,  60123457 },    // rounded at the seventh decimal
+      { "60.1234564",     true,  60123456 },
+      { "60.12345649999", true,  60123456 },    // decimals after the seventh are not looked at
+      { "-24.9999995",    true,  -25000000 },   // halves away from zero
+      { "-0.0000005",     true,  -1 },
+      { "-0.0000004",     true,  0 },
+      { "180",            true,  180000000 },
+      { "-180.000000",    true,  -180000000 },
+      { ".5",             true,  500000 },
+      { "5.",             true,  5000000 },
+      { "+1",             true,  1000000 },
+      { "  7.25",         true,  7250000 },
+      { "7.25  ",         true,  7250000 },
+      { "60.123456789012", true, 60123457 },
+      { "180.0000004",    true,  180000000 },
+      { "180.000001",     false, 0 },         // beyond the limit
+      { "2148",           false, 0 },
+      { "99999999999999", false, 0 },         // would overflow
+      { "12.5\"",         false, 0 },         // nothing may follow the number
+      { "12.5abc",        false, 0 },
+      { "1e5",            false, 0 },
+      { "1 2",            false, 0 },
+      { ".",              false, 0 },
+      { "-.",             false, 0 },
+      { "+",              false, 0 },
+      { "",               false, 0 },
+      { "abc",            false, 0 },
+      { ".e",             false, 0 },
+   };
+   static const int32_t values[] = { 0, 1, -1, 999999, -999999, 1000000, 60123456, -24940000, 180000000, -180000000 };
+   char text[32];
+   unsigned int loop;
+
+   for ( loop = 0; loop < sizeof(parses)/sizeof(parses[0]); loop ++ )
+   {
+      int32_t value = 0x5a5a5a5a;
+      bool ok = GPS_parse_microdeg( parses[loop].text, GPS_LONGITUDE_MAX, &value );
+      if ( !CHECK( ok == parses[loop].ok ) || ( ok && !CHECK( value == parses[loop].value ) ) )
+         printf("  parsing '%s' gave %s %d\n", parses[loop].text, ok ? "true" : "false", value );
+   }
+
+   for ( loop = 0; loop < sizeof(values)/sizeof(values[0]); loop ++ )
+   {
+      int32_t value = 0;
+      text[ GPS_format_microdeg( text, values[loop] ) ] = 0x00;
+      if ( !CHECK( GPS_parse_microdeg( text, GPS_LONGITUDE_MAX, &value ) && value == values[loop] ) )
+         printf("  %d formatted as '%s' parsed back as %d\n", values[loop], text, value );
+   }
+   // latitudes end at the poles
+   int32_t value = 0;
+   CHECK( GPS_parse_microdeg( "-90", GPS_LATITUDE_MAX, &value ) && value == -90000000 );
+   CHECK( !GPS_parse_microdeg( "90.000001", GPS_LATITUDE_MAX, &value ) );
+   CHECK( !GPS_parse_microdeg( "-91", GPS_LATITUDE_MAX, &value ) );
+
+   text[ GPS_format_microdeg( text, -1 ) ] = 0x00;
+   CHECK( strcmp( text, "-0.000001" ) == 0 );
+   text[ GPS_format_microdeg( text, 0 ) ] = 0x00;
+   CHECK( strcmp( text, "0.000000" ) == 0 );
+}
+
+/// Points that take every branch of the delta of delta coding: steady steps, jumps of time and position, repeated
+/// times, antimeridian, extreme heights, and blocks that end part full
+static bool test_formats_track( GPS_points* points )
+{
+   unsigned int npoints = 3 * TRACK_BLOCK_POINTS + 17, loop;
+   int64_t time = TEST_EPOCH;
+   int32_t latitude = 60170000, longitude = 24940000, height = 30;
+
+   if ( !test_points_alloc( points, npoints ) )
+      return false;
+   for ( loop = 0; loop < npoints; loop ++ )
+   {
+      switch ( loop % 97 )
+      {
+         case 10: time += 86400 * 40;  break;              // weeks without points
+         case 20: break;                                   // same second again
+         case 30: time += 1; latitude = -latitude; break;  // other hemisphere
+         case 40: time += 3; longitude = 179999999; break;
+         case 41: time += 3; longitude = -179999999; break;
+         case 50: time += 1; height = -420; break;
+         case 51: time += 1; height = 8848; break;
+         case 60: time += 1; latitude -= 1000000; longitude += 2000000; break;
+         default: time += 1 + loop % 3; latitude += 7; longitude += 13 - (int32_t)( loop % 5 ); height += loop % 2;
+      }
+      test_point( &points->points[loop], time, latitude, longitude, height );
+   }
+   return true;
+}
+
+static void test_formats_round_trip( const char* dir, const GPS_points* points, const char* name )
+{
+   const char* filename = test_path( dir, name );
+   GPS_points back;
+   unsigned int loop, differ = 0;
+
+   unlink( filename );
+   GPS_points_init( &back );
+   if ( !CHECK( GPS_points_write( (GPS_points*)points, filename ) ) || !CHECK( GPS_points_read( &back, filename ) ) )
+      return;
+   if ( CHECK( back.npoints == points->npoints ) )
+      for ( loop = 0; loop < back.npoints; loop ++ )
+         differ += !test_same_point( &back.points[loop], &points->points[loop] );
+   if ( !CHECK( differ == 0 ) )
+      printf("  %u of %u points of '%s' differ\n", differ, points->npoints, name );
+   GPS_points_free( &back );
+}
+
+/// Text of long arrays is formatted on threads, the file must be the same as written by one thread
+static void test_formats_parallel( const char* dir, const char* name )
+{
+   char serial[ BUFFER_SIZE ], parallel[ BUFFER_SIZE ];
+   GPS_points points;
+
+   snprintf( serial, sizeof(serial), "%s/serial_%s", dir, name );
+   snprintf( parallel, sizeof(parallel), "%s/parallel_%s", dir, name );
+   if ( !CHECK( test_walk( &points, 100000, TEST_EPOCH, -33860000, 151200000 ) ) )
+      return;
+   setenv( "GEOTECH_THREADS", "1", 1 );
+   CHECK( GPS_points_write( &points, serial ) );
+   setenv( "GEOTECH_THREADS", "5", 1 );
+   CHECK( GPS_points_write( &points, parallel ) );
+   unsetenv( "GEOTECH_THREADS" );
+   CHECK( test_same_files( serial, parallel ) );
+   GPS_points_free( &points );
+}
+
+static void test_formats( const char* dir )
+{
+   GPS_points points;
+
+   test_formats_microdeg();
+
+   if ( CHECK( test_formats_track( &points ) ) )
+   {
+      test_formats_round_trip( dir, &points, "track.gts" );
+      test_formats_round_trip( dir, &points, "track.gpx" );
+      GPS_points_free( &points );
+   }
+   if ( CHECK( test_points_alloc( &points, 0 ) ) )
+   {
+      test_formats_round_trip( dir, &points, "empty.gts" );
+      GPS_points_free( &points );
+   }
+
+   test_formats_parallel( dir, "walk.gpx" );
+   test_formats_parallel( dir, "walk.csv" );
+}
+
+
+///-------------------------------------------------------------------------------------
+/// OUTPUT: a file is replaced only by a complete new one, and never left half written
+///-------------------------------------------------------------------------------------
+typedef struct
+{
+   unsigned int calls;
+   bool         ok;
+} Test_done;
+
+static void test_output_done( const char* filename, bool ok, void* context )
+{
+   Test_done* done = (Test_done*)context;
+   done->calls ++;
+   done->ok = ok;
+}
+
+/// New text in place of the old one through output_open, kept or aborted
+static void test_output_replace( const char* dir, bool keep )
+{
+   const char* filename = test_path( dir, "replaced.txt" );
+   const char* temp     = test_path( dir, "replaced.txt.tmp" );
+   Test_done done = { 0, false };
+
+   CHECK( test_write_file( filename, "old\n" ) );
+   Output* output = output_open( filename );
+   if ( !CHECK( output != NULL ) )
+      return;
+   CHECK( output_write( output, "new\n", 4 ) );
+   // the old file is there until the new one is complete
+   CHECK( test_exists( temp ) );
+   char* text = test_read_file( filename, NULL );
+   CHECK( text != NULL && strcmp( text, "old\n" ) == 0 );
+   free( text );
+
+   if ( keep )
+      CHECK( output_close( output, test_output_done, &done ) );
+   else
+      output_abort( output );
+
+   text = test_read_file( filename, NULL );
+   CHECK( text != NULL && strcmp( text, keep ? "new\n" : "old\n" ) == 0 );
+   free( text );
+   CHECK( !test_exists( temp ) );
+   CHECK( done.calls == ( keep ? 1 : 0 ) && done.ok == keep );
+}
+
+/// Writer aborted after some points leaves the previous file and tells the handler it was not saved
+static void test_output_writer_abort( const char* dir, const char* name )
+{
+   char temp[ BUFFER_SIZE ], old[ BUFFER_SIZE ];
+   const char* filename = test_path( dir, name );
+   Test_done done = { 0, true };
+   GPS_points points;
+   unsigned int loop;
+
+   snprintf( temp, sizeof(temp), "%s.tmp", filename );
+   snprintf( old, sizeof(old), "%s/old_%s", dir, name );
+   if ( !CHECK( test_walk( &points, 2 * TRACK_BLOCK_POINTS, TEST_EPOCH, 60170000, 24940000 ) ) )
+      return;
+   points.npoints = 100;
+   CHECK( GPS_points_write( &points, filename ) );
+   CHECK( GPS_points_write( &points, old ) );
+   points.npoints = 2 * TRACK_BLOCK_POINTS;
+
+   GPS_writer* writer = GPS_writer_open( filename );
+   if ( CHECK( writer != NULL ) )
+   {
+      GPS_writer_notify( writer, test_output_done, &done );
+      for ( loop = 0; loop < points.npoints; loop ++ )
+         CHECK( GPS_writer_append( writer, &points.points[loop] ) );
+      GPS_writer_abort( writer );
+   }
+   CHECK( test_same_files( filename, old ) );
+   CHECK( !test_exists( temp ) );
+   CHECK( done.calls == 1 && !done.ok );
+   GPS_points_free( &points );
+}
+
+static void test_output( const char* dir )
+{
+   test_output_replace( dir, true );
+   test_output_replace( dir, false );
+   test_output_writer_abort( dir, "aborted.gpx" );
+   test_output_writer_abort( dir, "aborted.csv" );
+   test_output_writer_abort( dir, "aborted.gts" );
+
+   // a file that cannot be created is refused at open
+   CHECK( output_open( "/proc/geotech_test/none.txt" ) == NULL );
+}
+
+///-------------------------------------------------------------------------------------
+/// GZIP: compressed output is a series of complete gzip members, the same text as plain output
+///-------------------------------------------------------------------------------------
+#ifdef HAVE_ZLIB
+/// Inflate the members one by one. \returns number of members, -1 if one is broken or the file ends inside one
+static long test_gzip_members( const char* filename, char* text, size_t max_len, size_t* len )
+{
+   size_t packed_len = 0;
+   char* packed = test_read_file( filename, &packed_len );
+   z_stream stream;
+   long members = 0;
+   int ret = Z_OK;
+
+   if ( packed == NULL )
+      return -1;
+   memset( &stream, 0, sizeof(stream) );
+   stream.next_in   = (Bytef*)packed;
+   stream.avail_in  = packed_len;
+   stream.next_out  = (Bytef*)text;
+   stream.avail_out = max_len;
+   // window bits over 15 accept gzip header and trailer only
+   if ( inflateInit2( &stream, 15 + 16 ) != Z_OK )
+   {
+      free( packed );
+      return -1;
+   }
+   while ( stream.avail_in > 0 && ( ret = inflate( &stream, Z_FINISH ) ) == Z_STREAM_END )
+   {
+      members ++;
+      inflateReset( &stream );
+   }
+   *len = max_len - stream.avail_out;
+   inflateEnd( &stream );
+   free( packed );
+   return ( ret == Z_STREAM_END ) ? members : -1;
+}
+
+static void test_gzip_output( const char* dir, const char* name, unsigned int npoints )
+{
+   char plain[ BUFFER_SIZE ], packed[ BUFFER_SIZE ];
+   size_t plain_len = 0, text_len = 0;
+   GPS_points points;
+
+   snprintf( plain, sizeof(plain), "%s/%s", dir, name );
+   snprintf( packed, sizeof(packed), "%s/%s.gz", dir, name );
+   if ( !CHECK( test_walk( &points, npoints, TEST_EPOCH, 48850000, 2350000 ) ) )
+      return;
+   CHECK( GPS_points_write( &points, plain ) );
+   CHECK( GPS_points_write( &points, packed ) );
+   GPS_points_free( &points );
+
+   char* expected = test_read_file( plain, &plain_len );
+   char* text = (char*)malloc( plain_len + 1 );
+   if ( CHECK( expected != NULL && text != NULL ) )
+   {
+      long members = test_gzip_members( packed, text, plain_len + 1, &text_len );
+      // one member per started block of a megabyte
+      if ( !CHECK( members == (long)( ( plain_len + ( 1 << 20 ) - 1 ) >> 20 ) ) )
+         printf("  '%s' has %ld members for %zu bytes\n", packed, members, plain_len );
+      CHECK( text_len == plain_len && memcmp( text, expected, plain_len ) == 0 );
+   }
+   free( expected );
+   free( text );
+}
+#endif
+
+static void test_gzip( const char* dir )
+{
+#ifdef HAVE_ZLIB
+   test_gzip_output( dir, "short.csv", 10 );
+   test_gzip_output( dir, "long.csv", 200000 );
+   test_gzip_output( dir, "long.gpx", 50000 );
+#else
+   printf("gzip: built without zlib, nothing to check\n");
+#endif
+}
+
+///-------------------------------------------------------------------------------------
+/// MERGE: duplicates dropped within tolerance, external sort gives the same file as sort in memory
+///-------------------------------------------------------------------------------------
+/// Files of the directory whose name starts with prefix
+static unsigned int test_count_files( const char* dir, const char* prefix )
+{
+   unsigned int count = 0;
+   struct dirent* entry;
+   DIR* handle = opendir( dir );
+
+   if ( handle == NULL )
+      return 0;
+   while ( ( entry = readdir( handle ) ) != NULL )
+      count += ( strncmp( entry->d_name, prefix, strlen( prefix ) ) == 0 );
+   closedir( handle );
+   return count;
+}
+
+static void test_merge_run( const char* dir, const char* name, size_t memory, double tolerance, long written,
+                            long dropped )
+{
+   const char* inputs[2] = { test_path( dir, "first.gts" ), test_path( dir, "second.gts" ) };
+   const char* filename = test_path( dir, name );
+   Merge_options options = { memory, tolerance };
+   Merge_result result;
+   GPS_points merged;
+   unsigned int loop, unsorted = 0;
+
+   unlink( filename );
+   long count = merge_tracks( filename, inputs, 2, &options, &result );
+   if ( !CHECK( count == written && result.written == written && result.dropped == dropped && result.read == 20000 ) )
+      printf("  '%s': %ld written, %ld dropped of %ld read\n", name, result.written, result.dropped, result.read );
+   // runs are removed once merged
+   CHECK( ( memory == 0 ) ? result.runs == 0 : result.runs > 2 );
+   CHECK( test_count_files( dir, name ) == 1 );
+
+   GPS_points_init( &merged );
+   if ( CHECK( GPS_points_read( &merged, filename ) ) && CHECK( merged.npoints == (unsigned int)written ) )
+      for ( loop = 1; loop < merged.npoints; loop ++ )
+         unsorted += GPS_point_epoch( &merged.points[loop] ) < GPS_point_epoch( &merged.points[loop - 1] );
+   CHECK( unsorted == 0 );
+   GPS_points_free( &merged );
+}
+
+static void test_merge( const char* dir )
+{
+   GPS_points first, second;
+   unsigned int loop;
+
+   // second track has every other point of the first, a quarter moved by half a meter and a quarter by 111 m
+   if ( !CHECK( test_walk( &first, 10000, TEST_EPOCH, 60170000, 24940000 ) ) ||
+        !CHECK( test_walk( &second, 10000, TEST_EPOCH, 60170000, 24940000 ) ) )
+      return;
+   for ( loop = 0; loop < second.npoints; loop ++ )
+      second.points[loop].latitude += ( loop % 4 == 1 ) ? 5 : ( loop % 4 == 3 ) ? 1000 : 0;
+   // the second track is given in reverse, merge sorts by time
+   for ( loop = 0; loop < second.npoints / 2; loop ++ )
+   {
+      GPS_point swap = second.points[loop];
+      second.points[loop] = second.points[ second.npoints - 1 - loop ];
+      second.points[ second.npoints - 1 - loop ] = swap;
+   }
+   CHECK( GPS_points_write( &first, test_path( dir, "first.gts" ) ) );
+   CHECK( GPS_points_write( &second, test_path( dir, "second.gts" ) ) );
+   GPS_points_free( &first );
+   GPS_points_free( &second );
+
+   // the smallest budget sorts 4096 points at a time and merges two runs at once
+   test_merge_run( dir, "memory.gts", 0, 2.0, 12500, 7500 );
+   test_merge_run( dir, "external.gts", 1, 2.0, 12500, 7500 );
+   CHECK( test_same_files( test_path( dir, "memory.gts" ), test_path( dir, "external.gts" ) ) );
+   test_merge_run( dir, "exact.gts", 1, 0.0, 15000, 5000 );
+}
+
+///-------------------------------------------------------------------------------------
+/// RESAMPLE: interpolation on the grid, gaps, antimeridian, join of tracks with clock offset
+///-------------------------------------------------------------------------------------
+/// Points at the seconds after TEST_EPOCH, latitude and height offsets from a fixed place
+static bool test_resample_track( const char* filename, const int* seconds, const int* offsets, unsigned int npoints )
+{
+   GPS_points points;
+   unsigned int loop;
+
+   if ( !test_points_alloc( &points, npoints ) )
+      return false;
+   for ( loop = 0; loop < npoints; loop ++ )
+      test_point( &points.points[loop], TEST_EPOCH + seconds[loop], 60170000 + offsets[loop], 24940000,
+                  offsets[loop] / 10 );
+   bool ok = GPS_points_write( &points, filename );
+   GPS_points_free( &points );
+   return ok;
+}
+
+static void test_resample_grid( const char* dir )
+{
+   // first point off the grid, a gap longer than max_gap between 43 and 200 s
+   static const int seconds[] = { 3, 23, 43, 200, 221 };
+   static const int offsets[] = { 0, 200, 400, 2000, 2210 };
+   static const int grid[]    = { 10, 20, 30, 40, 200, 210, 220 };
+   static const int lerped[]  = { 70, 170, 270, 370, 2000, 2100, 2200 };
+   Resample_options options = { 10, 60 };
+   GPS_points points;
+   unsigned int loop;
+
+   if ( !CHECK( test_resample_track( test_path( dir, "a.gts" ), seconds, offsets, 5 ) ) )
+      return;
+   GPS_writer* writer = GPS_writer_open( test_path( dir, "grid.gts" ) );
+   if ( !CHECK( writer != NULL ) )
+      return;
+   CHECK( resample_track( test_path( dir, "a.gts" ), &options, writer ) == 7 );
+   CHECK( GPS_writer_close( writer ) );
+
+   GPS_points_init( &points );
+   if ( CHECK( GPS_points_read( &points, test_path( dir, "grid.gts" ) ) ) && CHECK( points.npoints == 7 ) )
+   {
+      for ( loop = 0; loop < 7; loop ++ )
+      {
+         GPS_point expected;
+         test_point( &expected, TEST_EPOCH + grid[loop], 60170000 + lerped[loop], 24940000, lerped[loop] / 10 );
+         if ( !CHECK( test_same_point( &points.points[loop], &expected ) ) )
+            printf("  grid point %u at %+d s has latitude %d height %d\n", loop,
+                   (int)( GPS_point_epoch( &points.points[loop] ) - TEST_EPOCH ), points.points[loop].latitude,
+                   points.points[loop].height );
+      }
+   }
+   GPS_points_free( &points );
+}
+
+/// Positions between two points on each side of the antimeridian go the short way
+static void test_resample_antimeridian( const char* dir )
+{
+   static const int32_t longitudes[] = { 179999500, 180000000, -179999500 };
+   GPS_points points;
+   GPS_point point;
+   unsigned int loop;
+
+   if ( !CHECK( test_points_alloc( &points, 2 ) ) )
+      return;
+   test_point( &points.points[0], TEST_EPOCH, -17000000, 179999000, 0 );
+   test_point( &points.points[1], TEST_EPOCH + 20, -17000000, -179999000, 0 );
+   CHECK( GPS_points_write( &points, test_path( dir, "fiji.gts" ) ) );
+   GPS_points_free( &points );
+
+   Resampler* resampler = resample_open( test_path( dir, "fiji.gts" ), 5, 60, 0.0 );
+   if ( !CHECK( resampler != NULL ) )
+      return;
+   CHECK( resample_next( resampler, &point ) == 1 && point.longitude == 179999000 );
+   for ( loop = 0; loop < 3; loop ++ )
+      if ( !CHECK( resample_next( resampler, &point ) == 1 && point.longitude == longitudes[loop] ) )
+         printf("  at %d s longitude is %d\n", (int)( GPS_point_epoch( &point ) - TEST_EPOCH ), point.longitude );
+   CHECK( resample_next( resampler, &point ) == 1 && point.longitude == -179999000 );
+   CHECK( resample_next( resampler, &point ) == 0 );
+   resample_close( resampler );
+}
+
+static void test_resample_join( const char* dir )
+{
+   // track b is 5 s behind, its clock offset puts its points on the grid of a
+   static const int seconds[] = { 0, 30 };
+   static const int offsets[] = { 0, 300 };
+   static const char expected[] =
+      "time,a_lat,a_lon,a_height,b_lat,b_lon,b_height\n"
+      "2012-04-14T10:00:10Z,60.170070,24.940000,7,60.170050,24.940000,5\n"
+      "2012-04-14T10:00:20Z,60.170170,24.940000,17,60.170150,24.940000,15\n"
+      "2012-04-14T10:00:30Z,60.170270,24.940000,27,60.170250,24.940000,25\n"
+      "2012-04-14T10:00:40Z,60.170370,24.940000,37,,,\n"
+      "2012-04-14T10:03:20Z,60.172000,24.940000,200,,,\n"
+      "2012-04-14T10:03:30Z,60.172100,24.940000,210,,,\n"
+      "2012-04-14T10:03:40Z,60.172200,24.940000,220,,,\n";
+   char input_b[ BUFFER_SIZE ];
+   Resample_options options = { 10, 60 };
+
+   if ( !CHECK( test_resample_track( test_path( dir, "b.gts" ), seconds, offsets, 2 ) ) )
+      return;
+   snprintf( input_b, sizeof(input_b), "%s/b.gts@5", dir );
+   const char* inputs[2] = { test_path( dir, "a.gts" ), input_b };
+   CHECK( resample_join( test_path( dir, "joined.csv" ), inputs, 2, &options ) == 7 );
+
+   char* text = test_read_file( test_path( dir, "joined.csv" ), NULL );
+   if ( !CHECK( text != NULL && strcmp( text, expected ) == 0 ) )
+      printf("  joined:\n%s", text != NULL ? text : "" );
+   free( text );
+}
+
+static void test_resample( const char* dir )
+{
+   test_resample_grid( dir );
+   test_resample_antimeridian( dir );
+   test_resample_join( dir );
+}
+
+///-------------------------------------------------------------------------------------
+/// STAYS: stay points of devices clustered to the places they come back to
+///-------------------------------------------------------------------------------------
+#define TEST_HOME_LAT 60170000
+#define TEST_WORK_LAT 60225000
+#define TEST_FAR_LAT  60300000
+#define TEST_STAY_LON 24940000
+
+/// Points every 10 s for the duration at the latitude, jittering by a few decimeters
+static void test_stays_stop( GPS_points* points, int64_t* time, int32_t latitude, int64_t duration )
+{
+   int64_t end = *time + duration;
+
+   for ( ; *time < end; *time += 10, points->npoints ++ )
+      test_point( &points->points[ points->npoints ], *time, latitude + (int32_t)( points->npoints % 7 ) - 3,
+                  TEST_STAY_LON + (int32_t)( points->npoints % 5 ) - 2, 12 );
+}
+
+/// 111 m every 10 s, no stay on the way
+static void test_stays_drive( GPS_points* points, int64_t* time, int32_t from, int32_t to )
+{
+   int32_t step = ( to > from ) ? 1000 : -1000;
+   int32_t latitude;
+
+   for ( latitude = from + step; latitude != to; latitude += step, *time += 10, points->npoints ++ )
+      test_point( &points->points[ points->npoints ], *time, latitude, TEST_STAY_LON, 12 );
+}
+
+/// Place row of the places CSV nearest to the latitude, false if there is none within 10 m
+static bool test_stays_place( const char* text, int32_t latitude, unsigned int* visits, unsigned int* sessions )
+{
+   const char* line = strchr( text, '\n' );
+
+   for ( ; line != NULL && line[1] != 0x00; line = strchr( line + 1, '\n' ) )
+   {
+      int32_t lat = 0;
+      char number[ 32 ];
+      const char* field = strchr( line + 1, ',' );
+      if ( field != NULL && sscanf( field + 1, "%31[^,]", number ) == 1 &&
+           GPS_parse_microdeg( number, GPS_LATITUDE_MAX, &lat ) && abs( lat - latitude ) < 90 )
+      {
+         // longitude, then visits and sessions
+         field = strchr( field + 1, ',' );
+         field = ( field != NULL ) ? strchr( field + 1, ',' ) : NULL;
+         return field != NULL && sscanf( field + 1, "%u,%u", visits, sessions ) == 2;
+      }
+   }
+   return false;
+}
+
+static void test_stays( const char* dir )
+{
+   Stays_options options = { 100.0, 300, 50.0, 2 };
+   GPS_points car, van;
+   int64_t time = TEST_EPOCH;
+   unsigned int visits = 0, sessions = 0;
+   long nstays = 0;
+
+   // car goes from home to work and back, van stops at work and briefly far away
+   if ( !CHECK( test_points_alloc( &car, 1000 ) ) || !CHECK( test_points_alloc( &van, 1000 ) ) )
+      return;
+   car.npoints = 0;
+   test_stays_stop( &car, &time, TEST_HOME_LAT, 600 );
+   test_stays_drive( &car, &time, TEST_HOME_LAT, TEST_WORK_LAT );
+   test_stays_stop( &car, &time, TEST_WORK_LAT, 600 );
+   test_stays_drive( &car, &time, TEST_WORK_LAT, TEST_HOME_LAT );
+   test_stays_stop( &car, &time, TEST_HOME_LAT, 600 );
+   van.npoints = 0;
+   time = TEST_EPOCH + 3600;
+   test_stays_stop( &van, &time, TEST_WORK_LAT, 900 );
+   test_stays_drive( &van, &time, TEST_WORK_LAT, TEST_FAR_LAT );
+   test_stays_stop( &van, &time, TEST_FAR_LAT, 60 );
+   CHECK( GPS_points_write( &car, test_path( dir, "car.gts" ) ) );
+   CHECK( GPS_points_write( &van, test_path( dir, "van.gts" ) ) );
+   GPS_points_free( &car );
+   GPS_points_free( &van );
+
+   const char* inputs[2] = { test_path( dir, "car.gts" ), test_path( dir, "van.gts" ) };
+   long nplaces = stays_scan( test_path( dir, "places.csv" ), test_path( dir, "visits.csv" ), inputs, 2, &options,
+                              &nstays );
+   if ( !CHECK( nplaces == 2 && nstays == 4 ) )
+      printf("  %ld places of %ld stays\n", nplaces, nstays );
+
+   char* places = test_read_file( test_path( dir, "places.csv" ), NULL );
+   if ( CHECK( places != NULL ) )
+   {
+      CHECK( strncmp( places, STAYS_PLACES_CSV_HEADER, strlen( STAYS_PLACES_CSV_HEADER ) ) == 0 );
+      // home twice by the car, work by both
+      CHECK( test_stays_place( places, TEST_HOME_LAT, &visits, &sessions ) && visits == 2 && sessions == 1 );
+      CHECK( test_stays_place( places, TEST_WORK_LAT, &visits, &sessions ) && visits == 2 && sessions == 2 );
+      CHECK( !test_stays_place( places, TEST_FAR_LAT, &visits, &sessions ) );
+   }
+   free( places );
+
+   char* text = test_read_file( test_path( dir, "visits.csv" ), NULL );
+   unsigned int lines = 0;
+   const char* pos;
+   for ( pos = text; pos != NULL && ( pos = strchr( pos, '\n' ) ) != NULL; pos ++ )
+      lines ++;
+   CHECK( lines == 1 + 4 );
+   free( text );
+}
+
+///-------------------------------------------------------------------------------------
+/// ARCHIVE: partitions merged whatever the state of their sidecar, a broken sidecar is an error
+///-------------------------------------------------------------------------------------
+/// Points of the device in the first hour of the test day, -1 if the extract failed
+static long test_archive_extract( const char* dir, const char* root )
+{
+   GPS_writer* writer = GPS_writer_open( test_path( dir, "extract.gts" ) );
+   if ( writer == NULL )
+      return -1;
+   long count = archive_extract( root, "watch", TEST_EPOCH, TEST_EPOCH + 3599, writer );
+   if ( count < 0 )
+      GPS_writer_abort( writer );
+   else if ( !GPS_writer_close( writer ) )
+      count = -1;
+   return count;
+}
+
+/// Walk of npoints from the second after TEST_EPOCH to the archive
+static bool test_archive_write( const char* root, unsigned int npoints, int64_t second )
+{
+   GPS_points points;
+   bool ok = test_walk( &points, npoints, TEST_EPOCH + second, 60170000 + second, 24940000 ) &&
+             archive_write( root, "watch", &points );
+   GPS_points_free( &points );
+   return ok;
+}
+
+static void test_archive( const char* dir )
+{
+   char root[ BUFFER_SIZE ], track[ BUFFER_SIZE + 32 ], meta[ BUFFER_SIZE + 32 ];
+
+   snprintf( root, sizeof(root), "%s/root", dir );
+   snprintf( track, sizeof(track), "%s/watch/2012/04/14.gts", root );
+   snprintf( meta, sizeof(meta), "%s/watch/2012/04/14.meta", root );
+   unlink( track );
+   unlink( meta );
+   unlink( test_path( root, "index" ) );
+   unlink( test_path( root, "index.tracks" ) );
+
+   CHECK( test_archive_write( root, 100, 0 ) );
+   CHECK( test_archive_extract( dir, root ) == 100 );
+
+   // sidecar lost, the points of the partition are still merged and the sidecar written again
+   CHECK( unlink( meta ) == 0 );
+   CHECK( test_archive_extract( dir, root ) == 100 );
+   CHECK( test_archive_write( root, 100, 100 ) );
+   CHECK( test_exists( meta ) );
+   CHECK( test_archive_extract( dir, root ) == 200 );
+
+   // broken sidecar fails the extract, the next write merges and replaces it
+   CHECK( test_write_file( meta, "points\n" ) );
+   CHECK( test_archive_extract( dir, root ) < 0 );
+   CHECK( test_archive_write( root, 50, 200 ) );
+   CHECK( test_archive_extract( dir, root ) == 250 );
+}
+
+///-------------------------------------------------------------------------------------
+/// INDEX: points of the spatial index keep the name of their track
+///-------------------------------------------------------------------------------------
+typedef struct
+{
+   const char*  name;      // expected track
+   unsigned int hits;
+   unsigned int wrong;     // hits of another track
+} Test_index_hits;
+
+static void test_index_hit( const char* track, uint32_t track_id, int64_t time, int32_t latitude, int32_t longitude,
+                            void* context )
+{
+   Test_index_hits* hits = (Test_index_hits*)context;
+
+   (void)track_id; (void)time; (void)latitude; (void)longitude;
+   hits->hits ++;
+   hits->wrong += ( strcmp( track, hits->name ) != 0 );
+}
+
+/// Points of the index within 0.1 degrees of the place, all of them expected from the track
+static long test_index_query( const char* index, int32_t latitude, int32_t longitude, const char* name,
+                              Test_index_hits* hits )
+{
+   Spatial_query query;
+
+   memset( &query, 0, sizeof(query) );
+   query.lat0 = latitude - 100000;
+   query.lon0 = longitude - 100000;
+   query.lat1 = latitude + 100000;
+   query.lon1 = longitude + 100000;
+   query.from = INT64_MIN;
+   query.to   = INT64_MAX;
+   memset( hits, 0, sizeof(Test_index_hits) );
+   hits->name = name;
+   return spatial_index_query( index, &query, test_index_hit, hits );
+}
+
+static bool test_index_add( const char* index, const char* name, int32_t latitude, int32_t longitude )
+{
+   GPS_points points;
+   bool ok = test_walk( &points, 100, TEST_EPOCH, latitude, longitude ) &&
+             spatial_index_add( index, &name, &points, 1 );
+   GPS_points_free( &points );
+   return ok;
+}
+
+static void test_index( const char* dir )
+{
+   char index[ BUFFER_SIZE ], tracks[ BUFFER_SIZE + 16 ];
+   Test_index_hits hits;
+
+   snprintf( index, sizeof(index), "%s/index", dir );
+   snprintf( tracks, sizeof(tracks), "%s.tracks", index );
+   unlink( index );
+   unlink( tracks );
+
+   CHECK( test_index_add( index, "north", 60170000, 24940000 ) );
+   CHECK( test_index_add( index, "south", -33860000, 151210000 ) );
+   CHECK( test_index_query( index, 60170000, 24940000, "north", &hits ) == 100 && hits.wrong == 0 );
+   CHECK( test_index_query( index, -33860000, 151210000, "south", &hits ) == 100 && hits.wrong == 0 );
+
+   // names left by an add that did not get to its records do not shift the names of later tracks
+   FILE* fid = fopen( tracks, "ab" );
+   if ( CHECK( fid != NULL ) )
+   {
+      fputs( "lost\n", fid );
+      fclose( fid );
+   }
+   CHECK( test_index_add( index, "east", 35680000, 139760000 ) );
+   CHECK( test_index_query( index, 35680000, 139760000, "east", &hits ) == 100 && hits.wrong == 0 );
+   CHECK( test_index_query( index, 60170000, 24940000, "north", &hits ) == 100 && hits.wrong == 0 );
+   CHECK( !test_exists( test_path( dir, "index.tmp" ) ) && !test_exists( test_path( dir, "index.tracks.tmp" ) ) );
+}
+
+///-------------------------------------------------------------------------------------
+/// FAKE DEVICE: answers the protocol of messages.h on a pseudo terminal from a child process
+///-------------------------------------------------------------------------------------
+#define TEST_DEVICE_MAX 8192
+
+/// Shared between the device and the checks
+typedef struct
+{
+   unsigned int  npoints;         // entries the device reports
+   int           fail_after;      // device goes away after answering this many entries, -1 never
+   bool          alter;           // entries fetched a second time differ by a microdegree
+   int           stall_from;      // entries from this index on stop halfway, -1 never
+   bool          ready;
+   unsigned int  fetches;         // entries answered
+   unsigned int  clears;
+   unsigned char fetched[ TEST_DEVICE_MAX ];
+} Test_device_state;
+
+typedef struct
+{
+   char               path[ 64 ];  // terminal to open as the device
+   pid_t              pid;
+   Test_device_state* state;
+} Test_device;
+
+/// Point the device stores as entry 'index'
+static void test_device_point( GPS_point* point, unsigned int index )
+{
+   test_point( point, TEST_EPOCH + ( index / 60 ) % 60 * 60 + index % 60, 60170000 + index * 7,
+               24940000 + index * 13, 30 + index / 10 );
+}
+
+static void test_device_entry( unsigned char* entry, unsigned int index, bool altered )
+{
+   uint32_t longitude = 24940000 + index * 13;
+   uint32_t latitude  = 60170000 + index * 7 + ( altered ? 1 : 0 );
+   unsigned int height = 30 + index / 10, second = index % 60, minute = ( index / 60 ) % 60;
+   unsigned int hour = 10, day = 14, month = 4, year = 12;
+   unsigned int loop, sum = 0;
+
+   entry[0] = 0x23;
+   entry[1] = 0x23;
+   entry[2] = 0xa7;
+   for ( loop = 0; loop < 4; loop ++ )
+   {
+      entry[3 + loop] = ( longitude >> ( loop * 8 ) ) & 0xff;
+      entry[7 + loop] = ( latitude >> ( loop * 8 ) ) & 0xff;
+   }
+   entry[11] = height & 0xff;
+   entry[12] = height >> 8;
+   entry[13] = 0x4e;
+   entry[14] = 0xaf;
+   entry[15] = second | ( ( minute & 3 ) << 6 );
+   entry[16] = ( minute >> 2 ) | ( ( hour & 15 ) << 4 );
+   entry[17] = ( hour >> 4 ) | ( day << 1 ) | ( ( month & 3 ) << 6 );
+   entry[18] = ( month >> 2 ) | ( year << 2 );
+   for ( loop = 0; loop < 19; loop ++ )
+      sum += entry[loop];
+   entry[19] = ( sum + 0xba ) & 0xff;
+}
+
+static bool test_device_write( int fd, const void* data, size_t len )
+{
+   const char* pos = (const char*)data;
+   while ( len > 0 )
+   {
+      ssize_t wrote = write( fd, pos, len );
+      if ( wrote < 0 && errno == EINTR )
+         continue;
+      if ( wrote <= 0 )
+         return false;
+      pos += wrote;
+      len -= wrote;
+   }
+   return true;
+}
+
+/// Answer one request "##<command>...*<check>\r\n"
+static bool test_device_answer( int fd, Test_device_state* state, const unsigned char* request )
+{
+   static const unsigned char speedup_000[] = { 0x23, 0x23, 0xa0, 0x2a, 0xa0, 0x0d, 0x0a };
+   static const unsigned char speedup_001[] = { 0x23, 0x23, 0xa5, 0x10, 0x2a, 0xb5, 0x0d, 0x0a };
+   static const unsigned char reset[]       = { 0x23, 0x23, 0xa1, 0x2a, 0xa1, 0x0d, 0x0a };
+   static const unsigned char sample_set[]  = { 0x23, 0x23, 0xa8, 0x2a, 0xa8, 0x0d, 0x0a };
+   static const unsigned char clear[]       = { 0x23, 0x23, 0xaa, 0x2a, 0xaa, 0x0d, 0x0a };
+   char answer[ 64 ];
+   unsigned char entry[ 20 ];
+
+   switch ( request[2] )
+   {
+      case 0xf0: return test_device_write( fd, speedup_000, sizeof(speedup_000) );
+      case 0xf5: return test_device_write( fd, speedup_001, sizeof(speedup_001) );
+      case 0xf1: return test_device_write( fd, reset, sizeof(reset) );
+      case 0xf8: return test_device_write( fd, sample_set, sizeof(sample_set) );
+      case 0xf9: return test_device_write( fd, "##\xa9" "32,1*k\r\n", 11 );
+      case 0xfa:
+         __atomic_add_fetch( &state->clears, 1, __ATOMIC_SEQ_CST );
+         return test_device_write( fd, clear, sizeof(clear) );
+      case 0xf6:
+         snprintf( answer, sizeof(answer), "##\xa6%u,%u*C\r\n", state->npoints, state->npoints + 1 );
+         return test_device_write( fd, answer, strlen( answer ) );
+      case 0xf7:
+      {
+         unsigned int index = (unsigned int)atoi( (const char*)request + 3 ) % TEST_DEVICE_MAX;
+         bool altered = state->alter && state->fetched[index] > 0;
+         if ( state->fetched[index] < 255 )
+            state->fetched[index] ++;
+         test_device_entry( entry, index, altered );
+         unsigned int fetches = __atomic_add_fetch( &state->fetches, 1, __ATOMIC_SEQ_CST );
+         bool stalled = state->stall_from >= 0 && index >= (unsigned int)state->stall_from;
+         if ( !test_device_write( fd, entry, stalled ? sizeof(entry) / 2 : sizeof(entry) ) )
+            return false;
+         return state->fail_after < 0 || fetches < (unsigned int)state->fail_after;
+      }
+      default:
+         return true;
+   }
+}
+
+static void test_device_serve( int fd, Test_device_state* state )
+{
+   unsigned char input[ BUFFER_SIZE ];
+   size_t len = 0;
+
+   while ( true )
+   {
+      ssize_t got = read( fd, input + len, sizeof(input) - len );
+      if ( got < 0 && errno == EINTR )
+         continue;
+      if ( got <= 0 )
+         return;
+      len += got;
+
+      // requests end two bytes after the check byte that follows '*'
+      size_t start = 0;
+      while ( true )
+      {
+         while ( start + 1 < len && ( input[start] != '#' || input[start + 1] != '#' ) )
+            start ++;
+         const unsigned char* star = (const unsigned char*)memchr( input + start, '*', len - start );
+         if ( start + 1 >= len || star == NULL || star + 4 > input + len )
+            break;
+         if ( !test_device_answer( fd, state, input + start ) )
+            return;
+         start = star + 4 - input;
+      }
+      memmove( input, input + start, len - start );
+      len -= start;
+      if ( len == sizeof(input) )
+         len = 0;
+   }
+}
+
+/// Device with 'npoints' entries on a new pseudo terminal, until test_device_stop
+static bool test_device_start( Test_device* device, unsigned int npoints )
+{
+   device->pid = -1;
+   device->state = (Test_device_state*)mmap( NULL, sizeof(Test_device_state), PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+   if ( device->state == MAP_FAILED )
+   {
+      device->state = NULL;
+      return false;
+   }
+   memset( device->state, 0, sizeof(Test_device_state) );
+   device->state->npoints    = npoints;
+   device->state->fail_after = -1;
+   device->state->stall_from = -1;
+
+   int master = posix_openpt( O_RDWR | O_NOCTTY );
+   if ( master < 0 )
+      return false;
+   if ( grantpt( master ) != 0 || unlockpt( master ) != 0 || ptsname_r( master, device->path, sizeof(device->path) ) != 0 )
+   {
+      close( master );
+      return false;
+   }
+
+   device->pid = fork();
+   if ( device->pid == 0 )
+   {
+      // the other end stays open as long as the device lives, reads fail only once it is gone
+      struct termios mode;
+      int other = open( device->path, O_RDWR | O_NOCTTY );
+      if ( other < 0 || tcgetattr( master, &mode ) != 0 )
+         _exit( 1 );
+      cfmakeraw( &mode );
+      tcsetattr( master, TCSANOW, &mode );
+      tcsetattr( other, TCSANOW, &mode );
+      __atomic_store_n( &device->state->ready, true, __ATOMIC_SEQ_CST );
+      test_device_serve( master, device->state );
+      _exit( 0 );
+   }
+   close( master );
+   if ( device->pid < 0 )
+      return false;
+
+   int loop;
+   for ( loop = 0; loop < 5000 && !__atomic_load_n( &device->state->ready, __ATOMIC_SEQ_CST ); loop ++ )
+      usleep( 1000 );
+   return device->state->ready;
+}
+
+static void test_device_stop( Test_device* device )
+{
+   if ( device->pid > 0 )
+   {
+      kill( device->pid, SIGTERM );
+      waitpid( device->pid, NULL, 0 );
+   }
+   if ( device->state != NULL )
+      munmap( device->state, sizeof(Test_device_state) );
+   device->pid = -1;
+   device->state = NULL;
+}
+
+///-------------------------------------------------------------------------------------
+/// DOWNLOAD: entries through the decode queue in order, more of them than the queue holds
+///-------------------------------------------------------------------------------------
+#define TEST_DOWNLOAD_POINTS 5000
+
+typedef struct
+{
+   unsigned int count;
+   unsigned int wrong;   // points not in the order or with values of the device
+   unsigned int stop;    // sink fails at this point, 0 never
+} Test_download_sink;
+
+static bool test_download_sink( const GPS_point* point, void* context )
+{
+   Test_download_sink* sink = (Test_download_sink*)context;
+   GPS_point expected;
+
+   test_device_point( &expected, sink->count );
+   if ( !test_same_point( point, &expected ) )
+      sink->wrong ++;
+   sink->count ++;
+   return sink->stop == 0 || sink->count < sink->stop;
+}
+
+/// \returns status of serial_download, points counted and checked by the sink
+static int test_download_run( Test_device* device, GPS_arena* arena, Test_download_sink* sink )
+{
+   unsigned char* buffer = (unsigned char*)malloc( BUFFER_SIZE + 1 );
+   int serial_fd = -1;
+   int status = -2;
+
+   if ( buffer != NULL && serial_init_highspeed( device->path, buffer, &serial_fd ) )
+   {
+      status = serial_download( serial_fd, buffer, arena, test_download_sink, sink );
+      close( serial_fd );
+   }
+   free( buffer );
+   return status;
+}
+
+static void test_download( const char* dir )
+{
+   Test_device device;
+   Test_download_sink sink;
+   Serial_counters before, after;
+   GPS_arena arena;
+   GPS_points points;
+   unsigned int loop;
+
+   (void)dir;
+   // all entries through the queue, wrapping it
+   memset( &sink, 0, sizeof(sink) );
+   GPS_arena_init( &arena, GPS_ARENA_HEAP );
+   serial_counters_get( &before );
+   if ( CHECK( test_device_start( &device, TEST_DOWNLOAD_POINTS ) ) )
+   {
+      CHECK( test_download_run( &device, &arena, &sink ) == 0 );
+      CHECK( sink.count == TEST_DOWNLOAD_POINTS && sink.wrong == 0 );
+      CHECK( device.state->fetches == TEST_DOWNLOAD_POINTS );
+   }
+   test_device_stop( &device );
+   serial_counters_get( &after );
+   CHECK( after.points - before.points == TEST_DOWNLOAD_POINTS && after.checksum_errors == before.checksum_errors );
+
+   GPS_points_init( &points );
+   if ( CHECK( GPS_arena_to_points( &arena, &points ) && points.npoints == TEST_DOWNLOAD_POINTS ) )
+   {
+      GPS_point expected;
+      unsigned int wrong = 0;
+      for ( loop = 0; loop < points.npoints; loop ++ )
+      {
+         test_device_point( &expected, loop );
+         wrong += test_same_point( &points.points[loop], &expected ) ? 0 : 1;
+      }
+      CHECK( wrong == 0 );
+   }
+   GPS_points_free( &points );
+   GPS_arena_free( &arena );
+
+   // a failing sink stops the download
+   memset( &sink, 0, sizeof(sink) );
+   sink.stop = 1000;
+   GPS_arena_init( &arena, GPS_ARENA_HEAP );
+   if ( CHECK( test_device_start( &device, TEST_DOWNLOAD_POINTS ) ) )
+   {
+      CHECK( test_download_run( &device, &arena, &sink ) != 0 );
+      CHECK( sink.count == 1000 && sink.wrong == 0 );
+      CHECK( device.state->fetches < TEST_DOWNLOAD_POINTS );
+   }
+   test_device_stop( &device );
+   GPS_arena_free( &arena );
+
+   // a device going away fails the download
+   memset( &sink, 0, sizeof(sink) );
+   GPS_arena_init( &arena, GPS_ARENA_HEAP );
+   if ( CHECK( test_device_start( &device, TEST_DOWNLOAD_POINTS ) ) )
+   {
+      device.state->fail_after = 2000;
+      CHECK( test_download_run( &device, &arena, &sink ) != 0 );
+      CHECK( sink.count <= 2000 && sink.wrong == 0 );
+   }
+   test_device_stop( &device );
+   GPS_arena_free( &arena );
+
+   // an entry cut short is asked again without backing off the timeout, and given up after its tries
+   if ( CHECK( test_device_start( &device, 100 ) ) )
+   {
+      unsigned char* buffer = (unsigned char*)malloc( BUFFER_SIZE + 1 );
+      int serial_fd = -1, count = 0;
+      GPS_point point;
+
+      device.state->stall_from = 50;
+      if ( CHECK( buffer != NULL && serial_init_highspeed( device.path, buffer, &serial_fd ) ) )
+      {
+         CHECK( serial_download_count( serial_fd, buffer, &count ) == 0 && count == 100 );
+         CHECK( serial_fetch_entry( serial_fd, buffer, 10, &point ) == 0 );
+         unsigned int timeouts = serial_timing_get( SERIAL_CMD_ENTRY )->timeouts;
+         unsigned int fetches = device.state->fetches;
+         CHECK( serial_fetch_entry( serial_fd, buffer, 60, &point ) != 0 );
+         CHECK( device.state->fetches - fetches == 10 );
+         CHECK( serial_timing_get( SERIAL_CMD_ENTRY )->timeouts == timeouts );
+         close( serial_fd );
+      }
+      free( buffer );
+   }
+   test_device_stop( &device );
+}
+
+///-------------------------------------------------------------------------------------
+/// VERIFY: sampled entries fetched again, the device cleared only after its download has been saved and checked
+///-------------------------------------------------------------------------------------
+#define TEST_VERIFY_POINTS 3000
+
+static bool test_verify_sink( const GPS_point* point, void* context )
+{
+   return verify_manifest_add( (Verify_manifest*)context, point );
+}
+
+/// Download the device to the track file, recording its manifest
+static bool test_verify_download( Test_device* device, const char* saved, const char* manifest_file )
+{
+   unsigned char* buffer = (unsigned char*)malloc( BUFFER_SIZE + 1 );
+   Verify_manifest* manifest = verify_manifest_open( manifest_file );
+   GPS_arena arena;
+   GPS_points points;
+   int serial_fd = -1;
+   bool ok = false;
+
+   GPS_arena_init( &arena, GPS_ARENA_HEAP );
+   GPS_points_init( &points );
+   if ( buffer != NULL && manifest != NULL && serial_init_highspeed( device->path, buffer, &serial_fd ) )
+   {
+      ok = ( serial_download( serial_fd, buffer, &arena, test_verify_sink, manifest ) == 0 );
+      close( serial_fd );
+   }
+   ok = verify_manifest_close( manifest, ok ) && ok;
+   ok = ok && GPS_arena_to_points( &arena, &points ) && GPS_points_write( &points, saved );
+   GPS_points_free( &points );
+   GPS_arena_free( &arena );
+   free( buffer );
+   return ok;
+}
+
+/// \returns result of the check, entries fetched by it to 'fetches'
+static bool test_verify_check( Test_device* device, const char* saved, const char* manifest_file, double fraction,
+                               unsigned int* fetches )
+{
+   unsigned char* buffer = (unsigned char*)malloc( BUFFER_SIZE + 1 );
+   unsigned int before = device->state->fetches;
+   int serial_fd = -1;
+   bool passed = false;
+
+   if ( buffer != NULL && serial_init_highspeed( device->path, buffer, &serial_fd ) )
+   {
+      passed = verify_device( serial_fd, buffer, manifest_file, saved, NULL, 0.99, fraction );
+      close( serial_fd );
+   }
+   free( buffer );
+   *fetches = device->state->fetches - before;
+   return passed;
+}
+
+/// Tool in the mode on the device, download with --clear, its output to the log.
+/// \returns exit status, -1 if it did not run
+static int test_verify_tool( const char* tool, const char* log, Test_device* device, const char* mode,
+                             const char* output )
+{
+   int status = 0;
+   pid_t pid = fork();
+
+   if ( pid == 0 )
+   {
+      int fd = open( log, O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+      if ( fd >= 0 )
+      {
+         dup2( fd, 1 );
+         dup2( fd, 2 );
+      }
+      setenv( "GEOTECH_HISTORY", "", 1 );
+      execl( tool, tool, device->path, mode, output, strcmp( mode, "download" ) == 0 ? "--clear" : NULL, (char*)NULL );
+      _exit( 127 );
+   }
+   if ( pid < 0 || waitpid( pid, &status, 0 ) != pid || !WIFEXITED( status ) )
+      return -1;
+   return WEXITSTATUS( status );
+}
+
+/// Clearing after the tool has saved, synced and verified the download, and only then
+static void test_verify_clear( const char* dir, const char* tool )
+{
+   char output[ BUFFER_SIZE ], temp[ BUFFER_SIZE + 16 ], manifest[ BUFFER_SIZE + 16 ], log[ BUFFER_SIZE ];
+   Test_device device;
+
+   snprintf( log, sizeof(log), "%s/tool.log", dir );
+
+   // saved and verified, then cleared
+   snprintf( output, sizeof(output), "%s/cleared.gpx", dir );
+   if ( CHECK( test_device_start( &device, 500 ) ) )
+   {
+      CHECK( test_verify_tool( tool, log, &device, "download", output ) == 0 );
+      CHECK( device.state->clears == 1 );
+   }
+   test_device_stop( &device );
+   snprintf( temp, sizeof(temp), "%s.tmp", output );
+   snprintf( manifest, sizeof(manifest), "%s.manifest", output );
+   CHECK( test_exists( output ) && test_exists( manifest ) && !test_exists( temp ) );
+
+   // clear mode clears only a device that passes verify against the manifest of its download
+   if ( CHECK( test_device_start( &device, 500 ) ) )
+   {
+      CHECK( test_verify_tool( tool, log, &device, "clear", output ) == 0 );
+      CHECK( device.state->clears == 1 );
+      snprintf( output, sizeof(output), "%s/none.gpx", dir );
+      CHECK( test_verify_tool( tool, log, &device, "clear", output ) != 0 );
+      CHECK( device.state->clears == 1 );
+   }
+   test_device_stop( &device );
+
+   // entries differ when fetched again, saved but not cleared
+   snprintf( output, sizeof(output), "%s/altered.gpx", dir );
+   if ( CHECK( test_device_start( &device, 500 ) ) )
+   {
+      device.state->alter = true;
+      CHECK( test_verify_tool( tool, log, &device, "download", output ) != 0 );
+      CHECK( device.state->clears == 0 );
+   }
+   test_device_stop( &device );
+   CHECK( test_exists( output ) );
+
+   // device gone in the middle of the download, the output of the last download stays and nothing is cleared
+   snprintf( output, sizeof(output), "%s/kept.gpx", dir );
+   snprintf( temp, sizeof(temp), "%s.tmp", output );
+   snprintf( manifest, sizeof(manifest), "%s.manifest", output );
+   unlink( manifest );
+   CHECK( test_write_file( output, "last download\n" ) );
+   if ( CHECK( test_device_start( &device, 500 ) ) )
+   {
+      device.state->fail_after = 200;
+      CHECK( test_verify_tool( tool, log, &device, "download", output ) != 0 );
+      CHECK( device.state->clears == 0 );
+   }
+   test_device_stop( &device );
+   char* text = test_read_file( output, NULL );
+   CHECK( text != NULL && strcmp( text, "last download\n" ) == 0 );
+   free( text );
+   CHECK( !test_exists( temp ) && !test_exists( manifest ) );
+}
+
+static void test_verify( const char* dir, const char* tool )
+{
+   char saved[ BUFFER_SIZE ], manifest[ BUFFER_SIZE ], shorter[ BUFFER_SIZE ];
+   Test_device device;
+   GPS_points points;
+   unsigned int fetches = 0;
+
+   snprintf( saved, sizeof(saved), "%s/saved.gts", dir );
+   snprintf( manifest, sizeof(manifest), "%s/saved.manifest", dir );
+   snprintf( shorter, sizeof(shorter), "%s/shorter.gts", dir );
+
+   if ( CHECK( test_device_start( &device, TEST_VERIFY_POINTS ) ) &&
+        CHECK( test_verify_download( &device, saved, manifest ) ) )
+   {
+      // first, last and log(0.01) / log(0.95) = 89.8 others
+      CHECK( test_verify_check( &device, saved, manifest, 0.05, &fetches ) && fetches == 92 );
+      CHECK( test_verify_check( &device, saved, manifest, 1.0, &fetches ) && fetches == 3 );
+
+      // a record missing from the saved output
+      if ( CHECK( GPS_points_read( &points, saved ) && points.npoints == TEST_VERIFY_POINTS ) )
+      {
+         memmove( &points.points[1000], &points.points[1001], ( points.npoints - 1001 ) * sizeof(GPS_point) );
+         points.npoints --;
+         CHECK( GPS_points_write( &points, shorter ) );
+      }
+      GPS_points_free( &points );
+      CHECK( !test_verify_check( &device, shorter, manifest, 0.05, &fetches ) );
+
+      // entries differ when fetched again
+      device.state->alter = true;
+      CHECK( !test_verify_check( &device, saved, manifest, 0.05, &fetches ) && fetches == 92 );
+      device.state->alter = false;
+
+      // device has other entries than the manifest, none fetched
+      device.state->npoints = TEST_VERIFY_POINTS - 1;
+      CHECK( !test_verify_check( &device, saved, manifest, 0.05, &fetches ) && fetches == 0 );
+   }
+   test_device_stop( &device );
+
+   if ( tool != NULL )
+      test_verify_clear( dir, tool );
+}
+
+///-------------------------------------------------------------------------------------
+///-------------------------------------------------------------------------------------
+void usage()
+{
+   printf("usage: ./geotech_test <group> <work directory> [tool]\n");
+   printf("       groups: formats output gzip merge resample stays archive index download verify\n");
+   exit(1);
+}
+
+int main( int argc, char** argv )
+{
+   if ( argc != 3 && argc != 4 )
+      usage();
+
+   const char* group = argv[1];
+   const char* dir   = argv[2];
+   const char* tool  = ( argc == 4 ) ? argv[3] : NULL;   // checks of the whole tool run it
+   if ( mkdir( dir, 0755 ) != 0 && errno != EEXIST )
+   {
+      ERROR("Cannot create directory '%s': %s", dir, strerror(errno) );
+      return 1;
+   }
+
+   if ( strcmp( group, "formats" ) == 0 )
+      test_formats( dir );
+   else if ( strcmp( group, "output" ) == 0 )
+      test_output( dir );
+   else if ( strcmp( group, "gzip" ) == 0 )
+      test_gzip( dir );
+   else if ( strcmp( group, "merge" ) == 0 )
+      test_merge( dir );
+   else if ( strcmp( group, "resample" ) == 0 )
+      test_resample( dir );
+   else if ( strcmp( group, "stays" ) == 0 )
+      test_stays( dir );
+   else if ( strcmp( group, "archive" ) == 0 )
+      test_archive( dir );
+   else if ( strcmp( group, "index" ) == 0 )
+      test_index( dir );
+   else if ( strcmp( group, "download" ) == 0 )
+      test_download( dir );
+   else if ( strcmp( group, "verify" ) == 0 )
+      test_verify( dir, tool );
+   else
+      usage();
+
+   printf("%s: %s\n", group, test_failures == 0 ? "passed" : "FAILED" );
+   return test_failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#define MODULE_NAME "trackstats"
+
+/// Points handled at once by the kernels, the per segment values of a chunk stay in cache
+#define STATS_CHUNK     4096
+/// Tracks longer than this are split over worker threads
+#define STATS_PARALLEL  (256*1024)
+/// Segments slower than this (m/s) are not counted as moving
+#define STATS_MOVING_SPEED 0.5
+
+typedef struct
+{
+   const GPS_points* data;
+   int               kernel;
+   unsigned int      nparts;
+   Track_stats*      parts;
+} Stats_job;
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Distance kernels, segment i is from point i to point i+1. Written as plain loops over arrays without branches so
+/// that the compiler can vectorize them. Coordinate deltas are taken exactly in micro-degrees before scaling.
+///--------------------------------------------------------------------------------------------------------------------
+static void stats_haversine( const int32_t* lat, const int32_t* lon, const double* coslat, double* distance, unsigned int nsegments )
+{
+   unsigned int loop;
+   for ( loop = 0; loop < nsegments; loop ++ )
+   {
+      double sdlat = sin( ( lat[loop+1] - lat[loop] ) * ( 0.5 * MICRODEG_TO_RAD ) );
+      double sdlon = sin( ( lon[loop+1] - lon[loop] ) * ( 0.5 * MICRODEG_TO_RAD ) );
+      double a = sdlat * sdlat + coslat[loop] * coslat[loop+1] * sdlon * sdlon;
+      distance[loop] = 2 * EARTH_RADIUS * asin( sqrt( a ) );
+   }
+}
+
+static void stats_equirectangular( const int32_t* lat, const int32_t* lon, const double* coslat, double* distance, unsigned int nsegments )
+{
+   unsigned int loop;
+   for ( loop = 0; loop < nsegments; loop ++ )
+   {
+      double x = ( lon[loop+1] - lon[loop] ) * ( 0.5 * MICRODEG_TO_RAD ) * ( coslat[loop] + coslat[loop+1] );
+      double y = ( lat[loop+1] - lat[loop] ) * MICRODEG_TO_RAD;
+      distance[loop] = EARTH_RADIUS * sqrt( x*x + y*y );
+   }
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+static void stats_empty( Track_stats* stats )
+{
+   memset( stats, 0, sizeof(Track_stats) );
+   stats->lat0 = stats->lon0 = INT32_MAX;
+   stats->lat1 = stats->lon1 = INT32_MIN;
+}
+
+/// Combine partial result of later part of the track to stats
+static void stats_combine( Track_stats* stats, const Track_stats* part )
+{
+   if ( part->npoints == 0 )
+      return;
+   if ( stats->npoints == 0 )
+      stats->start = part->start;
+
+   stats->npoints     += part->npoints;
+   stats->end          = part->end;
+   stats->distance    += part->distance;
+   stats->moving_time += part->moving_time;
+   stats->moving_distance += part->moving_distance;
+   stats->ascent      += part->ascent;
+   stats->descent     += part->descent;
+   stats->max_speed    = fmax( stats->max_speed, part->max_speed );
+   stats->lat0         = ( part->lat0 < stats->lat0 ) ? part->lat0 : stats->lat0;
+   stats->lon0         = ( part->lon0 < stats->lon0 ) ? part->lon0 : stats->lon0;
+   stats->lat1         = ( part->lat1 > stats->lat1 ) ? part->lat1 : stats->lat1;
+   stats->lon1         = ( part->lon1 > stats->lon1 ) ? part->lon1 : stats->lon1;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// All metrics of points first .. last-1 in single pass. The segment from point first-1 is included when first > 0.
+///--------------------------------------------------------------------------------------------------------------------
+static void stats_range( const GPS_points* data, unsigned int first, unsigned int last, int kernel, Track_stats* stats )
+{
+   int32_t lat[ STATS_CHUNK + 1 ], lon[ STATS_CHUNK + 1 ];
+   double coslat[ STATS_CHUNK + 1 ];
+   double height[ STATS_CHUNK + 1 ], time[ STATS_CHUNK + 1 ];
+   double distance[ STATS_CHUNK ];
+   unsigned int chunk, loop;
+
+   stats_empty( stats );
+   if ( first >= last )
+      return;
+
+   stats->npoints = last - first;
+   stats->start   = GPS_point_epoch( &data->points[first] );
+   stats->end     = GPS_point_epoch( &data->points[last - 1] );
+
+   // chunks overlap by one point so that all segments are seen
+   for ( chunk = ( first > 0 ? first - 1 : 0 ); chunk + 1 < last; chunk += STATS_CHUNK )
+   {
+      unsigned int npoints = ( last - chunk > STATS_CHUNK + 1 ) ? STATS_CHUNK + 1 : last - chunk;
+      const GPS_point* points = &data->points[chunk];
+
+      for ( loop = 0; loop < npoints; loop ++ )
+      {
+         lat[loop]    = points[loop].latitude;
+         lon[loop]    = points[loop].longitude;
+         coslat[loop] = cos( lat[loop] * MICRODEG_TO_RAD );
+         height[loop] = points[loop].height;
+         time[loop]   = GPS_point_epoch( &points[loop] );
+      }
+
+      if ( kernel == STATS_KERNEL_EQUIRECTANGULAR )
+         stats_equirectangular( lat, lon, coslat, distance, npoints - 1 );
+      else
+         stats_haversine( lat, lon, coslat, distance, npoints - 1 );
+
+      for ( loop = 0; loop + 1 < npoints; loop ++ )
+      {
+         double dt     = time[loop+1] - time[loop];
+         double dh     = height[loop+1] - height[loop];
+         double speed  = ( dt > 0 ) ? distance[loop] / dt : 0.0;
+         bool   moving = speed > STATS_MOVING_SPEED;
+
+         stats->distance    += distance[loop];
+         stats->moving_time += moving ? dt : 0.0;
+         stats->moving_distance += moving ? distance[loop] : 0.0;
+         stats->max_speed    = fmax( stats->max_speed, speed );
+         stats->ascent      += ( dh > 0 ) ? dh : 0.0;
+         stats->descent     += ( dh < 0 ) ? -dh : 0.0;
+      }
+   }
+
+   for ( loop = first; loop < last; loop ++ )
+   {
+      const GPS_point* point = &data->points[loop];
+      stats->lat0 = ( point->latitude  < stats->lat0 ) ? point->latitude  : stats->lat0;
+      stats->lat1 = ( point->latitude  > stats->lat1 ) ? point->latitude  : stats->lat1;
+      stats->lon0 = ( point->longitude < stats->lon0 ) ? point->longitude : stats->lon0;
+      stats->lon1 = ( point->longitude > stats->lon1 ) ? point->longitude : stats->lon1;
+   }
+}
+
+static void stats_job( unsigned int index, void* context )
+{
+   Stats_job* job = (Stats_job*)context;
+   unsigned int npoints = job->data->npoints;
+   unsigned int first = (uint64_t)npoints * index / job->nparts;
+   unsigned int last  = (uint64_t)npoints * ( index + 1 ) / job->nparts;
+
+   stats_range( job->data, first, last, job->kernel, &job->parts[index] );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Compute track statistics. Long tracks are split to parts, computed in parallel and combined in order.
+///--------------------------------------------------------------------------------------------------------------------
+bool track_stats( const GPS_points* data, int kernel, Track_stats* stats )
+{
+   Stats_job job;
+   unsigned int loop;
+
+   job.data   = data;
+   job.kernel = kernel;
+   job.nparts = 1;
+   if ( data->npoints >= STATS_PARALLEL )
+      job.nparts = workers_count() * 4;
+
+   job.parts = (Track_stats*)malloc( job.nparts * sizeof(Track_stats) );
+   if ( job.parts == NULL )
+   {
+      ERROR("Out of memory!");
+      return false;
+   }
+
+   if ( job.nparts == 1 )
+      stats_job( 0, &job );
+   else
+      workers_run( job.nparts, stats_job, &job );
+
+   stats_empty( stats );
+   for ( loop = 0; loop < job.nparts; loop ++ )
+      stats_combine( stats, &job.parts[loop] );
+
+   stats->total_time = ( stats->npoints > 0 ) ? stats->end - stats->start : 0;
+   stats->avg_speed  = ( stats->moving_time > 0 ) ? stats->moving_distance / stats->moving_time : 0.0;
+
+   free( job.parts );
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+///--------------------------------------------------------------------------------------------------------------------
+static void stats_print_duration( const char* label, double seconds )
+{
+   long total = (long)seconds;
+   printf("  %-16s %ld:%02ld:%02ld\n", label, total / 3600, ( total / 60 ) % 60, total % 60 );
+}
+
+void track_stats_print( const Track_stats* stats )
+{
+   char lat0[ 16 ], lon0[ 16 ], lat1[ 16 ], lon1[ 16 ];
+
+   printf("  %-16s %u\n", "POINTS", stats->npoints );
+   if ( stats->npoints == 0 )
+      return;
+
+   printf("  %-16s %.03f km\n", "DISTANCE", stats->distance / 1000 );
+   stats_print_duration( "TOTAL TIME", stats->total_time );
+   stats_print_duration( "MOVING TIME", stats->moving_time );
+   printf("  %-16s %.02f km/h\n", "AVERAGE SPEED", stats->avg_speed * 3.6 );
+   printf("  %-16s %.02f km/h\n", "MAX SPEED", stats->max_speed * 3.6 );
+   printf("  %-16s %.0f m / %.0f m\n", "ASCENT/DESCENT", stats->ascent, stats->descent );
+   lat0[ GPS_format_microdeg( lat0, stats->lat0 ) ] = 0x00;
+   lon0[ GPS_format_microdeg( lon0, stats->lon0 ) ] = 0x00;
+   lat1[ GPS_format_microdeg( lat1, stats->lat1 ) ] = 0x00;
+   lon1[ GPS_format_microdeg( lon1, stats->lon1 ) ] = 0x00;
+   printf("  %-16s %s %s - %s %s\n", "BOUNDING BOX", lat0, lon0, lat1, lon1 );
+}
@@ -0,0 +1,567 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define MODULE_NAME "trackstore"
+
+/// File layout, all integers little endian:
+///   header : "GTS1"
+///   blocks : uint32 npoints, uint32 payload length, payload
+///   index  : per block uint64 offset, uint32 npoints, int64 first time, int64 last time
+///   footer : uint64 index offset, uint32 nblocks, "GTSI"
+///
+/// Block payload is columnar, every value a zig-zag varint:
+///   first time, first longitude, first latitude (micro-degrees)
+///   time delta-of-deltas as run length pairs ( value, count )
+///   longitude deltas, latitude deltas, one per point after the first
+///   heights as run length pairs ( delta to previous run, count )
+
+#define TRACK_MAGIC        "GTS1"
+#define TRACK_INDEX_MAGIC  "GTSI"
+#define TRACK_HEADER_SIZE  4
+#define TRACK_FOOTER_SIZE  16
+#define TRACK_INDEX_ENTRY  28
+/// Worst case size of single point in payload: 3 columns of 10 byte varints, plus time and height runs
+#define TRACK_POINT_MAX    60
+
+typedef struct
+{
+   uint64_t offset;
+   uint32_t npoints;
+   int64_t  first_time;
+   int64_t  last_time;
+} Track_block;
+
+struct Track_writer
+{
+   Output*  output;
+   uint64_t offset;
+
+   // points of current block
+   GPS_point* points;
+   unsigned int npoints;
+
+   Track_block* blocks;
+   unsigned int nblocks;
+   unsigned int max_blocks;
+
+   unsigned char* payload;
+};
+
+struct Track_reader
+{
+   unsigned char* data;
+   size_t         size;
+
+   // mapping starts at page boundary before data
+   unsigned char* map;
+   size_t         map_size;
+
+   Track_block*   blocks;
+   unsigned int   nblocks;
+   unsigned int   npoints;
+};
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Byte coding helpers
+///--------------------------------------------------------------------------------------------------------------------
+static inline uint64_t zigzag_encode( int64_t value )
+{
+   return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzag_decode( uint64_t value )
+{
+   return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static inline unsigned char* varint_put( unsigned char* out, int64_t svalue )
+{
+   uint64_t value = zigzag_encode( svalue );
+   while ( value >= 0x80 )
+   {
+      *out++ = (unsigned char)(value | 0x80);
+      value >>= 7;
+   }
+   *out++ = (unsigned char)value;
+   return out;
+}
+
+/// \returns NULL if the varint runs over end
+static inline const unsigned char* varint_get( const unsigned char* in, const unsigned char* end, int64_t* svalue )
+{
+   uint64_t value = 0;
+   int shift = 0;
+   while ( in < end && shift < 64 )
+   {
+      unsigned char byte = *in++;
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ( (byte & 0x80) == 0 )
+      {
+         *svalue = zigzag_decode( value );
+         return in;
+      }
+      shift += 7;
+   }
+   return NULL;
+}
+
+static void put_u32( unsigned char* out, uint32_t value )
+{
+   int loop;
+   for ( loop = 0; loop < 4; loop ++ )
+      out[loop] = (value >> (8*loop)) & 0xff;
+}
+
+static void put_u64( unsigned char* out, uint64_t value )
+{
+   int loop;
+   for ( loop = 0; loop < 8; loop ++ )
+      out[loop] = (value >> (8*loop)) & 0xff;
+}
+
+static uint32_t get_u32( const unsigned char* in )
+{
+   return in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+}
+
+static uint64_t get_u64( const unsigned char* in )
+{
+   return get_u32( in ) | ((uint64_t)get_u32( in + 4 ) << 32);
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Encode the collected points as one block payload, \returns payload length
+///--------------------------------------------------------------------------------------------------------------------
+static unsigned int track_encode_block( const GPS_point* points, unsigned int npoints, unsigned char* payload )
+{
+   unsigned char* out = payload;
+   unsigned int loop;
+
+   int64_t time_prev  = GPS_point_epoch( &points[0] );
+   int32_t lon_prev   = points[0].longitude;
+   int32_t lat_prev   = points[0].latitude;
+
+   out = varint_put( out, time_prev );
+   out = varint_put( out, lon_prev );
+   out = varint_put( out, lat_prev );
+
+   // time delta-of-deltas, run length coded
+   int64_t delta_prev = 0;
+   int64_t run_value  = 0;
+   int64_t run_count  = 0;
+   for ( loop = 1; loop < npoints; loop ++ )
+   {
+      int64_t time  = GPS_point_epoch( &points[loop] );
+      int64_t delta = time - time_prev;
+      int64_t dod   = delta - delta_prev;
+
+      if ( run_count > 0 && dod != run_value )
+      {
+         out = varint_put( out, run_value );
+         out = varint_put( out, run_count );
+         run_count = 0;
+      }
+      run_value = dod;
+      run_count ++;
+      time_prev  = time;
+      delta_prev = delta;
+   }
+   if ( run_count > 0 )
+   {
+      out = varint_put( out, run_value );
+      out = varint_put( out, run_count );
+   }
+
+   // coordinate deltas
+   for ( loop = 1; loop < npoints; loop ++ )
+   {
+      int32_t lon = points[loop].longitude;
+      out = varint_put( out, (int64_t)lon - lon_prev );
+      lon_prev = lon;
+   }
+   for ( loop = 1; loop < npoints; loop ++ )
+   {
+      int32_t lat = points[loop].latitude;
+      out = varint_put( out, (int64_t)lat - lat_prev );
+      lat_prev = lat;
+   }
+
+   // heights, run length coded
+   int64_t height_prev = 0;
+   run_count = 0;
+   run_value = 0;
+   for ( loop = 0; loop < npoints; loop ++ )
+   {
+      int64_t height = points[loop].height;
+      if ( run_count > 0 && height != run_value )
+      {
+         out = varint_put( out, run_value - height_prev );
+         out = varint_put( out, run_count );
+         height_prev = run_value;
+         run_count   = 0;
+      }
+      run_value = height;
+      run_count ++;
+   }
+   out = varint_put( out, run_value - height_prev );
+   out = varint_put( out, run_count );
+
+   return out - payload;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Decode block payload into points, \returns false if payload is corrupted
+///--------------------------------------------------------------------------------------------------------------------
+static bool track_decode_block( const unsigned char* in, const unsigned char* end, GPS_point* points, unsigned int npoints )
+{
+   int64_t value, count;
+   int64_t time, lon, lat;
+   unsigned int loop;
+
+   if ( (in = varint_get( in, end, &time )) == NULL ) return false;
+   if ( (in = varint_get( in, end, &lon  )) == NULL ) return false;
+   if ( (in = varint_get( in, end, &lat  )) == NULL ) return false;
+
+   GPS_point_set_epoch( &points[0], time );
+   points[0].longitude = lon;
+   points[0].latitude  = lat;
+
+   int64_t delta = 0;
+   loop = 1;
+   while ( loop < npoints )
+   {
+      if ( (in = varint_get( in, end, &value )) == NULL ) return false;
+      if ( (in = varint_get( in, end, &count )) == NULL ) return false;
+      if ( count <= 0 || count > npoints - loop )
+         return false;
+
+      for ( ; count > 0; count --, loop ++ )
+      {
+         delta = delta + value;
+         time  = time + delta;
+         GPS_point_set_epoch( &points[loop], time );
+      }
+   }
+
+   for ( loop = 1; loop < npoints; loop ++ )
+   {
+      if ( (in = varint_get( in, end, &value )) == NULL ) return false;
+      lon = lon + value;
+      points[loop].longitude = lon;
+   }
+   for ( loop = 1; loop < npoints; loop ++ )
+   {
+      if ( (in = varint_get( in, end, &value )) == NULL ) return false;
+      lat = lat + value;
+      points[loop].latitude = lat;
+   }
+
+   int64_t height = 0;
+   loop = 0;
+   while ( loop < npoints )
+   {
+      if ( (in = varint_get( in, end, &value )) == NULL ) return false;
+      if ( (in = varint_get( in, end, &count )) == NULL ) return false;
+      if ( count <= 0 || count > npoints - loop )
+         return false;
+
+      height = height + value;
+      for ( ; count > 0; count --, loop ++ )
+         points[loop].height = height;
+   }
+   return true;
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// STREAMING ENCODER
+///--------------------------------------------------------------------------------------------------------------------
+Track_writer* track_writer_open( const char* filename )
+{
+   return track_writer_open_at( filename, -1 );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Write track store inside an existing file from given offset on, offsets in the track store are relative to it.
+/// Negative offset creates new file that replaces an existing one when closed successfully.
+///--------------------------------------------------------------------------------------------------------------------
+Track_writer* track_writer_open_at( const char* filename, int64_t offset )
+{
+   Track_writer* writer = (Track_writer*)calloc( 1, sizeof(Track_writer) );
+   if ( writer == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+
+   writer->points   = (GPS_point*)malloc( TRACK_BLOCK_POINTS * sizeof(GPS_point) );
+   writer->payload  = (unsigned char*)malloc( 8 + TRACK_BLOCK_POINTS * TRACK_POINT_MAX );
+   if ( writer->points == NULL || writer->payload == NULL )
+   {
+      ERROR("Out of memory!");
+      track_writer_close( writer );
+      return NULL;
+   }
+
+   writer->output = ( offset < 0 ) ? output_open( filename ) : output_open_at( filename, offset );
+   if ( writer->output == NULL || !output_write( writer->output, TRACK_MAGIC, TRACK_HEADER_SIZE ) )
+   {
+      track_writer_close( writer );
+      return NULL;
+   }
+   writer->offset = TRACK_HEADER_SIZE;
+   return writer;
+}
+
+static bool track_writer_flush( Track_writer* writer )
+{
+   if ( writer->npoints == 0 )
+      return true;
+
+   if ( writer->nblocks == writer->max_blocks )
+   {
+      unsigned int max_blocks = writer->max_blocks ? writer->max_blocks * 2 : 64;
+      Track_block* blocks = (Track_block*)realloc( writer->blocks, max_blocks * sizeof(Track_block) );
+      if ( blocks == NULL )
+      {
+         ERROR("Out of memory!");
+         return false;
+      }
+      writer->blocks     = blocks;
+      writer->max_blocks = max_blocks;
+   }
+
+   unsigned int len = track_encode_block( writer->points, writer->npoints, writer->payload + 8 );
+   put_u32( writer->payload, writer->npoints );
+   put_u32( writer->payload + 4, len );
+
+   if ( !output_write( writer->output, writer->payload, 8 + len ) )
+      return false;
+
+   Track_block* block = &writer->blocks[ writer->nblocks ++ ];
+   block->offset     = writer->offset;
+   block->npoints    = writer->npoints;
+   block->first_time = GPS_point_epoch( &writer->points[0] );
+   block->last_time  = GPS_point_epoch( &writer->points[ writer->npoints - 1 ] );
+
+   writer->offset  = writer->offset + 8 + len;
+   writer->npoints = 0;
+   return true;
+}
+
+bool track_writer_append( Track_writer* writer, const GPS_point* point )
+{
+   // a full block is written before the next point, a failed write leaves it full and the point is not taken
+   if ( writer->npoints == TRACK_BLOCK_POINTS && !track_writer_flush( writer ) )
+      return false;
+
+   writer->points[ writer->npoints ++ ] = *point;
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Flush last block and write the block index. Frees the writer also on failure.
+///--------------------------------------------------------------------------------------------------------------------
+bool track_writer_close( Track_writer* writer )
+{
+   bool ok = true;
+   unsigned int loop;
+
+   if ( writer->output != NULL )
+   {
+      ok = track_writer_flush( writer );
+
+      for ( loop = 0; ok && loop < writer->nblocks; loop ++ )
+      {
+         unsigned char entry[ TRACK_INDEX_ENTRY ];
+         put_u64( entry,      writer->blocks[loop].offset );
+         put_u32( entry + 8,  writer->blocks[loop].npoints );
+         put_u64( entry + 12, writer->blocks[loop].first_time );
+         put_u64( entry + 20, writer->blocks[loop].last_time );
+         ok = output_write( writer->output, entry, TRACK_INDEX_ENTRY );
+      }
+
+      unsigned char footer[ TRACK_FOOTER_SIZE ];
+      put_u64( footer, writer->offset );
+      put_u32( footer + 8, writer->nblocks );
+      memcpy( footer + 12, TRACK_INDEX_MAGIC, 4 );
+      ok = ok && output_write( writer->output, footer, TRACK_FOOTER_SIZE );
+
+      // a failed writer leaves no partial file behind
+      if ( !ok )
+         output_abort( writer->output );
+      else
+         ok = output_close( writer->output, NULL, NULL );
+   }
+   else
+      ok = false;
+
+   free( writer->points );
+   free( writer->payload );
+   free( writer->blocks );
+   free( writer );
+   return ok;
+}
+
+/// Drop the writer, the new file is removed. Frees the writer.
+void track_writer_abort( Track_writer* writer )
+{
+   if ( writer->output != NULL )
+      output_abort( writer->output );
+   free( writer->points );
+   free( writer->payload );
+   free( writer->blocks );
+   free( writer );
+}
+
+
+///--------------------------------------------------------------------------------------------------------------------
+/// BLOCK DECODER
+///--------------------------------------------------------------------------------------------------------------------
+Track_reader* track_reader_open( const char* filename )
+{
+   return track_reader_open_at( filename, 0, 0 );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Read track store stored inside another file at offset, size 0 means until end of file
+///--------------------------------------------------------------------------------------------------------------------
+Track_reader* track_reader_open_at( const char* filename, uint64_t offset, uint64_t size )
+{
+   struct stat info;
+   unsigned int loop;
+
+   int fd = open( filename, O_RDONLY );
+   if ( fd < 0 )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      return NULL;
+   }
+   if ( fstat( fd, &info ) != 0 || offset + size > (uint64_t)info.st_size )
+      size = 0;
+   else if ( size == 0 && offset < (uint64_t)info.st_size )
+      size = info.st_size - offset;
+   if ( size < TRACK_HEADER_SIZE + TRACK_FOOTER_SIZE )
+   {
+      ERROR("File '%s' is not a track store", filename );
+      close( fd );
+      return NULL;
+   }
+
+   Track_reader* reader = (Track_reader*)calloc( 1, sizeof(Track_reader) );
+   if ( reader == NULL )
+   {
+      ERROR("Out of memory!");
+      close( fd );
+      return NULL;
+   }
+
+   uint64_t map_offset = offset - offset % sysconf( _SC_PAGESIZE );
+   reader->size     = size;
+   reader->map_size = size + ( offset - map_offset );
+   reader->map      = (unsigned char*)mmap( NULL, reader->map_size, PROT_READ, MAP_PRIVATE, fd, map_offset );
+   close( fd );
+   if ( reader->map == MAP_FAILED )
+   {
+      ERROR("Cannot map file '%s': %s", filename, strerror(errno) );
+      free( reader );
+      return NULL;
+   }
+   reader->data = reader->map + ( offset - map_offset );
+
+   const unsigned char* footer = reader->data + reader->size - TRACK_FOOTER_SIZE;
+   uint64_t index_offset = get_u64( footer );
+   reader->nblocks       = get_u32( footer + 8 );
+
+   if ( memcmp( reader->data, TRACK_MAGIC, 4 ) != 0 || memcmp( footer + 12, TRACK_INDEX_MAGIC, 4 ) != 0 ||
+        index_offset + (uint64_t)reader->nblocks * TRACK_INDEX_ENTRY != reader->size - TRACK_FOOTER_SIZE )
+   {
+      ERROR("File '%s' is not a track store", filename );
+      track_reader_close( reader );
+      return NULL;
+   }
+
+   reader->blocks = (Track_block*)malloc( (reader->nblocks + 1) * sizeof(Track_block) );
+   if ( reader->blocks == NULL )
+   {
+      ERROR("Out of memory!");
+      track_reader_close( reader );
+      return NULL;
+   }
+
+   for ( loop = 0; loop < reader->nblocks; loop ++ )
+   {
+      const unsigned char* entry = reader->data + index_offset + loop * TRACK_INDEX_ENTRY;
+      Track_block* block = &reader->blocks[loop];
+      block->offset     = get_u64( entry );
+      block->npoints    = get_u32( entry + 8 );
+      block->first_time = (int64_t)get_u64( entry + 12 );
+      block->last_time  = (int64_t)get_u64( entry + 20 );
+
+      if ( block->offset + 8 > index_offset || get_u32( reader->data + block->offset ) != block->npoints ||
+           block->npoints > TRACK_BLOCK_POINTS )
+      {
+         ERROR("File '%s' has corrupted block index", filename );
+         track_reader_close( reader );
+         return NULL;
+      }
+      reader->npoints += block->npoints;
+   }
+   return reader;
+}
+
+unsigned int track_reader_nblocks( const Track_reader* reader )
+{
+   return reader->nblocks;
+}
+
+unsigned int track_reader_npoints( const Track_reader* reader )
+{
+   return reader->npoints;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Time range of block, for seeking without decoding
+///--------------------------------------------------------------------------------------------------------------------
+void track_reader_block_time( const Track_reader* reader, unsigned int block, int64_t* first_time, int64_t* last_time )
+{
+   *first_time = reader->blocks[block].first_time;
+   *last_time  = reader->blocks[block].last_time;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Decode single block. Points must have space for TRACK_BLOCK_POINTS. \returns number of points or -1 on error
+///--------------------------------------------------------------------------------------------------------------------
+int track_reader_block( const Track_reader* reader, unsigned int block, GPS_point* points )
+{
+   const Track_block* entry = &reader->blocks[block];
+   const unsigned char* start = reader->data + entry->offset;
+   uint32_t len = get_u32( start + 4 );
+
+   if ( entry->offset + 8 + len > reader->size - TRACK_FOOTER_SIZE ||
+        !track_decode_block( start + 8, start + 8 + len, points, entry->npoints ) )
+   {
+      ERROR("Track block %u is corrupted", block );
+      return -1;
+   }
+   return entry->npoints;
+}
+
+void track_reader_close( Track_reader* reader )
+{
+   if ( reader->map != NULL && reader->map != MAP_FAILED )
+      munmap( reader->map, reader->map_size );
+   free( reader->blocks );
+   free( reader );
+}
@@ -0,0 +1,401 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MODULE_NAME "verify"
+
+/// Manifest of a download, one record per entry of the device in download order:
+///   header  -- magic, number of records and time range of the points
+///   records -- hash of the point as downloaded, and hash of its position and time
+/// The position hash is looked for in the saved output, whose heights may have been replaced by terrain heights.
+/// The manifest is written to a temporary file that replaces the old one only when the download has succeeded.
+///
+/// Verification asks the device for its number of entries and fetches again a random sample of them, with the first
+/// and the last. If a fraction f of the entries differed from the manifest, n samples all match with probability
+/// (1-f)^n, so n = log(1-confidence) / log(1-f) samples detect it at the given confidence.
+
+#define VERIFY_MAGIC "GTV1"
+
+typedef struct
+{
+   char     magic[4];
+   uint32_t count;
+   int64_t  first;     // epoch of the earliest point
+   int64_t  last;      // epoch of the latest point
+} Verify_header;
+
+typedef struct
+{
+   uint64_t entry;     // all fields of the point
+   uint64_t saved;     // position and time
+} Verify_record;
+
+struct Verify_manifest
+{
+   FILE*         fid;
+   char*         filename;
+   char*         temp;
+   Verify_header header;
+};
+
+/// FNV-1a over the fields of the point, heights optional
+static uint64_t verify_hash( const GPS_point* point, bool height )
+{
+   int32_t fields[9];
+   const unsigned char* bytes = (const unsigned char*)fields;
+   uint64_t hash = 0xcbf29ce484222325ULL;
+   size_t loop;
+
+   fields[0] = point->longitude;
+   fields[1] = point->latitude;
+   fields[2] = height ? point->height : 0;
+   for ( loop = 0; loop < 6; loop ++ )
+      fields[ 3 + loop ] = point->time[loop];
+   for ( loop = 0; loop < sizeof(fields); loop ++ )
+      hash = ( hash ^ bytes[loop] ) * 0x100000001b3ULL;
+   return hash;
+}
+
+static int verify_hash_compare( const void* a, const void* b )
+{
+   uint64_t ha = *(const uint64_t*)a, hb = *(const uint64_t*)b;
+   return ( ha < hb ) ? -1 : ( ha > hb );
+}
+
+/// Create all directories of the path, the last component is a file
+static bool verify_mkdirs( const char* filename )
+{
+   char path[ BUFFER_SIZE ];
+   char* pos;
+
+   snprintf( path, sizeof(path), "%s", filename );
+   for ( pos = strchr( path + 1, '/' ); pos != NULL; pos = strchr( pos + 1, '/' ) )
+   {
+      *pos = 0x00;
+      if ( mkdir( path, 0755 ) != 0 && errno != EEXIST )
+      {
+         ERROR("Cannot create directory '%s': %s", path, strerror(errno) );
+         return false;
+      }
+      *pos = '/';
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// MANIFEST
+///--------------------------------------------------------------------------------------------------------------------
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Start the manifest of a download, its directories are created as the archive root may come with the download
+///--------------------------------------------------------------------------------------------------------------------
+Verify_manifest* verify_manifest_open( const char* filename )
+{
+   Verify_manifest* manifest = (Verify_manifest*)calloc( 1, sizeof(Verify_manifest) );
+   if ( manifest == NULL )
+   {
+      ERROR("Out of memory!");
+      return NULL;
+   }
+   manifest->filename = strdup( filename );
+   manifest->temp     = (char*)malloc( strlen( filename ) + 5 );
+   if ( manifest->filename == NULL || manifest->temp == NULL )
+   {
+      ERROR("Out of memory!");
+      verify_manifest_close( manifest, false );
+      return NULL;
+   }
+   sprintf( manifest->temp, "%s.tmp", filename );
+
+   memcpy( manifest->header.magic, VERIFY_MAGIC, 4 );
+   manifest->header.first = INT64_MAX;
+   manifest->header.last  = INT64_MIN;
+   manifest->fid = verify_mkdirs( manifest->temp ) ? fopen( manifest->temp, "wb" ) : NULL;
+   if ( manifest->fid == NULL || fwrite( &manifest->header, sizeof(Verify_header), 1, manifest->fid ) != 1 )
+   {
+      ERROR("Cannot open file '%s' for writing: %s", manifest->temp, strerror(errno) );
+      verify_manifest_close( manifest, false );
+      return NULL;
+   }
+   return manifest;
+}
+
+/// Record of the next downloaded point
+bool verify_manifest_add( Verify_manifest* manifest, const GPS_point* point )
+{
+   Verify_record record;
+   int64_t epoch = GPS_point_epoch( point );
+
+   record.entry = verify_hash( point, true );
+   record.saved = verify_hash( point, false );
+   manifest->header.count ++;
+   manifest->header.first = ( epoch < manifest->header.first ) ? epoch : manifest->header.first;
+   manifest->header.last  = ( epoch > manifest->header.last ) ? epoch : manifest->header.last;
+   if ( fwrite( &record, sizeof(record), 1, manifest->fid ) != 1 )
+   {
+      ERROR("Cannot write file '%s': %s", manifest->temp, strerror(errno) );
+      return false;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Finish the manifest. Only a complete download replaces the manifest of the previous one, on disk when this returns.
+///--------------------------------------------------------------------------------------------------------------------
+bool verify_manifest_close( Verify_manifest* manifest, bool ok )
+{
+   if ( manifest == NULL )
+      return false;
+
+   if ( manifest->fid != NULL )
+   {
+      ok = ok && fseek( manifest->fid, 0, SEEK_SET ) == 0 &&
+           fwrite( &manifest->header, sizeof(Verify_header), 1, manifest->fid ) == 1 &&
+           fflush( manifest->fid ) == 0 && fsync( fileno( manifest->fid ) ) == 0;
+      ok = ( fclose( manifest->fid ) == 0 ) && ok;
+      if ( ok && rename( manifest->temp, manifest->filename ) != 0 )
+      {
+         ERROR("Cannot rename '%s' to '%s': %s", manifest->temp, manifest->filename, strerror(errno) );
+         ok = false;
+      }
+      if ( !ok )
+         unlink( manifest->temp );
+   }
+   free( manifest->filename );
+   free( manifest->temp );
+   free( manifest );
+   return ok;
+}
+
+static Verify_record* verify_manifest_read( const char* filename, Verify_header* header )
+{
+   FILE* fid = fopen( filename, "rb" );
+   if ( fid == NULL )
+   {
+      ERROR("Cannot open file '%s': %s", filename, strerror(errno) );
+      return NULL;
+   }
+
+   Verify_record* records = NULL;
+   bool ok = fread( header, sizeof(Verify_header), 1, fid ) == 1 && memcmp( header->magic, VERIFY_MAGIC, 4 ) == 0;
+   if ( ok )
+   {
+      records = (Verify_record*)malloc( ( header->count + 1 ) * sizeof(Verify_record) );
+      if ( records == NULL )
+         ERROR("Out of memory!");
+      else if ( fread( records, sizeof(Verify_record), header->count, fid ) != header->count )
+         ok = false;
+   }
+   if ( !ok )
+      ERROR("File '%s' is not a download manifest", filename );
+   fclose( fid );
+   if ( !ok )
+   {
+      free( records );
+      return NULL;
+   }
+   return records;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// SAVED OUTPUT
+///--------------------------------------------------------------------------------------------------------------------
+
+/// Position hashes of all points of a track file, sorted. \returns number of points or -1 on failure
+static long verify_saved_hashes( const char* filename, uint64_t** hashes )
+{
+   GPS_point points[ 1024 ];
+   long count = 0, capacity = 0;
+   int got, loop;
+
+   *hashes = NULL;
+   GPS_reader* reader = GPS_reader_open( filename );
+   if ( reader == NULL )
+      return -1;
+   while ( ( got = GPS_reader_read( reader, points, 1024 ) ) > 0 )
+   {
+      if ( count + got > capacity )
+      {
+         capacity = capacity * 2 + 1024;
+         uint64_t* more = (uint64_t*)realloc( *hashes, capacity * sizeof(uint64_t) );
+         if ( more == NULL )
+         {
+            ERROR("Out of memory!");
+            got = -1;
+            break;
+         }
+         *hashes = more;
+      }
+      for ( loop = 0; loop < got; loop ++ )
+         (*hashes)[ count ++ ] = verify_hash( &points[loop], false );
+   }
+   GPS_reader_close( reader );
+   if ( got < 0 )
+   {
+      free( *hashes );
+      *hashes = NULL;
+      return -1;
+   }
+   qsort( *hashes, count, sizeof(uint64_t), verify_hash_compare );
+   return count;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Check that every manifest record is in the saved output: the track file, or the points of the device in the
+/// archive when device is given. \returns number of records missing, or -1 if the output cannot be read
+///--------------------------------------------------------------------------------------------------------------------
+static long verify_saved( const char* saved, const char* device, const Verify_header* header,
+                          const Verify_record* records )
+{
+   char temp[ BUFFER_SIZE ];
+   uint64_t* hashes = NULL;
+   long nhashes, missing = 0;
+   unsigned int loop;
+
+   if ( header->count == 0 )
+      return 0;
+   if ( device != NULL )
+   {
+      // the points of the device in the time range of the download, archive may have more of those days
+      const char* dir = getenv( "TMPDIR" );
+      snprintf( temp, sizeof(temp), "%s/geotech_verify_XXXXXX.gts", dir != NULL ? dir : "/tmp" );
+      int fd = mkstemps( temp, 4 );
+      if ( fd < 0 )
+      {
+         ERROR("Cannot create file '%s': %s", temp, strerror(errno) );
+         return -1;
+      }
+      close( fd );
+      GPS_writer* writer = GPS_writer_open( temp );
+      long extracted = ( writer != NULL ) ? archive_extract( saved, device, header->first, header->last, writer ) : -1;
+      bool ok = ( extracted >= 0 );
+      if ( writer != NULL && ok )
+         ok = GPS_writer_close( writer );
+      else if ( writer != NULL )
+         GPS_writer_abort( writer );
+      nhashes = ok ? verify_saved_hashes( temp, &hashes ) : -1;
+      unlink( temp );
+   }
+   else
+   {
+      nhashes = verify_saved_hashes( saved, &hashes );
+   }
+   if ( nhashes < 0 )
+      return -1;
+
+   for ( loop = 0; loop < header->count; loop ++ )
+      if ( bsearch( &records[loop].saved, hashes, nhashes, sizeof(uint64_t), verify_hash_compare ) == NULL )
+         missing ++;
+   free( hashes );
+   return missing;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// SPOT CHECK
+///--------------------------------------------------------------------------------------------------------------------
+
+/// Entries to fetch for the confidence to detect the fraction of changed entries, the first and last included
+static unsigned int verify_samples( unsigned int count, double confidence, double fraction )
+{
+   double needed = ( fraction >= 1.0 ) ? 1.0 : ceil( log( 1.0 - confidence ) / log( 1.0 - fraction ) );
+
+   needed += 2;
+   return ( needed >= count ) ? count : (unsigned int)needed;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Check the device against the manifest and the saved output: the device must have as many entries as the manifest,
+/// the sampled entries fetched again must match their records, and every record must be in the saved output.
+/// Device NULL when saved is a track file, archive device name when saved is an archive root. Outputs that cannot
+/// be read back (CSV, database, compressed) are checked against the manifest only.
+/// \returns true if the check passed and the device may be cleared
+///--------------------------------------------------------------------------------------------------------------------
+bool verify_device( int serial_fd, unsigned char* buffer, const char* manifest_file, const char* saved,
+                    const char* device, double confidence, double fraction )
+{
+   Verify_header header;
+   unsigned int loop, checked = 0, differ = 0, broken = 0;
+   int count = 0;
+   long missing = 0;
+   bool readable;
+
+   Verify_record* records = verify_manifest_read( manifest_file, &header );
+   if ( records == NULL )
+      return false;
+
+   readable = ( device != NULL ) ||
+              ( output_codec_of( saved ) == OUTPUT_PLAIN &&
+                ( GPS_format_of( saved ) == GPS_FORMAT_GPX || GPS_format_of( saved ) == GPS_FORMAT_TRACK ) );
+   if ( readable )
+   {
+      missing = verify_saved( saved, device, &header, records );
+      if ( missing < 0 )
+      {
+         free( records );
+         return false;
+      }
+   }
+
+   if ( serial_download_count( serial_fd, buffer, &count ) != 0 )
+   {
+      ERROR("Device does not tell its number of entries");
+      free( records );
+      return false;
+   }
+
+   // selection sampling picks the entries in increasing order, each with the same probability
+   unsigned int nsamples = verify_samples( header.count, confidence, fraction );
+   unsigned int wanted = ( nsamples >= 2 ) ? nsamples - 2 : 0, middle = ( header.count > 2 ) ? header.count - 2 : 0;
+   srand48( time( NULL ) ^ getpid() );
+   for ( loop = 0; (int)header.count == count && loop < header.count; loop ++ )
+   {
+      bool sample = ( loop == 0 || loop == header.count - 1 );
+      if ( !sample && wanted > 0 && drand48() * ( middle - ( loop - 1 ) ) < wanted )
+      {
+         sample = true;
+         wanted --;
+      }
+      if ( !sample )
+         continue;
+
+      GPS_point point;
+      int status = serial_fetch_entry( serial_fd, buffer, loop, &point );
+      if ( status < 0 )
+      {
+         free( records );
+         return false;
+      }
+      checked ++;
+      if ( status > 0 )
+         broken ++;
+      else if ( verify_hash( &point, true ) != records[loop].entry )
+      {
+         DEBUG(2, "entry %u differs from the manifest", loop );
+         differ ++;
+      }
+   }
+   free( records );
+
+   bool passed = ( (int)header.count == count ) && differ == 0 && broken == 0 && missing == 0;
+   printf("---------------------------------------------------------------------------------------\n");
+   printf("  VERIFY %s: device has %d entries, manifest '%s' %u\n", passed ? "PASSED" : "FAILED", count,
+          manifest_file, header.count );
+   printf("  %u entries fetched again, %u differ, %u broken\n", checked, differ, broken );
+   if ( readable )
+      printf("  %ld records missing from %s '%s'\n", missing, device != NULL ? "archive" : "file", saved );
+   else
+      printf("  file '%s' cannot be read back, checked against the manifest only\n", saved );
+   if ( passed )
+      printf("  %.4g%% confidence that less than %.4g%% of the entries differ\n", confidence * 100,
+             fraction * 100 );
+   printf("---------------------------------------------------------------------------------------\n");
+   return passed;
+}
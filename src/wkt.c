@@ -0,0 +1,120 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#define MODULE_NAME "wkt"
+
+/// Geometries in WKT text, one per line: '[<name>;]<KEYWORD>[ Z|M|ZM](..)' or 'MULTI<KEYWORD>(..)', as exported
+/// from GIS tools. The name is what comes before the geometry, without separators and quotes. Coordinates are
+/// 'lon lat', further ordinates are skipped. Lines without the keyword are ignored, text after the geometry too.
+
+static const char* wkt_skip( const char* pos )
+{
+   while ( isspace( (unsigned char)*pos ) )
+      pos ++;
+   return pos;
+}
+
+/// 'x y [z [m]]'
+static const char* wkt_coordinates( const char* pos, const Wkt_handler* handler, void* context )
+{
+   char* end;
+
+   double lon = strtod( pos, &end );
+   if ( end == pos )
+      return NULL;
+   pos = end;
+   double lat = strtod( pos, &end );
+   if ( end == pos )
+      return NULL;
+   pos = end;
+   while ( strtod( pos, &end ), end != pos )
+      pos = end;
+   return handler->vertex( context, lon, lat ) ? pos : NULL;
+}
+
+/// '(item, item ..)', items of level 1 are coordinates and lists of the level below otherwise
+static const char* wkt_list( const char* pos, unsigned int level, const Wkt_handler* handler, void* context )
+{
+   pos = wkt_skip( pos );
+   if ( *pos != '(' || !handler->list( context, level, true ) )
+      return NULL;
+   pos ++;
+
+   while ( true )
+   {
+      pos = ( level > 1 ) ? wkt_list( pos, level - 1, handler, context ) : wkt_coordinates( pos, handler, context );
+      if ( pos == NULL )
+         return NULL;
+      pos = wkt_skip( pos );
+      if ( *pos == ')' )
+         break;
+      if ( *pos != ',' )
+         return NULL;
+      pos ++;
+   }
+   return handler->list( context, level, false ) ? pos + 1 : NULL;
+}
+
+static bool wkt_line( const char* line, unsigned int linenum, const char* keyword, unsigned int levels,
+                      const Wkt_handler* handler, void* context )
+{
+   size_t keyword_len = strlen( keyword );
+   const char* geometry;
+
+   for ( geometry = line; *geometry != 0x00 && strncasecmp( geometry, keyword, keyword_len ) != 0; geometry ++ )
+      ;
+   if ( *geometry == 0x00 )
+      return true;
+
+   const char* name = wkt_skip( line );
+   const char* name_end = geometry;
+   bool multi = ( geometry - line >= 5 && strncasecmp( geometry - 5, "MULTI", 5 ) == 0 );
+   if ( multi )
+      name_end = geometry - 5;
+   while ( name_end > name && ( isspace( (unsigned char)name_end[-1] ) || strchr( ";,\t\"'", name_end[-1] ) != NULL ) )
+      name_end --;
+   while ( name < name_end && ( *name == '"' || *name == '\'' ) )
+      name ++;
+   if ( !handler->name( context, name, name_end - name, linenum ) )
+      return false;
+
+   // dimensions like 'POLYGON Z' are skipped, only the first two coordinates are used
+   const char* pos = wkt_skip( geometry + keyword_len );
+   while ( isalpha( (unsigned char)*pos ) && strncasecmp( pos, "EMPTY", 5 ) != 0 )
+      pos = wkt_skip( pos + 1 );
+   if ( strncasecmp( pos, "EMPTY", 5 ) == 0 )
+      return true;
+
+   if ( wkt_list( pos, multi ? levels + 1 : levels, handler, context ) == NULL )
+   {
+      ERROR("Invalid %s at line %u", keyword, linenum );
+      return false;
+   }
+   return true;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Read the geometries of the keyword from WKT text, which is split to lines in place. 'levels' is the nesting
+/// of coordinate lists in a single geometry: 1 for LINESTRING, 2 for POLYGON. \returns false on invalid geometry
+/// or when the handler fails.
+///--------------------------------------------------------------------------------------------------------------------
+bool wkt_read( char* text, const char* keyword, unsigned int levels, const Wkt_handler* handler, void* context )
+{
+   unsigned int linenum = 1;
+   char* line = text;
+
+   while ( line != NULL && *line != 0x00 )
+   {
+      char* next = strchr( line, '\n' );
+      if ( next != NULL )
+         *(next ++) = 0x00;
+      if ( !wkt_line( line, linenum ++, keyword, levels, handler, context ) )
+         return false;
+      line = next;
+   }
+   return true;
+}
@@ -0,0 +1,132 @@
+#include "common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define MODULE_NAME "workers"
+
+/// Maximum number of threads used
+#define WORKERS_MAX 64
+
+typedef struct
+{
+   pthread_mutex_t lock;
+   unsigned int    next;
+   unsigned int    njobs;
+   Worker_job      job;
+   void*           context;
+} Workers;
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Number of threads to use, GEOTECH_THREADS environment variable overrides the number of processors
+///--------------------------------------------------------------------------------------------------------------------
+unsigned int workers_count( void )
+{
+   const char* env = getenv( "GEOTECH_THREADS" );
+   long count = ( env != NULL ) ? atol( env ) : sysconf( _SC_NPROCESSORS_ONLN );
+
+   if ( count < 1 )
+      return 1;
+   if ( count > WORKERS_MAX )
+      return WORKERS_MAX;
+   return count;
+}
+
+static void* workers_main( void* param )
+{
+   Workers* workers = (Workers*)param;
+
+   while ( true )
+   {
+      pthread_mutex_lock( &workers->lock );
+      unsigned int index = workers->next ++;
+      pthread_mutex_unlock( &workers->lock );
+
+      if ( index >= workers->njobs )
+         break;
+      workers->job( index, workers->context );
+   }
+   return NULL;
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Run jobs 0 .. njobs-1 on a pool of threads and wait for all to finish. The calling thread works as one of the pool.
+///--------------------------------------------------------------------------------------------------------------------
+void workers_run( unsigned int njobs, Worker_job job, void* context )
+{
+   pthread_t threads[ WORKERS_MAX ];
+   Workers workers;
+   unsigned int nthreads = workers_count();
+   unsigned int loop, started = 0;
+
+   if ( nthreads > njobs )
+      nthreads = njobs;
+
+   pthread_mutex_init( &workers.lock, NULL );
+   workers.next    = 0;
+   workers.njobs   = njobs;
+   workers.job     = job;
+   workers.context = context;
+
+   for ( loop = 1; loop < nthreads; loop ++ )
+   {
+      int ret = pthread_create( &threads[started], NULL, workers_main, &workers );
+      if ( ret != 0 )
+      {
+         DEBUG(3, "cannot start thread: %s", strerror(ret) );
+         break;
+      }
+      started ++;
+   }
+
+   workers_main( &workers );
+
+   for ( loop = 0; loop < started; loop ++ )
+      pthread_join( threads[loop], NULL );
+   pthread_mutex_destroy( &workers.lock );
+}
+
+///--------------------------------------------------------------------------------------------------------------------
+/// Run jobs 0 .. njobs-1 on a pool of threads while the calling thread runs 'main', and wait for both. For results
+/// that must be consumed on the calling thread: writes to an io_uring output are cancelled when the thread that
+/// submitted them exits. \returns false, without running anything, when no thread could be started.
+///--------------------------------------------------------------------------------------------------------------------
+bool workers_serve( unsigned int njobs, Worker_job job, Worker_main main, void* context )
+{
+   pthread_t threads[ WORKERS_MAX ];
+   Workers workers;
+   unsigned int nthreads = workers_count();
+   unsigned int loop, started = 0;
+
+   if ( nthreads > njobs )
+      nthreads = njobs;
+
+   pthread_mutex_init( &workers.lock, NULL );
+   workers.next    = 0;
+   workers.njobs   = njobs;
+   workers.job     = job;
+   workers.context = context;
+
+   for ( loop = 0; loop < nthreads; loop ++ )
+   {
+      int ret = pthread_create( &threads[started], NULL, workers_main, &workers );
+      if ( ret != 0 )
+      {
+         DEBUG(3, "cannot start thread: %s", strerror(ret) );
+         break;
+      }
+      started ++;
+   }
+
+   if ( started > 0 )
+      main( context );
+
+   for ( loop = 0; loop < started; loop ++ )
+      pthread_join( threads[loop], NULL );
+   pthread_mutex_destroy( &workers.lock );
+   return started > 0;
+}